@@ -0,0 +1,196 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Allocation rate of a fragmented block group at several fill levels:
+ * the old first fit walk over an extent_io_tree against the free space
+ * index with the next-fit and best-fit policies.
+ *
+ * usage: alloc-bench [group size in MiB] [allocations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "kerncompat.h"
+#include "extent_io.h"
+#include "free-space-index.h"
+
+#define SECTORSIZE	4096ULL
+
+static const int fill_levels[] = { 50, 75, 90, 95, 98 };
+
+/* Random free/used layout of the group, as runs of sectors */
+struct layout {
+	u64 *start;
+	u64 *len;
+	int nr;
+	u64 free_bytes;
+};
+
+static void make_layout(struct layout *layout, u64 group_size, int fill)
+{
+	u64 sectors = group_size / SECTORSIZE;
+	u64 pos = 0;
+	u64 used;
+	u64 free;
+	int used_mean = 4 * fill / (100 - fill);
+	int max = 0;
+
+	layout->nr = 0;
+	layout->start = NULL;
+	layout->len = NULL;
+	layout->free_bytes = 0;
+	while (pos < sectors) {
+		/* free runs average 4 sectors, used runs fill the rest */
+		free = 1 + rand() % 7;
+		used = 1 + rand() % (2 * used_mean - 1);
+		pos += used;
+		if (pos >= sectors)
+			break;
+		free = min(free, sectors - pos);
+		if (layout->nr == max) {
+			max = max ? max * 2 : 1024;
+			layout->start = realloc(layout->start,
+						max * sizeof(u64));
+			layout->len = realloc(layout->len, max * sizeof(u64));
+			if (!layout->start || !layout->len) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+		}
+		layout->start[layout->nr] = pos * SECTORSIZE;
+		layout->len[layout->nr] = free * SECTORSIZE;
+		layout->nr++;
+		layout->free_bytes += free * SECTORSIZE;
+		pos += free;
+	}
+}
+
+static u64 alloc_size(int i)
+{
+	/* mostly tree blocks, some small data extents */
+	return (i % 4) ? 4 * SECTORSIZE : (1 + i % 7) * SECTORSIZE;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* what find_free_extent() did before the index: first fit from the start */
+static double bench_extent_io(struct layout *layout, int nr_allocs)
+{
+	struct extent_io_tree tree;
+	double t;
+	u64 start;
+	u64 end;
+	u64 last;
+	u64 bytes;
+	int done = 0;
+	int i;
+
+	extent_io_tree_init(&tree);
+	for (i = 0; i < layout->nr; i++)
+		set_extent_dirty(&tree, layout->start[i],
+				 layout->start[i] + layout->len[i] - 1, 0);
+
+	t = now();
+	for (i = 0; i < nr_allocs; i++) {
+		bytes = alloc_size(i);
+		last = 0;
+		while (!find_first_extent_bit(&tree, last, &start, &end,
+					      EXTENT_DIRTY)) {
+			start = max(last, start);
+			last = end + 1;
+			if (last - start < bytes)
+				continue;
+			clear_extent_dirty(&tree, start, start + bytes - 1, 0);
+			done++;
+			break;
+		}
+	}
+	t = now() - t;
+	extent_io_tree_cleanup(&tree);
+	return done / t;
+}
+
+static double bench_index(struct layout *layout, int nr_allocs, int best)
+{
+	struct btrfs_free_index index;
+	double t;
+	u64 start;
+	u64 bytes;
+	int done = 0;
+	int ret;
+	int i;
+
+	btrfs_free_index_init(&index);
+	for (i = 0; i < layout->nr; i++)
+		btrfs_free_index_add(&index, layout->start[i], layout->len[i]);
+
+	t = now();
+	for (i = 0; i < nr_allocs; i++) {
+		bytes = alloc_size(i);
+		if (best)
+			ret = btrfs_free_index_best_fit(&index, 0, bytes,
+							SECTORSIZE, &start);
+		else
+			ret = btrfs_free_index_next_fit(&index, bytes,
+							SECTORSIZE, &start);
+		if (ret)
+			continue;
+		btrfs_free_index_remove(&index, start, bytes);
+		done++;
+	}
+	t = now() - t;
+	btrfs_free_index_release(&index);
+	return done / t;
+}
+
+int main(int argc, char **argv)
+{
+	struct layout layout;
+	u64 group_size = 1024ULL * 1024 * 1024;
+	int nr_allocs = 10000;
+	int i;
+
+	if (argc > 1)
+		group_size = strtoull(argv[1], NULL, 10) * 1024 * 1024;
+	if (argc > 2)
+		nr_allocs = atoi(argv[2]);
+
+	printf("%llu MiB block group, %d allocations, allocations/s\n",
+	       (unsigned long long)(group_size >> 20), nr_allocs);
+	printf("%5s %10s %16s %16s %16s\n", "fill", "fragments",
+	       "extent_io walk", "index next-fit", "index best-fit");
+	for (i = 0; i < ARRAY_SIZE(fill_levels); i++) {
+		srand(fill_levels[i]);
+		make_layout(&layout, group_size, fill_levels[i]);
+		printf("%4llu%% %10d %16.0f %16.0f %16.0f\n",
+		       100 - (unsigned long long)(layout.free_bytes * 100 /
+						  group_size),
+		       layout.nr, bench_extent_io(&layout, nr_allocs),
+		       bench_index(&layout, nr_allocs, 0),
+		       bench_index(&layout, nr_allocs, 1));
+		free(layout.start);
+		free(layout.len);
+	}
+	return 0;
+}
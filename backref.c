@@ -853,6 +853,134 @@ out:
 	return ret;
 }
 
+/*
+ * The backref cache maps a tree block bytenr to every root the block is
+ * reachable from.  Entries are kept in LRU order and the least recently
+ * used one is dropped once max_blocks are cached.
+ */
+struct btrfs_backref_cache {
+	struct cache_tree blocks;
+	struct list_head lru;
+	unsigned long nr_blocks;
+	unsigned long max_blocks;
+	struct btrfs_backref_cache_stats stats;
+};
+
+struct backref_cache_entry {
+	struct cache_extent cache;
+	struct list_head lru;
+	unsigned long nr_roots;
+	u64 roots[];
+};
+
+struct btrfs_backref_cache *btrfs_backref_cache_alloc(unsigned long max_blocks)
+{
+	struct btrfs_backref_cache *cache;
+
+	cache = kzalloc(sizeof(*cache), GFP_NOFS);
+	if (!cache)
+		return NULL;
+	cache_tree_init_btree(&cache->blocks);
+	INIT_LIST_HEAD(&cache->lru);
+	cache->max_blocks = max(max_blocks, 1UL);
+	return cache;
+}
+
+static void free_backref_cache_entry(struct cache_extent *ce)
+{
+	kfree(container_of(ce, struct backref_cache_entry, cache));
+}
+
+static void backref_cache_drop_all(struct btrfs_backref_cache *cache)
+{
+	cache_tree_free_extents(&cache->blocks, free_backref_cache_entry);
+	INIT_LIST_HEAD(&cache->lru);
+	cache->nr_blocks = 0;
+}
+
+void btrfs_backref_cache_free(struct btrfs_backref_cache *cache)
+{
+	if (!cache)
+		return;
+	backref_cache_drop_all(cache);
+	kfree(cache);
+}
+
+/*
+ * Add the cached roots of @bytenr to @roots.  Returns 1 if the block was
+ * cached, 0 if not and -ENOMEM if @roots could not be extended.
+ */
+int btrfs_backref_cache_merge(struct btrfs_backref_cache *cache, u64 bytenr,
+			      struct ulist *roots)
+{
+	struct backref_cache_entry *entry;
+	struct cache_extent *ce;
+	unsigned long i;
+	int ret;
+
+	cache->stats.lookups++;
+	ce = lookup_cache_extent(&cache->blocks, bytenr, 1);
+	if (!ce)
+		return 0;
+
+	cache->stats.hits++;
+	entry = container_of(ce, struct backref_cache_entry, cache);
+	list_move(&entry->lru, &cache->lru);
+	for (i = 0; i < entry->nr_roots; i++) {
+		ret = ulist_add(roots, entry->roots[i], 0, GFP_NOFS);
+		if (ret < 0)
+			return ret;
+	}
+	return 1;
+}
+
+/* Remember @roots as the roots of tree block @bytenr */
+int btrfs_backref_cache_insert(struct btrfs_backref_cache *cache, u64 bytenr,
+			       struct ulist *roots)
+{
+	struct backref_cache_entry *entry;
+	struct ulist_iterator uiter;
+	struct ulist_node *node;
+	unsigned long i = 0;
+
+	if (lookup_cache_extent(&cache->blocks, bytenr, 1))
+		return 0;
+
+	entry = kmalloc(sizeof(*entry) + roots->nnodes * sizeof(u64),
+			GFP_NOFS);
+	if (!entry)
+		return -ENOMEM;
+	entry->cache.start = bytenr;
+	entry->cache.size = 1;
+	entry->nr_roots = roots->nnodes;
+	ULIST_ITER_INIT(&uiter);
+	while ((node = ulist_next(roots, &uiter)))
+		entry->roots[i++] = node->val;
+
+	if (cache->nr_blocks == cache->max_blocks) {
+		struct backref_cache_entry *old;
+
+		old = list_entry(cache->lru.prev, struct backref_cache_entry,
+				 lru);
+		list_del(&old->lru);
+		remove_cache_extent(&cache->blocks, &old->cache);
+		kfree(old);
+		cache->nr_blocks--;
+		cache->stats.evictions++;
+	}
+	insert_cache_extent(&cache->blocks, &entry->cache);
+	list_add(&entry->lru, &cache->lru);
+	cache->nr_blocks++;
+	cache->stats.inserts++;
+	return 0;
+}
+
+void btrfs_backref_cache_get_stats(struct btrfs_backref_cache *cache,
+				   struct btrfs_backref_cache_stats *stats)
+{
+	*stats = cache->stats;
+}
+
 static void free_leaf_list(struct ulist *blocks)
 {
 	struct ulist_node *node = NULL;
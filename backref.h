@@ -66,6 +66,29 @@ struct inode_fs_paths *init_ipath(s32 total_bytes, struct btrfs_root *fs_root,
 					struct btrfs_path *path);
 void free_ipath(struct inode_fs_paths *ipath);
 
+/*
+ * Roots reachable from tree blocks, for callers that resolve the roots of
+ * many blocks.  Snapshots share their interior nodes, so the same upward
+ * walks would otherwise be repeated for most extents.
+ */
+struct btrfs_backref_cache;
+
+struct btrfs_backref_cache_stats {
+	u64 lookups;
+	u64 hits;
+	u64 inserts;
+	u64 evictions;
+};
+
+struct btrfs_backref_cache *btrfs_backref_cache_alloc(unsigned long max_blocks);
+void btrfs_backref_cache_free(struct btrfs_backref_cache *cache);
+int btrfs_backref_cache_merge(struct btrfs_backref_cache *cache, u64 bytenr,
+			      struct ulist *roots);
+int btrfs_backref_cache_insert(struct btrfs_backref_cache *cache, u64 bytenr,
+			       struct ulist *roots);
+void btrfs_backref_cache_get_stats(struct btrfs_backref_cache *cache,
+				   struct btrfs_backref_cache_stats *stats);
+
 int btrfs_find_one_extref(struct btrfs_root *root, u64 inode_objectid,
 			  u64 start_off, struct btrfs_path *path,
 			  struct btrfs_inode_extref **ret_extref,
@@ -207,6 +207,8 @@ static int walk_nodes(struct btrfs_root *root, struct btrfs_path *path,
 		if (cur_blocknr > stat->highest_bytenr)
 			stat->highest_bytenr = cur_blocknr;
 		free_extent_buffer(tmp);
+		if (tmp)
+			path->nodes[level - 1] = NULL;
 		if (ret) {
 			fprintf(stderr, "Error walking down path\n");
 			break;
@@ -420,6 +422,8 @@ out:
 		free(seek);
 	}
 
+	/* the root node is not ours to free */
+	path->nodes[level] = NULL;
 	btrfs_free_path(path);
 	return ret;
 }
@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/acl.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -50,9 +51,24 @@
 struct task_ctx {
 	uint32_t max_copy_inodes;
 	uint32_t cur_copy_inodes;
+	struct timeval start;
 	struct task_info *info;
 };
 
+/* average number of inodes copied per second so far */
+static u64 copied_inodes_rate(struct task_ctx *priv)
+{
+	struct timeval now;
+	u64 usecs;
+
+	gettimeofday(&now, NULL);
+	usecs = (now.tv_sec - priv->start.tv_sec) * 1000000ULL +
+		now.tv_usec - priv->start.tv_usec;
+	if (!usecs)
+		return 0;
+	return priv->cur_copy_inodes * 1000000ULL / usecs;
+}
+
 static void *print_copied_inodes(void *p)
 {
 	struct task_ctx *priv = p;
@@ -62,9 +78,9 @@ static void *print_copied_inodes(void *p)
 	task_period_start(priv->info, 1000 /* 1s */);
 	while (1) {
 		count++;
-		printf("copy inodes [%c] [%10d/%10d]\r",
+		printf("copy inodes [%c] [%10d/%10d] [%8llu inodes/s]\r",
 		       work_indicator[count % 4], priv->cur_copy_inodes,
-		       priv->max_copy_inodes);
+		       priv->max_copy_inodes, copied_inodes_rate(priv));
 		fflush(stdout);
 		task_period_wait(priv->info);
 	}
@@ -76,7 +92,8 @@ static int after_copied_inodes(void *p)
 {
 	struct task_ctx *priv = p;
 
-	printf("\n");
+	printf("\ncopied %u inodes, %llu inodes/s\n", priv->cur_copy_inodes,
+	       copied_inodes_rate(priv));
 	task_period_stop(priv->info);
 
 	return 0;
@@ -163,8 +180,8 @@ static int cache_free_extents(struct btrfs_root *root, ext2_filsys ext2_fs)
 		if (ext2fs_fast_test_block_bitmap(ext2_fs->block_map, block))
 			continue;
 		bytenr = block * blocksize;
-		ret = set_extent_dirty(&root->fs_info->free_space_cache,
-				       bytenr, bytenr + blocksize - 1, 0);
+		ret = btrfs_set_free_space(root->fs_info, bytenr,
+					   bytenr + blocksize - 1);
 		BUG_ON(ret);
 	}
 
@@ -173,12 +190,11 @@ static int cache_free_extents(struct btrfs_root *root, ext2_filsys ext2_fs)
 		bytenr &= ~((u64)BTRFS_STRIPE_LEN - 1);
 		if (bytenr >= blocksize * ext2_fs->super->s_blocks_count)
 			break;
-		clear_extent_dirty(&root->fs_info->free_space_cache, bytenr,
-				   bytenr + BTRFS_STRIPE_LEN - 1, 0);
+		btrfs_clear_free_space(root->fs_info, bytenr,
+				       bytenr + BTRFS_STRIPE_LEN - 1);
 	}
 
-	clear_extent_dirty(&root->fs_info->free_space_cache,
-			   0, BTRFS_SUPER_INFO_OFFSET - 1, 0);
+	btrfs_clear_free_space(root->fs_info, 0, BTRFS_SUPER_INFO_OFFSET - 1);
 
 	return 0;
 }
@@ -223,8 +239,8 @@ static int custom_alloc_extent(struct btrfs_root *root, u64 num_bytes,
 			continue;
 		}
 
-		clear_extent_dirty(&root->fs_info->free_space_cache,
-				   start, start + num_bytes - 1, 0);
+		btrfs_clear_free_space(root->fs_info, start,
+				       start + num_bytes - 1);
 
 		ins->objectid = start;
 		ins->offset = num_bytes;
@@ -263,16 +279,73 @@ static struct btrfs_extent_ops extent_ops = {
 	.free_extent = custom_free_extent,
 };
 
-struct dir_iterate_data {
-	struct btrfs_trans_handle *trans;
-	struct btrfs_root *root;
-	struct btrfs_inode_item *inode;
+/*
+ * copy_inodes() reads the ext2 side of the inodes on a task pool.  The
+ * workers look up the block runs of files, read directory entries, xattrs
+ * and the data of small files into a struct convert_inode, and the main
+ * thread inserts the btrfs items of each inode in inode order.
+ */
+#define CONVERT_BATCH_INODES	256
+
+struct convert_buf {
+	char *data;
+	u32 len;
+	u32 size;
+};
+
+/* file blocks [file_block, file_block + num_blocks) live at disk_block */
+struct convert_run {
+	u64 file_block;
+	u64 disk_block;
+	u64 num_blocks;
+};
+
+struct convert_dirent {
 	u64 objectid;
-	u64 index_cnt;
-	u64 parent;
+	u16 name_len;
+	u8 file_type;
+	char name[0];
+};
+
+struct convert_xattr {
+	u32 name_len;
+	u32 data_len;
+	char data[0];	/* name followed by the value */
+};
+
+struct convert_inode {
+	ext2_ino_t ext2_ino;
+	struct ext2_inode ext2_inode;
 	int errcode;
+	u64 parent;
+	struct convert_buf runs;
+	struct convert_buf dirents;
+	struct convert_buf xattrs;
+	char *inline_data;
+	u32 inline_len;
 };
 
+/* append a record of @len bytes, records are 8 byte aligned */
+static void *convert_buf_add(struct convert_buf *buf, u32 len)
+{
+	char *data;
+	u32 size;
+
+	len = round_up(len, 8);
+	if (buf->len + len > buf->size) {
+		size = max_t(u32, buf->size * 2, buf->len + len);
+		size = max_t(u32, size, 256);
+		data = realloc(buf->data, size);
+		if (!data)
+			return NULL;
+		buf->data = data;
+		buf->size = size;
+	}
+	data = buf->data + buf->len;
+	buf->len += len;
+	return data;
+}
+
 static u8 filetype_conversion_table[EXT2_FT_MAX] = {
 	[EXT2_FT_UNKNOWN]	= BTRFS_FT_UNKNOWN,
 	[EXT2_FT_REG_FILE]	= BTRFS_FT_REG_FILE,
@@ -289,13 +362,11 @@ static int dir_iterate_proc(ext2_ino_t dir, int entry,
 			    int offset, int blocksize,
 			    char *buf,void *priv_data)
 {
-	int ret;
 	int file_type;
 	u64 objectid;
-        u64 inode_size;
 	char dotdot[] = "..";
-	struct btrfs_key location;
-	struct dir_iterate_data *idata = (struct dir_iterate_data *)priv_data;
+	struct convert_inode *ci = priv_data;
+	struct convert_dirent *de;
 	int name_len;
 
 	name_len = dirent->name_len & 0xFF;
@@ -303,73 +374,80 @@ static int dir_iterate_proc(ext2_ino_t dir, int entry,
 	objectid = dirent->inode + INO_OFFSET;
 	if (!strncmp(dirent->name, dotdot, name_len)) {
 		if (name_len == 2) {
-			BUG_ON(idata->parent != 0);
-			idata->parent = objectid;
+			BUG_ON(ci->parent != 0);
+			ci->parent = objectid;
 		}
 		return 0;
 	}
 	if (dirent->inode < EXT2_GOOD_OLD_FIRST_INO)
 		return 0;
 
-	location.objectid = objectid;
-	location.offset = 0;
-	btrfs_set_key_type(&location, BTRFS_INODE_ITEM_KEY);
-
 	file_type = dirent->name_len >> 8;
 	BUG_ON(file_type > EXT2_FT_SYMLINK);
-	ret = btrfs_insert_dir_item(idata->trans, idata->root,
-				    dirent->name, name_len,
-				    idata->objectid, &location,
-				    filetype_conversion_table[file_type],
-				    idata->index_cnt);
-	if (ret)
-		goto fail;
-	ret = btrfs_insert_inode_ref(idata->trans, idata->root,
-				     dirent->name, name_len,
-				     objectid, idata->objectid,
-				     idata->index_cnt);
-	if (ret)
-		goto fail;
-	idata->index_cnt++;
-	inode_size = btrfs_stack_inode_size(idata->inode) +
-		     name_len * 2;
-	btrfs_set_stack_inode_size(idata->inode, inode_size);
+	de = convert_buf_add(&ci->dirents, sizeof(*de) + name_len);
+	if (!de) {
+		ci->errcode = -ENOMEM;
+		return BLOCK_ABORT;
+	}
+	de->objectid = objectid;
+	de->name_len = name_len;
+	de->file_type = filetype_conversion_table[file_type];
+	memcpy(de->name, dirent->name, name_len);
 	return 0;
-fail:
-	idata->errcode = ret;
-	return BLOCK_ABORT;
+}
+
+static int read_dir_entries(ext2_filsys ext2_fs, struct convert_inode *ci)
+{
+	errcode_t err;
+
+	err = ext2fs_dir_iterate2(ext2_fs, ci->ext2_ino, 0, NULL,
+				  dir_iterate_proc, ci);
+	if (err) {
+		fprintf(stderr, "ext2fs_dir_iterate2: %s\n",
+			error_message(err));
+		return -1;
+	}
+	return ci->errcode;
 }
 
 static int create_dir_entries(struct btrfs_trans_handle *trans,
 			      struct btrfs_root *root, u64 objectid,
 			      struct btrfs_inode_item *btrfs_inode,
-			      ext2_filsys ext2_fs, ext2_ino_t ext2_ino)
+			      struct convert_inode *ci)
 {
 	int ret;
-	errcode_t err;
-	struct dir_iterate_data data = {
-		.trans		= trans,
-		.root		= root,
-		.inode		= btrfs_inode,
-		.objectid	= objectid,
-		.index_cnt	= 2,
-		.parent		= 0,
-		.errcode	= 0,
-	};
-
-	err = ext2fs_dir_iterate2(ext2_fs, ext2_ino, 0, NULL,
-				  dir_iterate_proc, &data);
-	if (err)
-		goto error;
-	ret = data.errcode;
-	if (ret == 0 && data.parent == objectid) {
-		ret = btrfs_insert_inode_ref(trans, root, "..", 2,
-					     objectid, objectid, 0);
+	u64 index_cnt = 2;
+	u64 inode_size;
+	u32 offset = 0;
+	struct btrfs_key location;
+	struct convert_dirent *de;
+
+	while (offset < ci->dirents.len) {
+		de = (struct convert_dirent *)(ci->dirents.data + offset);
+		offset += round_up(sizeof(*de) + de->name_len, 8);
+
+		location.objectid = de->objectid;
+		location.offset = 0;
+		btrfs_set_key_type(&location, BTRFS_INODE_ITEM_KEY);
+		ret = btrfs_insert_dir_item(trans, root, de->name,
+					    de->name_len, objectid, &location,
+					    de->file_type, index_cnt);
+		if (ret)
+			return ret;
+		ret = btrfs_insert_inode_ref(trans, root, de->name,
+					     de->name_len, de->objectid,
+					     objectid, index_cnt);
+		if (ret)
+			return ret;
+		index_cnt++;
+		inode_size = btrfs_stack_inode_size(btrfs_inode) +
+			     de->name_len * 2;
+		btrfs_set_stack_inode_size(btrfs_inode, inode_size);
 	}
-	return ret;
-error:
-	fprintf(stderr, "ext2fs_dir_iterate2: %s\n", error_message(err));
-	return -1;
+	if (ci->parent == objectid)
+		return btrfs_insert_inode_ref(trans, root, "..", 2,
+					      objectid, objectid, 0);
+	return 0;
 }
 
 static int read_disk_extent(struct btrfs_root *root, u64 bytenr,
@@ -388,35 +466,231 @@ fail:
 	return ret;
 }
 
-static int csum_disk_extent(struct btrfs_trans_handle *trans,
-			    struct btrfs_root *root,
-			    u64 disk_bytenr, u64 num_bytes)
+/*
+ * Data checksums are not inserted as each file extent is recorded.  The
+ * extents are queued in a batch which, when it is large enough or before
+ * the transaction commits, is sorted and read back in big sequential
+ * chunks.  The chunks are checksummed on a thread pool while the next one
+ * is being read, and the sums go into the csum tree in bytenr order.
+ */
+#define CSUM_BATCH_BYTES	(256 * 1024 * 1024)
+#define CSUM_READ_BYTES		(4 * 1024 * 1024)
+#define CSUM_WORK_BYTES		(256 * 1024)
+
+struct csum_range {
+	u64 bytenr;
+	u64 num_bytes;
+};
+
+struct csum_work {
+	struct task_work work;
+	char *data;
+	char *sums;
+	u32 len;
+	u32 sectorsize;
+	u16 csum_size;
+};
+
+struct csum_buffer {
+	char *data;
+	char *sums;
+	u64 bytenr;
+	u32 len;
+	int nr_works;
+	struct csum_work works[CSUM_READ_BYTES / CSUM_WORK_BYTES];
+};
+
+struct csum_batch {
+	struct task_pool *pool;
+	struct csum_range *ranges;
+	int nr_ranges;
+	int max_ranges;
+	u64 bytes;
+};
+
+static struct csum_batch csum_batch;
+
+static void csum_data_blocks(struct task_work *work)
+{
+	struct csum_work *cw = container_of(work, struct csum_work, work);
+	u32 offset;
+	u32 crc;
+
+	for (offset = 0; offset < cw->len; offset += cw->sectorsize) {
+		crc = btrfs_csum_data(NULL, cw->data + offset, ~(u32)0,
+				      cw->sectorsize);
+		btrfs_csum_final(crc, cw->sums +
+				 offset / cw->sectorsize * cw->csum_size);
+	}
+}
+
+static void queue_csum_buffer(struct btrfs_root *root, struct csum_buffer *buf)
 {
-	u32 blocksize = root->sectorsize;
+	u16 csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
+	struct csum_work *cw;
+	u32 offset;
+
+	buf->nr_works = 0;
+	for (offset = 0; offset < buf->len; offset += CSUM_WORK_BYTES) {
+		cw = &buf->works[buf->nr_works++];
+		cw->data = buf->data + offset;
+		cw->sums = buf->sums + offset / root->sectorsize * csum_size;
+		cw->len = min_t(u32, CSUM_WORK_BYTES, buf->len - offset);
+		cw->sectorsize = root->sectorsize;
+		cw->csum_size = csum_size;
+		if (csum_batch.pool)
+			task_pool_queue(csum_batch.pool, &cw->work,
+					csum_data_blocks);
+		else
+			csum_data_blocks(&cw->work);
+	}
+}
+
+static void wait_csum_buffer(struct csum_buffer *buf)
+{
+	int i;
+
+	if (!csum_batch.pool)
+		return;
+	for (i = 0; i < buf->nr_works; i++)
+		task_pool_wait_work(csum_batch.pool, &buf->works[i].work);
+	buf->nr_works = 0;
+}
+
+static int cmp_csum_range(const void *a, const void *b)
+{
+	const struct csum_range *ra = a;
+	const struct csum_range *rb = b;
+
+	if (ra->bytenr != rb->bytenr)
+		return ra->bytenr < rb->bytenr ? -1 : 1;
+	return 0;
+}
+
+static int flush_csum_batch(struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root)
+{
+	struct btrfs_root *csum_root = root->fs_info->csum_root;
+	u16 csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
+	struct csum_buffer *bufs;
+	struct csum_buffer *buf;
+	struct csum_buffer *prev = NULL;
+	struct csum_range *range;
 	u64 offset;
-	char *buffer;
+	int nr = 0;
+	int cur = 0;
 	int ret = 0;
+	int i;
 
-	buffer = malloc(blocksize);
-	if (!buffer)
+	if (!csum_batch.nr_ranges)
+		return 0;
+
+	qsort(csum_batch.ranges, csum_batch.nr_ranges,
+	      sizeof(struct csum_range), cmp_csum_range);
+	for (i = 0; i < csum_batch.nr_ranges; i++) {
+		range = csum_batch.ranges + i;
+		if (nr && csum_batch.ranges[nr - 1].bytenr +
+		    csum_batch.ranges[nr - 1].num_bytes == range->bytenr) {
+			csum_batch.ranges[nr - 1].num_bytes += range->num_bytes;
+			continue;
+		}
+		csum_batch.ranges[nr++] = *range;
+	}
+
+	bufs = calloc(2, sizeof(*bufs));
+	if (!bufs)
 		return -ENOMEM;
-	for (offset = 0; offset < num_bytes; offset += blocksize) {
-		ret = read_disk_extent(root, disk_bytenr + offset,
-					blocksize, buffer);
-		if (ret)
-			break;
-		ret = btrfs_csum_file_block(trans,
-					    root->fs_info->csum_root,
-					    disk_bytenr + num_bytes,
-					    disk_bytenr + offset,
-					    buffer, blocksize);
-		if (ret)
-			break;
+	for (i = 0; i < 2; i++) {
+		bufs[i].data = malloc(CSUM_READ_BYTES);
+		bufs[i].sums = malloc(CSUM_READ_BYTES / root->sectorsize *
+				      csum_size);
+		if (!bufs[i].data || !bufs[i].sums) {
+			ret = -ENOMEM;
+			goto out;
+		}
 	}
-	free(buffer);
+
+	for (i = 0; i < nr; i++) {
+		range = csum_batch.ranges + i;
+		for (offset = 0; offset < range->num_bytes;
+		     offset += CSUM_READ_BYTES) {
+			buf = bufs + cur;
+			buf->bytenr = range->bytenr + offset;
+			buf->len = min_t(u64, CSUM_READ_BYTES,
+					 range->num_bytes - offset);
+			/* read this chunk while the previous one is summed */
+			ret = read_disk_extent(root, buf->bytenr, buf->len,
+					       buf->data);
+			if (ret)
+				goto out;
+			queue_csum_buffer(root, buf);
+
+			if (prev) {
+				wait_csum_buffer(prev);
+				ret = btrfs_insert_csums(trans, csum_root,
+						prev->bytenr,
+						prev->len / root->sectorsize,
+						prev->sums);
+				prev = NULL;
+				if (ret)
+					goto out;
+			}
+			prev = buf;
+			cur ^= 1;
+		}
+	}
+	if (prev) {
+		wait_csum_buffer(prev);
+		ret = btrfs_insert_csums(trans, csum_root, prev->bytenr,
+					 prev->len / root->sectorsize,
+					 prev->sums);
+		prev = NULL;
+	}
+out:
+	if (prev)
+		wait_csum_buffer(prev);
+	for (i = 0; i < 2; i++) {
+		free(bufs[i].data);
+		free(bufs[i].sums);
+	}
+	free(bufs);
+	csum_batch.nr_ranges = 0;
+	csum_batch.bytes = 0;
 	return ret;
 }
 
+static void free_csum_batch(void)
+{
+	free(csum_batch.ranges);
+	memset(&csum_batch, 0, sizeof(csum_batch));
+}
+
+static int csum_disk_extent(struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root,
+			    u64 disk_bytenr, u64 num_bytes)
+{
+	struct csum_range *ranges;
+	struct csum_range *range;
+
+	if (csum_batch.nr_ranges == csum_batch.max_ranges) {
+		int max = max(1024, csum_batch.max_ranges * 2);
+
+		ranges = realloc(csum_batch.ranges, max * sizeof(*ranges));
+		if (!ranges)
+			return -ENOMEM;
+		csum_batch.ranges = ranges;
+		csum_batch.max_ranges = max;
+	}
+	range = csum_batch.ranges + csum_batch.nr_ranges++;
+	range->bytenr = disk_bytenr;
+	range->num_bytes = num_bytes;
+	csum_batch.bytes += num_bytes;
+
+	if (csum_batch.bytes >= CSUM_BATCH_BYTES)
+		return flush_csum_batch(trans, root);
+	return 0;
+}
+
 static int record_file_blocks(struct btrfs_trans_handle *trans,
 			      struct btrfs_root *root, u64 objectid,
 			      struct btrfs_inode_item *inode,
@@ -505,30 +779,81 @@ fail:
 	return BLOCK_ABORT;
 }
 
-static int __block_iterate_proc(ext2_filsys fs, blk_t *blocknr,
-			        e2_blkcnt_t blockcnt, blk_t ref_block,
-			        int ref_offset, void *priv_data)
+static int collect_block_proc(ext2_filsys fs, blk_t *blocknr,
+			      e2_blkcnt_t blockcnt, blk_t ref_block,
+			      int ref_offset, void *priv_data)
 {
-	struct blk_iterate_data *idata;
-	idata = (struct blk_iterate_data *)priv_data;
-	return block_iterate_proc(fs, *blocknr, blockcnt, idata);
+	struct convert_inode *ci = priv_data;
+	struct convert_run *run;
+
+	if (ci->runs.len) {
+		run = (struct convert_run *)(ci->runs.data + ci->runs.len) - 1;
+		if (run->file_block + run->num_blocks == blockcnt &&
+		    run->disk_block + run->num_blocks == *blocknr) {
+			run->num_blocks++;
+			return 0;
+		}
+	}
+	run = convert_buf_add(&ci->runs, sizeof(*run));
+	if (!run) {
+		ci->errcode = -ENOMEM;
+		return BLOCK_ABORT;
+	}
+	run->file_block = blockcnt;
+	run->disk_block = *blocknr;
+	run->num_blocks = 1;
+	return 0;
 }
 
 /*
- * traverse file's data blocks, record these data blocks as file extents.
+ * look up the data blocks of a file.  The data of a file that may be
+ * inlined (@inline_size fits in a leaf) is read as well.
+ */
+static int read_file_blocks(struct btrfs_root *root, ext2_filsys ext2_fs,
+			    struct convert_inode *ci, u64 inline_size)
+{
+	struct convert_run *run;
+	errcode_t err;
+
+	err = ext2fs_block_iterate2(ext2_fs, ci->ext2_ino, BLOCK_FLAG_DATA_ONLY,
+				    NULL, collect_block_proc, ci);
+	if (err) {
+		fprintf(stderr, "ext2fs_block_iterate2: %s\n",
+			error_message(err));
+		return -1;
+	}
+	if (ci->errcode)
+		return ci->errcode;
+
+	run = (struct convert_run *)ci->runs.data;
+	if (inline_size > BTRFS_MAX_INLINE_DATA_SIZE(root) ||
+	    ci->runs.len != sizeof(*run) || run->file_block != 0)
+		return 0;
+	ci->inline_len = run->num_blocks * root->sectorsize;
+	ci->inline_data = malloc(ci->inline_len);
+	if (!ci->inline_data)
+		return -ENOMEM;
+	return read_disk_extent(root, run->disk_block * root->sectorsize,
+				ci->inline_len, ci->inline_data);
+}
+
+/*
+ * record the data blocks of a file as file extents.
  */
 static int create_file_extents(struct btrfs_trans_handle *trans,
 			       struct btrfs_root *root, u64 objectid,
 			       struct btrfs_inode_item *btrfs_inode,
-			       ext2_filsys ext2_fs, ext2_ino_t ext2_ino,
+			       struct convert_inode *ci,
 			       int datacsum, int packing)
 {
-	int ret;
-	char *buffer = NULL;
-	errcode_t err;
+	int ret = 0;
 	u32 last_block;
 	u32 sectorsize = root->sectorsize;
 	u64 inode_size = btrfs_stack_inode_size(btrfs_inode);
+	struct convert_run *run = (struct convert_run *)ci->runs.data;
+	u32 nr_runs = ci->runs.len / sizeof(*run);
+	u64 block;
+	u32 i;
 	struct blk_iterate_data data = {
 		.trans		= trans,
 		.root		= root,
@@ -541,31 +866,29 @@ static int create_file_extents(struct btrfs_trans_handle *trans,
 		.checksum	= datacsum,
 		.errcode	= 0,
 	};
-	err = ext2fs_block_iterate2(ext2_fs, ext2_ino, BLOCK_FLAG_DATA_ONLY,
-				    NULL, __block_iterate_proc, &data);
-	if (err)
-		goto error;
-	ret = data.errcode;
-	if (ret)
-		goto fail;
+
+	for (i = 0; i < nr_runs; i++, run++) {
+		for (block = 0; block < run->num_blocks; block++) {
+			ret = block_iterate_proc(NULL, run->disk_block + block,
+						 run->file_block + block,
+						 &data);
+			if (ret & BLOCK_ABORT)
+				return data.errcode;
+		}
+	}
 	if (packing && data.first_block == 0 && data.num_blocks > 0 &&
 	    inode_size <= BTRFS_MAX_INLINE_DATA_SIZE(root)) {
 		u64 num_bytes = data.num_blocks * sectorsize;
-		u64 disk_bytenr = data.disk_block * sectorsize;
 		u64 nbytes;
 
-		buffer = malloc(num_bytes);
-		if (!buffer)
-			return -ENOMEM;
-		ret = read_disk_extent(root, disk_bytenr, num_bytes, buffer);
-		if (ret)
-			goto fail;
+		/* read_file_blocks() has read the data already */
+		BUG_ON(!ci->inline_data || ci->inline_len != num_bytes);
 		if (num_bytes > inode_size)
 			num_bytes = inode_size;
 		ret = btrfs_insert_inline_extent(trans, root, objectid,
-						 0, buffer, num_bytes);
+						 0, ci->inline_data, num_bytes);
 		if (ret)
-			goto fail;
+			return ret;
 		nbytes = btrfs_stack_inode_nbytes(btrfs_inode) + num_bytes;
 		btrfs_set_stack_inode_nbytes(btrfs_inode, nbytes);
 	} else if (data.num_blocks > 0) {
@@ -573,7 +896,7 @@ static int create_file_extents(struct btrfs_trans_handle *trans,
 					 data.first_block, data.disk_block,
 					 data.num_blocks, data.checksum);
 		if (ret)
-			goto fail;
+			return ret;
 	}
 	data.first_block += data.num_blocks;
 	last_block = (inode_size + sectorsize - 1) / sectorsize;
@@ -582,32 +905,26 @@ static int create_file_extents(struct btrfs_trans_handle *trans,
 					 data.first_block, 0, last_block -
 					 data.first_block, data.checksum);
 	}
-fail:
-	free(buffer);
 	return ret;
-error:
-	fprintf(stderr, "ext2fs_block_iterate2: %s\n", error_message(err));
-	return -1;
 }
 
 static int create_symbol_link(struct btrfs_trans_handle *trans,
 			      struct btrfs_root *root, u64 objectid,
 			      struct btrfs_inode_item *btrfs_inode,
-			      ext2_filsys ext2_fs, ext2_ino_t ext2_ino,
-			      struct ext2_inode *ext2_inode)
+			      ext2_filsys ext2_fs, struct convert_inode *ci)
 {
 	int ret;
 	char *pathname;
 	u64 inode_size = btrfs_stack_inode_size(btrfs_inode);
-	if (ext2fs_inode_data_blocks(ext2_fs, ext2_inode)) {
+	if (ext2fs_inode_data_blocks(ext2_fs, &ci->ext2_inode)) {
 		btrfs_set_stack_inode_size(btrfs_inode, inode_size + 1);
 		ret = create_file_extents(trans, root, objectid, btrfs_inode,
-					  ext2_fs, ext2_ino, 1, 1);
+					  ci, 1, 1);
 		btrfs_set_stack_inode_size(btrfs_inode, inode_size);
 		return ret;
 	}
 
-	pathname = (char *)&(ext2_inode->i_block[0]);
+	pathname = (char *)&(ci->ext2_inode.i_block[0]);
 	BUG_ON(pathname[inode_size] != 0);
 	ret = btrfs_insert_inline_extent(trans, root, objectid, 0,
 					 pathname, inode_size + 1);
@@ -778,57 +1095,57 @@ static char *xattr_prefix_table[] = {
 	[6] =	"security.",
 };
 
-static int copy_single_xattr(struct btrfs_trans_handle *trans,
-			     struct btrfs_root *root, u64 objectid,
+/*
+ * translate one ext2 xattr to its btrfs name and value, converting ACLs
+ * to the POSIX xattr format.
+ */
+static int read_single_xattr(struct convert_inode *ci,
 			     struct ext2_ext_attr_entry *entry,
 			     const void *data, u32 datalen)
 {
 	int ret = 0;
 	int name_len;
 	int name_index;
-	void *databuf = NULL;
-	char namebuf[XATTR_NAME_MAX + 1];
+	int prefix_len;
+	size_t bufsize = datalen;
+	struct convert_xattr *xattr;
 
 	name_index = entry->e_name_index;
 	if (name_index >= ARRAY_SIZE(xattr_prefix_table) ||
 	    xattr_prefix_table[name_index] == NULL)
 		return -EOPNOTSUPP;
-	name_len = strlen(xattr_prefix_table[name_index]) +
-		   entry->e_name_len;
-	if (name_len >= sizeof(namebuf))
+	prefix_len = strlen(xattr_prefix_table[name_index]);
+	name_len = prefix_len + entry->e_name_len;
+	if (name_len > XATTR_NAME_MAX)
 		return -ERANGE;
 
 	if (name_index == 2 || name_index == 3) {
-		size_t bufsize = acl_ea_size(ext2_acl_count(datalen));
-		databuf = malloc(bufsize);
-		if (!databuf)
-		       return -ENOMEM;
-		ret = ext2_acl_to_xattr(databuf, data, bufsize, datalen);
-		if (ret)
-			goto out;
-		data = databuf;
-		datalen = bufsize;
-	}
-	strncpy(namebuf, xattr_prefix_table[name_index], XATTR_NAME_MAX);
-	strncat(namebuf, EXT2_EXT_ATTR_NAME(entry), entry->e_name_len);
-	if (name_len + datalen > BTRFS_LEAF_DATA_SIZE(root) -
-	    sizeof(struct btrfs_item) - sizeof(struct btrfs_dir_item)) {
-		fprintf(stderr, "skip large xattr on inode %Lu name %.*s\n",
-			objectid - INO_OFFSET, name_len, namebuf);
-		goto out;
+		int count = ext2_acl_count(datalen);
+
+		if (count <= 0)
+			return -EINVAL;
+		bufsize = acl_ea_size(count);
 	}
-	ret = btrfs_insert_xattr_item(trans, root, namebuf, name_len,
-				      data, datalen, objectid);
-out:
-	free(databuf);
+	xattr = convert_buf_add(&ci->xattrs,
+				sizeof(*xattr) + name_len + bufsize);
+	if (!xattr)
+		return -ENOMEM;
+	xattr->name_len = name_len;
+	xattr->data_len = bufsize;
+	memcpy(xattr->data, xattr_prefix_table[name_index], prefix_len);
+	memcpy(xattr->data + prefix_len, EXT2_EXT_ATTR_NAME(entry),
+	       entry->e_name_len);
+	if (name_index == 2 || name_index == 3)
+		ret = ext2_acl_to_xattr(xattr->data + name_len, data,
+					bufsize, datalen);
+	else
+		memcpy(xattr->data + name_len, data, datalen);
 	return ret;
 }
 
-static int copy_extended_attrs(struct btrfs_trans_handle *trans,
-			       struct btrfs_root *root, u64 objectid,
-			       struct btrfs_inode_item *btrfs_inode,
-			       ext2_filsys ext2_fs, ext2_ino_t ext2_ino)
+static int read_extended_attrs(ext2_filsys ext2_fs, struct convert_inode *ci)
 {
+	ext2_ino_t ext2_ino = ci->ext2_ino;
 	int ret = 0;
 	int inline_ea = 0;
 	errcode_t err;
@@ -885,8 +1202,7 @@ static int copy_extended_attrs(struct btrfs_trans_handle *trans,
 			data = (void *)EXT2_XATTR_IFIRST(ext2_inode) +
 				entry->e_value_offs;
 			datalen = entry->e_value_size;
-			ret = copy_single_xattr(trans, root, objectid,
-						entry, data, datalen);
+			ret = read_single_xattr(ci, entry, data, datalen);
 			if (ret)
 				goto out;
 			entry = EXT2_EXT_ATTR_NEXT(entry);
@@ -919,8 +1235,7 @@ static int copy_extended_attrs(struct btrfs_trans_handle *trans,
 			goto out;
 		data = buffer + entry->e_value_offs;
 		datalen = entry->e_value_size;
-		ret = copy_single_xattr(trans, root, objectid,
-					entry, data, datalen);
+		ret = read_single_xattr(ci, entry, data, datalen);
 		if (ret)
 			goto out;
 		entry = EXT2_EXT_ATTR_NEXT(entry);
@@ -931,6 +1246,38 @@ out:
 		free(ext2_inode);
 	return ret;
 }
+
+static int copy_extended_attrs(struct btrfs_trans_handle *trans,
+			       struct btrfs_root *root, u64 objectid,
+			       struct convert_inode *ci)
+{
+	int ret;
+	u32 offset = 0;
+	struct convert_xattr *xattr;
+
+	while (offset < ci->xattrs.len) {
+		xattr = (struct convert_xattr *)(ci->xattrs.data + offset);
+		offset += round_up(sizeof(*xattr) + xattr->name_len +
+				   xattr->data_len, 8);
+
+		if (xattr->name_len + xattr->data_len >
+		    BTRFS_LEAF_DATA_SIZE(root) - sizeof(struct btrfs_item) -
+		    sizeof(struct btrfs_dir_item)) {
+			fprintf(stderr,
+				"skip large xattr on inode %Lu name %.*s\n",
+				objectid - INO_OFFSET, xattr->name_len,
+				xattr->data);
+			continue;
+		}
+		ret = btrfs_insert_xattr_item(trans, root, xattr->data,
+					      xattr->name_len,
+					      xattr->data + xattr->name_len,
+					      xattr->data_len, objectid);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
 #define MINORBITS	20
 #define MKDEV(ma, mi)	(((ma) << MINORBITS) | (mi))
 
@@ -989,22 +1336,66 @@ static int copy_inode_item(struct btrfs_inode_item *dst,
 	return 0;
 }
 
+/*
+ * read everything copy_single_inode() needs from ext2 for one inode.
+ * This runs on the task pool with a private ext2 handle.
+ */
+static int read_convert_inode(struct btrfs_root *root, ext2_filsys ext2_fs,
+			      struct convert_inode *ci, int packing,
+			      int noxattr)
+{
+	int ret;
+	u64 inode_size;
+	struct ext2_inode *ext2_inode = &ci->ext2_inode;
+
+	if (ext2_inode->i_links_count == 0)
+		return 0;
+
+	switch (ext2_inode->i_mode & S_IFMT) {
+	case S_IFREG:
+		inode_size = (u64)ext2_inode->i_size_high << 32 |
+			     ext2_inode->i_size;
+		ret = read_file_blocks(root, ext2_fs, ci,
+				       packing ? inode_size : (u64)-1);
+		break;
+	case S_IFDIR:
+		ret = read_dir_entries(ext2_fs, ci);
+		break;
+	case S_IFLNK:
+		ret = 0;
+		if (ext2fs_inode_data_blocks(ext2_fs, ext2_inode))
+			ret = read_file_blocks(root, ext2_fs, ci,
+					       (u64)ext2_inode->i_size + 1);
+		break;
+	default:
+		ret = 0;
+		break;
+	}
+	if (ret)
+		return ret;
+
+	if (!noxattr)
+		ret = read_extended_attrs(ext2_fs, ci);
+	return ret;
+}
+
 /*
  * copy a single inode. do all the required works, such as cloning
  * inode item, creating file extents and creating directory entries.
  */
 static int copy_single_inode(struct btrfs_trans_handle *trans,
 			     struct btrfs_root *root, u64 objectid,
-			     ext2_filsys ext2_fs, ext2_ino_t ext2_ino,
-			     struct ext2_inode *ext2_inode,
+			     ext2_filsys ext2_fs, struct convert_inode *ci,
 			     int datacsum, int packing, int noxattr)
 {
 	int ret;
-	struct btrfs_key inode_key;
+	struct ext2_inode *ext2_inode = &ci->ext2_inode;
 	struct btrfs_inode_item btrfs_inode;
 
 	if (ext2_inode->i_links_count == 0)
 		return 0;
+	if (ci->errcode)
+		return ci->errcode;
 
 	copy_inode_item(&btrfs_inode, ext2_inode, ext2_fs->blocksize);
 	if (!datacsum && S_ISREG(ext2_inode->i_mode)) {
@@ -1016,15 +1407,15 @@ static int copy_single_inode(struct btrfs_trans_handle *trans,
 	switch (ext2_inode->i_mode & S_IFMT) {
 	case S_IFREG:
 		ret = create_file_extents(trans, root, objectid, &btrfs_inode,
-					ext2_fs, ext2_ino, datacsum, packing);
+					  ci, datacsum, packing);
 		break;
 	case S_IFDIR:
 		ret = create_dir_entries(trans, root, objectid, &btrfs_inode,
-					 ext2_fs, ext2_ino);
+					 ci);
 		break;
 	case S_IFLNK:
 		ret = create_symbol_link(trans, root, objectid, &btrfs_inode,
-					 ext2_fs, ext2_ino, ext2_inode);
+					 ext2_fs, ci);
 		break;
 	default:
 		ret = 0;
@@ -1034,16 +1425,11 @@ static int copy_single_inode(struct btrfs_trans_handle *trans,
 		return ret;
 
 	if (!noxattr) {
-		ret = copy_extended_attrs(trans, root, objectid, &btrfs_inode,
-					  ext2_fs, ext2_ino);
+		ret = copy_extended_attrs(trans, root, objectid, ci);
 		if (ret)
 			return ret;
 	}
-	inode_key.objectid = objectid;
-	inode_key.offset = 0;
-	btrfs_set_key_type(&inode_key, BTRFS_INODE_ITEM_KEY);
-	ret = btrfs_insert_inode(trans, root, objectid, &btrfs_inode);
-	return ret;
+	return btrfs_insert_inode(trans, root, objectid, &btrfs_inode);
 }
 
 static int copy_disk_extent(struct btrfs_root *root, u64 dst_bytenr,
@@ -1069,27 +1455,200 @@ fail:
 		ret = -1;
 	return ret;
 }
+struct convert_ctx {
+	struct btrfs_root *root;
+	struct task_pool *pool;
+	const char *devname;
+	int packing;
+	int noxattr;
+	/* idle ext2 handles of the workers */
+	pthread_mutex_t lock;
+	ext2_filsys *handles;
+	int nr_handles;
+};
+
+struct convert_batch {
+	struct task_work work;
+	struct list_head list;
+	struct convert_ctx *ctx;
+	int nr_inodes;
+	struct convert_inode inodes[CONVERT_BATCH_INODES];
+};
+
+/*
+ * libext2fs handles can't be shared between threads, every worker reads
+ * through a handle of its own.
+ */
+static ext2_filsys get_convert_fs(struct convert_ctx *cctx)
+{
+	ext2_filsys ext2_fs = NULL;
+	errcode_t err;
+
+	pthread_mutex_lock(&cctx->lock);
+	if (cctx->nr_handles)
+		ext2_fs = cctx->handles[--cctx->nr_handles];
+	pthread_mutex_unlock(&cctx->lock);
+	if (ext2_fs)
+		return ext2_fs;
+
+	err = ext2fs_open(cctx->devname, 0, 0, 0, unix_io_manager, &ext2_fs);
+	if (err) {
+		fprintf(stderr, "ext2fs_open: %s\n", error_message(err));
+		return NULL;
+	}
+	return ext2_fs;
+}
+
+static void put_convert_fs(struct convert_ctx *cctx, ext2_filsys ext2_fs)
+{
+	pthread_mutex_lock(&cctx->lock);
+	cctx->handles[cctx->nr_handles++] = ext2_fs;
+	pthread_mutex_unlock(&cctx->lock);
+}
+
+static void read_convert_batch(struct task_work *work)
+{
+	struct convert_batch *batch;
+	struct convert_ctx *cctx;
+	struct convert_inode *ci;
+	ext2_filsys ext2_fs;
+	int i;
+
+	batch = container_of(work, struct convert_batch, work);
+	cctx = batch->ctx;
+	ext2_fs = get_convert_fs(cctx);
+	for (i = 0; i < batch->nr_inodes; i++) {
+		ci = &batch->inodes[i];
+		if (!ext2_fs)
+			ci->errcode = -EIO;
+		else
+			ci->errcode = read_convert_inode(cctx->root, ext2_fs,
+							 ci, cctx->packing,
+							 cctx->noxattr);
+	}
+	if (ext2_fs)
+		put_convert_fs(cctx, ext2_fs);
+}
+
+static void queue_convert_batch(struct convert_ctx *cctx,
+				struct convert_batch *batch,
+				struct list_head *queued)
+{
+	batch->ctx = cctx;
+	list_add_tail(&batch->list, queued);
+	if (cctx->pool)
+		task_pool_queue(cctx->pool, &batch->work, read_convert_batch);
+	else
+		read_convert_batch(&batch->work);
+}
+
+/* take the oldest batch off @queued once its inodes have been read */
+static struct convert_batch *wait_convert_batch(struct list_head *queued)
+{
+	struct convert_batch *batch;
+
+	batch = list_first_entry(queued, struct convert_batch, list);
+	list_del(&batch->list);
+	if (batch->ctx->pool)
+		task_pool_wait_work(batch->ctx->pool, &batch->work);
+	return batch;
+}
+
+static void free_convert_batch(struct convert_batch *batch)
+{
+	struct convert_inode *ci;
+	int i;
+
+	for (i = 0; i < batch->nr_inodes; i++) {
+		ci = &batch->inodes[i];
+		free(ci->runs.data);
+		free(ci->dirents.data);
+		free(ci->xattrs.data);
+		free(ci->inline_data);
+	}
+	free(batch);
+}
+
+static int write_convert_batch(struct btrfs_trans_handle **trans,
+			       struct btrfs_root *root, ext2_filsys ext2_fs,
+			       struct list_head *queued, int datacsum,
+			       int packing, int noxattr, struct task_ctx *p)
+{
+	struct convert_batch *batch;
+	struct convert_inode *ci;
+	u64 objectid;
+	int ret = 0;
+	int i;
+
+	batch = wait_convert_batch(queued);
+	for (i = 0; i < batch->nr_inodes; i++) {
+		ci = &batch->inodes[i];
+		objectid = ci->ext2_ino + INO_OFFSET;
+		ret = copy_single_inode(*trans, root, objectid, ext2_fs, ci,
+					datacsum, packing, noxattr);
+		p->cur_copy_inodes++;
+		if (ret)
+			break;
+		if ((*trans)->blocks_used >= 4096) {
+			ret = flush_csum_batch(*trans, root);
+			if (ret)
+				break;
+			ret = btrfs_commit_transaction(*trans, root);
+			BUG_ON(ret);
+			*trans = btrfs_start_transaction(root, 1);
+			BUG_ON(!*trans);
+		}
+	}
+	free_convert_batch(batch);
+	return ret;
+}
+
 /*
  * scan ext2's inode bitmap and copy all used inodes.
+ *
+ * The inodes are handed to the task pool in batches, the pool reads their
+ * blocks, directories and xattrs while the items of older batches are
+ * inserted here.
  */
 static int copy_inodes(struct btrfs_root *root, ext2_filsys ext2_fs,
-		       int datacsum, int packing, int noxattr, struct task_ctx *p)
+		       const char *devname, struct task_pool *pool,
+		       int datacsum, int packing, int noxattr,
+		       struct task_ctx *p)
 {
-	int ret;
+	int ret = 0;
 	errcode_t err;
-	ext2_inode_scan ext2_scan;
+	ext2_inode_scan ext2_scan = NULL;
 	struct ext2_inode ext2_inode;
 	ext2_ino_t ext2_ino;
-	u64 objectid;
 	struct btrfs_trans_handle *trans;
+	struct convert_batch *batch = NULL;
+	struct convert_inode *ci;
+	struct convert_ctx cctx = {
+		.root		= root,
+		.pool		= pool,
+		.devname	= devname,
+		.packing	= packing,
+		.noxattr	= noxattr,
+	};
+	LIST_HEAD(queued);
+	int nr_threads = pool ? pool->nr_threads : 1;
+	int nr_queued = 0;
 
-	trans = btrfs_start_transaction(root, 1);
-	if (!trans)
+	pthread_mutex_init(&cctx.lock, NULL);
+	cctx.handles = calloc(nr_threads, sizeof(ext2_filsys));
+	if (!cctx.handles)
 		return -ENOMEM;
+
+	trans = btrfs_start_transaction(root, 1);
+	if (!trans) {
+		ret = -ENOMEM;
+		goto out;
+	}
 	err = ext2fs_open_inode_scan(ext2_fs, 0, &ext2_scan);
 	if (err) {
 		fprintf(stderr, "ext2fs_open_inode_scan: %s\n", error_message(err));
-		return -1;
+		ret = -1;
+		goto out;
 	}
 	while (!(err = ext2fs_get_next_inode(ext2_scan, &ext2_ino,
 					     &ext2_inode))) {
@@ -1100,28 +1659,62 @@ static int copy_inodes(struct btrfs_root *root, ext2_filsys ext2_fs,
 		if (ext2_ino < EXT2_GOOD_OLD_FIRST_INO &&
 		    ext2_ino != EXT2_ROOT_INO)
 			continue;
-		objectid = ext2_ino + INO_OFFSET;
-		ret = copy_single_inode(trans, root,
-					objectid, ext2_fs, ext2_ino,
-					&ext2_inode, datacsum, packing,
-					noxattr);
-		p->cur_copy_inodes++;
-		if (ret)
-			return ret;
-		if (trans->blocks_used >= 4096) {
-			ret = btrfs_commit_transaction(trans, root);
-			BUG_ON(ret);
-			trans = btrfs_start_transaction(root, 1);
-			BUG_ON(!trans);
+		if (!batch) {
+			batch = calloc(1, sizeof(*batch));
+			if (!batch) {
+				ret = -ENOMEM;
+				goto out;
+			}
 		}
+		ci = &batch->inodes[batch->nr_inodes++];
+		ci->ext2_ino = ext2_ino;
+		ci->ext2_inode = ext2_inode;
+		if (batch->nr_inodes < CONVERT_BATCH_INODES)
+			continue;
+
+		queue_convert_batch(&cctx, batch, &queued);
+		batch = NULL;
+		/* keep the workers busy while the oldest batch is inserted */
+		if (++nr_queued < 2 * nr_threads)
+			continue;
+		nr_queued--;
+		ret = write_convert_batch(&trans, root, ext2_fs, &queued,
+					  datacsum, packing, noxattr, p);
+		if (ret)
+			goto out;
 	}
 	if (err) {
 		fprintf(stderr, "ext2fs_get_next_inode: %s\n", error_message(err));
-		return -1;
+		ret = -1;
+		goto out;
 	}
+	if (batch) {
+		queue_convert_batch(&cctx, batch, &queued);
+		batch = NULL;
+	}
+	while (!list_empty(&queued)) {
+		ret = write_convert_batch(&trans, root, ext2_fs, &queued,
+					  datacsum, packing, noxattr, p);
+		if (ret)
+			goto out;
+	}
+	ret = flush_csum_batch(trans, root);
+	if (ret)
+		goto out;
 	ret = btrfs_commit_transaction(trans, root);
 	BUG_ON(ret);
-
+out:
+	/* the pool may still be reading batches we are not going to use */
+	while (!list_empty(&queued))
+		free_convert_batch(wait_convert_batch(&queued));
+	if (batch)
+		free_convert_batch(batch);
+	while (cctx.nr_handles)
+		ext2fs_close(cctx.handles[--cctx.nr_handles]);
+	free(cctx.handles);
+	pthread_mutex_destroy(&cctx.lock);
+	if (ext2_scan)
+		ext2fs_close_inode_scan(ext2_scan);
 	return ret;
 }
 
@@ -1697,6 +2290,7 @@ static int migrate_super_block(int fd, u64 old_bytenr, u32 sectorsize)
 		return -ENOMEM;
 
 	buf->len = sectorsize;
+	buf->data = buf->inline_data;
 	ret = pread(fd, buf->data, sectorsize, old_bytenr);
 	if (ret != sectorsize)
 		goto fail;
@@ -1777,6 +2371,7 @@ static int prepare_system_chunk(int fd, u64 sb_bytenr, u32 sectorsize)
 		return -ENOMEM;
 
 	buf->len = sectorsize;
+	buf->data = buf->inline_data;
 	ret = pread(fd, buf->data, sectorsize, sb_bytenr);
 	if (ret != sectorsize)
 		goto fail;
@@ -2084,6 +2679,9 @@ next:
 		btrfs_release_path(&path);
 
 		if (trans->blocks_used >= 4096) {
+			ret = flush_csum_batch(trans, cur_root);
+			if (ret)
+				goto fail;
 			ret = btrfs_commit_transaction(trans, cur_root);
 			BUG_ON(ret);
 			trans = btrfs_start_transaction(cur_root, 1);
@@ -2092,6 +2690,9 @@ next:
 	}
 	btrfs_release_path(&path);
 
+	ret = flush_csum_batch(trans, cur_root);
+	if (ret)
+		goto fail;
 	ret = btrfs_commit_transaction(trans, cur_root);
 	BUG_ON(ret);
 
@@ -2246,6 +2847,7 @@ static int do_convert(const char *devname, int datacsum, int packing, int noxatt
 	ext2_filsys ext2_fs;
 	struct btrfs_root *root;
 	struct btrfs_root *ext2_root;
+	struct task_pool *pool = NULL;
 	struct task_ctx ctx;
 
 	ret = open_ext2fs(devname, &ext2_fs);
@@ -2322,7 +2924,12 @@ static int do_convert(const char *devname, int datacsum, int packing, int noxatt
 		ctx.info = task_init(print_copied_inodes, after_copied_inodes, &ctx);
 		task_start(ctx.info);
 	}
-	ret = copy_inodes(root, ext2_fs, datacsum, packing, noxattr, &ctx);
+	pool = task_pool_init(0);
+	if (datacsum)
+		csum_batch.pool = pool;
+	gettimeofday(&ctx.start, NULL);
+	ret = copy_inodes(root, ext2_fs, devname, pool, datacsum, packing,
+			  noxattr, &ctx);
 	if (ret) {
 		fprintf(stderr, "error during copy_inodes %d\n", ret);
 		goto fail;
@@ -2359,6 +2966,9 @@ static int do_convert(const char *devname, int datacsum, int packing, int noxatt
 		fprintf(stderr, "error during cleanup_sys_chunk %d\n", ret);
 		goto fail;
 	}
+	free_csum_batch();
+	task_pool_destroy(pool);
+	pool = NULL;
 	ret = close_ctree(root);
 	if (ret) {
 		fprintf(stderr, "error during close_ctree %d\n", ret);
@@ -2393,6 +3003,8 @@ static int do_convert(const char *devname, int datacsum, int packing, int noxatt
 	printf("conversion complete.\n");
 	return 0;
 fail:
+	free_csum_batch();
+	task_pool_destroy(pool);
 	if (fd != -1)
 		close(fd);
 	fprintf(stderr, "conversion aborted.\n");
@@ -2855,6 +3467,7 @@ int main(int argc, char *argv[])
 	if (rollback) {
 		ret = do_rollback(file);
 	} else {
+		crc32c_optimization_init();
 		ret = do_convert(file, datacsum, packing, noxattr, copylabel, fslabel, progress);
 	}
 	if (ret)
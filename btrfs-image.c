@@ -1439,6 +1439,7 @@ static struct extent_buffer *alloc_dummy_eb(u64 bytenr, u32 size)
 
 	eb->start = bytenr;
 	eb->len = size;
+	eb->data = eb->inline_data;
 	return eb;
 }
 
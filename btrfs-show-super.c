@@ -195,6 +195,7 @@ static void print_sys_chunk_array(struct btrfs_super_block *sb)
 		fprintf(stderr, "%s\n", strerror(ENOMEM));
 		exit(1);
 	}
+	buf->data = buf->inline_data;
 	write_extent_buffer(buf, sb, 0, sizeof(*sb));
 	ptr = sb->sys_chunk_array;
 	array_end = ptr + btrfs_super_sys_array_size(sb);
@@ -0,0 +1,183 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * cache_tree as an rbtree against the B+tree backend.  The extents are
+ * embedded in records about the size of check's extent_record, allocated
+ * in random order, so following the tree costs what it costs in fsck.
+ *
+ * usage: cache-bench [extents]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "kerncompat.h"
+#include "extent-cache.h"
+
+struct record {
+	char payload[160];
+	struct cache_extent cache;
+};
+
+static struct record **records;
+static struct cache_extent **sorted;
+static int nr_records;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Disjoint 16KiB extents with holes, records allocated in random order */
+static void make_records(int nr)
+{
+	struct record *tmp;
+	int i;
+	int j;
+
+	records = malloc(nr * sizeof(*records));
+	sorted = malloc(nr * sizeof(*sorted));
+	if (!records || !sorted) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < nr; i++) {
+		records[i] = calloc(1, sizeof(struct record));
+		if (!records[i]) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	for (i = nr - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		tmp = records[i];
+		records[i] = records[j];
+		records[j] = tmp;
+	}
+	for (i = 0; i < nr; i++) {
+		records[i]->cache.start = (u64)i * 65536;
+		records[i]->cache.size = 16384;
+		sorted[i] = &records[i]->cache;
+	}
+	/* insertion order is random too */
+	for (i = nr - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		tmp = records[i];
+		records[i] = records[j];
+		records[j] = tmp;
+	}
+	nr_records = nr;
+}
+
+static void print_rate(int nr, double t)
+{
+	printf(" %12.0f", nr / t);
+	fflush(stdout);
+}
+
+static void bench(const char *name, int btree)
+{
+	struct cache_tree tree;
+	struct cache_extent *ce;
+	double t;
+	u64 sum = 0;
+	int i;
+
+	printf("%-8s", name);
+	if (btree)
+		cache_tree_init_btree(&tree);
+	else
+		cache_tree_init(&tree);
+
+	t = now();
+	for (i = 0; i < nr_records; i++)
+		insert_cache_extent(&tree, &records[i]->cache);
+	print_rate(nr_records, now() - t);
+
+	t = now();
+	for (i = 0; i < nr_records; i++) {
+		ce = lookup_cache_extent(&tree, (u64)(rand() % nr_records) *
+					 65536 + 4096, 4096);
+		sum += ce->size;
+	}
+	print_rate(nr_records, now() - t);
+
+	t = now();
+	for (i = 0; i < nr_records; i++) {
+		ce = search_cache_extent(&tree, (u64)(rand() % nr_records) *
+					 65536 + 32768);
+		if (ce)
+			sum += ce->size;
+	}
+	print_rate(nr_records, now() - t);
+
+	t = now();
+	for (ce = first_cache_extent(&tree); ce; ce = next_cache_extent(ce))
+		sum += ce->start;
+	print_rate(nr_records, now() - t);
+
+	t = now();
+	for (i = 0; i < nr_records; i++)
+		remove_cache_extent(&tree, &records[i]->cache);
+	print_rate(nr_records, now() - t);
+
+	t = now();
+	cache_tree_bulk_load(&tree, sorted, nr_records);
+	print_rate(nr_records, now() - t);
+
+	/* drop everything in 1MiB slices */
+	t = now();
+	for (i = 0; i < nr_records; i += 16)
+		cache_tree_remove_range(&tree, (u64)i * 65536, 16 * 65536,
+					NULL);
+	print_rate(nr_records, now() - t);
+
+	if (!cache_tree_empty(&tree) || !sum)
+		printf(" (tree not empty)");
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	int nr = 1000000;
+	int i;
+
+	if (argc > 1)
+		nr = atoi(argv[1]);
+	if (nr <= 0) {
+		fprintf(stderr, "usage: cache-bench [extents]\n");
+		return 1;
+	}
+
+	srand(nr);
+	make_records(nr);
+	printf("%d extents, operations/s\n", nr);
+	printf("%-8s %12s %12s %12s %12s %12s %12s %12s\n", "", "insert",
+	       "lookup", "search", "iterate", "remove", "bulk load",
+	       "range del");
+	bench("rbtree", 0);
+	bench("btree", 1);
+
+	for (i = 0; i < nr; i++)
+		free(records[i]);
+	free(records);
+	free(sorted);
+	return 0;
+}
@@ -766,6 +766,7 @@ static int scan_one_device(void *dev_scan_struct)
 	if (!buf)
 		return -ENOMEM;
 	buf->len = rc->leafsize;
+	buf->data = buf->inline_data;
 
 	bytenr = 0;
 	while (1) {
@@ -1080,7 +1081,7 @@ static int block_group_free_all_extent(struct btrfs_trans_handle *trans,
 
 	set_extent_bits(&info->block_group_cache, start, end,
 			BLOCK_GROUP_DIRTY, GFP_NOFS);
-	set_extent_dirty(&info->free_space_cache, start, end, GFP_NOFS);
+	btrfs_set_free_space(info, start, end);
 
 	btrfs_set_block_group_used(&cache->item, 0);
 
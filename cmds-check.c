@@ -26,6 +26,11 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <uuid/uuid.h>
 #include "ctree.h"
 #include "volumes.h"
@@ -42,6 +47,7 @@
 #include "rbtree-utils.h"
 #include "backref.h"
 #include "ulist.h"
+#include "task-utils.h"
 
 static u64 bytes_used = 0;
 static u64 total_csum_bytes = 0;
@@ -59,6 +65,91 @@ static int no_holes = 0;
 static int init_extent_tree = 0;
 static int check_data_csum = 0;
 
+/* how far tree walks read ahead, --readahead */
+static u64 reada_bytes = 16 * 1024 * 1024;
+static u32 reada_blocks = 1024;
+
+enum btrfs_check_mode {
+	CHECK_MODE_ORIGINAL,
+	CHECK_MODE_LOWMEM,
+};
+
+static enum btrfs_check_mode check_mode = CHECK_MODE_ORIGINAL;
+
+/* lowmem mode leaves out the blocks not written since this generation */
+static u64 lowmem_min_gen = 0;
+static u64 lowmem_blocks = 0;
+
+/* the parts of a check, in the order they run */
+enum check_phase {
+	CHECK_PHASE_EXTENTS,
+	CHECK_PHASE_SPACE_CACHE,
+	CHECK_PHASE_FS_ROOTS,
+	CHECK_PHASE_CSUMS,
+	CHECK_PHASE_ROOT_REFS,
+	CHECK_PHASE_DONE,
+};
+
+/* how far a check got, saved to --checkpoint now and then */
+struct check_progress {
+	const char *file;
+	struct btrfs_fs_info *info;
+	struct cache_tree *root_cache;
+	enum check_phase phase;
+	/* set when the phase is to continue from the fields below */
+	int resume;
+	/* the phase can pick up from where it is interrupted */
+	int resumable;
+	/* the root item of the tree being walked and the key reached in it */
+	struct btrfs_key root_key;
+	struct btrfs_key key;
+	/* lowmem block group accounting, and root dir state of the tree */
+	u64 bg_start;
+	u64 bg_used;
+	u64 bg_last_end;
+	int root_dir;
+	/* errors found by the extent phase, and by this phase so far */
+	int extents_err;
+	int errors;
+	time_t last_save;
+};
+
+static struct check_progress progress;
+
+/* extent items and csums are looked up in about increasing order */
+static struct btrfs_tree_cursor extent_cursor;
+static struct btrfs_tree_cursor csum_cursor;
+
+/* the records the original mode keeps in memory, counted for --stats */
+enum check_rec_type {
+	CHECK_REC_INODE,
+	CHECK_REC_SHARED_NODE,
+	CHECK_REC_EXTENT,
+	CHECK_REC_EXTENT_BACKREF,
+	CHECK_REC_CHUNK,
+	CHECK_REC_BLOCK_GROUP,
+	CHECK_REC_DEV_EXTENT,
+	CHECK_REC_TYPES,
+};
+
+static struct {
+	u64 nr;
+	u64 peak;
+	u64 total;
+} check_recs[CHECK_REC_TYPES];
+
+static inline void check_rec_add(enum check_rec_type type)
+{
+	check_recs[type].total++;
+	if (++check_recs[type].nr > check_recs[type].peak)
+		check_recs[type].peak = check_recs[type].nr;
+}
+
+static inline void check_rec_del(enum check_rec_type type)
+{
+	check_recs[type].nr--;
+}
+
 struct extent_backref {
 	struct list_head list;
 	unsigned int is_data:1;
@@ -121,8 +212,8 @@ struct inode_backref {
 	unsigned int found_dir_index:1;
 	unsigned int found_inode_ref:1;
 	unsigned int filetype:8;
+	unsigned int ref_type:8;
 	int errors;
-	unsigned int ref_type;
 	u64 dir;
 	u64 index;
 	u16 namelen;
@@ -172,12 +263,11 @@ struct inode_record {
 	u64 nbytes;
 
 	u32 found_link;
+	u32 refs;
 	u64 found_size;
 	u64 extent_start;
 	u64 extent_end;
 	u64 first_extent_gap;
-
-	u32 refs;
 };
 
 #define I_ERR_NO_INODE_ITEM		(1 << 0)
@@ -218,19 +308,30 @@ struct root_record {
 	u32 found_ref;
 };
 
-struct ptr_node {
-	struct cache_extent cache;
-	void *data;
+/*
+ * Inode records by ino, in an open addressing table with linear probing
+ * that is doubled when it gets 3/4 full.  A removal moves the records
+ * probed past it back, so there are no deleted slots to step over.  The
+ * table is freed when it is empty, as most shared nodes soon are.
+ */
+struct inode_recs {
+	struct inode_record **slots;
+	u32 bits;
+	u64 nr;
 };
 
 struct shared_node {
 	struct cache_extent cache;
-	struct cache_tree root_cache;
-	struct cache_tree inode_cache;
+	struct inode_recs root_cache;
+	struct inode_recs inode_cache;
 	struct inode_record *current;
+	u64 generation;
 	u32 refs;
 };
 
+/* times a tree spliced in the summary of a shared node instead of walking it */
+static u64 shared_node_reuse;
+
 struct block_info {
 	u64 start;
 	u32 size;
@@ -241,6 +342,7 @@ struct walk_control {
 	struct shared_node *nodes[BTRFS_MAX_LEVEL];
 	int active_node;
 	int root_level;
+	struct btrfs_reada_window reada;
 };
 
 struct bad_item {
@@ -294,22 +396,278 @@ static int device_record_compare(struct rb_node *node1, struct rb_node *node2)
 		return 0;
 }
 
+/*
+ * Inode records and their backrefs, names included, are carved out of
+ * large chunks rather than malloc'd one at a time.  Freed pieces are kept
+ * on a list by size, rounded up to REC_ARENA_ALIGN, and handed out again;
+ * the chunks are freed when the last piece is, at the latest when all the
+ * fs trees are checked.
+ */
+#define REC_ARENA_CHUNK		(256 * 1024)
+#define REC_ARENA_ALIGN		8
+#define REC_ARENA_CLASSES	((sizeof(struct inode_backref) + \
+				  BTRFS_NAME_LEN + 1) / REC_ARENA_ALIGN + 1)
+
+static struct {
+	void *free[REC_ARENA_CLASSES];
+	void *chunks;
+	char *cur;
+	u32 left;
+	u64 live;
+} rec_arena;
+
+/* the memory the inode records and their tables take, for --stats */
+static struct {
+	u64 bytes;
+	u64 peak;
+} inode_store;
+
+static void inode_store_bytes(s64 bytes)
+{
+	inode_store.bytes += bytes;
+	if (inode_store.bytes > inode_store.peak)
+		inode_store.peak = inode_store.bytes;
+}
+
+static void *rec_arena_alloc(size_t size)
+{
+	int class = (size + REC_ARENA_ALIGN - 1) / REC_ARENA_ALIGN;
+	void **chunk;
+	void *ptr;
+
+	BUG_ON(class >= REC_ARENA_CLASSES);
+	size = class * REC_ARENA_ALIGN;
+	ptr = rec_arena.free[class];
+	if (ptr) {
+		rec_arena.free[class] = *(void **)ptr;
+	} else {
+		if (rec_arena.left < size) {
+			chunk = malloc(REC_ARENA_CHUNK);
+			if (!chunk)
+				return NULL;
+			inode_store_bytes(REC_ARENA_CHUNK);
+			*chunk = rec_arena.chunks;
+			rec_arena.chunks = chunk;
+			rec_arena.cur = (char *)chunk + REC_ARENA_ALIGN;
+			rec_arena.left = REC_ARENA_CHUNK - REC_ARENA_ALIGN;
+		}
+		ptr = rec_arena.cur;
+		rec_arena.cur += size;
+		rec_arena.left -= size;
+	}
+	rec_arena.live++;
+	return ptr;
+}
+
+static void rec_arena_free(void *ptr, size_t size)
+{
+	int class = (size + REC_ARENA_ALIGN - 1) / REC_ARENA_ALIGN;
+	void *chunk;
+
+	*(void **)ptr = rec_arena.free[class];
+	rec_arena.free[class] = ptr;
+	if (--rec_arena.live)
+		return;
+
+	while (rec_arena.chunks) {
+		chunk = rec_arena.chunks;
+		rec_arena.chunks = *(void **)chunk;
+		free(chunk);
+		inode_store_bytes(-REC_ARENA_CHUNK);
+	}
+	memset(&rec_arena, 0, sizeof(rec_arena));
+}
+
+static inline size_t inode_backref_size(int namelen)
+{
+	return sizeof(struct inode_backref) + namelen + 1;
+}
+
+static struct inode_backref *alloc_inode_backref(int namelen)
+{
+	return rec_arena_alloc(inode_backref_size(namelen));
+}
+
+static void free_inode_backref(struct inode_backref *backref)
+{
+	rec_arena_free(backref, inode_backref_size(backref->namelen));
+}
+
+static inline u64 inode_recs_size(struct inode_recs *recs)
+{
+	return recs->slots ? 1ULL << recs->bits : 0;
+}
+
+static inline u64 inode_recs_hash(struct inode_recs *recs, u64 ino)
+{
+	return (ino * 0x9e3779b97f4a7c15ULL) >> (64 - recs->bits);
+}
+
+static void inode_recs_init(struct inode_recs *recs)
+{
+	memset(recs, 0, sizeof(*recs));
+}
+
+static inline int inode_recs_empty(struct inode_recs *recs)
+{
+	return recs->nr == 0;
+}
+
+/* the slot of @ino, or the empty one it would go in */
+static u64 inode_recs_slot(struct inode_recs *recs, u64 ino)
+{
+	u64 mask = inode_recs_size(recs) - 1;
+	u64 i = inode_recs_hash(recs, ino);
+
+	while (recs->slots[i] && recs->slots[i]->ino != ino)
+		i = (i + 1) & mask;
+	return i;
+}
+
+static int inode_recs_grow(struct inode_recs *recs)
+{
+	struct inode_recs new;
+	u64 size = inode_recs_size(recs);
+	u64 i;
+
+	new.bits = recs->slots ? recs->bits + 1 : 4;
+	new.nr = recs->nr;
+	new.slots = calloc(1ULL << new.bits, sizeof(*new.slots));
+	if (!new.slots)
+		return -ENOMEM;
+	for (i = 0; i < size; i++) {
+		if (recs->slots[i])
+			new.slots[inode_recs_slot(&new, recs->slots[i]->ino)] =
+				recs->slots[i];
+	}
+	inode_store_bytes(((1ULL << new.bits) - size) * sizeof(*new.slots));
+	free(recs->slots);
+	*recs = new;
+	return 0;
+}
+
+static int inode_recs_insert(struct inode_recs *recs,
+			     struct inode_record *rec)
+{
+	u64 i;
+	int ret;
+
+	if ((recs->nr + 1) * 4 > inode_recs_size(recs) * 3) {
+		ret = inode_recs_grow(recs);
+		if (ret)
+			return ret;
+	}
+	i = inode_recs_slot(recs, rec->ino);
+	if (recs->slots[i])
+		return -EEXIST;
+	recs->slots[i] = rec;
+	recs->nr++;
+	return 0;
+}
+
+static void inode_recs_remove(struct inode_recs *recs,
+			      struct inode_record *rec)
+{
+	u64 mask = inode_recs_size(recs) - 1;
+	u64 i;
+	u64 j;
+	u64 home;
+
+	i = inode_recs_slot(recs, rec->ino);
+	BUG_ON(recs->slots[i] != rec);
+	recs->slots[i] = NULL;
+	recs->nr--;
+
+	/* pull back the records that were probed past the freed slot */
+	for (j = (i + 1) & mask; recs->slots[j]; j = (j + 1) & mask) {
+		home = inode_recs_hash(recs, recs->slots[j]->ino);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			recs->slots[i] = recs->slots[j];
+			recs->slots[j] = NULL;
+			i = j;
+		}
+	}
+
+	if (inode_recs_empty(recs)) {
+		inode_store_bytes(-(s64)((mask + 1) * sizeof(*recs->slots)));
+		free(recs->slots);
+		inode_recs_init(recs);
+	}
+}
+
+/* takes all the records out of @recs, into an array to be freed */
+static struct inode_record **inode_recs_take(struct inode_recs *recs,
+					     u64 *nr)
+{
+	struct inode_record **slots = recs->slots;
+	u64 size = inode_recs_size(recs);
+	u64 i;
+
+	*nr = 0;
+	for (i = 0; i < size; i++) {
+		if (slots[i])
+			slots[(*nr)++] = slots[i];
+	}
+	inode_store_bytes(-(s64)(size * sizeof(*slots)));
+	inode_recs_init(recs);
+	return slots;
+}
+
+static int cmp_inode_rec_ino(const void *a, const void *b)
+{
+	const struct inode_record *rec1 = *(const struct inode_record **)a;
+	const struct inode_record *rec2 = *(const struct inode_record **)b;
+
+	if (rec1->ino < rec2->ino)
+		return -1;
+	return rec1->ino > rec2->ino;
+}
+
+/* the records of @recs sorted by ino, which stay in @recs as well */
+static struct inode_record **inode_recs_sorted(struct inode_recs *recs,
+					       u64 *nr)
+{
+	struct inode_record **sorted;
+	u64 size = inode_recs_size(recs);
+	u64 i;
+
+	*nr = 0;
+	sorted = malloc(max_t(u64, recs->nr, 1) * sizeof(*sorted));
+	if (!sorted)
+		return NULL;
+	for (i = 0; i < size; i++) {
+		if (recs->slots[i])
+			sorted[(*nr)++] = recs->slots[i];
+	}
+	qsort(sorted, *nr, sizeof(*sorted), cmp_inode_rec_ino);
+	return sorted;
+}
+
+static struct inode_record *alloc_inode_rec(void)
+{
+	struct inode_record *rec;
+
+	rec = rec_arena_alloc(sizeof(*rec));
+	if (!rec)
+		return NULL;
+	check_rec_add(CHECK_REC_INODE);
+	return rec;
+}
+
 static struct inode_record *clone_inode_rec(struct inode_record *orig_rec)
 {
 	struct inode_record *rec;
 	struct inode_backref *backref;
 	struct inode_backref *orig;
-	size_t size;
 
-	rec = malloc(sizeof(*rec));
+	rec = alloc_inode_rec();
 	memcpy(rec, orig_rec, sizeof(*rec));
 	rec->refs = 1;
 	INIT_LIST_HEAD(&rec->backrefs);
 
 	list_for_each_entry(orig, &orig_rec->backrefs, list) {
-		size = sizeof(*orig) + orig->namelen + 1;
-		backref = malloc(size);
-		memcpy(backref, orig, size);
+		backref = alloc_inode_backref(orig->namelen);
+		memcpy(backref, orig, inode_backref_size(orig->namelen));
 		list_add_tail(&backref->list, &rec->backrefs);
 	}
 	return rec;
@@ -393,40 +751,36 @@ static void print_ref_error(int errors)
 	fprintf(stderr, "\n");
 }
 
-static struct inode_record *get_inode_rec(struct cache_tree *inode_cache,
+static struct inode_record *get_inode_rec(struct inode_recs *inode_cache,
 					  u64 ino, int mod)
 {
-	struct ptr_node *node;
-	struct cache_extent *cache;
 	struct inode_record *rec = NULL;
+	u64 slot = 0;
 	int ret;
 
-	cache = lookup_cache_extent(inode_cache, ino, 1);
-	if (cache) {
-		node = container_of(cache, struct ptr_node, cache);
-		rec = node->data;
+	if (!inode_recs_empty(inode_cache)) {
+		slot = inode_recs_slot(inode_cache, ino);
+		rec = inode_cache->slots[slot];
+	}
+	if (rec) {
 		if (mod && rec->refs > 1) {
-			node->data = clone_inode_rec(rec);
 			rec->refs--;
-			rec = node->data;
+			rec = clone_inode_rec(rec);
+			inode_cache->slots[slot] = rec;
 		}
 	} else if (mod) {
-		rec = calloc(1, sizeof(*rec));
+		rec = alloc_inode_rec();
+		memset(rec, 0, sizeof(*rec));
 		rec->ino = ino;
 		rec->extent_start = (u64)-1;
 		rec->first_extent_gap = (u64)-1;
 		rec->refs = 1;
 		INIT_LIST_HEAD(&rec->backrefs);
 
-		node = malloc(sizeof(*node));
-		node->cache.start = ino;
-		node->cache.size = 1;
-		node->data = rec;
-
 		if (ino == BTRFS_FREE_INO_OBJECTID)
 			rec->found_link = 1;
 
-		ret = insert_cache_extent(inode_cache, &node->cache);
+		ret = inode_recs_insert(inode_cache, rec);
 		BUG_ON(ret);
 	}
 	return rec;
@@ -443,9 +797,10 @@ static void free_inode_rec(struct inode_record *rec)
 		backref = list_entry(rec->backrefs.next,
 				     struct inode_backref, list);
 		list_del(&backref->list);
-		free(backref);
+		free_inode_backref(backref);
 	}
-	free(rec);
+	rec_arena_free(rec, sizeof(*rec));
+	check_rec_del(CHECK_REC_INODE);
 }
 
 static int can_free_inode_rec(struct inode_record *rec)
@@ -456,32 +811,9 @@ static int can_free_inode_rec(struct inode_record *rec)
 	return 0;
 }
 
-static void maybe_free_inode_rec(struct cache_tree *inode_cache,
-				 struct inode_record *rec)
+/* the checks that need every item of the inode to have been seen */
+static void check_inode_rec_complete(struct inode_record *rec)
 {
-	struct cache_extent *cache;
-	struct inode_backref *tmp, *backref;
-	struct ptr_node *node;
-	unsigned char filetype;
-
-	if (!rec->found_inode_item)
-		return;
-
-	filetype = imode_to_type(rec->imode);
-	list_for_each_entry_safe(backref, tmp, &rec->backrefs, list) {
-		if (backref->found_dir_item && backref->found_dir_index) {
-			if (backref->filetype != filetype)
-				backref->errors |= REF_ERR_FILETYPE_UNMATCH;
-			if (!backref->errors && backref->found_inode_ref) {
-				list_del(&backref->list);
-				free(backref);
-			}
-		}
-	}
-
-	if (!rec->checked || rec->merging)
-		return;
-
 	if (S_ISDIR(rec->imode)) {
 		if (rec->found_size != rec->isize)
 			rec->errors |= I_ERR_DIR_ISIZE_WRONG;
@@ -506,14 +838,36 @@ static void maybe_free_inode_rec(struct cache_tree *inode_cache,
 		if (rec->some_csum_missing && !rec->nodatasum)
 			rec->errors |= I_ERR_SOME_CSUM_MISSING;
 	}
+}
+
+static void maybe_free_inode_rec(struct inode_recs *inode_cache,
+				 struct inode_record *rec)
+{
+	struct inode_backref *tmp, *backref;
+	unsigned char filetype;
+
+	if (!rec->found_inode_item)
+		return;
+
+	filetype = imode_to_type(rec->imode);
+	list_for_each_entry_safe(backref, tmp, &rec->backrefs, list) {
+		if (backref->found_dir_item && backref->found_dir_index) {
+			if (backref->filetype != filetype)
+				backref->errors |= REF_ERR_FILETYPE_UNMATCH;
+			if (!backref->errors && backref->found_inode_ref) {
+				list_del(&backref->list);
+				free_inode_backref(backref);
+			}
+		}
+	}
+
+	if (!rec->checked || rec->merging)
+		return;
 
+	check_inode_rec_complete(rec);
 	BUG_ON(rec->refs != 1);
 	if (can_free_inode_rec(rec)) {
-		cache = lookup_cache_extent(inode_cache, rec->ino, 1);
-		node = container_of(cache, struct ptr_node, cache);
-		BUG_ON(node->data != rec);
-		remove_cache_extent(inode_cache, &node->cache);
-		free(node);
+		inode_recs_remove(inode_cache, rec);
 		free_inode_rec(rec);
 	}
 }
@@ -579,7 +933,7 @@ static struct inode_backref *get_inode_backref(struct inode_record *rec,
 		return backref;
 	}
 
-	backref = malloc(sizeof(*backref) + namelen + 1);
+	backref = alloc_inode_backref(namelen);
 	memset(backref, 0, sizeof(*backref));
 	backref->dir = dir;
 	backref->namelen = namelen;
@@ -589,7 +943,7 @@ static struct inode_backref *get_inode_backref(struct inode_record *rec,
 	return backref;
 }
 
-static int add_inode_backref(struct cache_tree *inode_cache,
+static int add_inode_backref(struct inode_recs *inode_cache,
 			     u64 ino, u64 dir, u64 index,
 			     const char *name, int namelen,
 			     int filetype, int itemtype, int errors)
@@ -641,7 +995,7 @@ static int add_inode_backref(struct cache_tree *inode_cache,
 }
 
 static int merge_inode_recs(struct inode_record *src, struct inode_record *dst,
-			    struct cache_tree *dst_cache)
+			    struct inode_recs *dst_cache)
 {
 	struct inode_backref *backref;
 	u32 dir_count = 0;
@@ -719,11 +1073,12 @@ static int merge_inode_recs(struct inode_record *src, struct inode_record *dst,
 static int splice_shared_node(struct shared_node *src_node,
 			      struct shared_node *dst_node)
 {
-	struct cache_extent *cache;
-	struct ptr_node *node, *ins;
-	struct cache_tree *src, *dst;
+	struct inode_recs *src, *dst;
+	struct inode_record **recs;
 	struct inode_record *rec, *conflict;
 	u64 current_ino = 0;
+	u64 nr;
+	u64 i;
 	int splice = 0;
 	int ret;
 
@@ -735,23 +1090,20 @@ static int splice_shared_node(struct shared_node *src_node,
 	src = &src_node->root_cache;
 	dst = &dst_node->root_cache;
 again:
-	cache = search_cache_extent(src, 0);
-	while (cache) {
-		node = container_of(cache, struct ptr_node, cache);
-		rec = node->data;
-		cache = next_cache_extent(cache);
-
-		if (splice) {
-			remove_cache_extent(src, &node->cache);
-			ins = node;
-		} else {
-			ins = malloc(sizeof(*ins));
-			ins->cache.start = node->cache.start;
-			ins->cache.size = node->cache.size;
-			ins->data = rec;
+	if (splice) {
+		recs = inode_recs_take(src, &nr);
+	} else {
+		recs = src->slots;
+		nr = inode_recs_size(src);
+	}
+	for (i = 0; i < nr; i++) {
+		rec = recs[i];
+		if (!rec)
+			continue;
+		if (!splice)
 			rec->refs++;
-		}
-		ret = insert_cache_extent(dst, &ins->cache);
+
+		ret = inode_recs_insert(dst, rec);
 		if (ret == -EEXIST) {
 			conflict = get_inode_rec(dst, rec->ino, 1);
 			merge_inode_recs(rec, conflict, dst);
@@ -762,11 +1114,12 @@ again:
 			}
 			maybe_free_inode_rec(dst, conflict);
 			free_inode_rec(rec);
-			free(ins);
 		} else {
 			BUG_ON(ret);
 		}
 	}
+	if (splice)
+		free(recs);
 
 	if (src == &src_node->root_cache) {
 		src = &src_node->inode_cache;
@@ -785,19 +1138,18 @@ again:
 	return 0;
 }
 
-static void free_inode_ptr(struct cache_extent *cache)
+static void free_inode_recs(struct inode_recs *recs)
 {
-	struct ptr_node *node;
-	struct inode_record *rec;
+	struct inode_record **slots;
+	u64 nr;
+	u64 i;
 
-	node = container_of(cache, struct ptr_node, cache);
-	rec = node->data;
-	free_inode_rec(rec);
-	free(node);
+	slots = inode_recs_take(recs, &nr);
+	for (i = 0; i < nr; i++)
+		free_inode_rec(slots[i]);
+	free(slots);
 }
 
-FREE_EXTENT_CACHE_BASED_TREE(inode_recs, free_inode_ptr);
-
 static struct shared_node *find_shared_node(struct cache_tree *shared,
 					    u64 bytenr)
 {
@@ -812,16 +1164,19 @@ static struct shared_node *find_shared_node(struct cache_tree *shared,
 	return NULL;
 }
 
-static int add_shared_node(struct cache_tree *shared, u64 bytenr, u32 refs)
+static int add_shared_node(struct cache_tree *shared, u64 bytenr, u64 gen,
+			   u32 refs)
 {
 	int ret;
 	struct shared_node *node;
 
 	node = calloc(1, sizeof(*node));
+	check_rec_add(CHECK_REC_SHARED_NODE);
 	node->cache.start = bytenr;
 	node->cache.size = 1;
-	cache_tree_init(&node->root_cache);
-	cache_tree_init(&node->inode_cache);
+	inode_recs_init(&node->root_cache);
+	inode_recs_init(&node->inode_cache);
+	node->generation = gen;
 	node->refs = refs;
 
 	ret = insert_cache_extent(shared, &node->cache);
@@ -829,8 +1184,8 @@ static int add_shared_node(struct cache_tree *shared, u64 bytenr, u32 refs)
 	return 0;
 }
 
-static int enter_shared_node(struct btrfs_root *root, u64 bytenr, u32 refs,
-			     struct walk_control *wc, int level)
+static int enter_shared_node(struct btrfs_root *root, u64 bytenr, u64 gen,
+			     u32 refs, struct walk_control *wc, int level)
 {
 	struct shared_node *node;
 	struct shared_node *dest;
@@ -841,20 +1196,25 @@ static int enter_shared_node(struct btrfs_root *root, u64 bytenr, u32 refs,
 	BUG_ON(wc->active_node <= level);
 	node = find_shared_node(&wc->shared, bytenr);
 	if (!node) {
-		add_shared_node(&wc->shared, bytenr, refs);
+		add_shared_node(&wc->shared, bytenr, gen, refs);
 		node = find_shared_node(&wc->shared, bytenr);
 		wc->nodes[level] = node;
 		wc->active_node = level;
 		return 0;
 	}
+	/* not the block that was summarized, let the walk read it */
+	if (node->generation != gen)
+		return 0;
+	shared_node_reuse++;
 
 	if (wc->root_level == wc->active_node &&
 	    btrfs_root_refs(&root->root_item) == 0) {
 		if (--node->refs == 0) {
-			free_inode_recs_tree(&node->root_cache);
-			free_inode_recs_tree(&node->inode_cache);
+			free_inode_recs(&node->root_cache);
+			free_inode_recs(&node->inode_cache);
 			remove_cache_extent(&wc->shared, &node->cache);
 			free(node);
+			check_rec_del(CHECK_REC_SHARED_NODE);
 		}
 		return 1;
 	}
@@ -864,6 +1224,7 @@ static int enter_shared_node(struct btrfs_root *root, u64 bytenr, u32 refs,
 	if (node->refs == 0) {
 		remove_cache_extent(&wc->shared, &node->cache);
 		free(node);
+		check_rec_del(CHECK_REC_SHARED_NODE);
 	}
 	return 1;
 }
@@ -900,6 +1261,46 @@ static int leave_shared_node(struct btrfs_root *root,
 	return 0;
 }
 
+/*
+ * Extent item lookups of the tree walks go through extent_cursor.  Repair
+ * changes the trees inside the running transaction, which the cursor
+ * can't tell, so it keeps no path between lookups then.
+ */
+static int walk_extent_info(u64 bytenr, u64 level, u64 *refs, u64 *flags)
+{
+	int ret;
+
+	ret = btrfs_lookup_extent_info_cursor(&extent_cursor, bytenr, level,
+					      1, refs, flags);
+	if (repair)
+		btrfs_tree_cursor_release(&extent_cursor);
+	return ret;
+}
+
+/*
+ * Whether a block the walk is about to enter is shared, with its refs.
+ * A block that already has a shared node was summarized when the first
+ * tree to get to it walked it, and every other tree sharing it, each
+ * snapshot of a subvolume, splices that summary in.  The refs left are
+ * kept in the node, so those trees don't look it up in the extent tree.
+ */
+static int shared_block_refs(struct walk_control *wc, u64 bytenr, u64 gen,
+			     int level, u64 *refs)
+{
+	struct shared_node *node;
+	int ret;
+
+	node = find_shared_node(&wc->shared, bytenr);
+	if (node && node->generation == gen) {
+		*refs = node->refs;
+		return 1;
+	}
+	ret = walk_extent_info(bytenr, level, refs, NULL);
+	if (ret < 0)
+		return 0;
+	return *refs > 1;
+}
+
 /*
  * Returns:
  * < 0 - on error
@@ -983,8 +1384,8 @@ static int process_dir_item(struct btrfs_root *root,
 	int filetype;
 	struct btrfs_dir_item *di;
 	struct inode_record *rec;
-	struct cache_tree *root_cache;
-	struct cache_tree *inode_cache;
+	struct inode_recs *root_cache;
+	struct inode_recs *inode_cache;
 	struct btrfs_key location;
 	char namebuf[BTRFS_NAME_LEN];
 
@@ -1049,7 +1450,7 @@ static int process_inode_ref(struct extent_buffer *eb,
 	u32 name_len;
 	u64 index;
 	int error;
-	struct cache_tree *inode_cache;
+	struct inode_recs *inode_cache;
 	struct btrfs_inode_ref *ref;
 	char namebuf[BTRFS_NAME_LEN];
 
@@ -1089,7 +1490,7 @@ static int process_inode_extref(struct extent_buffer *eb,
 	u64 index;
 	u64 parent;
 	int error;
-	struct cache_tree *inode_cache;
+	struct inode_recs *inode_cache;
 	struct btrfs_inode_extref *extref;
 	char namebuf[BTRFS_NAME_LEN];
 
@@ -1125,7 +1526,7 @@ static int count_csum_range(struct btrfs_root *root, u64 start,
 			    u64 len, u64 *found)
 {
 	struct btrfs_key key;
-	struct btrfs_path path;
+	struct btrfs_path *path = &csum_cursor.path;
 	struct extent_buffer *leaf;
 	int ret;
 	size_t size;
@@ -1133,48 +1534,45 @@ static int count_csum_range(struct btrfs_root *root, u64 start,
 	u64 csum_end;
 	u16 csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
 
-	btrfs_init_path(&path);
-
 	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
 	key.offset = start;
 	key.type = BTRFS_EXTENT_CSUM_KEY;
 
-	ret = btrfs_search_slot(NULL, root->fs_info->csum_root,
-				&key, &path, 0, 0);
+	ret = btrfs_tree_cursor_seek(&csum_cursor, &key);
 	if (ret < 0)
 		goto out;
-	if (ret > 0 && path.slots[0] > 0) {
-		leaf = path.nodes[0];
-		btrfs_item_key_to_cpu(leaf, &key, path.slots[0] - 1);
+	if (ret > 0 && path->slots[0] > 0) {
+		leaf = path->nodes[0];
+		btrfs_item_key_to_cpu(leaf, &key, path->slots[0] - 1);
 		if (key.objectid == BTRFS_EXTENT_CSUM_OBJECTID &&
 		    key.type == BTRFS_EXTENT_CSUM_KEY)
-			path.slots[0]--;
+			path->slots[0]--;
 	}
 
 	while (len > 0) {
-		leaf = path.nodes[0];
-		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
-			ret = btrfs_next_leaf(root->fs_info->csum_root, &path);
+		leaf = path->nodes[0];
+		if (path->slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(root->fs_info->csum_root, path);
 			if (ret > 0)
 				break;
 			else if (ret < 0)
 				goto out;
-			leaf = path.nodes[0];
+			leaf = path->nodes[0];
 		}
 
-		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		btrfs_item_key_to_cpu(leaf, &key, path->slots[0]);
 		if (key.objectid != BTRFS_EXTENT_CSUM_OBJECTID ||
 		    key.type != BTRFS_EXTENT_CSUM_KEY)
 			break;
 
-		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		btrfs_item_key_to_cpu(leaf, &key, path->slots[0]);
 		if (key.offset >= start + len)
 			break;
 
 		if (key.offset > start)
 			start = key.offset;
 
-		size = btrfs_item_size_nr(leaf, path.slots[0]);
+		size = btrfs_item_size_nr(leaf, path->slots[0]);
 		csum_end = key.offset + (size / csum_size) * root->sectorsize;
 		if (csum_end > start) {
 			size = min(csum_end - start, len);
@@ -1183,13 +1581,13 @@ static int count_csum_range(struct btrfs_root *root, u64 start,
 			*found += size;
 		}
 
-		path.slots[0]++;
+		path->slots[0]++;
 	}
 out:
-	btrfs_release_path(&path);
-	if (ret < 0)
-		return ret;
-	return 0;
+	/* as for extent_cursor, repair may change the csum tree under it */
+	if (ret < 0 || repair)
+		btrfs_tree_cursor_release(&csum_cursor);
+	return ret < 0 ? ret : 0;
 }
 
 static int process_file_extent(struct btrfs_root *root,
@@ -1282,7 +1680,7 @@ static int process_one_leaf(struct btrfs_root *root, struct extent_buffer *eb,
 	u32 nritems;
 	int i;
 	int ret = 0;
-	struct cache_tree *inode_cache;
+	struct inode_recs *inode_cache;
 	struct shared_node *active_node;
 
 	if (wc->root_level == wc->active_node &&
@@ -1335,29 +1733,6 @@ static int process_one_leaf(struct btrfs_root *root, struct extent_buffer *eb,
 	return ret;
 }
 
-static void reada_walk_down(struct btrfs_root *root,
-			    struct extent_buffer *node, int slot)
-{
-	u64 bytenr;
-	u64 ptr_gen;
-	u32 nritems;
-	u32 blocksize;
-	int i;
-	int level;
-
-	level = btrfs_header_level(node);
-	if (level != 1)
-		return;
-
-	nritems = btrfs_header_nritems(node);
-	blocksize = btrfs_level_size(root, level - 1);
-	for (i = slot; i < nritems; i++) {
-		bytenr = btrfs_node_blockptr(node, i);
-		ptr_gen = btrfs_node_ptr_generation(node, i);
-		readahead_tree_block(root, bytenr, blocksize, ptr_gen);
-	}
-}
-
 /*
  * Check the child node/leaf by the following condition:
  * 1. the first item key of the node/leaf should be the same with the one
@@ -1422,9 +1797,8 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 
 	WARN_ON(*level < 0);
 	WARN_ON(*level >= BTRFS_MAX_LEVEL);
-	ret = btrfs_lookup_extent_info(NULL, root,
-				       path->nodes[*level]->start,
-				       *level, 1, &refs, NULL);
+	ret = walk_extent_info(path->nodes[*level]->start, *level,
+			       &refs, NULL);
 	if (ret < 0) {
 		err = ret;
 		goto out;
@@ -1432,7 +1806,8 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 
 	if (refs > 1) {
 		ret = enter_shared_node(root, path->nodes[*level]->start,
-					refs, wc, *level);
+				btrfs_header_generation(path->nodes[*level]),
+				refs, wc, *level);
 		if (ret > 0) {
 			err = ret;
 			goto out;
@@ -1458,13 +1833,8 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 		bytenr = btrfs_node_blockptr(cur, path->slots[*level]);
 		ptr_gen = btrfs_node_ptr_generation(cur, path->slots[*level]);
 		blocksize = btrfs_level_size(root, *level - 1);
-		ret = btrfs_lookup_extent_info(NULL, root, bytenr, *level - 1,
-					       1, &refs, NULL);
-		if (ret < 0)
-			refs = 0;
-
-		if (refs > 1) {
-			ret = enter_shared_node(root, bytenr, refs,
+		if (shared_block_refs(wc, bytenr, ptr_gen, *level - 1, &refs)) {
+			ret = enter_shared_node(root, bytenr, ptr_gen, refs,
 						wc, *level - 1);
 			if (ret > 0) {
 				path->slots[*level]++;
@@ -1475,7 +1845,7 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 		next = btrfs_find_tree_block(root, bytenr, blocksize);
 		if (!next || !btrfs_buffer_uptodate(next, ptr_gen)) {
 			free_extent_buffer(next);
-			reada_walk_down(root, cur, path->slots[*level]);
+			btrfs_reada_window_read(&wc->reada, path, *level);
 			next = read_tree_block(root, bytenr, blocksize,
 					       ptr_gen);
 			if (!next) {
@@ -1623,7 +1993,7 @@ static int repair_inode_orphan_item(struct btrfs_trans_handle *trans,
 }
 
 static int add_missing_dir_index(struct btrfs_root *root,
-				 struct cache_tree *inode_cache,
+				 struct inode_recs *inode_cache,
 				 struct inode_record *rec,
 				 struct inode_backref *backref)
 {
@@ -1689,7 +2059,7 @@ static int add_missing_dir_index(struct btrfs_root *root,
 }
 
 static int delete_dir_index(struct btrfs_root *root,
-			    struct cache_tree *inode_cache,
+			    struct inode_recs *inode_cache,
 			    struct inode_record *rec,
 			    struct inode_backref *backref)
 {
@@ -1793,7 +2163,7 @@ static int create_inode_item(struct btrfs_root *root,
 
 static int repair_inode_backrefs(struct btrfs_root *root,
 				 struct inode_record *rec,
-				 struct cache_tree *inode_cache,
+				 struct inode_recs *inode_cache,
 				 int delete)
 {
 	struct inode_backref *tmp, *backref;
@@ -1824,7 +2194,7 @@ static int repair_inode_backrefs(struct btrfs_root *root,
 				break;
 			repaired++;
 			list_del(&backref->list);
-			free(backref);
+			free_inode_backref(backref);
 		}
 
 		if (!delete && !backref->found_dir_index &&
@@ -1840,7 +2210,7 @@ static int repair_inode_backrefs(struct btrfs_root *root,
 				if (!backref->errors &&
 				    backref->found_inode_ref) {
 					list_del(&backref->list);
-					free(backref);
+					free_inode_backref(backref);
 				}
 			}
 		}
@@ -1975,7 +2345,7 @@ static int reset_nlink(struct btrfs_trans_handle *trans,
 		      backref->found_dir_item &&
 		      backref->found_inode_ref)) {
 			list_del(&backref->list);
-			free(backref);
+			free_inode_backref(backref);
 		} else {
 			rec->found_link++;
 		}
@@ -2301,12 +2671,13 @@ static int try_repair_inode(struct btrfs_root *root, struct inode_record *rec)
 }
 
 static int check_inode_recs(struct btrfs_root *root,
-			    struct cache_tree *inode_cache)
+			    struct inode_recs *inode_cache)
 {
-	struct cache_extent *cache;
-	struct ptr_node *node;
+	struct inode_record **recs;
 	struct inode_record *rec;
 	struct inode_backref *backref;
+	u64 nr;
+	u64 i;
 	int stage = 0;
 	int ret = 0;
 	int err = 0;
@@ -2314,7 +2685,7 @@ static int check_inode_recs(struct btrfs_root *root,
 	u64 root_dirid = btrfs_root_dirid(&root->root_item);
 
 	if (btrfs_root_refs(&root->root_item) == 0) {
-		if (!cache_tree_empty(inode_cache))
+		if (!inode_recs_empty(inode_cache))
 			fprintf(stderr, "warning line %d\n", __LINE__);
 		return 0;
 	}
@@ -2326,13 +2697,11 @@ static int check_inode_recs(struct btrfs_root *root,
 	 * 'lost+found' ino may be a missing ino in a corrupted leaf,
 	 * this may cause 'lost+found' dir has wrong nlinks.
 	 */
-	cache = last_cache_extent(inode_cache);
-	if (cache) {
-		node = container_of(cache, struct ptr_node, cache);
-		rec = node->data;
-		if (rec->ino > root->highest_inode)
-			root->highest_inode = rec->ino;
-	}
+	recs = inode_recs_sorted(inode_cache, &nr);
+	if (!recs)
+		return -ENOMEM;
+	if (nr && recs[nr - 1]->ino > root->highest_inode)
+		root->highest_inode = recs[nr - 1]->ino;
 
 	/*
 	 * We need to repair backrefs first because we could change some of the
@@ -2354,16 +2723,12 @@ static int check_inode_recs(struct btrfs_root *root,
 		if (stage == 3 && !err)
 			break;
 
-		cache = search_cache_extent(inode_cache, 0);
-		while (repair && cache) {
-			node = container_of(cache, struct ptr_node, cache);
-			rec = node->data;
-			cache = next_cache_extent(cache);
+		for (i = 0; repair && i < nr; i++) {
+			rec = recs[i];
 
 			/* Need to free everything up and rescan */
 			if (stage == 3) {
-				remove_cache_extent(inode_cache, &node->cache);
-				free(node);
+				inode_recs_remove(inode_cache, rec);
 				free_inode_rec(rec);
 				continue;
 			}
@@ -2383,7 +2748,7 @@ static int check_inode_recs(struct btrfs_root *root,
 		}
 	}
 	if (err)
-		return err;
+		goto out;
 
 	rec = get_inode_rec(inode_cache, root_dirid, 0);
 	if (rec) {
@@ -2402,7 +2767,7 @@ static int check_inode_recs(struct btrfs_root *root,
 			trans = btrfs_start_transaction(root, 1);
 			if (IS_ERR(trans)) {
 				err = PTR_ERR(trans);
-				return err;
+				goto out;
 			}
 
 			fprintf(stderr,
@@ -2413,7 +2778,8 @@ static int check_inode_recs(struct btrfs_root *root,
 			BUG_ON(ret);
 
 			btrfs_commit_transaction(trans, root);
-			return -EAGAIN;
+			err = -EAGAIN;
+			goto out;
 		}
 
 		fprintf(stderr, "root %llu root dir %llu not found\n",
@@ -2421,14 +2787,9 @@ static int check_inode_recs(struct btrfs_root *root,
 			(unsigned long long)root_dirid);
 	}
 
-	while (1) {
-		cache = search_cache_extent(inode_cache, 0);
-		if (!cache)
-			break;
-		node = container_of(cache, struct ptr_node, cache);
-		rec = node->data;
-		remove_cache_extent(inode_cache, &node->cache);
-		free(node);
+	for (i = 0; i < nr; i++) {
+		rec = recs[i];
+		inode_recs_remove(inode_cache, rec);
 		if (rec->ino == root_dirid ||
 		    rec->ino == BTRFS_ORPHAN_OBJECTID) {
 			free_inode_rec(rec);
@@ -2478,6 +2839,10 @@ static int check_inode_recs(struct btrfs_root *root,
 		}
 		free_inode_rec(rec);
 	}
+out:
+	free(recs);
+	if (err)
+		return err;
 	return (error > 0) ? -1 : 0;
 }
 
@@ -2598,33 +2963,29 @@ static int add_root_backref(struct cache_tree *root_cache,
 }
 
 static int merge_root_recs(struct btrfs_root *root,
-			   struct cache_tree *src_cache,
+			   struct inode_recs *src_cache,
 			   struct cache_tree *dst_cache)
 {
-	struct cache_extent *cache;
-	struct ptr_node *node;
+	struct inode_record **recs;
 	struct inode_record *rec;
 	struct inode_backref *backref;
+	u64 nr;
+	u64 i;
 	int ret = 0;
 
 	if (root->root_key.objectid == BTRFS_TREE_RELOC_OBJECTID) {
-		free_inode_recs_tree(src_cache);
+		free_inode_recs(src_cache);
 		return 0;
 	}
 
-	while (1) {
-		cache = search_cache_extent(src_cache, 0);
-		if (!cache)
-			break;
-		node = container_of(cache, struct ptr_node, cache);
-		rec = node->data;
-		remove_cache_extent(src_cache, &node->cache);
-		free(node);
+	recs = inode_recs_take(src_cache, &nr);
+	for (i = 0; i < nr; i++) {
+		rec = recs[i];
+		if (ret < 0)
+			goto skip;
 
 		ret = is_child_root(root, root->objectid, rec->ino);
-		if (ret < 0)
-			break;
-		else if (ret == 0)
+		if (ret <= 0)
 			goto skip;
 
 		list_for_each_entry(backref, &rec->backrefs, list) {
@@ -2645,6 +3006,7 @@ static int merge_root_recs(struct btrfs_root *root,
 skip:
 		free_inode_rec(rec);
 	}
+	free(recs);
 	if (ret < 0)
 		return ret;
 	return 0;
@@ -2933,8 +3295,8 @@ static int check_fs_root(struct btrfs_root *root,
 
 	btrfs_init_path(&path);
 	memset(&root_node, 0, sizeof(root_node));
-	cache_tree_init(&root_node.root_cache);
-	cache_tree_init(&root_node.inode_cache);
+	inode_recs_init(&root_node.root_cache);
+	inode_recs_init(&root_node.inode_cache);
 
 	level = btrfs_header_level(root->node);
 	memset(wc->nodes, 0, sizeof(wc->nodes));
@@ -2950,6 +3312,7 @@ static int check_fs_root(struct btrfs_root *root,
 	if (status != BTRFS_TREE_BLOCK_CLEAN)
 		return -EIO;
 
+	btrfs_reada_window_init(&wc->reada, root, reada_bytes, reada_blocks);
 	if (btrfs_root_refs(root_item) > 0 ||
 	    btrfs_disk_key_objectid(&root_item->drop_progress) == 0) {
 		path.nodes[level] = root->node;
@@ -2985,6 +3348,7 @@ static int check_fs_root(struct btrfs_root *root,
 			break;
 	}
 skip_walking:
+	btrfs_reada_window_release(&wc->reada);
 	btrfs_release_path(&path);
 
 	if (!cache_tree_empty(&corrupt_blocks)) {
@@ -3044,6 +3408,303 @@ static int fs_root_objectid(u64 objectid)
 	return is_fstree(objectid);
 }
 
+#define CHECK_CHECKPOINT_SECS	30
+#define CHECK_CHECKPOINT_HEADER	"btrfs check checkpoint"
+
+static const char * const check_phase_names[] = {
+	"extents", "space-cache", "fs-roots", "csums", "root-refs", "done",
+};
+
+static volatile sig_atomic_t check_interrupted;
+
+static void check_sigint(int signo)
+{
+	check_interrupted = 1;
+	/* with no point to stop at ahead, the last save is where to resume */
+	if (!progress.resumable) {
+		signal(signo, SIG_DFL);
+		raise(signo);
+	}
+}
+
+/* has a point the check can be resumed from come due for saving */
+static int check_progress_due(void)
+{
+	if (!progress.file)
+		return 0;
+	return check_interrupted ||
+		time(NULL) - progress.last_save >= CHECK_CHECKPOINT_SECS;
+}
+
+static void save_root_recs(FILE *f, struct cache_tree *root_cache)
+{
+	struct cache_extent *cache;
+	struct root_record *rec;
+	struct root_backref *backref;
+	int i;
+
+	for (cache = first_cache_extent(root_cache); cache;
+	     cache = next_cache_extent(cache)) {
+		rec = container_of(cache, struct root_record, cache);
+		fprintf(f, "root_rec:%llu %u %u\n",
+			(unsigned long long)rec->objectid,
+			rec->found_root_item, rec->found_ref);
+		list_for_each_entry(backref, &rec->backrefs, list) {
+			fprintf(f, "root_backref:%llu %llu %llu %llu %u %d ",
+				(unsigned long long)rec->objectid,
+				(unsigned long long)backref->ref_root,
+				(unsigned long long)backref->dir,
+				(unsigned long long)backref->index,
+				backref->found_dir_item |
+				backref->found_dir_index << 1 |
+				backref->found_back_ref << 2 |
+				backref->found_forward_ref << 3 |
+				backref->reachable << 4, backref->errors);
+			for (i = 0; i < backref->namelen; i++)
+				fprintf(f, "%02x", (u8)backref->name[i]);
+			fprintf(f, "\n");
+		}
+	}
+}
+
+static int load_root_rec(struct cache_tree *root_cache, char *value,
+			 int is_backref)
+{
+	struct root_record *rec;
+	struct root_backref *backref;
+	unsigned long long objectid;
+	unsigned long long ref_root;
+	unsigned long long dir;
+	unsigned long long index;
+	unsigned int flags;
+	unsigned int found_ref;
+	char name[BTRFS_NAME_LEN];
+	char hex[BTRFS_NAME_LEN * 2 + 1];
+	unsigned int byte;
+	int errors;
+	int namelen;
+	int i;
+
+	if (!is_backref) {
+		if (sscanf(value, "%llu %u %u", &objectid, &flags,
+			   &found_ref) != 3)
+			return -EINVAL;
+		rec = get_root_rec(root_cache, objectid);
+		rec->found_root_item = flags;
+		rec->found_ref = found_ref;
+		return 0;
+	}
+
+	hex[0] = 0;
+	if (sscanf(value, "%llu %llu %llu %llu %u %d %510s", &objectid,
+		   &ref_root, &dir, &index, &flags, &errors, hex) < 6)
+		return -EINVAL;
+	namelen = strlen(hex) / 2;
+	for (i = 0; i < namelen; i++) {
+		if (sscanf(hex + i * 2, "%2x", &byte) != 1)
+			return -EINVAL;
+		name[i] = byte;
+	}
+	rec = get_root_rec(root_cache, objectid);
+	backref = get_root_backref(rec, ref_root, dir, index, name, namelen);
+	backref->found_dir_item = !!(flags & 1);
+	backref->found_dir_index = !!(flags & 2);
+	backref->found_back_ref = !!(flags & 4);
+	backref->found_forward_ref = !!(flags & 8);
+	backref->reachable = !!(flags & 16);
+	backref->errors = errors;
+	return 0;
+}
+
+static void fill_check_progress(FILE *f, void *data)
+{
+	struct btrfs_fs_info *info = progress.info;
+	int *errors = data;
+
+	fprintf(f, "generation:%llu\n",
+		(unsigned long long)btrfs_super_generation(info->super_copy));
+	fprintf(f, "mode:%s\n",
+		check_mode == CHECK_MODE_LOWMEM ? "lowmem" : "original");
+	fprintf(f, "min_generation:%llu\n", (unsigned long long)lowmem_min_gen);
+	fprintf(f, "phase:%s\n", check_phase_names[progress.phase]);
+	fprintf(f, "root_key:%llu %u %llu\n",
+		(unsigned long long)progress.root_key.objectid,
+		progress.root_key.type,
+		(unsigned long long)progress.root_key.offset);
+	fprintf(f, "key:%llu %u %llu\n",
+		(unsigned long long)progress.key.objectid, progress.key.type,
+		(unsigned long long)progress.key.offset);
+	fprintf(f, "block_group:%llu %llu %llu\n",
+		(unsigned long long)progress.bg_start,
+		(unsigned long long)progress.bg_used,
+		(unsigned long long)progress.bg_last_end);
+	fprintf(f, "root_dir:%d\n", progress.root_dir);
+	fprintf(f, "extents_err:%d\n", progress.extents_err);
+	fprintf(f, "errors:%d\n", !!*errors);
+	fprintf(f, "bytes_used:%llu\n", (unsigned long long)bytes_used);
+	fprintf(f, "total_csum_bytes:%llu\n",
+		(unsigned long long)total_csum_bytes);
+	fprintf(f, "total_btree_bytes:%llu\n",
+		(unsigned long long)total_btree_bytes);
+	fprintf(f, "total_fs_tree_bytes:%llu\n",
+		(unsigned long long)total_fs_tree_bytes);
+	fprintf(f, "total_extent_tree_bytes:%llu\n",
+		(unsigned long long)total_extent_tree_bytes);
+	fprintf(f, "btree_space_waste:%llu\n",
+		(unsigned long long)btree_space_waste);
+	fprintf(f, "data_bytes_allocated:%llu\n",
+		(unsigned long long)data_bytes_allocated);
+	fprintf(f, "data_bytes_referenced:%llu\n",
+		(unsigned long long)data_bytes_referenced);
+	fprintf(f, "blocks:%llu\n", (unsigned long long)lowmem_blocks);
+	fprintf(f, "found_old_backref:%d\n", found_old_backref);
+	if (check_mode == CHECK_MODE_ORIGINAL &&
+	    progress.phase >= CHECK_PHASE_FS_ROOTS)
+		save_root_recs(f, progress.root_cache);
+}
+
+/*
+ * Save where the check is, @errors being those the current phase found
+ * so far.  An interrupted check stops here.
+ */
+static void check_progress_save(int errors)
+{
+	int ret;
+
+	ret = save_state_file(progress.file, CHECK_CHECKPOINT_HEADER,
+			      progress.info->fsid, fill_check_progress,
+			      &errors);
+	if (ret)
+		fprintf(stderr, "ERROR: cannot save checkpoint %s: %s\n",
+			progress.file, strerror(-ret));
+	progress.last_save = time(NULL);
+	if (check_interrupted) {
+		printf("progress saved in %s, continue with --resume\n",
+		       progress.file);
+		exit(1);
+	}
+}
+
+/* a phase is done, the next one starts from the beginning */
+static void check_progress_phase(enum check_phase phase)
+{
+	progress.phase = phase;
+	progress.resume = 0;
+	memset(&progress.root_key, 0, sizeof(progress.root_key));
+	memset(&progress.key, 0, sizeof(progress.key));
+	progress.root_dir = 0;
+	if (progress.file)
+		check_progress_save(0);
+}
+
+static int parse_check_progress(char *key, char *value, void *data)
+{
+	struct btrfs_fs_info *info = progress.info;
+	struct btrfs_key *pkey;
+	unsigned long long a, b;
+	unsigned int type;
+	int *phase = data;
+	u64 val;
+	int i;
+
+	if (!strcmp(key, "mode")) {
+		if (strcmp(value, check_mode == CHECK_MODE_LOWMEM ?
+			   "lowmem" : "original")) {
+			fprintf(stderr, "ERROR: checkpoint %s is for the %s "
+				"mode\n", progress.file, value);
+			return -ESTALE;
+		}
+		return 0;
+	}
+	if (!strcmp(key, "phase")) {
+		for (i = 0; i <= CHECK_PHASE_DONE; i++)
+			if (!strcmp(value, check_phase_names[i]))
+				*phase = i;
+		return 0;
+	}
+	if (!strcmp(key, "root_rec") || !strcmp(key, "root_backref"))
+		return load_root_rec(progress.root_cache, value,
+				     !strcmp(key, "root_backref"));
+	if (!strcmp(key, "root_key") || !strcmp(key, "key")) {
+		pkey = !strcmp(key, "key") ? &progress.key : &progress.root_key;
+		if (sscanf(value, "%llu %u %llu", &a, &type, &b) != 3)
+			return -EINVAL;
+		pkey->objectid = a;
+		pkey->type = type;
+		pkey->offset = b;
+		return 0;
+	}
+	if (!strcmp(key, "block_group")) {
+		if (sscanf(value, "%llu %llu %llu",
+			   (unsigned long long *)&progress.bg_start,
+			   (unsigned long long *)&progress.bg_used,
+			   (unsigned long long *)&progress.bg_last_end) != 3)
+			return -EINVAL;
+		return 0;
+	}
+
+	val = strtoull(value, NULL, 10);
+	if (!strcmp(key, "generation") &&
+	    val != btrfs_super_generation(info->super_copy)) {
+		fprintf(stderr, "ERROR: the filesystem changed since "
+			"checkpoint %s was saved\n", progress.file);
+		return -ESTALE;
+	}
+	if (!strcmp(key, "min_generation"))
+		lowmem_min_gen = val;
+	else if (!strcmp(key, "root_dir"))
+		progress.root_dir = val;
+	else if (!strcmp(key, "extents_err"))
+		progress.extents_err = val;
+	else if (!strcmp(key, "errors"))
+		progress.errors = val;
+	else if (!strcmp(key, "bytes_used"))
+		bytes_used = val;
+	else if (!strcmp(key, "total_csum_bytes"))
+		total_csum_bytes = val;
+	else if (!strcmp(key, "total_btree_bytes"))
+		total_btree_bytes = val;
+	else if (!strcmp(key, "total_fs_tree_bytes"))
+		total_fs_tree_bytes = val;
+	else if (!strcmp(key, "total_extent_tree_bytes"))
+		total_extent_tree_bytes = val;
+	else if (!strcmp(key, "btree_space_waste"))
+		btree_space_waste = val;
+	else if (!strcmp(key, "data_bytes_allocated"))
+		data_bytes_allocated = val;
+	else if (!strcmp(key, "data_bytes_referenced"))
+		data_bytes_referenced = val;
+	else if (!strcmp(key, "blocks"))
+		lowmem_blocks = val;
+	else if (!strcmp(key, "found_old_backref"))
+		found_old_backref = val;
+	return 0;
+}
+
+static int check_progress_load(void)
+{
+	int phase = -1;
+	int ret;
+
+	ret = load_state_file(progress.file, CHECK_CHECKPOINT_HEADER,
+			      progress.info->fsid, "check checkpoint",
+			      parse_check_progress, &phase);
+	if (ret == -ENOENT)
+		fprintf(stderr, "ERROR: cannot open checkpoint %s: %s\n",
+			progress.file, strerror(-ret));
+	if (ret)
+		return ret;
+	if (phase < 0) {
+		fprintf(stderr, "ERROR: %s is not a check checkpoint\n",
+			progress.file);
+		return -EINVAL;
+	}
+	progress.phase = phase;
+	/* otherwise the phase had only just begun */
+	progress.resume = progress.root_key.objectid || progress.key.objectid;
+	return 0;
+}
+
 static int check_fs_roots(struct btrfs_root *root,
 			  struct cache_tree *root_cache)
 {
@@ -3065,11 +3726,18 @@ static int check_fs_roots(struct btrfs_root *root,
 	memset(&wc, 0, sizeof(wc));
 	cache_tree_init(&wc.shared);
 	btrfs_init_path(&path);
+	progress.resumable = 1;
 
 again:
 	key.offset = 0;
 	key.objectid = 0;
 	key.type = BTRFS_ROOT_ITEM_KEY;
+	if (progress.resume) {
+		/* the root records up to here came with the checkpoint */
+		key = progress.root_key;
+		err = progress.errors;
+		progress.resume = 0;
+	}
 	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
 	if (ret < 0) {
 		err = 1;
@@ -3095,6 +3763,12 @@ again:
 		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
 		if (key.type == BTRFS_ROOT_ITEM_KEY &&
 		    fs_root_objectid(key.objectid)) {
+			/* records of blocks shared with trees ahead aren't saved */
+			if (check_progress_due() &&
+			    cache_tree_empty(&wc.shared)) {
+				progress.root_key = key;
+				check_progress_save(err);
+			}
 			if (key.objectid == BTRFS_TREE_RELOC_OBJECTID) {
 				tmp_root = btrfs_read_fs_root_no_cache(
 						root->fs_info, &key);
@@ -3126,6 +3800,7 @@ next:
 		path.slots[0]++;
 	}
 out:
+	progress.resumable = 0;
 	btrfs_release_path(&path);
 	if (err)
 		free_extent_cache_tree(&wc.shared);
@@ -3258,6 +3933,7 @@ static int free_all_extent_backrefs(struct extent_record *rec)
 		back = list_entry(cur, struct extent_backref, list);
 		list_del(cur);
 		free(back);
+		check_rec_del(CHECK_REC_EXTENT_BACKREF);
 	}
 	return 0;
 }
@@ -3277,6 +3953,7 @@ static void free_extent_record_cache(struct btrfs_fs_info *fs_info,
 		remove_cache_extent(extent_cache, cache);
 		free_all_extent_backrefs(rec);
 		free(rec);
+		check_rec_del(CHECK_REC_EXTENT);
 	}
 }
 
@@ -3290,6 +3967,7 @@ static int maybe_free_extent_rec(struct cache_tree *extent_cache,
 		free_all_extent_backrefs(rec);
 		list_del_init(&rec->list);
 		free(rec);
+		check_rec_del(CHECK_REC_EXTENT);
 	}
 	return 0;
 }
@@ -3763,6 +4441,7 @@ static struct tree_backref *alloc_tree_backref(struct extent_record *rec,
 						u64 parent, u64 root)
 {
 	struct tree_backref *ref = malloc(sizeof(*ref));
+	check_rec_add(CHECK_REC_EXTENT_BACKREF);
 	memset(&ref->node, 0, sizeof(ref->node));
 	if (parent > 0) {
 		ref->parent = parent;
@@ -3819,6 +4498,7 @@ static struct data_backref *alloc_data_backref(struct extent_record *rec,
 						u64 max_size)
 {
 	struct data_backref *ref = malloc(sizeof(*ref));
+	check_rec_add(CHECK_REC_EXTENT_BACKREF);
 	memset(&ref->node, 0, sizeof(ref->node));
 	ref->node.is_data = 1;
 
@@ -3884,6 +4564,7 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 				tmp = malloc(sizeof(*tmp));
 				if (!tmp)
 					return -ENOMEM;
+				check_rec_add(CHECK_REC_EXTENT);
 				tmp->start = start;
 				tmp->max_size = max_size;
 				tmp->nr = nr;
@@ -3929,6 +4610,7 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 		return ret;
 	}
 	rec = malloc(sizeof(*rec));
+	check_rec_add(CHECK_REC_EXTENT);
 	rec->start = start;
 	rec->max_size = max_size;
 	rec->nr = max(nr, max_size);
@@ -4180,6 +4862,7 @@ static void free_chunk_record(struct cache_extent *cache)
 	list_del_init(&rec->list);
 	list_del_init(&rec->dextents);
 	free(rec);
+	check_rec_del(CHECK_REC_CHUNK);
 }
 
 void free_chunk_cache_tree(struct cache_tree *chunk_cache)
@@ -4217,6 +4900,7 @@ static void free_block_group_record(struct cache_extent *cache)
 	rec = container_of(cache, struct block_group_record, cache);
 	list_del_init(&rec->list);
 	free(rec);
+	check_rec_del(CHECK_REC_BLOCK_GROUP);
 }
 
 void free_block_group_tree(struct block_group_tree *tree)
@@ -4254,6 +4938,7 @@ static void free_device_extent_record(struct cache_extent *cache)
 	if (!list_empty(&rec->device_list))
 		list_del_init(&rec->device_list);
 	free(rec);
+	check_rec_del(CHECK_REC_DEV_EXTENT);
 }
 
 void free_device_extent_tree(struct device_extent_tree *tree)
@@ -4298,6 +4983,7 @@ struct chunk_record *btrfs_new_chunk_record(struct extent_buffer *leaf,
 	}
 
 	memset(rec, 0, btrfs_chunk_record_size(num_stripes));
+	check_rec_add(CHECK_REC_CHUNK);
 
 	INIT_LIST_HEAD(&rec->list);
 	INIT_LIST_HEAD(&rec->dextents);
@@ -4348,6 +5034,7 @@ static int process_chunk_item(struct cache_tree *chunk_cache,
 		fprintf(stderr, "Chunk[%llu, %llu] existed.\n",
 			rec->offset, rec->length);
 		free(rec);
+		check_rec_del(CHECK_REC_CHUNK);
 	}
 
 	return ret;
@@ -4402,6 +5089,7 @@ btrfs_new_block_group_record(struct extent_buffer *leaf, struct btrfs_key *key,
 		exit(-1);
 	}
 	memset(rec, 0, sizeof(*rec));
+	check_rec_add(CHECK_REC_BLOCK_GROUP);
 
 	rec->cache.start = key->objectid;
 	rec->cache.size = key->offset;
@@ -4433,6 +5121,7 @@ static int process_block_group_item(struct block_group_tree *block_group_cache,
 		fprintf(stderr, "Block Group[%llu, %llu] existed.\n",
 			rec->objectid, rec->offset);
 		free(rec);
+		check_rec_del(CHECK_REC_BLOCK_GROUP);
 	}
 
 	return ret;
@@ -4451,6 +5140,7 @@ btrfs_new_device_extent_record(struct extent_buffer *leaf,
 		exit(-1);
 	}
 	memset(rec, 0, sizeof(*rec));
+	check_rec_add(CHECK_REC_DEV_EXTENT);
 
 	rec->cache.objectid = key->objectid;
 	rec->cache.start = key->offset;
@@ -4490,6 +5180,7 @@ process_device_extent_item(struct device_extent_tree *dev_extent_cache,
 			"Device extent[%llu, %llu, %llu] existed.\n",
 			rec->objectid, rec->offset, rec->length);
 		free(rec);
+		check_rec_del(CHECK_REC_DEV_EXTENT);
 	}
 
 	return ret;
@@ -4837,7 +5528,8 @@ static int read_extent_data(struct btrfs_root *root, char *data,
 	if (*len > max_len)
 		*len = max_len;
 
-	ret = pread64(device->fd, data, *len, multi->stripes[0].physical);
+	ret = btrfs_device_pread(device, data, *len,
+				 multi->stripes[0].physical);
 	if (ret != *len)
 		ret = -EIO;
 	else
@@ -4847,124 +5539,592 @@ err:
 	return ret;
 }
 
-static int check_extent_csums(struct btrfs_root *root, u64 bytenr,
-			u64 num_bytes, unsigned long leaf_offset,
-			struct extent_buffer *eb) {
+/*
+ * Data checksums are verified in a pipeline: check_csums() walks the csum
+ * tree and cuts the data into batches that are contiguous on one device,
+ * a reader thread per device reads them, and the sectors are checked on a
+ * task pool.  At most CSUM_BATCH_SLOTS batches are in flight.
+ */
+#define CSUM_BATCH_SIZE		(1024 * 1024)
+#define CSUM_BATCH_SLOTS	64
 
-	u64 offset = 0;
-	u16 csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
+struct csum_verify;
+
+struct csum_reader {
+	struct csum_verify *cv;
+	struct btrfs_device *device;
+	pthread_t thread;
+	pthread_cond_t cond;
+	struct list_head queue;
+	u64 queued;
+
+	/* stats, under cv->lock */
+	u64 bytes;
+	u64 reads;
+	double busy;
+	u64 read_errors;
+	u64 csum_errors;
+};
+
+struct csum_batch {
+	struct task_work work;
+	struct list_head list;
+	struct csum_verify *cv;
+	struct csum_reader *reader;
+	u64 logical;
+	u64 physical;
+	u64 len;
+	u64 type;
+	int mirror;
+	int busy;
+	int ret;
 	char *data;
-	unsigned long csum_offset;
+	char *csums;
+};
+
+struct csum_verify {
+	struct btrfs_fs_info *info;
+	struct task_pool *pool;
+	struct csum_reader *readers;
+	int nr_readers;
+	struct csum_batch *batches;
+	struct csum_batch *open;
+	int next;
+	int stop;
+	pthread_mutex_t lock;
+	u32 sectorsize;
+	u16 csum_size;
+	u64 bytes;
+	u64 unrecoverable;
+	u64 skipped;
+	double start;
+};
+
+static double csum_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static struct csum_reader *csum_find_reader(struct csum_verify *cv,
+					    struct btrfs_device *device)
+{
+	int i;
+
+	for (i = 0; i < cv->nr_readers; i++)
+		if (cv->readers[i].device == device)
+			return &cv->readers[i];
+	return NULL;
+}
+
+static int csum_sector_ok(struct csum_verify *cv, char *data, char *expected,
+			  u32 *csum_ret)
+{
+	u32 csum = ~(u32)0;
+
+	csum = btrfs_csum_data(NULL, data, csum, cv->sectorsize);
+	btrfs_csum_final(csum, (char *)&csum);
+	*csum_ret = csum;
+	return !memcmp(&csum, expected, cv->csum_size);
+}
+
+static void csum_batch_read(struct csum_batch *batch)
+{
+	struct csum_reader *reader = batch->reader;
+	struct csum_verify *cv = batch->cv;
+	double t = csum_now();
+	ssize_t ret;
+
+	ret = btrfs_device_pread(reader->device, batch->data, batch->len,
+				 batch->physical);
+	batch->ret = ret == batch->len ? 0 : -EIO;
+	if (batch->ret)
+		fprintf(stderr, "read error on %s at %llu, bytenr %llu len %llu\n",
+			reader->device->name,
+			(unsigned long long)batch->physical,
+			(unsigned long long)batch->logical,
+			(unsigned long long)batch->len);
+
+	pthread_mutex_lock(&cv->lock);
+	reader->busy += csum_now() - t;
+	reader->reads++;
+	reader->queued -= batch->len;
+	if (batch->ret)
+		reader->read_errors++;
+	else
+		reader->bytes += batch->len;
+	pthread_mutex_unlock(&cv->lock);
+}
+
+/*
+ * Look for a good copy of a sector that failed to read or verify.  Only
+ * mirrored profiles have one: the other "mirrors" of RAID5/6 are parity.
+ */
+static int csum_other_copy_ok(struct csum_batch *batch, u64 offset,
+			      char *expected)
+{
+	struct csum_verify *cv = batch->cv;
+	struct btrfs_mapping_tree *map_tree = &cv->info->mapping_tree;
+	struct btrfs_multi_bio *multi;
+	struct btrfs_device *device;
+	u64 logical = batch->logical + offset;
+	u64 physical;
+	u64 len;
 	u32 csum;
-	u32 csum_expected;
-	u64 read_len;
-	u64 data_checked = 0;
-	u64 tmp;
-	int ret = 0;
-	int mirror;
+	u32 csum_expected = 0;
+	char *buf;
 	int num_copies;
+	int mirror;
+	int ok = 0;
 
-	if (num_bytes % root->sectorsize)
-		return -EINVAL;
+	if (!(batch->type & (BTRFS_BLOCK_GROUP_RAID1 |
+			     BTRFS_BLOCK_GROUP_RAID10 |
+			     BTRFS_BLOCK_GROUP_DUP)))
+		return 0;
 
-	data = malloc(num_bytes);
-	if (!data)
-		return -ENOMEM;
+	buf = malloc(cv->sectorsize);
+	if (!buf)
+		return 0;
+	memcpy(&csum_expected, expected, min_t(u16, cv->csum_size, 4));
+	num_copies = btrfs_num_copies(map_tree, logical, cv->sectorsize);
+	for (mirror = 1; mirror <= num_copies && !ok; mirror++) {
+		len = cv->sectorsize;
+		multi = NULL;
+		if (btrfs_map_block(map_tree, READ, logical, &len, &multi,
+				    mirror, NULL))
+			continue;
+		device = multi->stripes[0].dev;
+		physical = multi->stripes[0].physical;
+		kfree(multi);
+		if (device == batch->reader->device &&
+		    physical == batch->physical + offset)
+			continue;
+		if (device->fd <= 0 ||
+		    btrfs_device_pread(device, buf, cv->sectorsize,
+				       physical) != cv->sectorsize)
+			continue;
+		ok = csum_sector_ok(cv, buf, expected, &csum);
+		if (!ok)
+			fprintf(stderr, "mirror %d bytenr %llu csum %u "
+				"expected csum %u\n", mirror,
+				(unsigned long long)logical, csum,
+				csum_expected);
+	}
+	free(buf);
+	return ok;
+}
 
-	while (offset < num_bytes) {
-		mirror = 0;
-again:
-		read_len = num_bytes - offset;
-		/* read as much space once a time */
-		ret = read_extent_data(root, data + offset,
-				bytenr + offset, &read_len, mirror);
-		if (ret)
-			goto out;
-		data_checked = 0;
-		/* verify every 4k data's checksum */
-		while (data_checked < read_len) {
-			csum = ~(u32)0;
-			tmp = offset + data_checked;
-
-			csum = btrfs_csum_data(NULL, (char *)data + tmp,
-					       csum, root->sectorsize);
-			btrfs_csum_final(csum, (char *)&csum);
-
-			csum_offset = leaf_offset +
-				 tmp / root->sectorsize * csum_size;
-			read_extent_buffer(eb, (char *)&csum_expected,
-					   csum_offset, csum_size);
-			/* try another mirror */
-			if (csum != csum_expected) {
-				fprintf(stderr, "mirror %d bytenr %llu csum %u expected csum %u\n",
-						mirror, bytenr + tmp,
-						csum, csum_expected);
-				num_copies = btrfs_num_copies(
-						&root->fs_info->mapping_tree,
-						bytenr, num_bytes);
-				if (mirror < num_copies - 1) {
-					mirror += 1;
-					goto again;
-				}
-			}
-			data_checked += root->sectorsize;
+static void csum_batch_verify(struct task_work *work)
+{
+	struct csum_batch *batch = container_of(work, struct csum_batch, work);
+	struct csum_verify *cv = batch->cv;
+	u64 csum_errors = 0;
+	u64 unrecoverable = 0;
+	u64 offset;
+	u32 csum;
+	u32 csum_expected;
+	char *expected;
+
+	for (offset = 0; offset < batch->len; offset += cv->sectorsize) {
+		expected = batch->csums +
+			   offset / cv->sectorsize * cv->csum_size;
+		if (!batch->ret) {
+			if (csum_sector_ok(cv, batch->data + offset, expected,
+					   &csum))
+				continue;
+			csum_expected = 0;
+			memcpy(&csum_expected, expected,
+			       min_t(u16, cv->csum_size, 4));
+			fprintf(stderr, "mirror %d bytenr %llu csum %u "
+				"expected csum %u\n", batch->mirror,
+				(unsigned long long)(batch->logical + offset),
+				csum, csum_expected);
+			csum_errors++;
 		}
-		offset += read_len;
+		if (!csum_other_copy_ok(batch, offset, expected))
+			unrecoverable++;
 	}
-out:
-	free(data);
-	return ret;
+
+	pthread_mutex_lock(&cv->lock);
+	batch->reader->csum_errors += csum_errors;
+	cv->unrecoverable += unrecoverable;
+	cv->bytes += batch->len;
+	pthread_mutex_unlock(&cv->lock);
 }
 
-static int check_extent_exists(struct btrfs_root *root, u64 bytenr,
-			       u64 num_bytes)
+static void *csum_reader_thread(void *data)
 {
-	struct btrfs_path *path;
-	struct extent_buffer *leaf;
-	struct btrfs_key key;
-	int ret;
+	struct csum_reader *reader = data;
+	struct csum_verify *cv = reader->cv;
+	struct csum_batch *batch;
 
-	path = btrfs_alloc_path();
-	if (!path) {
-		fprintf(stderr, "Error allocing path\n");
-		return -ENOMEM;
+	pthread_mutex_lock(&cv->lock);
+	while (1) {
+		while (list_empty(&reader->queue) && !cv->stop)
+			pthread_cond_wait(&reader->cond, &cv->lock);
+		if (list_empty(&reader->queue))
+			break;
+		batch = list_entry(reader->queue.next, struct csum_batch,
+				   list);
+		list_del_init(&batch->list);
+		pthread_mutex_unlock(&cv->lock);
+
+		csum_batch_read(batch);
+		task_pool_queue(cv->pool, &batch->work, csum_batch_verify);
+
+		pthread_mutex_lock(&cv->lock);
 	}
+	pthread_mutex_unlock(&cv->lock);
+	return NULL;
+}
 
-	key.objectid = bytenr;
-	key.type = BTRFS_EXTENT_ITEM_KEY;
-	key.offset = (u64)-1;
+static void csum_verify_stop_readers(struct csum_verify *cv, int nr)
+{
+	int i;
 
-again:
-	ret = btrfs_search_slot(NULL, root->fs_info->extent_root, &key, path,
-				0, 0);
-	if (ret < 0) {
-		fprintf(stderr, "Error looking up extent record %d\n", ret);
-		btrfs_free_path(path);
-		return ret;
-	} else if (ret) {
-		if (path->slots[0] > 0) {
-			path->slots[0]--;
-		} else {
-			ret = btrfs_prev_leaf(root, path);
-			if (ret < 0) {
-				goto out;
-			} else if (ret > 0) {
-				ret = 0;
-				goto out;
-			}
+	pthread_mutex_lock(&cv->lock);
+	cv->stop = 1;
+	for (i = 0; i < nr; i++)
+		pthread_cond_signal(&cv->readers[i].cond);
+	pthread_mutex_unlock(&cv->lock);
+	for (i = 0; i < nr; i++)
+		pthread_join(cv->readers[i].thread, NULL);
+}
+
+/*
+ * Without a task pool or reader threads every batch is read and verified
+ * by the walker as soon as it is full.
+ */
+static int csum_verify_init(struct csum_verify *cv,
+			    struct btrfs_fs_info *info)
+{
+	struct btrfs_fs_devices *fs_devices;
+	struct btrfs_device *device;
+	struct csum_batch *batch;
+	u32 csums_size;
+	int i;
+
+	memset(cv, 0, sizeof(*cv));
+	cv->info = info;
+	cv->sectorsize = info->tree_root->sectorsize;
+	cv->csum_size = btrfs_super_csum_size(info->super_copy);
+	pthread_mutex_init(&cv->lock, NULL);
+
+	for (fs_devices = info->fs_devices; fs_devices;
+	     fs_devices = fs_devices->seed)
+		list_for_each_entry(device, &fs_devices->devices, dev_list)
+			cv->nr_readers++;
+	cv->readers = calloc(cv->nr_readers, sizeof(*cv->readers));
+	cv->batches = calloc(CSUM_BATCH_SLOTS, sizeof(*cv->batches));
+	if (!cv->readers || !cv->batches)
+		return -ENOMEM;
+
+	i = 0;
+	for (fs_devices = info->fs_devices; fs_devices;
+	     fs_devices = fs_devices->seed) {
+		list_for_each_entry(device, &fs_devices->devices, dev_list) {
+			cv->readers[i].cv = cv;
+			cv->readers[i].device = device;
+			pthread_cond_init(&cv->readers[i].cond, NULL);
+			INIT_LIST_HEAD(&cv->readers[i].queue);
+			i++;
+		}
+	}
+
+	csums_size = CSUM_BATCH_SIZE / cv->sectorsize * cv->csum_size;
+	for (i = 0; i < CSUM_BATCH_SLOTS; i++) {
+		batch = &cv->batches[i];
+		batch->cv = cv;
+		INIT_LIST_HEAD(&batch->list);
+		batch->data = malloc(CSUM_BATCH_SIZE);
+		batch->csums = malloc(csums_size);
+		if (!batch->data || !batch->csums)
+			return -ENOMEM;
+	}
+
+	cv->pool = task_pool_init(0);
+	for (i = 0; cv->pool && i < cv->nr_readers; i++) {
+		if (pthread_create(&cv->readers[i].thread, NULL,
+				   csum_reader_thread, &cv->readers[i])) {
+			csum_verify_stop_readers(cv, i);
+			task_pool_destroy(cv->pool);
+			cv->pool = NULL;
 		}
 	}
+	cv->start = csum_now();
+	return 0;
+}
 
-	btrfs_item_key_to_cpu(path->nodes[0], &key, path->slots[0]);
+static void csum_batch_submit(struct csum_verify *cv, struct csum_batch *batch)
+{
+	struct csum_reader *reader = batch->reader;
 
-	/*
-	 * Block group items come before extent items if they have the same
-	 * bytenr, so walk back one more just in case.  Dear future traveler,
-	 * first congrats on mastering time travel.  Now if it's not too much
-	 * trouble could you go back to 2006 and tell Chris to make the
-	 * BLOCK_GROUP_ITEM_KEY (and BTRFS_*_REF_KEY) lower than the
-	 * EXTENT_ITEM_KEY please?
-	 */
+	cv->open = NULL;
+	if (!cv->pool) {
+		reader->queued += batch->len;
+		csum_batch_read(batch);
+		csum_batch_verify(&batch->work);
+		return;
+	}
+
+	pthread_mutex_lock(&cv->lock);
+	reader->queued += batch->len;
+	list_add_tail(&batch->list, &reader->queue);
+	pthread_cond_signal(&reader->cond);
+	pthread_mutex_unlock(&cv->lock);
+}
+
+/* the oldest batch slot, once it is verified */
+static struct csum_batch *csum_batch_get(struct csum_verify *cv)
+{
+	struct csum_batch *batch = &cv->batches[cv->next];
+
+	cv->next = (cv->next + 1) % CSUM_BATCH_SLOTS;
+	if (batch->busy && cv->pool)
+		task_pool_wait_work(cv->pool, &batch->work);
+	batch->work.done = 0;
+	batch->busy = 1;
+	batch->len = 0;
+	batch->ret = 0;
+	return batch;
+}
+
+static int csum_batch_extends(struct csum_batch *batch,
+			      struct csum_reader *reader, u64 logical,
+			      u64 physical)
+{
+	return batch && batch->reader == reader &&
+	       batch->logical + batch->len == logical &&
+	       batch->physical + batch->len == physical &&
+	       batch->len < CSUM_BATCH_SIZE;
+}
+
+/*
+ * Pick the copy of @logical to read.  Mirrored profiles read the copy
+ * that continues the open batch, or else the one on the device with the
+ * least queued, instead of always starting at the first mirror.
+ */
+static int csum_verify_map(struct csum_verify *cv, u64 logical, u64 *len,
+			   struct csum_batch *map)
+{
+	struct btrfs_mapping_tree *map_tree = &cv->info->mapping_tree;
+	struct btrfs_multi_bio *multi = NULL;
+	struct csum_reader *reader;
+	u64 queued = (u64)-1;
+	u64 physical;
+	u64 map_len;
+	u64 load;
+	int num_copies;
+	int mirror;
+	int ret;
+
+	ret = __btrfs_map_block(map_tree, READ, logical, len, &map->type,
+				&multi, 0, NULL);
+	if (ret)
+		return ret;
+	map->reader = csum_find_reader(cv, multi->stripes[0].dev);
+	map->physical = multi->stripes[0].physical;
+	map->mirror = 0;
+	kfree(multi);
+
+	if (!(map->type & (BTRFS_BLOCK_GROUP_RAID1 |
+			   BTRFS_BLOCK_GROUP_RAID10)))
+		return 0;
+
+	num_copies = btrfs_num_copies(map_tree, logical, *len);
+	for (mirror = 1; mirror <= num_copies; mirror++) {
+		map_len = *len;
+		multi = NULL;
+		if (btrfs_map_block(map_tree, READ, logical, &map_len, &multi,
+				    mirror, NULL))
+			continue;
+		reader = csum_find_reader(cv, multi->stripes[0].dev);
+		physical = multi->stripes[0].physical;
+		kfree(multi);
+		if (!reader || reader->device->fd <= 0)
+			continue;
+		if (csum_batch_extends(cv->open, reader, logical, physical)) {
+			queued = 0;
+		} else {
+			pthread_mutex_lock(&cv->lock);
+			load = reader->queued;
+			pthread_mutex_unlock(&cv->lock);
+			if (load >= queued)
+				continue;
+			queued = load;
+		}
+		map->reader = reader;
+		map->physical = physical;
+		map->mirror = mirror;
+		if (!queued)
+			break;
+	}
+	return 0;
+}
+
+/* queue the data covered by a csum item, @csum_offset points at its csums */
+static void csum_verify_add(struct csum_verify *cv, u64 logical, u64 len,
+			    struct extent_buffer *leaf,
+			    unsigned long csum_offset)
+{
+	struct csum_batch *batch;
+	struct csum_batch map;
+	u64 map_len;
+
+	while (len) {
+		map_len = len;
+		if (csum_verify_map(cv, logical, &map_len, &map)) {
+			fprintf(stderr, "Couldn't map the block %llu\n",
+				(unsigned long long)logical);
+			cv->skipped += len;
+			return;
+		}
+		map_len = min(map_len, len);
+		if (!map.reader || map.reader->device->fd <= 0) {
+			fprintf(stderr, "No device to read bytenr %llu\n",
+				(unsigned long long)logical);
+			cv->skipped += map_len;
+			goto next;
+		}
+
+		batch = cv->open;
+		if (batch && !csum_batch_extends(batch, map.reader, logical,
+						 map.physical)) {
+			csum_batch_submit(cv, batch);
+			batch = NULL;
+		}
+		if (!batch) {
+			batch = csum_batch_get(cv);
+			batch->reader = map.reader;
+			batch->logical = logical;
+			batch->physical = map.physical;
+			batch->type = map.type;
+			batch->mirror = map.mirror;
+			cv->open = batch;
+		}
+		map_len = min_t(u64, map_len, CSUM_BATCH_SIZE - batch->len);
+		read_extent_buffer(leaf, batch->csums + batch->len /
+				   cv->sectorsize * cv->csum_size, csum_offset,
+				   map_len / cv->sectorsize * cv->csum_size);
+		batch->len += map_len;
+		if (batch->len == CSUM_BATCH_SIZE)
+			csum_batch_submit(cv, batch);
+next:
+		csum_offset += map_len / cv->sectorsize * cv->csum_size;
+		logical += map_len;
+		len -= map_len;
+	}
+}
+
+static void csum_verify_finish(struct csum_verify *cv)
+{
+	struct csum_reader *reader;
+	double seconds;
+	int i;
+
+	if (cv->open)
+		csum_batch_submit(cv, cv->open);
+	if (cv->pool) {
+		csum_verify_stop_readers(cv, cv->nr_readers);
+		task_pool_flush(cv->pool);
+	}
+	seconds = max(csum_now() - cv->start, 0.000001);
+
+	printf("data csums: %llu MiB checked in %.2fs, %.1f MiB/s\n",
+	       (unsigned long long)cv->bytes >> 20, seconds,
+	       (double)cv->bytes / (1024 * 1024) / seconds);
+	for (i = 0; i < cv->nr_readers; i++) {
+		reader = &cv->readers[i];
+		if (!reader->reads)
+			continue;
+		printf("\tdevid %llu %s: %llu MiB in %llu reads, %.1f MiB/s, "
+		       "%llu read errors, %llu csum errors\n",
+		       (unsigned long long)reader->device->devid,
+		       reader->device->name,
+		       (unsigned long long)reader->bytes >> 20,
+		       (unsigned long long)reader->reads,
+		       (double)reader->bytes / (1024 * 1024) /
+		       max(reader->busy, 0.000001),
+		       (unsigned long long)reader->read_errors,
+		       (unsigned long long)reader->csum_errors);
+	}
+	if (cv->unrecoverable)
+		printf("data csums: %llu sectors without a good copy\n",
+		       (unsigned long long)cv->unrecoverable);
+	if (cv->skipped)
+		printf("data csums: %llu bytes could not be read\n",
+		       (unsigned long long)cv->skipped);
+}
+
+static void csum_verify_release(struct csum_verify *cv)
+{
+	int i;
+
+	if (cv->pool && !cv->stop)
+		csum_verify_stop_readers(cv, cv->nr_readers);
+	task_pool_destroy(cv->pool);
+	for (i = 0; cv->batches && i < CSUM_BATCH_SLOTS; i++) {
+		free(cv->batches[i].data);
+		free(cv->batches[i].csums);
+	}
+	for (i = 0; cv->readers && i < cv->nr_readers; i++)
+		pthread_cond_destroy(&cv->readers[i].cond);
+	free(cv->batches);
+	free(cv->readers);
+	pthread_mutex_destroy(&cv->lock);
+}
+
+static int check_extent_exists(struct btrfs_root *root, u64 bytenr,
+			       u64 num_bytes)
+{
+	struct btrfs_path *path;
+	struct extent_buffer *leaf;
+	struct btrfs_key key;
+	int ret;
+
+	path = btrfs_alloc_path();
+	if (!path) {
+		fprintf(stderr, "Error allocing path\n");
+		return -ENOMEM;
+	}
+
+	key.objectid = bytenr;
+	key.type = BTRFS_EXTENT_ITEM_KEY;
+	key.offset = (u64)-1;
+
+again:
+	ret = btrfs_search_slot(NULL, root->fs_info->extent_root, &key, path,
+				0, 0);
+	if (ret < 0) {
+		fprintf(stderr, "Error looking up extent record %d\n", ret);
+		btrfs_free_path(path);
+		return ret;
+	} else if (ret) {
+		if (path->slots[0] > 0) {
+			path->slots[0]--;
+		} else {
+			ret = btrfs_prev_leaf(root, path);
+			if (ret < 0) {
+				goto out;
+			} else if (ret > 0) {
+				ret = 0;
+				goto out;
+			}
+		}
+	}
+
+	btrfs_item_key_to_cpu(path->nodes[0], &key, path->slots[0]);
+
+	/*
+	 * Block group items come before extent items if they have the same
+	 * bytenr, so walk back one more just in case.  Dear future traveler,
+	 * first congrats on mastering time travel.  Now if it's not too much
+	 * trouble could you go back to 2006 and tell Chris to make the
+	 * BLOCK_GROUP_ITEM_KEY (and BTRFS_*_REF_KEY) lower than the
+	 * EXTENT_ITEM_KEY please?
+	 */
 	while (key.type > BTRFS_EXTENT_ITEM_KEY) {
 		if (path->slots[0] > 0) {
 			path->slots[0]--;
@@ -5067,6 +6227,7 @@ static int check_csums(struct btrfs_root *root)
 	struct btrfs_key key;
 	u64 offset = 0, num_bytes = 0;
 	u16 csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
+	struct csum_verify cv;
 	int errors = 0;
 	int ret;
 	u64 data_len;
@@ -5086,11 +6247,18 @@ static int check_csums(struct btrfs_root *root)
 	if (!path)
 		return -ENOMEM;
 
+	if (check_data_csum) {
+		ret = csum_verify_init(&cv, root->fs_info);
+		if (ret) {
+			fprintf(stderr, "Error setting up csum verification\n");
+			goto out;
+		}
+	}
+
 	ret = btrfs_search_slot(NULL, root, &key, path, 0, 0);
 	if (ret < 0) {
 		fprintf(stderr, "Error searching csum tree %d\n", ret);
-		btrfs_free_path(path);
-		return ret;
+		goto out;
 	}
 
 	if (ret > 0 && path->slots[0])
@@ -5121,10 +6289,7 @@ static int check_csums(struct btrfs_root *root)
 		if (!check_data_csum)
 			goto skip_csum_check;
 		leaf_offset = btrfs_item_ptr_offset(leaf, path->slots[0]);
-		ret = check_extent_csums(root, key.offset, data_len,
-					 leaf_offset, leaf);
-		if (ret)
-			break;
+		csum_verify_add(&cv, key.offset, data_len, leaf, leaf_offset);
 skip_csum_check:
 		if (!num_bytes) {
 			offset = key.offset;
@@ -5142,9 +6307,15 @@ skip_csum_check:
 		num_bytes += data_len;
 		path->slots[0]++;
 	}
+	ret = errors;
 
+	if (check_data_csum)
+		csum_verify_finish(&cv);
+out:
+	if (check_data_csum)
+		csum_verify_release(&cv);
 	btrfs_free_path(path);
-	return errors;
+	return ret;
 }
 
 static int is_dropped_key(struct btrfs_key *key,
@@ -5312,6 +6483,9 @@ static int run_next_block(struct btrfs_trans_handle *trans,
 	int nritems;
 	struct btrfs_key key;
 	struct cache_extent *cache;
+	struct btrfs_reada_block *blocks;
+	u64 reada_len = 0;
+	int nr_blocks = 0;
 	int reada_bits;
 
 	nritems = pick_next_pending(pending, reada, nodes, *last, bits,
@@ -5319,21 +6493,33 @@ static int run_next_block(struct btrfs_trans_handle *trans,
 	if (nritems == 0)
 		return 1;
 
-	if (!reada_bits) {
-		for(i = 0; i < nritems; i++) {
-			ret = add_cache_extent(reada, bits[i].start,
-					       bits[i].size);
-			if (ret == -EEXIST)
-				continue;
-
-			/* fixme, get the parent transid */
-			readahead_tree_block(root, bits[i].start,
-					     bits[i].size, 0);
-		}
+	/*
+	 * Every block goes in the reada set as before, as that is the order
+	 * they are picked in, but only the ones within the window are read
+	 * ahead.
+	 */
+	blocks = reada_bits ? NULL : malloc(nritems * sizeof(*blocks));
+	for (i = 0; !reada_bits && i < nritems; i++) {
+		ret = add_cache_extent(reada, bits[i].start, bits[i].size);
+		if (ret == -EEXIST)
+			continue;
+		if (!blocks || nr_blocks >= reada_blocks ||
+		    reada_len + bits[i].size > reada_bytes)
+			continue;
+		blocks[nr_blocks].bytenr = bits[i].start;
+		blocks[nr_blocks].len = bits[i].size;
+		reada_len += bits[i].size;
+		nr_blocks++;
 	}
+	if (nr_blocks)
+		readahead_tree_blocks(root->fs_info, blocks, nr_blocks);
+	free(blocks);
+
 	*last = bits[0].start;
 	bytenr = bits[0].start;
 	size = bits[0].size;
+	btrfs_reada_account(root->fs_info, bytenr, size,
+			    reada_bits && reada_blocks);
 
 	cache = lookup_cache_extent(pending, bytenr, size);
 	if (cache) {
@@ -5373,9 +6559,8 @@ static int run_next_block(struct btrfs_trans_handle *trans,
 	 * backref mode.
 	 */
 	if (!init_extent_tree) {
-		ret = btrfs_lookup_extent_info(NULL, root, bytenr,
-				       btrfs_header_level(buf), 1, NULL,
-				       &flags);
+		ret = walk_extent_info(bytenr, btrfs_header_level(buf),
+				       NULL, &flags);
 		if (ret < 0)
 			goto out;
 	} else {
@@ -5638,6 +6823,7 @@ static int free_extent_hook(struct btrfs_trans_handle *trans,
 		if (!back->node.found_extent_tree && back->node.found_ref) {
 			list_del(&back->node.list);
 			free(back);
+			check_rec_del(CHECK_REC_EXTENT_BACKREF);
 		}
 	} else {
 		struct tree_backref *back;
@@ -5657,6 +6843,7 @@ static int free_extent_hook(struct btrfs_trans_handle *trans,
 		if (!back->node.found_extent_tree && back->node.found_ref) {
 			list_del(&back->node.list);
 			free(back);
+			check_rec_del(CHECK_REC_EXTENT_BACKREF);
 		}
 	}
 	maybe_free_extent_rec(extent_cache, rec);
@@ -6352,10 +7539,12 @@ static int process_duplicates(struct btrfs_root *root,
 		list_splice_init(&tmp->backrefs, &good->backrefs);
 		remove_cache_extent(extent_cache, &tmp->cache);
 		free(tmp);
+		check_rec_del(CHECK_REC_EXTENT);
 	}
 	ret = insert_cache_extent(extent_cache, &good->cache);
 	BUG_ON(ret);
 	free(rec);
+	check_rec_del(CHECK_REC_EXTENT);
 	return good->num_duplicates ? 0 : 1;
 }
 
@@ -6440,12 +7629,14 @@ out:
 		if (tmp == rec)
 			continue;
 		free(tmp);
+		check_rec_del(CHECK_REC_EXTENT);
 	}
 
 	while (!list_empty(&rec->dups)) {
 		tmp = list_entry(rec->dups.next, struct extent_record, list);
 		list_del_init(&tmp->list);
 		free(tmp);
+		check_rec_del(CHECK_REC_EXTENT);
 	}
 
 	btrfs_free_path(path);
@@ -6731,13 +7922,15 @@ static void reset_cached_block_groups(struct btrfs_fs_info *fs_info)
 	u64 start, end;
 	int ret;
 
+	/* the repairs may have made the on-disk space cache stale */
+	fs_info->ignore_space_cache = 1;
+
 	while (1) {
 		ret = find_first_extent_bit(&fs_info->free_space_cache, 0,
 					    &start, &end, EXTENT_DIRTY);
 		if (ret)
 			break;
-		clear_extent_dirty(&fs_info->free_space_cache, start, end,
-				   GFP_NOFS);
+		btrfs_clear_free_space(fs_info, start, end);
 	}
 
 	start = 0;
@@ -6883,6 +8076,7 @@ static int check_extent_refs(struct btrfs_trans_handle *trans,
 		remove_cache_extent(extent_cache, cache);
 		free_all_extent_backrefs(rec);
 		free(rec);
+		check_rec_del(CHECK_REC_EXTENT);
 	}
 repair_abort:
 	if (repair) {
@@ -7277,11 +8471,11 @@ static int check_chunks_and_extents(struct btrfs_root *root)
 	block_group_tree_init(&block_group_cache);
 	device_extent_tree_init(&dev_extent_cache);
 
-	cache_tree_init(&extent_cache);
-	cache_tree_init(&seen);
-	cache_tree_init(&pending);
-	cache_tree_init(&nodes);
-	cache_tree_init(&reada);
+	cache_tree_init_btree(&extent_cache);
+	cache_tree_init_btree(&seen);
+	cache_tree_init_btree(&pending);
+	cache_tree_init_btree(&nodes);
+	cache_tree_init_btree(&reada);
 	cache_tree_init(&corrupt_blocks);
 	INIT_LIST_HEAD(&dropping_trees);
 	INIT_LIST_HEAD(&normal_trees);
@@ -7443,126 +8637,2318 @@ out:
 	return ret;
 }
 
-static int btrfs_fsck_reinit_root(struct btrfs_trans_handle *trans,
-			   struct btrfs_root *root, int overwrite)
-{
-	struct extent_buffer *c;
-	struct extent_buffer *old = root->node;
-	int level;
-	int ret;
-	struct btrfs_disk_key disk_key = {0,0,0};
-
-	level = 0;
-
-	if (overwrite) {
-		c = old;
-		extent_buffer_get(c);
-		goto init;
-	}
-	c = btrfs_alloc_free_block(trans, root,
-				   btrfs_level_size(root, 0),
-				   root->root_key.objectid,
-				   &disk_key, level, 0, 0);
-	if (IS_ERR(c)) {
-		c = old;
-		extent_buffer_get(c);
-		overwrite = 1;
-	}
-init:
-	memset_extent_buffer(c, 0, 0, sizeof(struct btrfs_header));
-	btrfs_set_header_level(c, level);
-	btrfs_set_header_bytenr(c, c->start);
-	btrfs_set_header_generation(c, trans->transid);
-	btrfs_set_header_backref_rev(c, BTRFS_MIXED_BACKREF_REV);
-	btrfs_set_header_owner(c, root->root_key.objectid);
+/*
+ * Low memory mode.
+ *
+ * The original mode keeps a record of every extent, inode and root it
+ * has seen until it can cross-check them all, so its memory grows with
+ * the filesystem.  Here each extent item is checked against the trees
+ * that reference it with targeted searches, and each tree is walked once
+ * checking its blocks, inodes and file extents against the extent tree
+ * and against itself the same way.  Only a few paths are held at a time
+ * and what is read stays bounded by the node cache.
+ */
 
-	write_extent_buffer(c, root->fs_info->fsid,
-			    btrfs_header_fsid(), BTRFS_FSID_SIZE);
+/* the most a compressed extent holds once uncompressed */
+#define LOWMEM_MAX_UNCOMPRESSED		(128 * 1024)
 
-	write_extent_buffer(c, root->fs_info->chunk_tree_uuid,
-			    btrfs_header_chunk_tree_uuid(c),
-			    BTRFS_UUID_SIZE);
+static struct btrfs_root *lowmem_read_root(struct btrfs_fs_info *info,
+					   u64 objectid)
+{
+	struct btrfs_key key;
 
-	btrfs_mark_buffer_dirty(c);
-	/*
-	 * this case can happen in the following case:
-	 *
-	 * 1.overwrite previous root.
-	 *
-	 * 2.reinit reloc data root, this is because we skip pin
-	 * down reloc data tree before which means we can allocate
-	 * same block bytenr here.
-	 */
-	if (old->start == c->start) {
-		btrfs_set_root_generation(&root->root_item,
-					  trans->transid);
-		root->root_item.level = btrfs_header_level(root->node);
-		ret = btrfs_update_root(trans, root->fs_info->tree_root,
-					&root->root_key, &root->root_item);
-		if (ret) {
-			free_extent_buffer(c);
-			return ret;
-		}
-	}
-	free_extent_buffer(old);
-	root->node = c;
-	add_root_to_dirty_list(root);
-	return 0;
+	key.objectid = objectid;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = (u64)-1;
+	return btrfs_read_fs_root(info, &key);
 }
 
-static int pin_down_tree_blocks(struct btrfs_fs_info *fs_info,
-				struct extent_buffer *eb, int tree_root)
+/* does the tree of @root_id reach @eb by the keys leading to it */
+static int lowmem_tree_reaches(struct btrfs_fs_info *info, u64 root_id,
+			       struct extent_buffer *eb)
 {
-	struct extent_buffer *tmp;
-	struct btrfs_root_item *ri;
+	struct btrfs_root *root;
+	struct btrfs_path path;
 	struct btrfs_key key;
-	u64 bytenr;
-	u32 leafsize;
 	int level = btrfs_header_level(eb);
-	int nritems;
 	int ret;
-	int i;
 
-	/*
-	 * If we have pinned this block before, don't pin it again.
-	 * This can not only avoid forever loop with broken filesystem
-	 * but also give us some speedups.
-	 */
-	if (test_range_bit(&fs_info->pinned_extents, eb->start,
-			   eb->start + eb->len - 1, EXTENT_DIRTY, 0))
+	/* relocation and log trees come and go, trust their refs */
+	if (root_id == BTRFS_TREE_RELOC_OBJECTID ||
+	    root_id == BTRFS_TREE_LOG_OBJECTID)
+		return 1;
+	root = lowmem_read_root(info, root_id);
+	if (IS_ERR(root) || !root || !extent_buffer_uptodate(root->node))
+		return 0;
+	/* a dead root is dropped a bit at a time, its refs go with it */
+	if (is_fstree(root_id) && btrfs_root_refs(&root->root_item) == 0)
+		return 1;
+	if (btrfs_header_level(root->node) <= level)
+		return root->node->start == eb->start;
+	if (!btrfs_header_nritems(eb))
 		return 0;
 
-	btrfs_pin_extent(fs_info, eb->start, eb->len);
+	if (level)
+		btrfs_node_key_to_cpu(eb, &key, 0);
+	else
+		btrfs_item_key_to_cpu(eb, &key, 0);
+	btrfs_init_path(&path);
+	path.lowest_level = level;
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	ret = ret >= 0 && path.nodes[level] &&
+	      path.nodes[level]->start == eb->start;
+	btrfs_release_path(&path);
+	return ret;
+}
 
-	leafsize = btrfs_super_leafsize(fs_info->super_copy);
-	nritems = btrfs_header_nritems(eb);
-	for (i = 0; i < nritems; i++) {
-		if (level == 0) {
-			btrfs_item_key_to_cpu(eb, &key, i);
-			if (key.type != BTRFS_ROOT_ITEM_KEY)
-				continue;
-			/* Skip the extent root and reloc roots */
-			if (key.objectid == BTRFS_EXTENT_TREE_OBJECTID ||
-			    key.objectid == BTRFS_TREE_RELOC_OBJECTID ||
-			    key.objectid == BTRFS_DATA_RELOC_TREE_OBJECTID)
-				continue;
-			ri = btrfs_item_ptr(eb, i, struct btrfs_root_item);
-			bytenr = btrfs_disk_root_bytenr(eb, ri);
+/* does the node at @parent point to @eb */
+static int lowmem_parent_points_to(struct btrfs_fs_info *info, u64 parent,
+				   struct extent_buffer *eb)
+{
+	struct extent_buffer *node;
+	u32 nritems;
+	int found = 0;
+	int i;
 
-			/*
-			 * If at any point we start needing the real root we
-			 * will have to build a stump root for the root we are
-			 * in, but for now this doesn't actually use the root so
-			 * just pass in extent_root.
-			 */
-			tmp = read_tree_block(fs_info->extent_root, bytenr,
-					      leafsize, 0);
-			if (!tmp) {
-				fprintf(stderr, "Error reading root block\n");
-				return -EIO;
-			}
-			ret = pin_down_tree_blocks(fs_info, tmp, 0);
-			free_extent_buffer(tmp);
+	node = read_tree_block(info->tree_root, parent,
+			       info->tree_root->nodesize, 0);
+	if (!extent_buffer_uptodate(node))
+		goto out;
+	if (btrfs_header_level(node) != btrfs_header_level(eb) + 1)
+		goto out;
+	nritems = btrfs_header_nritems(node);
+	for (i = 0; i < nritems && !found; i++)
+		found = btrfs_node_blockptr(node, i) == eb->start;
+out:
+	free_extent_buffer(node);
+	return found;
+}
+
+/*
+ * File extents of @root_id's inode @ino at file offset @offset (the
+ * offset the data extent starts at in the file) pointing to @bytenr, in
+ * leaves owned by @root_id.  Returns 1 if the root can't be counted.
+ */
+static int lowmem_count_file_refs(struct btrfs_fs_info *info, u64 root_id,
+				  u64 ino, u64 offset, u64 bytenr, u64 len,
+				  u64 *found)
+{
+	struct btrfs_root *root;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	struct btrfs_file_extent_item *fi;
+	struct extent_buffer *leaf;
+	u64 limit;
+	int ret;
+
+	*found = 0;
+	if (root_id == BTRFS_TREE_RELOC_OBJECTID)
+		return 1;
+	root = lowmem_read_root(info, root_id);
+	if (IS_ERR(root) || !root)
+		return -ENOENT;
+	if (btrfs_root_refs(&root->root_item) == 0)
+		return 1;
+
+	/*
+	 * Every file extent using the data extent starts within it, or
+	 * within the uncompressed size for a compressed one.
+	 */
+	limit = offset + max_t(u64, len, LOWMEM_MAX_UNCOMPRESSED);
+	key.objectid = ino;
+	key.type = BTRFS_EXTENT_DATA_KEY;
+	key.offset = offset;
+	btrfs_init_path(&path);
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	while (1) {
+		leaf = path.nodes[0];
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(root, &path);
+			if (ret)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		if (key.objectid != ino || key.type != BTRFS_EXTENT_DATA_KEY ||
+		    key.offset >= limit)
+			break;
+		fi = btrfs_item_ptr(leaf, path.slots[0],
+				    struct btrfs_file_extent_item);
+		if (btrfs_header_owner(leaf) == root_id &&
+		    btrfs_file_extent_type(leaf, fi) !=
+		    BTRFS_FILE_EXTENT_INLINE &&
+		    btrfs_file_extent_disk_bytenr(leaf, fi) == bytenr &&
+		    key.offset == offset + btrfs_file_extent_offset(leaf, fi))
+			(*found)++;
+		path.slots[0]++;
+	}
+out:
+	btrfs_release_path(&path);
+	return ret < 0 ? ret : 0;
+}
+
+/* file extents in the leaf at @parent pointing to @bytenr */
+static u64 lowmem_count_leaf_refs(struct btrfs_fs_info *info, u64 parent,
+				  u64 bytenr)
+{
+	struct extent_buffer *leaf;
+	struct btrfs_file_extent_item *fi;
+	struct btrfs_key key;
+	u64 found = 0;
+	u32 nritems;
+	int i;
+
+	leaf = read_tree_block(info->tree_root, parent,
+			       info->tree_root->leafsize, 0);
+	if (!extent_buffer_uptodate(leaf) || btrfs_header_level(leaf))
+		goto out;
+	nritems = btrfs_header_nritems(leaf);
+	for (i = 0; i < nritems; i++) {
+		btrfs_item_key_to_cpu(leaf, &key, i);
+		if (key.type != BTRFS_EXTENT_DATA_KEY)
+			continue;
+		fi = btrfs_item_ptr(leaf, i, struct btrfs_file_extent_item);
+		if (btrfs_file_extent_type(leaf, fi) ==
+		    BTRFS_FILE_EXTENT_INLINE)
+			continue;
+		if (btrfs_file_extent_disk_bytenr(leaf, fi) == bytenr)
+			found++;
+	}
+out:
+	free_extent_buffer(leaf);
+	return found;
+}
+
+/* the extent item being checked and what its backrefs add up to */
+struct lowmem_extent {
+	u64 bytenr;
+	u64 len;
+	u64 refs;
+	u64 found;
+	int metadata;
+	int level;
+	/* the tree block, if it could be read */
+	struct extent_buffer *eb;
+};
+
+static int lowmem_check_backref(struct btrfs_fs_info *info,
+				struct lowmem_extent *ext, int type,
+				u64 offset, u64 owner, u64 owner_offset,
+				u64 count)
+{
+	u64 found;
+	int ret;
+
+	switch (type) {
+	case BTRFS_TREE_BLOCK_REF_KEY:
+	case BTRFS_SHARED_BLOCK_REF_KEY:
+		ext->found++;
+		if (!ext->metadata) {
+			fprintf(stderr,
+				"data extent %llu has a tree block backref\n",
+				(unsigned long long)ext->bytenr);
+			return 1;
+		}
+		if (!ext->eb)
+			return 0;
+		if (type == BTRFS_TREE_BLOCK_REF_KEY) {
+			if (lowmem_tree_reaches(info, offset, ext->eb))
+				return 0;
+			fprintf(stderr,
+				"Backref %llu root %llu not referenced back\n",
+				(unsigned long long)ext->bytenr,
+				(unsigned long long)offset);
+			return 1;
+		}
+		if (lowmem_parent_points_to(info, offset, ext->eb))
+			return 0;
+		fprintf(stderr,
+			"Backref %llu parent %llu not referenced back\n",
+			(unsigned long long)ext->bytenr,
+			(unsigned long long)offset);
+		return 1;
+	case BTRFS_EXTENT_DATA_REF_KEY:
+	case BTRFS_SHARED_DATA_REF_KEY:
+		ext->found += count;
+		if (ext->metadata) {
+			fprintf(stderr,
+				"tree block %llu has a data backref\n",
+				(unsigned long long)ext->bytenr);
+			return 1;
+		}
+		if (type == BTRFS_SHARED_DATA_REF_KEY) {
+			found = lowmem_count_leaf_refs(info, offset,
+						       ext->bytenr);
+			if (found == count)
+				return 0;
+			fprintf(stderr,
+				"Incorrect local backref count on %llu parent %llu found %llu wanted %llu\n",
+				(unsigned long long)ext->bytenr,
+				(unsigned long long)offset,
+				(unsigned long long)found,
+				(unsigned long long)count);
+			return 1;
+		}
+		ret = lowmem_count_file_refs(info, offset, owner,
+					     owner_offset, ext->bytenr,
+					     ext->len, &found);
+		if (ret == -ENOENT) {
+			fprintf(stderr,
+				"Backref %llu root %llu: root not found\n",
+				(unsigned long long)ext->bytenr,
+				(unsigned long long)offset);
+			return 1;
+		}
+		if (ret)
+			return ret < 0;
+		if (found == count)
+			return 0;
+		fprintf(stderr,
+			"Incorrect local backref count on %llu root %llu owner %llu offset %llu found %llu wanted %llu\n",
+			(unsigned long long)ext->bytenr,
+			(unsigned long long)offset,
+			(unsigned long long)owner,
+			(unsigned long long)owner_offset,
+			(unsigned long long)found,
+			(unsigned long long)count);
+		return 1;
+	default:
+		fprintf(stderr, "corrupt extent record: key %llu %u %llu\n",
+			(unsigned long long)ext->bytenr, type,
+			(unsigned long long)ext->len);
+		return 1;
+	}
+}
+
+/* check the tree block behind a metadata extent item and count it */
+static int lowmem_read_extent_block(struct btrfs_fs_info *info,
+				    struct lowmem_extent *ext)
+{
+	struct btrfs_root *root = info->tree_root;
+	struct extent_buffer *eb;
+	enum btrfs_tree_block_status status;
+	u64 owner;
+	u32 nritems;
+	int err = 0;
+
+	eb = read_tree_block(root, ext->bytenr, ext->len, 0);
+	if (!extent_buffer_uptodate(eb)) {
+		fprintf(stderr, "tree block %llu can't be read\n",
+			(unsigned long long)ext->bytenr);
+		free_extent_buffer(eb);
+		return 1;
+	}
+	if (btrfs_header_level(eb) != ext->level) {
+		fprintf(stderr,
+			"tree block %llu level %d doesn't match extent item level %d\n",
+			(unsigned long long)ext->bytenr,
+			btrfs_header_level(eb), ext->level);
+		err = 1;
+	}
+	if (btrfs_is_leaf(eb))
+		status = btrfs_check_leaf(root, NULL, eb);
+	else
+		status = btrfs_check_node(root, NULL, eb);
+	if (status != BTRFS_TREE_BLOCK_CLEAN) {
+		fprintf(stderr, "tree block %llu is corrupted\n",
+			(unsigned long long)ext->bytenr);
+		free_extent_buffer(eb);
+		return 1;
+	}
+
+	/* the same numbers the original mode gathers in run_next_block */
+	nritems = btrfs_header_nritems(eb);
+	owner = btrfs_header_owner(eb);
+	if (btrfs_is_leaf(eb)) {
+		struct btrfs_file_extent_item *fi;
+		struct btrfs_key key;
+		int i;
+
+		btree_space_waste += btrfs_leaf_free_space(root, eb);
+		for (i = 0; i < nritems; i++) {
+			btrfs_item_key_to_cpu(eb, &key, i);
+			if (key.type == BTRFS_EXTENT_CSUM_KEY) {
+				total_csum_bytes += btrfs_item_size_nr(eb, i);
+				continue;
+			}
+			if (key.type != BTRFS_EXTENT_DATA_KEY)
+				continue;
+			fi = btrfs_item_ptr(eb, i,
+					    struct btrfs_file_extent_item);
+			if (btrfs_file_extent_type(eb, fi) ==
+			    BTRFS_FILE_EXTENT_INLINE ||
+			    btrfs_file_extent_disk_bytenr(eb, fi) == 0)
+				continue;
+			data_bytes_allocated +=
+				btrfs_file_extent_disk_num_bytes(eb, fi);
+			data_bytes_referenced +=
+				btrfs_file_extent_num_bytes(eb, fi);
+		}
+	} else {
+		btree_space_waste += (BTRFS_NODEPTRS_PER_BLOCK(root) -
+				      nritems) * sizeof(struct btrfs_key_ptr);
+	}
+	total_btree_bytes += eb->len;
+	if (fs_root_objectid(owner))
+		total_fs_tree_bytes += eb->len;
+	if (owner == BTRFS_EXTENT_TREE_OBJECTID)
+		total_extent_tree_bytes += eb->len;
+	if (!found_old_backref && owner == BTRFS_TREE_RELOC_OBJECTID &&
+	    btrfs_header_backref_rev(eb) == BTRFS_MIXED_BACKREF_REV &&
+	    !btrfs_header_flag(eb, BTRFS_HEADER_FLAG_RELOC))
+		found_old_backref = 1;
+
+	ext->eb = eb;
+	return err;
+}
+
+/* start checking the extent item at @slot, including its inline refs */
+static int lowmem_extent_item(struct btrfs_fs_info *info,
+			      struct lowmem_extent *ext,
+			      struct extent_buffer *leaf, int slot,
+			      struct btrfs_key *key)
+{
+	struct btrfs_extent_item *ei;
+	struct btrfs_extent_inline_ref *iref;
+	struct btrfs_extent_data_ref *dref;
+	struct btrfs_shared_data_ref *sref;
+	u32 item_size = btrfs_item_size_nr(leaf, slot);
+	unsigned long ptr;
+	unsigned long end;
+	u64 flags;
+	int type;
+	int err = 0;
+
+	memset(ext, 0, sizeof(*ext));
+	ext->bytenr = key->objectid;
+	if (key->type == BTRFS_METADATA_ITEM_KEY) {
+		ext->len = info->extent_root->leafsize;
+		ext->level = key->offset;
+	} else {
+		ext->len = key->offset;
+	}
+	bytes_used += ext->len;
+
+	if (item_size < sizeof(*ei)) {
+		fprintf(stderr, "extent item %llu uses the old format\n",
+			(unsigned long long)ext->bytenr);
+		found_old_backref = 1;
+		return 1;
+	}
+	ei = btrfs_item_ptr(leaf, slot, struct btrfs_extent_item);
+	ext->refs = btrfs_extent_refs(leaf, ei);
+	flags = btrfs_extent_flags(leaf, ei);
+	ext->metadata = !!(flags & BTRFS_EXTENT_FLAG_TREE_BLOCK);
+	if (key->type == BTRFS_METADATA_ITEM_KEY && !ext->metadata) {
+		fprintf(stderr, "metadata item %llu isn't a tree block\n",
+			(unsigned long long)ext->bytenr);
+		err = 1;
+		ext->metadata = 1;
+	}
+
+	ptr = (unsigned long)(ei + 1);
+	if (ext->metadata && key->type == BTRFS_EXTENT_ITEM_KEY) {
+		struct btrfs_tree_block_info *info_item;
+
+		info_item = (struct btrfs_tree_block_info *)ptr;
+		ext->level = btrfs_tree_block_level(leaf, info_item);
+		ptr += sizeof(*info_item);
+	}
+	if (ext->metadata)
+		err |= lowmem_read_extent_block(info, ext);
+
+	end = (unsigned long)ei + item_size;
+	while (ptr < end) {
+		iref = (struct btrfs_extent_inline_ref *)ptr;
+		type = btrfs_extent_inline_ref_type(leaf, iref);
+		switch (type) {
+		case BTRFS_EXTENT_DATA_REF_KEY:
+			dref = (struct btrfs_extent_data_ref *)(&iref->offset);
+			err |= lowmem_check_backref(info, ext, type,
+				btrfs_extent_data_ref_root(leaf, dref),
+				btrfs_extent_data_ref_objectid(leaf, dref),
+				btrfs_extent_data_ref_offset(leaf, dref),
+				btrfs_extent_data_ref_count(leaf, dref));
+			break;
+		case BTRFS_SHARED_DATA_REF_KEY:
+			sref = (struct btrfs_shared_data_ref *)(iref + 1);
+			err |= lowmem_check_backref(info, ext, type,
+				btrfs_extent_inline_ref_offset(leaf, iref), 0, 0,
+				btrfs_shared_data_ref_count(leaf, sref));
+			break;
+		case BTRFS_TREE_BLOCK_REF_KEY:
+		case BTRFS_SHARED_BLOCK_REF_KEY:
+			err |= lowmem_check_backref(info, ext, type,
+				btrfs_extent_inline_ref_offset(leaf, iref), 0, 0,
+				1);
+			break;
+		default:
+			lowmem_check_backref(info, ext, type, 0, 0, 0, 0);
+			return 1;
+		}
+		ptr += btrfs_extent_inline_ref_size(type);
+	}
+	return err;
+}
+
+/* a keyed backref item following the extent item */
+static int lowmem_keyed_backref(struct btrfs_fs_info *info,
+				struct lowmem_extent *ext,
+				struct extent_buffer *leaf, int slot,
+				struct btrfs_key *key)
+{
+	struct btrfs_extent_data_ref *dref;
+	struct btrfs_shared_data_ref *sref;
+
+	if (!ext || key->objectid != ext->bytenr) {
+		fprintf(stderr,
+			"backref [%llu %u %llu] has no extent item\n",
+			(unsigned long long)key->objectid, key->type,
+			(unsigned long long)key->offset);
+		return 1;
+	}
+	switch (key->type) {
+	case BTRFS_EXTENT_DATA_REF_KEY:
+		dref = btrfs_item_ptr(leaf, slot, struct btrfs_extent_data_ref);
+		return lowmem_check_backref(info, ext, key->type,
+				btrfs_extent_data_ref_root(leaf, dref),
+				btrfs_extent_data_ref_objectid(leaf, dref),
+				btrfs_extent_data_ref_offset(leaf, dref),
+				btrfs_extent_data_ref_count(leaf, dref));
+	case BTRFS_SHARED_DATA_REF_KEY:
+		sref = btrfs_item_ptr(leaf, slot, struct btrfs_shared_data_ref);
+		return lowmem_check_backref(info, ext, key->type, key->offset,
+				0, 0, btrfs_shared_data_ref_count(leaf, sref));
+	default:
+		return lowmem_check_backref(info, ext, key->type, key->offset,
+					    0, 0, 1);
+	}
+}
+
+static int lowmem_finish_extent(struct lowmem_extent *ext)
+{
+	int err = 0;
+
+	if (ext->found != ext->refs) {
+		fprintf(stderr,
+			"ref mismatch on [%llu %llu] extent item %llu, found %llu\n",
+			(unsigned long long)ext->bytenr,
+			(unsigned long long)ext->len,
+			(unsigned long long)ext->refs,
+			(unsigned long long)ext->found);
+		err = 1;
+	}
+	free_extent_buffer(ext->eb);
+	ext->eb = NULL;
+	return err;
+}
+
+/* block groups are followed along with the extent items, in bytenr order */
+struct lowmem_bg_walk {
+	struct btrfs_fs_info *info;
+	struct btrfs_block_group_cache *cache;
+	u64 used;
+	u64 last_end;
+	int errors;
+};
+
+static struct btrfs_block_group_cache *
+lowmem_bg_seek(struct lowmem_bg_walk *w, u64 bytenr)
+{
+	struct btrfs_block_group_cache *cache = w->cache;
+	u64 end;
+
+	while (cache && cache->key.objectid + cache->key.offset <= bytenr) {
+		if (btrfs_block_group_used(&cache->item) != w->used) {
+			fprintf(stderr,
+				"block group [%llu %llu] used %llu but extent items used %llu\n",
+				(unsigned long long)cache->key.objectid,
+				(unsigned long long)cache->key.offset,
+				(unsigned long long)
+				btrfs_block_group_used(&cache->item),
+				(unsigned long long)w->used);
+			w->errors++;
+		}
+		end = cache->key.objectid + cache->key.offset;
+		w->used = 0;
+		cache = btrfs_lookup_first_block_group(w->info, end);
+	}
+	w->cache = cache;
+	if (cache && cache->key.objectid <= bytenr)
+		return cache;
+	return NULL;
+}
+
+static void lowmem_bg_account(struct lowmem_bg_walk *w,
+			      struct lowmem_extent *ext)
+{
+	struct btrfs_block_group_cache *cache;
+
+	if (ext->bytenr < w->last_end) {
+		fprintf(stderr, "extent [%llu %llu] overlaps the one before\n",
+			(unsigned long long)ext->bytenr,
+			(unsigned long long)ext->len);
+		w->errors++;
+	}
+	w->last_end = ext->bytenr + ext->len;
+
+	cache = lowmem_bg_seek(w, ext->bytenr);
+	if (!cache || ext->bytenr + ext->len >
+	    cache->key.objectid + cache->key.offset) {
+		fprintf(stderr,
+			"extent [%llu %llu] isn't inside a block group\n",
+			(unsigned long long)ext->bytenr,
+			(unsigned long long)ext->len);
+		w->errors++;
+		return;
+	}
+	w->used += ext->len;
+}
+
+/* the chunk at @offset, with a stripe on @devid at @physical if given */
+static int lowmem_find_chunk(struct btrfs_fs_info *info, u64 offset,
+			     u64 length, u64 type, u64 devid, u64 physical)
+{
+	struct btrfs_path path;
+	struct btrfs_key key;
+	struct btrfs_chunk *chunk;
+	struct extent_buffer *leaf;
+	int found = 0;
+	int i;
+
+	key.objectid = BTRFS_FIRST_CHUNK_TREE_OBJECTID;
+	key.type = BTRFS_CHUNK_ITEM_KEY;
+	key.offset = offset;
+	btrfs_init_path(&path);
+	if (btrfs_search_slot(NULL, info->chunk_root, &key, &path, 0, 0))
+		goto out;
+	leaf = path.nodes[0];
+	chunk = btrfs_item_ptr(leaf, path.slots[0], struct btrfs_chunk);
+	if (length && btrfs_chunk_length(leaf, chunk) != length)
+		goto out;
+	if (type && btrfs_chunk_type(leaf, chunk) != type)
+		goto out;
+	if (!devid) {
+		found = 1;
+		goto out;
+	}
+	for (i = 0; i < btrfs_chunk_num_stripes(leaf, chunk); i++) {
+		if (btrfs_stripe_devid_nr(leaf, chunk, i) == devid &&
+		    btrfs_stripe_offset_nr(leaf, chunk, i) == physical) {
+			found = 1;
+			break;
+		}
+	}
+out:
+	btrfs_release_path(&path);
+	return found;
+}
+
+/* check a chunk against its block group item and dev extents */
+static int lowmem_check_chunk(struct btrfs_fs_info *info,
+			      struct extent_buffer *leaf, int slot,
+			      struct btrfs_key *key)
+{
+	struct btrfs_chunk *chunk;
+	struct btrfs_block_group_item *bi;
+	struct btrfs_dev_extent *de;
+	struct btrfs_path path;
+	struct btrfs_key bg_key;
+	struct btrfs_key dev_key;
+	u64 length;
+	u64 type;
+	u64 stripe_len;
+	int num_stripes;
+	int err = 0;
+	int ret;
+	int i;
+
+	chunk = btrfs_item_ptr(leaf, slot, struct btrfs_chunk);
+	length = btrfs_chunk_length(leaf, chunk);
+	type = btrfs_chunk_type(leaf, chunk);
+	num_stripes = btrfs_chunk_num_stripes(leaf, chunk);
+
+	bg_key.objectid = key->offset;
+	bg_key.type = BTRFS_BLOCK_GROUP_ITEM_KEY;
+	bg_key.offset = length;
+	btrfs_init_path(&path);
+	ret = btrfs_search_slot(NULL, info->extent_root, &bg_key, &path, 0, 0);
+	if (ret) {
+		fprintf(stderr,
+			"Chunk[%llu, %u, %llu]: length(%llu), offset(%llu), type(%llu) is not found in block group\n",
+			(unsigned long long)key->objectid, key->type,
+			(unsigned long long)key->offset,
+			(unsigned long long)length,
+			(unsigned long long)key->offset,
+			(unsigned long long)type);
+		err = 1;
+	} else {
+		bi = btrfs_item_ptr(path.nodes[0], path.slots[0],
+				    struct btrfs_block_group_item);
+		if (btrfs_disk_block_group_flags(path.nodes[0], bi) != type) {
+			fprintf(stderr,
+				"Chunk[%llu, %u, %llu]: type(%llu) mismatch with block group flags(%llu)\n",
+				(unsigned long long)key->objectid, key->type,
+				(unsigned long long)key->offset,
+				(unsigned long long)type,
+				(unsigned long long)
+				btrfs_disk_block_group_flags(path.nodes[0], bi));
+			err = 1;
+		}
+	}
+	btrfs_release_path(&path);
+
+	stripe_len = calc_stripe_length(type, length, num_stripes);
+	for (i = 0; i < num_stripes; i++) {
+		dev_key.objectid = btrfs_stripe_devid_nr(leaf, chunk, i);
+		dev_key.type = BTRFS_DEV_EXTENT_KEY;
+		dev_key.offset = btrfs_stripe_offset_nr(leaf, chunk, i);
+		ret = btrfs_search_slot(NULL, info->dev_root, &dev_key,
+					&path, 0, 0);
+		if (ret) {
+			fprintf(stderr,
+				"Chunk[%llu, %u, %llu] stripe[%llu, %llu] is not found in dev extent\n",
+				(unsigned long long)key->objectid, key->type,
+				(unsigned long long)key->offset,
+				(unsigned long long)dev_key.objectid,
+				(unsigned long long)dev_key.offset);
+			err = 1;
+			btrfs_release_path(&path);
+			continue;
+		}
+		de = btrfs_item_ptr(path.nodes[0], path.slots[0],
+				    struct btrfs_dev_extent);
+		if (btrfs_dev_extent_chunk_offset(path.nodes[0], de) !=
+		    key->offset ||
+		    btrfs_dev_extent_length(path.nodes[0], de) != stripe_len) {
+			fprintf(stderr,
+				"Chunk[%llu, %u, %llu] stripe[%llu, %llu] dismatch dev extent[%llu, %llu, %llu]\n",
+				(unsigned long long)key->objectid, key->type,
+				(unsigned long long)key->offset,
+				(unsigned long long)dev_key.objectid,
+				(unsigned long long)dev_key.offset,
+				(unsigned long long)dev_key.objectid,
+				(unsigned long long)dev_key.offset,
+				(unsigned long long)
+				btrfs_dev_extent_length(path.nodes[0], de));
+			err = 1;
+		}
+		btrfs_release_path(&path);
+	}
+	return err;
+}
+
+/* the dev extents of a device add up to what its dev item says is used */
+static int lowmem_check_dev_item(struct btrfs_fs_info *info,
+				 struct extent_buffer *leaf, int slot,
+				 struct btrfs_key *key)
+{
+	struct btrfs_dev_item *dev_item;
+	struct btrfs_dev_extent *de;
+	struct btrfs_path path;
+	struct btrfs_key dev_key;
+	u64 devid;
+	u64 total = 0;
+	u64 used;
+	int ret;
+
+	dev_item = btrfs_item_ptr(leaf, slot, struct btrfs_dev_item);
+	devid = btrfs_device_id(leaf, dev_item);
+	used = btrfs_device_bytes_used(leaf, dev_item);
+
+	dev_key.objectid = devid;
+	dev_key.type = BTRFS_DEV_EXTENT_KEY;
+	dev_key.offset = 0;
+	btrfs_init_path(&path);
+	ret = btrfs_search_slot(NULL, info->dev_root, &dev_key, &path, 0, 0);
+	while (ret >= 0) {
+		if (path.slots[0] >= btrfs_header_nritems(path.nodes[0])) {
+			ret = btrfs_next_leaf(info->dev_root, &path);
+			if (ret)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(path.nodes[0], &dev_key, path.slots[0]);
+		if (dev_key.objectid != devid ||
+		    dev_key.type != BTRFS_DEV_EXTENT_KEY)
+			break;
+		de = btrfs_item_ptr(path.nodes[0], path.slots[0],
+				    struct btrfs_dev_extent);
+		total += btrfs_dev_extent_length(path.nodes[0], de);
+		path.slots[0]++;
+	}
+	btrfs_release_path(&path);
+
+	if (total != used) {
+		fprintf(stderr,
+			"Dev extent's total-byte(%llu) is not equal to byte-used(%llu) in dev[%llu, %u, %llu]\n",
+			(unsigned long long)total, (unsigned long long)used,
+			(unsigned long long)key->objectid, key->type,
+			(unsigned long long)key->offset);
+		return 1;
+	}
+	return 0;
+}
+
+static int lowmem_check_chunk_tree(struct btrfs_fs_info *info)
+{
+	struct btrfs_root *root = info->chunk_root;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int err = 0;
+	int ret;
+
+	key.objectid = 0;
+	key.type = 0;
+	key.offset = 0;
+	btrfs_init_path(&path);
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	while (ret >= 0) {
+		if (path.slots[0] >= btrfs_header_nritems(path.nodes[0])) {
+			ret = btrfs_next_leaf(root, &path);
+			if (ret)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
+		if (key.type == BTRFS_CHUNK_ITEM_KEY)
+			err |= lowmem_check_chunk(info, path.nodes[0],
+						  path.slots[0], &key);
+		else if (key.type == BTRFS_DEV_ITEM_KEY)
+			err |= lowmem_check_dev_item(info, path.nodes[0],
+						     path.slots[0], &key);
+		path.slots[0]++;
+	}
+	btrfs_release_path(&path);
+	return err || ret < 0;
+}
+
+static int lowmem_check_dev_tree(struct btrfs_fs_info *info)
+{
+	struct btrfs_root *root = info->dev_root;
+	struct btrfs_dev_extent *de;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int err = 0;
+	int ret;
+
+	key.objectid = 0;
+	key.type = BTRFS_DEV_EXTENT_KEY;
+	key.offset = 0;
+	btrfs_init_path(&path);
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	while (ret >= 0) {
+		if (path.slots[0] >= btrfs_header_nritems(path.nodes[0])) {
+			ret = btrfs_next_leaf(root, &path);
+			if (ret)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
+		if (key.type != BTRFS_DEV_EXTENT_KEY) {
+			path.slots[0]++;
+			continue;
+		}
+		de = btrfs_item_ptr(path.nodes[0], path.slots[0],
+				    struct btrfs_dev_extent);
+		if (!lowmem_find_chunk(info,
+				btrfs_dev_extent_chunk_offset(path.nodes[0], de),
+				0, 0, key.objectid, key.offset)) {
+			fprintf(stderr,
+				"Device extent[%llu, %llu, %llu] didn't find the relative chunk.\n",
+				(unsigned long long)key.objectid,
+				(unsigned long long)key.offset,
+				(unsigned long long)
+				btrfs_dev_extent_length(path.nodes[0], de));
+			err = 1;
+		}
+		path.slots[0]++;
+	}
+	btrfs_release_path(&path);
+	return err || ret < 0;
+}
+
+/*
+ * Is the block at @level of @path referenced from the extent tree by
+ * the root being walked, the owner of its parent or the parent itself.
+ */
+static int lowmem_check_block_backref(struct btrfs_root *root,
+				      struct btrfs_path *path, int level)
+{
+	struct btrfs_tree_cursor *cur = &extent_cursor;
+	struct extent_buffer *eb = path->nodes[level];
+	struct extent_buffer *parent = NULL;
+	struct extent_buffer *leaf;
+	struct btrfs_extent_item *ei;
+	struct btrfs_extent_inline_ref *iref;
+	struct btrfs_key key;
+	unsigned long ptr;
+	unsigned long end;
+	u64 candidates[3];
+	u64 offset;
+	int type;
+	int i;
+
+	if (level + 1 < BTRFS_MAX_LEVEL)
+		parent = path->nodes[level + 1];
+	candidates[0] = root->root_key.objectid;
+	candidates[1] = btrfs_header_owner(eb);
+	candidates[2] = parent ? btrfs_header_owner(parent) : candidates[0];
+
+	key.objectid = eb->start;
+	key.type = BTRFS_METADATA_ITEM_KEY;
+	key.offset = level;
+	if (!btrfs_fs_incompat(root->fs_info,
+			       BTRFS_FEATURE_INCOMPAT_SKINNY_METADATA) ||
+	    btrfs_tree_cursor_seek(cur, &key)) {
+		key.type = BTRFS_EXTENT_ITEM_KEY;
+		key.offset = eb->len;
+		if (btrfs_tree_cursor_seek(cur, &key)) {
+			fprintf(stderr,
+				"tree block %llu in root %llu has no extent item\n",
+				(unsigned long long)eb->start,
+				(unsigned long long)root->root_key.objectid);
+			return 1;
+		}
+	}
+
+	leaf = cur->path.nodes[0];
+	ei = btrfs_item_ptr(leaf, cur->path.slots[0], struct btrfs_extent_item);
+	if (btrfs_item_size_nr(leaf, cur->path.slots[0]) < sizeof(*ei))
+		return 0;
+	ptr = (unsigned long)(ei + 1);
+	if (key.type == BTRFS_EXTENT_ITEM_KEY)
+		ptr += sizeof(struct btrfs_tree_block_info);
+	end = (unsigned long)ei + btrfs_item_size_nr(leaf, cur->path.slots[0]);
+	while (ptr < end) {
+		iref = (struct btrfs_extent_inline_ref *)ptr;
+		type = btrfs_extent_inline_ref_type(leaf, iref);
+		offset = btrfs_extent_inline_ref_offset(leaf, iref);
+		if (type == BTRFS_SHARED_BLOCK_REF_KEY && parent &&
+		    offset == parent->start)
+			return 0;
+		if (type == BTRFS_TREE_BLOCK_REF_KEY) {
+			for (i = 0; i < 3; i++)
+				if (offset == candidates[i])
+					return 0;
+		}
+		if (type != BTRFS_TREE_BLOCK_REF_KEY &&
+		    type != BTRFS_SHARED_BLOCK_REF_KEY)
+			break;
+		ptr += btrfs_extent_inline_ref_size(type);
+	}
+
+	key.objectid = eb->start;
+	key.type = BTRFS_TREE_BLOCK_REF_KEY;
+	for (i = 0; i < 3; i++) {
+		key.offset = candidates[i];
+		if (!btrfs_tree_cursor_seek(cur, &key))
+			return 0;
+	}
+	if (parent) {
+		key.type = BTRFS_SHARED_BLOCK_REF_KEY;
+		key.offset = parent->start;
+		if (!btrfs_tree_cursor_seek(cur, &key))
+			return 0;
+	}
+	fprintf(stderr,
+		"tree block %llu in root %llu parent %llu has no backref in the extent tree\n",
+		(unsigned long long)eb->start,
+		(unsigned long long)root->root_key.objectid,
+		(unsigned long long)(parent ? parent->start : 0));
+	return 1;
+}
+
+/* the leaf and node sanity checks, 1 if @eb can't be trusted */
+static int lowmem_block_corrupted(struct btrfs_root *root,
+				  struct extent_buffer *eb)
+{
+	enum btrfs_tree_block_status status;
+
+	if (btrfs_is_leaf(eb))
+		status = btrfs_check_leaf(root, NULL, eb);
+	else
+		status = btrfs_check_node(root, NULL, eb);
+	if (status == BTRFS_TREE_BLOCK_CLEAN)
+		return 0;
+	fprintf(stderr, "tree block %llu in root %llu is corrupted\n",
+		(unsigned long long)eb->start,
+		(unsigned long long)root->root_key.objectid);
+	return 1;
+}
+
+/* called for each leaf a block walk reaches, < 0 stops the walk */
+typedef int (*lowmem_leaf_fn)(struct btrfs_root *root,
+			      struct extent_buffer *leaf, void *data);
+
+static int lowmem_visit_block(struct btrfs_root *root, struct btrfs_path *path,
+			      int level, int check_backrefs,
+			      lowmem_leaf_fn fn, void *data)
+{
+	int err = 0;
+	int ret;
+
+	if (check_backrefs) {
+		lowmem_blocks++;
+		err |= lowmem_check_block_backref(root, path, level);
+	}
+	if (!level && fn) {
+		ret = fn(root, path->nodes[0], data);
+		if (ret < 0)
+			return ret;
+		err |= ret;
+	}
+	return err;
+}
+
+/* the last pointer in @node to keys not after @key */
+static int lowmem_node_slot(struct extent_buffer *node, struct btrfs_key *key)
+{
+	struct btrfs_key found;
+	int slot;
+
+	for (slot = btrfs_header_nritems(node) - 1; slot > 0; slot--) {
+		btrfs_node_key_to_cpu(node, &found, slot);
+		if (btrfs_comp_cpu_keys(&found, key) <= 0)
+			break;
+	}
+	return slot;
+}
+
+/*
+ * Walk the blocks of @root depth first, in key order, from the leaf that
+ * @start is in if given, leaving out the subtrees whose pointer
+ * generation is not newer than lowmem_min_gen.  Errors are added to
+ * @errors, and 1 is returned if the walk had to stop.
+ */
+static int lowmem_walk_blocks(struct btrfs_root *root, struct btrfs_key *start,
+			      int check_backrefs, lowmem_leaf_fn fn, void *data,
+			      int *errors)
+{
+	struct btrfs_reada_window reada;
+	struct btrfs_path path;
+	struct extent_buffer *eb;
+	struct extent_buffer *next;
+	u64 bytenr;
+	u64 ptr_gen;
+	int slot;
+	int top;
+	int level;
+	int ret;
+
+	if (btrfs_header_generation(root->node) <= lowmem_min_gen)
+		return 0;
+
+	if (lowmem_block_corrupted(root, root->node)) {
+		*errors |= 1;
+		return 0;
+	}
+
+	btrfs_reada_window_init(&reada, root, reada_bytes, reada_blocks);
+	reada.min_gen = lowmem_min_gen;
+	btrfs_init_path(&path);
+	top = btrfs_header_level(root->node);
+	extent_buffer_get(root->node);
+	path.nodes[top] = root->node;
+	ret = lowmem_visit_block(root, &path, top, check_backrefs, fn, data);
+	level = top;
+	while (ret >= 0 && level <= top) {
+		*errors |= ret;
+		ret = 0;
+		eb = path.nodes[level];
+		if (start && level)
+			path.slots[level] = lowmem_node_slot(eb, start);
+		slot = path.slots[level];
+		if (!level || slot >= btrfs_header_nritems(eb)) {
+			free_extent_buffer(eb);
+			path.nodes[level] = NULL;
+			if (++level <= top)
+				path.slots[level]++;
+			continue;
+		}
+
+		ptr_gen = btrfs_node_ptr_generation(eb, slot);
+		if (ptr_gen <= lowmem_min_gen) {
+			path.slots[level]++;
+			start = NULL;
+			continue;
+		}
+		bytenr = btrfs_node_blockptr(eb, slot);
+		btrfs_reada_window_read(&reada, &path, level);
+		next = read_tree_block(root, bytenr,
+				       btrfs_level_size(root, level - 1), ptr_gen);
+		if (!extent_buffer_uptodate(next) ||
+		    btrfs_header_level(next) != level - 1) {
+			fprintf(stderr,
+				"tree block %llu in root %llu can't be read\n",
+				(unsigned long long)bytenr,
+				(unsigned long long)root->root_key.objectid);
+			ret = 1;
+		} else {
+			/* corrupt blocks are reported and left out too */
+			ret = lowmem_block_corrupted(root, next);
+		}
+		if (ret) {
+			free_extent_buffer(next);
+			path.slots[level]++;
+			start = NULL;
+			continue;
+		}
+		level--;
+		path.nodes[level] = next;
+		path.slots[level] = 0;
+		/* only the way down to @start's leaf is searched for it */
+		if (!level)
+			start = NULL;
+		ret = lowmem_visit_block(root, &path, level, check_backrefs,
+					 fn, data);
+	}
+	btrfs_reada_window_release(&reada);
+	btrfs_release_path(&path);
+	if (ret < 0) {
+		fprintf(stderr, "failed to walk root %llu\n",
+			(unsigned long long)root->root_key.objectid);
+		return 1;
+	}
+	return 0;
+}
+
+/* the extent tree items of the extent being walked */
+struct lowmem_extent_walk {
+	struct btrfs_fs_info *info;
+	struct lowmem_bg_walk bg;
+	struct lowmem_extent ext;
+	int have_ext;
+	/* the first bytenr not checked yet, and the last one looked at */
+	u64 next;
+	u64 last;
+	int err;
+};
+
+/* a block group's used bytes against the extent items inside it */
+static int lowmem_check_bg_used(struct btrfs_fs_info *info,
+				struct extent_buffer *leaf, int slot,
+				struct btrfs_key *bg_key)
+{
+	struct btrfs_root *root = info->extent_root;
+	struct btrfs_block_group_item *bi;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	u64 used = 0;
+	int ret;
+
+	bi = btrfs_item_ptr(leaf, slot, struct btrfs_block_group_item);
+	key.objectid = bg_key->objectid;
+	key.type = 0;
+	key.offset = 0;
+	btrfs_init_path(&path);
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	while (ret >= 0) {
+		if (path.slots[0] >= btrfs_header_nritems(path.nodes[0])) {
+			ret = btrfs_next_leaf(root, &path);
+			if (ret)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
+		if (key.objectid >= bg_key->objectid + bg_key->offset)
+			break;
+		if (key.type == BTRFS_EXTENT_ITEM_KEY)
+			used += key.offset;
+		else if (key.type == BTRFS_METADATA_ITEM_KEY)
+			used += root->leafsize;
+		path.slots[0]++;
+	}
+	btrfs_release_path(&path);
+	if (ret < 0)
+		return 1;
+	if (btrfs_disk_block_group_used(leaf, bi) != used) {
+		fprintf(stderr,
+			"block group [%llu %llu] used %llu but extent items used %llu\n",
+			(unsigned long long)bg_key->objectid,
+			(unsigned long long)bg_key->offset,
+			(unsigned long long)btrfs_disk_block_group_used(leaf, bi),
+			(unsigned long long)used);
+		return 1;
+	}
+	return 0;
+}
+
+/* is an extent checked out of order inside a block group */
+static int lowmem_extent_in_block_group(struct btrfs_fs_info *info,
+					struct lowmem_extent *ext)
+{
+	struct btrfs_block_group_cache *cache;
+
+	cache = btrfs_lookup_block_group(info, ext->bytenr);
+	if (cache && ext->bytenr + ext->len <=
+	    cache->key.objectid + cache->key.offset)
+		return 0;
+	fprintf(stderr, "extent [%llu %llu] isn't inside a block group\n",
+		(unsigned long long)ext->bytenr,
+		(unsigned long long)ext->len);
+	return 1;
+}
+
+static void lowmem_extent_tree_item(struct lowmem_extent_walk *w,
+				    struct extent_buffer *leaf, int slot,
+				    struct btrfs_key *key)
+{
+	struct btrfs_fs_info *info = w->info;
+	struct btrfs_block_group_item *bi;
+
+	switch (key->type) {
+	case BTRFS_EXTENT_ITEM_KEY:
+	case BTRFS_METADATA_ITEM_KEY:
+		if (w->have_ext)
+			w->err |= lowmem_finish_extent(&w->ext);
+		w->err |= lowmem_extent_item(info, &w->ext, leaf, slot, key);
+		if (lowmem_min_gen)
+			w->err |= lowmem_extent_in_block_group(info, &w->ext);
+		else
+			lowmem_bg_account(&w->bg, &w->ext);
+		w->have_ext = 1;
+		break;
+	case BTRFS_TREE_BLOCK_REF_KEY:
+	case BTRFS_SHARED_BLOCK_REF_KEY:
+	case BTRFS_EXTENT_DATA_REF_KEY:
+	case BTRFS_SHARED_DATA_REF_KEY:
+		w->err |= lowmem_keyed_backref(info,
+				w->have_ext ? &w->ext : NULL, leaf, slot, key);
+		break;
+	case BTRFS_BLOCK_GROUP_ITEM_KEY:
+		bi = btrfs_item_ptr(leaf, slot, struct btrfs_block_group_item);
+		if (!lowmem_find_chunk(info, key->objectid, key->offset,
+			btrfs_disk_block_group_flags(leaf, bi), 0, 0)) {
+			fprintf(stderr,
+				"Block group[%llu, %llu] (flags = %llu) didn't find the relative chunk.\n",
+				(unsigned long long)key->objectid,
+				(unsigned long long)key->offset,
+				(unsigned long long)
+				btrfs_disk_block_group_flags(leaf, bi));
+			w->err = 1;
+		}
+		if (lowmem_min_gen)
+			w->err |= lowmem_check_bg_used(info, leaf, slot, key);
+		break;
+	default:
+		break;
+	}
+}
+
+/* all the items of the extent at @bytenr, old leaves included */
+static int lowmem_recheck_extent(struct lowmem_extent_walk *w, u64 bytenr)
+{
+	struct btrfs_root *root = w->info->extent_root;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int ret;
+
+	key.objectid = bytenr;
+	key.type = 0;
+	key.offset = 0;
+	btrfs_init_path(&path);
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	while (ret >= 0) {
+		if (path.slots[0] >= btrfs_header_nritems(path.nodes[0])) {
+			ret = btrfs_next_leaf(root, &path);
+			if (ret)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
+		if (key.objectid != bytenr)
+			break;
+		lowmem_extent_tree_item(w, path.nodes[0], path.slots[0], &key);
+		path.slots[0]++;
+	}
+	btrfs_release_path(&path);
+	if (w->have_ext)
+		w->err |= lowmem_finish_extent(&w->ext);
+	w->have_ext = 0;
+	return ret < 0 ? ret : 0;
+}
+
+/* save the walk before the extent at @bytenr */
+static void lowmem_extent_progress(struct lowmem_extent_walk *w, u64 bytenr)
+{
+	struct btrfs_block_group_cache *cache = w->bg.cache;
+
+	if (w->have_ext)
+		w->err |= lowmem_finish_extent(&w->ext);
+	w->have_ext = 0;
+	progress.key.objectid = bytenr;
+	progress.bg_start = cache ? cache->key.objectid : (u64)-1;
+	progress.bg_used = w->bg.used;
+	progress.bg_last_end = w->bg.last_end;
+	check_progress_save(progress.errors | w->err | w->bg.errors);
+}
+
+static int lowmem_extent_leaf(struct btrfs_root *root,
+			      struct extent_buffer *leaf, void *data)
+{
+	struct lowmem_extent_walk *w = data;
+	struct btrfs_key key;
+	int ret;
+	int i;
+
+	for (i = 0; i < btrfs_header_nritems(leaf); i++) {
+		btrfs_item_key_to_cpu(leaf, &key, i);
+		if (key.objectid < w->next)
+			continue;
+		if (key.objectid != w->last && check_progress_due())
+			lowmem_extent_progress(w, key.objectid);
+		w->last = key.objectid;
+		if (!lowmem_min_gen) {
+			lowmem_extent_tree_item(w, leaf, i, &key);
+			continue;
+		}
+		/* the rest of a new leaf's extents may be in old leaves */
+		w->next = key.objectid + 1;
+		ret = lowmem_recheck_extent(w, key.objectid);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static int lowmem_check_extent_tree(struct btrfs_fs_info *info)
+{
+	struct lowmem_extent_walk w;
+	struct btrfs_key *start = NULL;
+	int err;
+
+	memset(&w, 0, sizeof(w));
+	w.info = info;
+	w.bg.info = info;
+	w.bg.cache = btrfs_lookup_first_block_group(info, 0);
+	if (progress.resume) {
+		start = &progress.key;
+		w.next = start->objectid;
+		w.err = progress.errors;
+		w.bg.cache = NULL;
+		if (progress.bg_start != (u64)-1)
+			w.bg.cache = btrfs_lookup_first_block_group(info,
+							progress.bg_start);
+		w.bg.used = progress.bg_used;
+		w.bg.last_end = progress.bg_last_end;
+		progress.resume = 0;
+	}
+
+	progress.resumable = 1;
+	err = lowmem_walk_blocks(info->extent_root, start, 0,
+				 lowmem_extent_leaf, &w, &w.err);
+	progress.resumable = 0;
+	if (w.have_ext)
+		w.err |= lowmem_finish_extent(&w.ext);
+	if (!lowmem_min_gen)
+		lowmem_bg_seek(&w.bg, (u64)-1);
+	return err || w.err || w.bg.errors;
+}
+
+/* is a data backref matching this file extent in the extent item at @slot */
+static int lowmem_inline_data_ref(struct extent_buffer *leaf, int slot,
+				  u64 *roots, u64 ino, u64 offset, u64 parent)
+{
+	struct btrfs_extent_item *ei;
+	struct btrfs_extent_inline_ref *iref;
+	struct btrfs_extent_data_ref *dref;
+	unsigned long ptr;
+	unsigned long end;
+	u64 ref_root;
+	int type;
+
+	ei = btrfs_item_ptr(leaf, slot, struct btrfs_extent_item);
+	ptr = (unsigned long)(ei + 1);
+	end = (unsigned long)ei + btrfs_item_size_nr(leaf, slot);
+	while (ptr < end) {
+		iref = (struct btrfs_extent_inline_ref *)ptr;
+		type = btrfs_extent_inline_ref_type(leaf, iref);
+		if (type == BTRFS_SHARED_DATA_REF_KEY &&
+		    btrfs_extent_inline_ref_offset(leaf, iref) == parent)
+			return 1;
+		if (type == BTRFS_EXTENT_DATA_REF_KEY) {
+			dref = (struct btrfs_extent_data_ref *)(&iref->offset);
+			ref_root = btrfs_extent_data_ref_root(leaf, dref);
+			if ((ref_root == roots[0] || ref_root == roots[1]) &&
+			    btrfs_extent_data_ref_objectid(leaf, dref) == ino &&
+			    btrfs_extent_data_ref_offset(leaf, dref) == offset)
+				return 1;
+		}
+		if (type != BTRFS_EXTENT_DATA_REF_KEY &&
+		    type != BTRFS_SHARED_DATA_REF_KEY)
+			break;
+		ptr += btrfs_extent_inline_ref_size(type);
+	}
+	return 0;
+}
+
+/* does the extent tree know about the file extent at @slot */
+static int lowmem_check_file_extent_backref(struct btrfs_root *root,
+					    struct extent_buffer *eb, int slot,
+					    struct btrfs_key *fkey)
+{
+	struct btrfs_tree_cursor *cur = &extent_cursor;
+	struct btrfs_file_extent_item *fi;
+	struct btrfs_extent_data_ref *dref;
+	struct extent_buffer *leaf;
+	struct btrfs_extent_item *ei;
+	struct btrfs_key key;
+	u64 roots[2];
+	u64 bytenr;
+	u64 offset;
+	int ret;
+	int i;
+
+	fi = btrfs_item_ptr(eb, slot, struct btrfs_file_extent_item);
+	if (btrfs_file_extent_type(eb, fi) == BTRFS_FILE_EXTENT_INLINE)
+		return 0;
+	bytenr = btrfs_file_extent_disk_bytenr(eb, fi);
+	if (!bytenr)
+		return 0;
+	offset = fkey->offset - btrfs_file_extent_offset(eb, fi);
+	roots[0] = root->root_key.objectid;
+	roots[1] = btrfs_header_owner(eb);
+
+	key.objectid = bytenr;
+	key.type = BTRFS_EXTENT_ITEM_KEY;
+	key.offset = btrfs_file_extent_disk_num_bytes(eb, fi);
+	if (btrfs_tree_cursor_seek(cur, &key)) {
+		fprintf(stderr,
+			"root %llu inode %llu file extent %llu: data extent [%llu %llu] not found\n",
+			(unsigned long long)roots[0],
+			(unsigned long long)fkey->objectid,
+			(unsigned long long)fkey->offset,
+			(unsigned long long)key.objectid,
+			(unsigned long long)key.offset);
+		return 1;
+	}
+	leaf = cur->path.nodes[0];
+	ei = btrfs_item_ptr(leaf, cur->path.slots[0], struct btrfs_extent_item);
+	if (btrfs_item_size_nr(leaf, cur->path.slots[0]) < sizeof(*ei))
+		return 0;
+	if (!(btrfs_extent_flags(leaf, ei) & BTRFS_EXTENT_FLAG_DATA)) {
+		fprintf(stderr,
+			"root %llu inode %llu file extent %llu: extent %llu isn't data\n",
+			(unsigned long long)roots[0],
+			(unsigned long long)fkey->objectid,
+			(unsigned long long)fkey->offset,
+			(unsigned long long)bytenr);
+		return 1;
+	}
+	if (lowmem_inline_data_ref(leaf, cur->path.slots[0], roots,
+				   fkey->objectid, offset, eb->start))
+		return 0;
+
+	for (i = 0; i < 2; i++) {
+		if (i && roots[1] == roots[0])
+			break;
+		key.type = BTRFS_EXTENT_DATA_REF_KEY;
+		key.offset = hash_extent_data_ref(roots[i], fkey->objectid,
+						  offset);
+		ret = btrfs_tree_cursor_seek(cur, &key);
+		if (ret)
+			continue;
+		leaf = cur->path.nodes[0];
+		dref = btrfs_item_ptr(leaf, cur->path.slots[0],
+				      struct btrfs_extent_data_ref);
+		if (btrfs_extent_data_ref_root(leaf, dref) == roots[i] &&
+		    btrfs_extent_data_ref_objectid(leaf, dref) ==
+		    fkey->objectid &&
+		    btrfs_extent_data_ref_offset(leaf, dref) == offset)
+			return 0;
+	}
+	key.type = BTRFS_SHARED_DATA_REF_KEY;
+	key.offset = eb->start;
+	if (!btrfs_tree_cursor_seek(cur, &key))
+		return 0;
+
+	fprintf(stderr,
+		"root %llu inode %llu file extent %llu: data extent %llu has no backref for it\n",
+		(unsigned long long)roots[0],
+		(unsigned long long)fkey->objectid,
+		(unsigned long long)fkey->offset,
+		(unsigned long long)bytenr);
+	return 1;
+}
+
+/* the inode whose items are being walked in a fs tree */
+struct lowmem_fs_walk {
+	struct btrfs_root *root;
+	struct shared_node node;
+	struct inode_record rec;
+	u64 root_dirid;
+	unsigned int root_dir_found:1;
+	unsigned int root_dir_ref:1;
+	unsigned int root_dir_bad:1;
+	/* the first inode not checked yet */
+	u64 next_ino;
+	int check_inodes;
+	int errors;
+};
+
+static void lowmem_inode_start(struct lowmem_fs_walk *fw, u64 ino)
+{
+	struct inode_record *rec = &fw->rec;
+
+	memset(rec, 0, sizeof(*rec));
+	INIT_LIST_HEAD(&rec->backrefs);
+	rec->ino = ino;
+	rec->extent_start = (u64)-1;
+	rec->first_extent_gap = (u64)-1;
+	rec->refs = 1;
+	if (ino == BTRFS_FREE_INO_OBJECTID)
+		rec->found_link = 1;
+	fw->node.current = rec;
+}
+
+/* the rules check_inode_recs() applies, for one inode */
+static void lowmem_inode_finish(struct lowmem_fs_walk *fw)
+{
+	struct btrfs_root *root = fw->root;
+	struct inode_record *rec = fw->node.current;
+	struct inode_backref *backref;
+
+	if (!rec)
+		return;
+	fw->node.current = NULL;
+	check_inode_rec_complete(rec);
+
+	if (rec->ino == fw->root_dirid) {
+		fw->root_dir_found = 1;
+		if (!rec->found_inode_item || rec->errors || rec->nlink != 1 ||
+		    rec->found_link != 0 || !fw->root_dir_ref ||
+		    fw->root_dir_bad || !list_empty(&rec->backrefs)) {
+			fprintf(stderr, "root %llu root dir %llu error\n",
+				(unsigned long long)root->root_key.objectid,
+				(unsigned long long)rec->ino);
+			print_inode_error(root, rec);
+			fw->errors++;
+		}
+		goto out;
+	}
+	if (rec->ino == BTRFS_ORPHAN_OBJECTID)
+		goto out;
+
+	if ((rec->errors & I_ERR_NO_ORPHAN_ITEM) &&
+	    !check_orphan_item(root, rec->ino))
+		rec->errors &= ~I_ERR_NO_ORPHAN_ITEM;
+	if (!rec->found_inode_item)
+		rec->errors |= I_ERR_NO_INODE_ITEM;
+	if (rec->found_link != rec->nlink)
+		rec->errors |= I_ERR_LINK_COUNT_WRONG;
+	if (!rec->errors && list_empty(&rec->backrefs))
+		goto out;
+
+	fw->errors++;
+	print_inode_error(root, rec);
+	list_for_each_entry(backref, &rec->backrefs, list) {
+		fprintf(stderr, "\tunresolved ref dir %llu index %llu"
+			" namelen %u name %s filetype %d errors %x",
+			(unsigned long long)backref->dir,
+			(unsigned long long)backref->index,
+			backref->namelen, backref->name,
+			backref->filetype, backref->errors);
+		print_ref_error(backref->errors);
+	}
+out:
+	while (!list_empty(&rec->backrefs)) {
+		backref = list_entry(rec->backrefs.next,
+				     struct inode_backref, list);
+		list_del(&backref->list);
+		free_inode_backref(backref);
+	}
+}
+
+/* does the dir item a lookup returned point to @objectid */
+static int lowmem_dir_item_points_to(struct btrfs_path *path,
+				     struct btrfs_dir_item *di, u64 objectid,
+				     u8 type)
+{
+	struct btrfs_key location;
+
+	if (IS_ERR(di) || !di)
+		return 0;
+	btrfs_dir_item_key_to_cpu(path->nodes[0], di, &location);
+	return location.objectid == objectid && location.type == type;
+}
+
+/* the dir item and dir index for one name of the inode being walked */
+static void lowmem_inode_name(struct lowmem_fs_walk *fw, u64 dir, u64 index,
+			      char *name, int namelen, int errors,
+			      int ref_type)
+{
+	struct btrfs_root *root = fw->root;
+	struct inode_record *rec = fw->node.current;
+	struct inode_backref *backref;
+	struct btrfs_dir_item *di;
+	struct btrfs_path path;
+	int filetype = 0;
+
+	if (rec->ino == fw->root_dirid && dir == rec->ino) {
+		if (index == 0 && namelen == 2 && !memcmp(name, "..", 2))
+			fw->root_dir_ref = 1;
+		else
+			fw->root_dir_bad = 1;
+		return;
+	}
+
+	btrfs_init_path(&path);
+	di = btrfs_lookup_dir_item(NULL, root, &path, dir, name, namelen, 0);
+	if (!lowmem_dir_item_points_to(&path, di, rec->ino,
+				       BTRFS_INODE_ITEM_KEY)) {
+		errors |= REF_ERR_NO_DIR_ITEM;
+	} else {
+		filetype = btrfs_dir_type(path.nodes[0], di);
+		rec->found_link++;
+	}
+	btrfs_release_path(&path);
+
+	di = btrfs_lookup_dir_index(NULL, root, &path, dir, name, namelen,
+				    index, 0);
+	if (!lowmem_dir_item_points_to(&path, di, rec->ino,
+				       BTRFS_INODE_ITEM_KEY)) {
+		errors |= REF_ERR_NO_DIR_INDEX;
+	} else {
+		if (filetype && btrfs_dir_type(path.nodes[0], di) != filetype)
+			errors |= REF_ERR_FILETYPE_UNMATCH;
+		filetype = btrfs_dir_type(path.nodes[0], di);
+	}
+	btrfs_release_path(&path);
+
+	if (rec->found_inode_item && filetype &&
+	    filetype != imode_to_type(rec->imode))
+		errors |= REF_ERR_FILETYPE_UNMATCH;
+	if (!errors)
+		return;
+
+	backref = get_inode_backref(rec, name, namelen, dir);
+	backref->found_inode_ref = 1;
+	backref->found_dir_item = !(errors & REF_ERR_NO_DIR_ITEM);
+	backref->found_dir_index = !(errors & REF_ERR_NO_DIR_INDEX);
+	backref->index = index;
+	backref->filetype = filetype;
+	backref->ref_type = ref_type;
+	backref->errors |= errors;
+}
+
+static void lowmem_inode_ref(struct lowmem_fs_walk *fw,
+			     struct extent_buffer *eb, int slot,
+			     struct btrfs_key *key)
+{
+	struct btrfs_inode_ref *ref;
+	char namebuf[BTRFS_NAME_LEN];
+	u32 total;
+	u32 cur = 0;
+	u32 len;
+	u32 name_len;
+	int error;
+
+	ref = btrfs_item_ptr(eb, slot, struct btrfs_inode_ref);
+	total = btrfs_item_size_nr(eb, slot);
+	while (cur < total) {
+		name_len = btrfs_inode_ref_name_len(eb, ref);
+		if (name_len <= BTRFS_NAME_LEN) {
+			len = name_len;
+			error = 0;
+		} else {
+			len = BTRFS_NAME_LEN;
+			error = REF_ERR_NAME_TOO_LONG;
+		}
+		read_extent_buffer(eb, namebuf, (unsigned long)(ref + 1), len);
+		lowmem_inode_name(fw, key->offset,
+				  btrfs_inode_ref_index(eb, ref), namebuf, len,
+				  error, key->type);
+
+		len = sizeof(*ref) + name_len;
+		ref = (struct btrfs_inode_ref *)((char *)ref + len);
+		cur += len;
+	}
+}
+
+static void lowmem_inode_extref(struct lowmem_fs_walk *fw,
+				struct extent_buffer *eb, int slot,
+				struct btrfs_key *key)
+{
+	struct btrfs_inode_extref *extref;
+	char namebuf[BTRFS_NAME_LEN];
+	u32 total;
+	u32 cur = 0;
+	u32 len;
+	u32 name_len;
+	int error;
+
+	extref = btrfs_item_ptr(eb, slot, struct btrfs_inode_extref);
+	total = btrfs_item_size_nr(eb, slot);
+	while (cur < total) {
+		name_len = btrfs_inode_extref_name_len(eb, extref);
+		if (name_len <= BTRFS_NAME_LEN) {
+			len = name_len;
+			error = 0;
+		} else {
+			len = BTRFS_NAME_LEN;
+			error = REF_ERR_NAME_TOO_LONG;
+		}
+		read_extent_buffer(eb, namebuf,
+				   (unsigned long)(extref + 1), len);
+		lowmem_inode_name(fw, btrfs_inode_extref_parent(eb, extref),
+				  btrfs_inode_extref_index(eb, extref),
+				  namebuf, len, error, key->type);
+
+		len = sizeof(*extref) + name_len;
+		extref = (struct btrfs_inode_extref *)((char *)extref + len);
+		cur += len;
+	}
+}
+
+/* does the inode a dir entry points to have a ref back with that name */
+static int lowmem_dir_entry(struct lowmem_fs_walk *fw, struct btrfs_key *key,
+			    u64 ino, char *name, int namelen, int filetype)
+{
+	struct btrfs_root *root = fw->root;
+	struct btrfs_inode_ref *ref;
+	struct btrfs_inode_extref *extref;
+	struct btrfs_path path;
+	u64 index = 0;
+	int found = 0;
+	int errors = 0;
+
+	btrfs_init_path(&path);
+	ref = btrfs_lookup_inode_ref(NULL, root, &path, name, namelen, ino,
+				     key->objectid, 0, 0);
+	if (!IS_ERR(ref) && ref) {
+		index = btrfs_inode_ref_index(path.nodes[0], ref);
+		found = 1;
+	}
+	btrfs_release_path(&path);
+	if (!found) {
+		extref = btrfs_lookup_inode_extref(NULL, &path, root, ino,
+						   key->objectid, 0, name,
+						   namelen, 0);
+		if (!IS_ERR(extref) && extref) {
+			index = btrfs_inode_extref_index(path.nodes[0],
+							 extref);
+			found = 1;
+		}
+		btrfs_release_path(&path);
+	}
+
+	if (!found)
+		errors |= REF_ERR_NO_INODE_REF;
+	else if (key->type == BTRFS_DIR_INDEX_KEY && index != key->offset)
+		errors |= REF_ERR_INDEX_UNMATCH;
+	if (!errors)
+		return 0;
+
+	fprintf(stderr,
+		"root %llu dir %llu %s %llu namelen %u name %s filetype %d points to inode %llu errors %x",
+		(unsigned long long)root->root_key.objectid,
+		(unsigned long long)key->objectid,
+		key->type == BTRFS_DIR_INDEX_KEY ? "index" : "item",
+		(unsigned long long)key->offset, namelen, name, filetype,
+		(unsigned long long)ino, errors);
+	print_ref_error(errors);
+	return 1;
+}
+
+static void lowmem_dir_item(struct lowmem_fs_walk *fw,
+			    struct extent_buffer *eb, int slot,
+			    struct btrfs_key *key)
+{
+	struct inode_record *rec = fw->node.current;
+	struct btrfs_dir_item *di;
+	struct btrfs_key location;
+	char namebuf[BTRFS_NAME_LEN + 1];
+	u32 total;
+	u32 cur = 0;
+	u32 len;
+	u32 name_len;
+	u32 data_len;
+	int nritems = 0;
+
+	rec->found_dir_item = 1;
+	di = btrfs_item_ptr(eb, slot, struct btrfs_dir_item);
+	total = btrfs_item_size_nr(eb, slot);
+	while (cur < total) {
+		nritems++;
+		btrfs_dir_item_key_to_cpu(eb, di, &location);
+		name_len = btrfs_dir_name_len(eb, di);
+		data_len = btrfs_dir_data_len(eb, di);
+
+		rec->found_size += name_len;
+		len = min_t(u32, name_len, BTRFS_NAME_LEN);
+		read_extent_buffer(eb, namebuf, (unsigned long)(di + 1), len);
+		namebuf[len] = '\0';
+
+		if (name_len > BTRFS_NAME_LEN) {
+			fprintf(stderr,
+				"root %llu dir %llu name %s too long\n",
+				(unsigned long long)fw->root->root_key.objectid,
+				(unsigned long long)key->objectid, namebuf);
+			fw->errors++;
+		}
+		if (location.type == BTRFS_INODE_ITEM_KEY) {
+			fw->errors += lowmem_dir_entry(fw, key,
+					location.objectid, namebuf, len,
+					btrfs_dir_type(eb, di));
+		} else if (location.type != BTRFS_ROOT_ITEM_KEY) {
+			fprintf(stderr, "invalid location in dir item %u\n",
+				location.type);
+			fw->errors++;
+		}
+
+		len = sizeof(*di) + name_len + data_len;
+		di = (struct btrfs_dir_item *)((char *)di + len);
+		cur += len;
+	}
+	if (key->type == BTRFS_DIR_INDEX_KEY && nritems > 1)
+		rec->errors |= I_ERR_DUP_DIR_INDEX;
+}
+
+static int lowmem_fs_item(struct lowmem_fs_walk *fw, struct extent_buffer *eb,
+			  int slot, struct btrfs_key *key)
+{
+	int ret;
+
+	if (!fw->node.current || fw->node.current->ino < key->objectid) {
+		lowmem_inode_finish(fw);
+		lowmem_inode_start(fw, key->objectid);
+	}
+	switch (key->type) {
+	case BTRFS_DIR_ITEM_KEY:
+	case BTRFS_DIR_INDEX_KEY:
+		lowmem_dir_item(fw, eb, slot, key);
+		break;
+	case BTRFS_INODE_REF_KEY:
+		lowmem_inode_ref(fw, eb, slot, key);
+		break;
+	case BTRFS_INODE_EXTREF_KEY:
+		lowmem_inode_extref(fw, eb, slot, key);
+		break;
+	case BTRFS_INODE_ITEM_KEY:
+		process_inode_item(eb, slot, key, &fw->node);
+		break;
+	case BTRFS_EXTENT_DATA_KEY:
+		ret = process_file_extent(fw->root, eb, slot, key, &fw->node);
+		if (ret < 0)
+			return ret;
+		/* a leaf that wasn't rewritten still has its backrefs */
+		if (btrfs_header_generation(eb) > lowmem_min_gen)
+			fw->errors += lowmem_check_file_extent_backref(fw->root,
+							eb, slot, key);
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+/* all the items of inode @ino, old leaves included */
+static int lowmem_recheck_inode(struct lowmem_fs_walk *fw, u64 ino)
+{
+	struct btrfs_root *root = fw->root;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int ret;
+
+	key.objectid = ino;
+	key.type = 0;
+	key.offset = 0;
+	btrfs_init_path(&path);
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	while (ret >= 0) {
+		if (path.slots[0] >= btrfs_header_nritems(path.nodes[0])) {
+			ret = btrfs_next_leaf(root, &path);
+			if (ret)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
+		if (key.objectid != ino)
+			break;
+		if (key.type != BTRFS_ORPHAN_ITEM_KEY) {
+			ret = lowmem_fs_item(fw, path.nodes[0], path.slots[0],
+					     &key);
+			if (ret < 0)
+				break;
+		}
+		path.slots[0]++;
+	}
+	btrfs_release_path(&path);
+	lowmem_inode_finish(fw);
+	return ret < 0 ? ret : 0;
+}
+
+/* save the walk before inode @ino */
+static void lowmem_fs_progress(struct lowmem_fs_walk *fw, u64 ino)
+{
+	lowmem_inode_finish(fw);
+	progress.key.objectid = ino;
+	progress.root_dir = fw->root_dir_found | fw->root_dir_ref << 1 |
+			    fw->root_dir_bad << 2;
+	check_progress_save(progress.errors | fw->errors);
+}
+
+static int lowmem_fs_leaf(struct btrfs_root *root, struct extent_buffer *eb,
+			  void *data)
+{
+	struct lowmem_fs_walk *fw = data;
+	struct btrfs_key key;
+	u32 nritems = btrfs_header_nritems(eb);
+	int ret;
+	int i;
+
+	/* only the blocks are checked, the walk can go on from any leaf */
+	if (!fw->check_inodes) {
+		if (nritems && progress.resumable && check_progress_due()) {
+			btrfs_item_key_to_cpu(eb, &progress.key, 0);
+			check_progress_save(progress.errors | fw->errors);
+		}
+		return 0;
+	}
+
+	for (i = 0; i < nritems; i++) {
+		btrfs_item_key_to_cpu(eb, &key, i);
+		if (key.objectid == BTRFS_FREE_SPACE_OBJECTID)
+			continue;
+		if (key.type == BTRFS_ORPHAN_ITEM_KEY)
+			continue;
+		if (key.objectid < fw->next_ino)
+			continue;
+		if ((!fw->node.current || fw->node.current->ino < key.objectid) &&
+		    check_progress_due())
+			lowmem_fs_progress(fw, key.objectid);
+
+		if (!lowmem_min_gen) {
+			ret = lowmem_fs_item(fw, eb, i, &key);
+		} else {
+			/* the inode's other items may be in old leaves */
+			fw->next_ino = key.objectid + 1;
+			ret = lowmem_recheck_inode(fw, key.objectid);
+		}
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Walk @root once, checking the backref of every block on the way and,
+ * for a live fs tree, the inodes in its leaves.  With @resume the walk
+ * continues from the inode the checkpoint got to.
+ */
+static int lowmem_walk_tree(struct btrfs_root *root, int check_inodes,
+			    int resume)
+{
+	struct lowmem_fs_walk fw;
+	struct btrfs_key *start = NULL;
+	int err;
+
+	memset(&fw, 0, sizeof(fw));
+	fw.root = root;
+	fw.root_dirid = btrfs_root_dirid(&root->root_item);
+	fw.check_inodes = check_inodes;
+	if (resume) {
+		start = &progress.key;
+		fw.next_ino = start->objectid;
+		fw.root_dir_found = !!(progress.root_dir & 1);
+		fw.root_dir_ref = !!(progress.root_dir & 2);
+		fw.root_dir_bad = !!(progress.root_dir & 4);
+	}
+
+	err = lowmem_walk_blocks(root, start, 1, lowmem_fs_leaf, &fw,
+				 &fw.errors);
+	if (check_inodes) {
+		lowmem_inode_finish(&fw);
+		/* an incremental walk only sees the root dir if it changed */
+		if (!fw.root_dir_found && !lowmem_min_gen) {
+			fprintf(stderr, "root %llu root dir %llu not found\n",
+				(unsigned long long)root->root_key.objectid,
+				(unsigned long long)fw.root_dirid);
+			fw.errors++;
+		}
+	}
+	return err || fw.errors;
+}
+
+static int check_chunks_and_extents_lowmem(struct btrfs_fs_info *info)
+{
+	int err = 0;
+
+	/* a resumed check has their errors from the checkpoint */
+	if (!progress.resume) {
+		err |= lowmem_check_chunk_tree(info);
+		err |= lowmem_check_dev_tree(info);
+		progress.errors = err;
+	}
+	err |= lowmem_check_extent_tree(info);
+
+	/* the blocks of the trees that aren't fs trees, the other way */
+	err |= lowmem_walk_tree(info->tree_root, 0, 0);
+	err |= lowmem_walk_tree(info->chunk_root, 0, 0);
+	return err;
+}
+
+/* walk every tree in the tree root, checking the inodes of the fs trees */
+static int check_fs_roots_lowmem(struct btrfs_fs_info *info)
+{
+	struct btrfs_root *tree_root = info->tree_root;
+	struct btrfs_root *root;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	struct btrfs_key root_key;
+	int resume = 0;
+	int err = 0;
+	int ret;
+
+	key.objectid = 0;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = 0;
+	if (progress.resume) {
+		key = progress.root_key;
+		err = progress.errors;
+		resume = 1;
+		progress.resume = 0;
+	}
+	btrfs_init_path(&path);
+	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
+	while (ret >= 0) {
+		if (path.slots[0] >= btrfs_header_nritems(path.nodes[0])) {
+			ret = btrfs_next_leaf(tree_root, &path);
+			if (ret)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
+		path.slots[0]++;
+		if (key.type != BTRFS_ROOT_ITEM_KEY)
+			continue;
+		root_key = key;
+
+		if (key.objectid == BTRFS_TREE_RELOC_OBJECTID) {
+			root = btrfs_read_fs_root_no_cache(info, &key);
+		} else {
+			key.offset = (u64)-1;
+			root = btrfs_read_fs_root(info, &key);
+		}
+		if (IS_ERR(root) || !root) {
+			fprintf(stderr, "failed to read root %llu\n",
+				(unsigned long long)key.objectid);
+			err = 1;
+			resume = 0;
+			continue;
+		}
+		/* a dead root is dropped a bit at a time, leave it be */
+		if (!extent_buffer_uptodate(root->node) ||
+		    btrfs_root_refs(&root->root_item) == 0) {
+			if (key.objectid == BTRFS_TREE_RELOC_OBJECTID)
+				btrfs_free_fs_root(root);
+			resume = 0;
+			continue;
+		}
+		progress.root_key = root_key;
+		progress.errors = err;
+		if (!resume)
+			memset(&progress.key, 0, sizeof(progress.key));
+		progress.resumable = 1;
+		err |= lowmem_walk_tree(root, fs_root_objectid(key.objectid),
+					resume);
+		progress.resumable = 0;
+		resume = 0;
+		if (key.objectid == BTRFS_TREE_RELOC_OBJECTID)
+			btrfs_free_fs_root(root);
+	}
+	btrfs_release_path(&path);
+	return err || ret < 0;
+}
+
+/* the other half of a root ref, and for a forward ref the dir entries */
+static int lowmem_check_root_ref(struct btrfs_fs_info *info,
+				 struct extent_buffer *eb, int slot,
+				 struct btrfs_key *key)
+{
+	struct btrfs_root_ref *ref;
+	struct btrfs_root_ref *other;
+	struct btrfs_root *parent_root;
+	struct btrfs_dir_item *di;
+	struct btrfs_key other_key;
+	struct btrfs_path path;
+	char name[BTRFS_NAME_LEN + 1];
+	char other_name[BTRFS_NAME_LEN];
+	u64 parent;
+	u64 child;
+	u64 dirid;
+	u64 index;
+	int namelen;
+	int errors = 0;
+
+	ref = btrfs_item_ptr(eb, slot, struct btrfs_root_ref);
+	dirid = btrfs_root_ref_dirid(eb, ref);
+	index = btrfs_root_ref_sequence(eb, ref);
+	namelen = min_t(int, btrfs_root_ref_name_len(eb, ref), BTRFS_NAME_LEN);
+	read_extent_buffer(eb, name, (unsigned long)(ref + 1), namelen);
+	name[namelen] = '\0';
+	if (key->type == BTRFS_ROOT_REF_KEY) {
+		parent = key->objectid;
+		child = key->offset;
+		other_key.type = BTRFS_ROOT_BACKREF_KEY;
+	} else {
+		parent = key->offset;
+		child = key->objectid;
+		other_key.type = BTRFS_ROOT_REF_KEY;
+	}
+	other_key.objectid = key->offset;
+	other_key.offset = key->objectid;
+
+	btrfs_init_path(&path);
+	if (btrfs_search_slot(NULL, info->tree_root, &other_key, &path,
+			      0, 0)) {
+		errors |= key->type == BTRFS_ROOT_REF_KEY ?
+			  REF_ERR_NO_ROOT_BACKREF : REF_ERR_NO_ROOT_REF;
+	} else {
+		other = btrfs_item_ptr(path.nodes[0], path.slots[0],
+				       struct btrfs_root_ref);
+		read_extent_buffer(path.nodes[0], other_name,
+				   (unsigned long)(other + 1),
+				   min_t(int, namelen,
+					 btrfs_root_ref_name_len(path.nodes[0],
+								 other)));
+		if (btrfs_root_ref_dirid(path.nodes[0], other) != dirid ||
+		    btrfs_root_ref_sequence(path.nodes[0], other) != index ||
+		    btrfs_root_ref_name_len(path.nodes[0], other) != namelen ||
+		    memcmp(name, other_name, namelen))
+			errors |= key->type == BTRFS_ROOT_REF_KEY ?
+				  REF_ERR_NO_ROOT_BACKREF :
+				  REF_ERR_NO_ROOT_REF;
+	}
+	btrfs_release_path(&path);
+
+	/* the dir entries are looked at once, from the forward ref */
+	if (key->type == BTRFS_ROOT_REF_KEY) {
+		parent_root = lowmem_read_root(info, parent);
+		if (IS_ERR(parent_root) || !parent_root) {
+			errors |= REF_ERR_NO_DIR_ITEM | REF_ERR_NO_DIR_INDEX;
+			goto out;
+		}
+		di = btrfs_lookup_dir_item(NULL, parent_root, &path, dirid,
+					   name, namelen, 0);
+		if (!lowmem_dir_item_points_to(&path, di, child,
+					       BTRFS_ROOT_ITEM_KEY))
+			errors |= REF_ERR_NO_DIR_ITEM;
+		btrfs_release_path(&path);
+
+		di = btrfs_lookup_dir_index(NULL, parent_root, &path, dirid,
+					    name, namelen, index, 0);
+		if (!lowmem_dir_item_points_to(&path, di, child,
+					       BTRFS_ROOT_ITEM_KEY))
+			errors |= REF_ERR_NO_DIR_INDEX;
+		btrfs_release_path(&path);
+	}
+out:
+	if (!errors)
+		return 0;
+	fprintf(stderr, "fs tree %llu\n\tunresolved ref root %llu dir %llu"
+		" index %llu namelen %u name %s errors %x",
+		(unsigned long long)child, (unsigned long long)parent,
+		(unsigned long long)dirid, (unsigned long long)index,
+		namelen, name, errors);
+	print_ref_error(errors);
+	return 1;
+}
+
+/* is the subvolume @objectid linked in somewhere, or about to be deleted */
+static int lowmem_root_referenced(struct btrfs_fs_info *info, u64 objectid)
+{
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int ret;
+
+	key.objectid = objectid;
+	key.type = BTRFS_ROOT_BACKREF_KEY;
+	key.offset = 0;
+	btrfs_init_path(&path);
+	ret = btrfs_search_slot(NULL, info->tree_root, &key, &path, 0, 0);
+	if (ret > 0 && path.slots[0] >= btrfs_header_nritems(path.nodes[0]))
+		ret = btrfs_next_leaf(info->tree_root, &path);
+	if (ret >= 0 && path.slots[0] < btrfs_header_nritems(path.nodes[0])) {
+		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
+		ret = key.objectid == objectid &&
+		      key.type == BTRFS_ROOT_BACKREF_KEY;
+	} else {
+		ret = 0;
+	}
+	btrfs_release_path(&path);
+	if (ret)
+		return 1;
+	return !check_orphan_item(info->tree_root, objectid);
+}
+
+static int check_root_refs_lowmem(struct btrfs_fs_info *info)
+{
+	struct btrfs_root *tree_root = info->tree_root;
+	struct btrfs_root_item *ri;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int errors = 0;
+	int ret;
+
+	key.objectid = 0;
+	key.type = 0;
+	key.offset = 0;
+	btrfs_init_path(&path);
+	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
+	while (ret >= 0) {
+		if (path.slots[0] >= btrfs_header_nritems(path.nodes[0])) {
+			ret = btrfs_next_leaf(tree_root, &path);
+			if (ret)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
+		if (key.type == BTRFS_ROOT_REF_KEY ||
+		    key.type == BTRFS_ROOT_BACKREF_KEY) {
+			errors += lowmem_check_root_ref(info, path.nodes[0],
+							path.slots[0], &key);
+		} else if (key.type == BTRFS_ROOT_ITEM_KEY &&
+			   key.objectid >= BTRFS_FIRST_FREE_OBJECTID &&
+			   key.objectid <= BTRFS_LAST_FREE_OBJECTID) {
+			ri = btrfs_item_ptr(path.nodes[0], path.slots[0],
+					    struct btrfs_root_item);
+			if (btrfs_disk_root_refs(path.nodes[0], ri) > 0 &&
+			    !lowmem_root_referenced(info, key.objectid)) {
+				fprintf(stderr, "fs tree %llu not referenced\n",
+					(unsigned long long)key.objectid);
+				errors++;
+			}
+		}
+		path.slots[0]++;
+	}
+	btrfs_release_path(&path);
+	return errors > 0 || ret < 0;
+}
+
+static int btrfs_fsck_reinit_root(struct btrfs_trans_handle *trans,
+			   struct btrfs_root *root, int overwrite)
+{
+	struct extent_buffer *c;
+	struct extent_buffer *old = root->node;
+	int level;
+	int ret;
+	struct btrfs_disk_key disk_key = {0,0,0};
+
+	level = 0;
+
+	if (overwrite) {
+		c = old;
+		extent_buffer_get(c);
+		goto init;
+	}
+	c = btrfs_alloc_free_block(trans, root,
+				   btrfs_level_size(root, 0),
+				   root->root_key.objectid,
+				   &disk_key, level, 0, 0);
+	if (IS_ERR(c)) {
+		c = old;
+		extent_buffer_get(c);
+		overwrite = 1;
+	}
+init:
+	memset_extent_buffer(c, 0, 0, sizeof(struct btrfs_header));
+	btrfs_set_header_level(c, level);
+	btrfs_set_header_bytenr(c, c->start);
+	btrfs_set_header_generation(c, trans->transid);
+	btrfs_set_header_backref_rev(c, BTRFS_MIXED_BACKREF_REV);
+	btrfs_set_header_owner(c, root->root_key.objectid);
+
+	write_extent_buffer(c, root->fs_info->fsid,
+			    btrfs_header_fsid(), BTRFS_FSID_SIZE);
+
+	write_extent_buffer(c, root->fs_info->chunk_tree_uuid,
+			    btrfs_header_chunk_tree_uuid(c),
+			    BTRFS_UUID_SIZE);
+
+	btrfs_mark_buffer_dirty(c);
+	/*
+	 * this case can happen in the following case:
+	 *
+	 * 1.overwrite previous root.
+	 *
+	 * 2.reinit reloc data root, this is because we skip pin
+	 * down reloc data tree before which means we can allocate
+	 * same block bytenr here.
+	 */
+	if (old->start == c->start) {
+		btrfs_set_root_generation(&root->root_item,
+					  trans->transid);
+		root->root_item.level = btrfs_header_level(root->node);
+		ret = btrfs_update_root(trans, root->fs_info->tree_root,
+					&root->root_key, &root->root_item);
+		if (ret) {
+			free_extent_buffer(c);
+			return ret;
+		}
+	}
+	free_extent_buffer(old);
+	root->node = c;
+	add_root_to_dirty_list(root);
+	return 0;
+}
+
+static int pin_down_tree_blocks(struct btrfs_fs_info *fs_info,
+				struct extent_buffer *eb, int tree_root)
+{
+	struct extent_buffer *tmp;
+	struct btrfs_root_item *ri;
+	struct btrfs_key key;
+	u64 bytenr;
+	u32 leafsize;
+	int level = btrfs_header_level(eb);
+	int nritems;
+	int ret;
+	int i;
+
+	/*
+	 * If we have pinned this block before, don't pin it again.
+	 * This can not only avoid forever loop with broken filesystem
+	 * but also give us some speedups.
+	 */
+	if (test_range_bit(&fs_info->pinned_extents, eb->start,
+			   eb->start + eb->len - 1, EXTENT_DIRTY, 0))
+		return 0;
+
+	btrfs_pin_extent(fs_info, eb->start, eb->len);
+
+	leafsize = btrfs_super_leafsize(fs_info->super_copy);
+	nritems = btrfs_header_nritems(eb);
+	for (i = 0; i < nritems; i++) {
+		if (level == 0) {
+			btrfs_item_key_to_cpu(eb, &key, i);
+			if (key.type != BTRFS_ROOT_ITEM_KEY)
+				continue;
+			/* Skip the extent root and reloc roots */
+			if (key.objectid == BTRFS_EXTENT_TREE_OBJECTID ||
+			    key.objectid == BTRFS_TREE_RELOC_OBJECTID ||
+			    key.objectid == BTRFS_DATA_RELOC_TREE_OBJECTID)
+				continue;
+			ri = btrfs_item_ptr(eb, i, struct btrfs_root_item);
+			bytenr = btrfs_disk_root_bytenr(eb, ri);
+
+			/*
+			 * If at any point we start needing the real root we
+			 * will have to build a stump root for the root we are
+			 * in, but for now this doesn't actually use the root so
+			 * just pass in extent_root.
+			 */
+			tmp = read_tree_block(fs_info->extent_root, bytenr,
+					      leafsize, 0);
+			if (!tmp) {
+				fprintf(stderr, "Error reading root block\n");
+				return -EIO;
+			}
+			ret = pin_down_tree_blocks(fs_info, tmp, 0);
+			free_extent_buffer(tmp);
 			if (ret)
 				return ret;
 		} else {
@@ -7660,9 +11046,8 @@ static int reset_block_groups(struct btrfs_fs_info *fs_info)
 				      btrfs_chunk_type(leaf, chunk),
 				      key.objectid, key.offset,
 				      btrfs_chunk_length(leaf, chunk));
-		set_extent_dirty(&fs_info->free_space_cache, key.offset,
-				 key.offset + btrfs_chunk_length(leaf, chunk),
-				 GFP_NOFS);
+		btrfs_set_free_space(fs_info, key.offset,
+				     key.offset + btrfs_chunk_length(leaf, chunk));
 		path->slots[0]++;
 	}
 	start = 0;
@@ -7941,124 +11326,430 @@ static int delete_bad_item(struct btrfs_root *root, struct bad_item *bad)
 		return PTR_ERR(trans);
 	}
 
-	ret = btrfs_search_slot(trans, root, &bad->key, path, -1, 1);
-	if (ret) {
-		if (ret > 0)
-			ret = 0;
-		goto out;
+	ret = btrfs_search_slot(trans, root, &bad->key, path, -1, 1);
+	if (ret) {
+		if (ret > 0)
+			ret = 0;
+		goto out;
+	}
+	ret = btrfs_del_item(trans, root, path);
+out:
+	btrfs_commit_transaction(trans, root);
+	btrfs_free_path(path);
+	return ret;
+}
+
+static int zero_log_tree(struct btrfs_root *root)
+{
+	struct btrfs_trans_handle *trans;
+	int ret;
+
+	trans = btrfs_start_transaction(root, 1);
+	if (IS_ERR(trans)) {
+		ret = PTR_ERR(trans);
+		return ret;
+	}
+	btrfs_set_super_log_root(root->fs_info->super_copy, 0);
+	btrfs_set_super_log_root_level(root->fs_info->super_copy, 0);
+	ret = btrfs_commit_transaction(trans, root);
+	return ret;
+}
+
+/*
+ * --init-csum-tree reads the data extents in CSUM_FILL_CHUNK pieces that
+ * are contiguous in the logical address space.  The reads and the sums
+ * happen on a task pool while the main thread walks the extent tree, and
+ * the sums are inserted in bytenr order, so btrfs_insert_csums() keeps
+ * growing the last item and the leaves are filled as they are appended.
+ */
+#define CSUM_FILL_CHUNK		(4 * 1024 * 1024)
+#define CSUM_FILL_SLOTS		16
+#define CSUM_FILL_SEGS		64
+
+struct csum_fill;
+
+struct csum_fill_seg {
+	struct btrfs_device *device;
+	u64 physical;
+	u64 len;
+};
+
+struct csum_fill_chunk {
+	struct task_work work;
+	struct csum_fill *cf;
+	u64 logical;
+	u64 len;
+	int nr_segs;
+	int busy;
+	int ret;
+	struct csum_fill_seg segs[CSUM_FILL_SEGS];
+	char *data;
+	char *sums;
+};
+
+struct csum_fill {
+	struct btrfs_trans_handle *trans;
+	struct btrfs_root *csum_root;
+	struct task_pool *pool;
+	struct csum_fill_chunk *chunks;
+	struct csum_fill_chunk *open;
+	int next;
+	u32 sectorsize;
+	u16 csum_size;
+	u64 bytes;
+	double start;
+	double last_report;
+};
+
+static void csum_fill_work(struct task_work *work)
+{
+	struct csum_fill_chunk *chunk;
+	struct csum_fill_seg *seg;
+	u32 sectorsize;
+	u64 offset = 0;
+	u32 crc;
+	int i;
+
+	chunk = container_of(work, struct csum_fill_chunk, work);
+	sectorsize = chunk->cf->sectorsize;
+	chunk->ret = 0;
+	for (i = 0; i < chunk->nr_segs; i++) {
+		seg = &chunk->segs[i];
+		if (seg->device->fd <= 0 ||
+		    btrfs_device_pread(seg->device, chunk->data + offset,
+				       seg->len, seg->physical) != seg->len) {
+			chunk->ret = -EIO;
+			return;
+		}
+		offset += seg->len;
+	}
+
+	for (offset = 0; offset < chunk->len; offset += sectorsize) {
+		crc = btrfs_csum_data(NULL, chunk->data + offset, ~(u32)0,
+				      sectorsize);
+		btrfs_csum_final(crc, chunk->sums +
+				 offset / sectorsize * chunk->cf->csum_size);
+	}
+}
+
+/* a chunk that could not be read in one go, a sector at a time from any copy */
+static int csum_fill_retry(struct csum_fill *cf, struct csum_fill_chunk *chunk)
+{
+	struct btrfs_fs_info *info = cf->csum_root->fs_info;
+	u64 logical;
+	u64 len;
+	u32 crc;
+	int num_copies;
+	int mirror;
+	int ret = -EIO;
+
+	for (logical = chunk->logical; logical < chunk->logical + chunk->len;
+	     logical += cf->sectorsize) {
+		num_copies = btrfs_num_copies(&info->mapping_tree, logical,
+					      cf->sectorsize);
+		for (mirror = 1; mirror <= num_copies; mirror++) {
+			len = cf->sectorsize;
+			ret = read_extent_data(cf->csum_root, chunk->data,
+					       logical, &len, mirror);
+			if (!ret && len == cf->sectorsize)
+				break;
+			ret = -EIO;
+		}
+		if (ret) {
+			fprintf(stderr,
+				"unable to read data at %llu for the csum tree\n",
+				(unsigned long long)logical);
+			return ret;
+		}
+		crc = btrfs_csum_data(NULL, chunk->data, ~(u32)0,
+				      cf->sectorsize);
+		btrfs_csum_final(crc, chunk->sums + (logical - chunk->logical) /
+				 cf->sectorsize * cf->csum_size);
+	}
+	return 0;
+}
+
+static void csum_fill_report(struct csum_fill *cf, int final)
+{
+	double now = csum_now();
+	double elapsed = now - cf->start;
+
+	if (!final && now - cf->last_report < 5)
+		return;
+	cf->last_report = now;
+	if (elapsed <= 0)
+		elapsed = 1e-6;
+	fprintf(stderr, "csum tree: %llu MiB summed in %.1fs, %.1f MiB/s\n",
+		(unsigned long long)(cf->bytes >> 20), elapsed,
+		cf->bytes / elapsed / (1024 * 1024));
+}
+
+/* wait for the oldest chunk in flight and insert its sums */
+static int csum_fill_finish_chunk(struct csum_fill *cf,
+				  struct csum_fill_chunk *chunk)
+{
+	int ret;
+
+	if (!chunk->busy)
+		return 0;
+	if (cf->pool)
+		task_pool_wait_work(cf->pool, &chunk->work);
+	chunk->busy = 0;
+
+	ret = chunk->ret;
+	if (ret)
+		ret = csum_fill_retry(cf, chunk);
+	if (!ret)
+		ret = btrfs_insert_csums(cf->trans, cf->csum_root,
+					 chunk->logical,
+					 chunk->len / cf->sectorsize,
+					 chunk->sums);
+	if (ret)
+		return ret;
+	cf->bytes += chunk->len;
+	csum_fill_report(cf, 0);
+	return 0;
+}
+
+static int csum_fill_submit(struct csum_fill *cf)
+{
+	struct csum_fill_chunk *chunk = cf->open;
+
+	if (!chunk)
+		return 0;
+	cf->open = NULL;
+	chunk->busy = 1;
+	if (cf->pool)
+		task_pool_queue(cf->pool, &chunk->work, csum_fill_work);
+	else
+		csum_fill_work(&chunk->work);
+
+	/* the slot after this one is the oldest, make room in it */
+	return csum_fill_finish_chunk(cf, &cf->chunks[cf->next]);
+}
+
+static int csum_fill_add(struct csum_fill *cf, u64 logical, u64 len)
+{
+	struct btrfs_fs_info *info = cf->csum_root->fs_info;
+	struct btrfs_multi_bio *multi = NULL;
+	struct csum_fill_chunk *chunk;
+	struct csum_fill_seg *seg;
+	struct btrfs_device *device;
+	u64 physical;
+	u64 map_len;
+	int ret;
+
+	while (len) {
+		chunk = cf->open;
+		if (chunk && (chunk->logical + chunk->len != logical ||
+			      chunk->len == CSUM_FILL_CHUNK ||
+			      chunk->nr_segs == CSUM_FILL_SEGS)) {
+			ret = csum_fill_submit(cf);
+			if (ret)
+				return ret;
+			chunk = NULL;
+		}
+		if (!chunk) {
+			chunk = &cf->chunks[cf->next];
+			cf->next = (cf->next + 1) % CSUM_FILL_SLOTS;
+			chunk->logical = logical;
+			chunk->len = 0;
+			chunk->nr_segs = 0;
+			cf->open = chunk;
+		}
+
+		map_len = min_t(u64, len, CSUM_FILL_CHUNK - chunk->len);
+		ret = btrfs_map_block(&info->mapping_tree, READ, logical,
+				      &map_len, &multi, 0, NULL);
+		if (ret) {
+			fprintf(stderr, "Couldn't map the block %llu\n",
+				(unsigned long long)logical);
+			return ret;
+		}
+		device = multi->stripes[0].dev;
+		physical = multi->stripes[0].physical;
+		kfree(multi);
+		multi = NULL;
+		map_len = min(map_len, len);
+		map_len = min_t(u64, map_len, CSUM_FILL_CHUNK - chunk->len);
+
+		seg = chunk->nr_segs ? &chunk->segs[chunk->nr_segs - 1] : NULL;
+		if (seg && seg->device == device &&
+		    seg->physical + seg->len == physical) {
+			seg->len += map_len;
+		} else {
+			seg = &chunk->segs[chunk->nr_segs++];
+			seg->device = device;
+			seg->physical = physical;
+			seg->len = map_len;
+		}
+		chunk->len += map_len;
+		logical += map_len;
+		len -= map_len;
 	}
-	ret = btrfs_del_item(trans, root, path);
-out:
-	btrfs_commit_transaction(trans, root);
-	btrfs_free_path(path);
-	return ret;
+	return 0;
 }
 
-static int zero_log_tree(struct btrfs_root *root)
+static void csum_fill_release(struct csum_fill *cf)
 {
-	struct btrfs_trans_handle *trans;
-	int ret;
+	int i;
 
-	trans = btrfs_start_transaction(root, 1);
-	if (IS_ERR(trans)) {
-		ret = PTR_ERR(trans);
-		return ret;
+	if (cf->pool) {
+		task_pool_flush(cf->pool);
+		task_pool_destroy(cf->pool);
 	}
-	btrfs_set_super_log_root(root->fs_info->super_copy, 0);
-	btrfs_set_super_log_root_level(root->fs_info->super_copy, 0);
-	ret = btrfs_commit_transaction(trans, root);
-	return ret;
+	for (i = 0; cf->chunks && i < CSUM_FILL_SLOTS; i++) {
+		free(cf->chunks[i].data);
+		free(cf->chunks[i].sums);
+	}
+	free(cf->chunks);
 }
 
-static int populate_csum(struct btrfs_trans_handle *trans,
-			 struct btrfs_root *csum_root, char *buf, u64 start,
-			 u64 len)
+static int csum_fill_init(struct csum_fill *cf, struct btrfs_trans_handle *trans,
+			  struct btrfs_root *csum_root)
 {
-	u64 offset = 0;
-	u64 sectorsize;
-	int ret = 0;
+	struct csum_fill_chunk *chunk;
+	int i;
 
-	while (offset < len) {
-		sectorsize = csum_root->sectorsize;
-		ret = read_extent_data(csum_root, buf, start + offset,
-				       &sectorsize, 0);
-		if (ret)
-			break;
-		ret = btrfs_csum_file_block(trans, csum_root, start + len,
-					    start + offset, buf, sectorsize);
-		if (ret)
-			break;
-		offset += sectorsize;
+	memset(cf, 0, sizeof(*cf));
+	cf->trans = trans;
+	cf->csum_root = csum_root;
+	cf->sectorsize = csum_root->sectorsize;
+	cf->csum_size = btrfs_super_csum_size(csum_root->fs_info->super_copy);
+	cf->chunks = calloc(CSUM_FILL_SLOTS, sizeof(*cf->chunks));
+	if (!cf->chunks)
+		return -ENOMEM;
+	for (i = 0; i < CSUM_FILL_SLOTS; i++) {
+		chunk = &cf->chunks[i];
+		chunk->cf = cf;
+		chunk->data = malloc(CSUM_FILL_CHUNK);
+		chunk->sums = malloc(CSUM_FILL_CHUNK / cf->sectorsize *
+				     cf->csum_size);
+		if (!chunk->data || !chunk->sums) {
+			csum_fill_release(cf);
+			return -ENOMEM;
+		}
 	}
-	return ret;
+	/* without a pool everything is done inline */
+	cf->pool = task_pool_init(0);
+	cf->start = csum_now();
+	cf->last_report = cf->start;
+	return 0;
 }
 
+struct csum_fill_extent {
+	u64 start;
+	u64 len;
+};
+
 static int fill_csum_tree(struct btrfs_trans_handle *trans,
 			  struct btrfs_root *csum_root)
 {
 	struct btrfs_root *extent_root = csum_root->fs_info->extent_root;
+	struct csum_fill_extent *extents;
 	struct btrfs_path *path;
 	struct btrfs_extent_item *ei;
 	struct extent_buffer *leaf;
-	char *buf;
+	struct csum_fill_chunk *chunk;
+	struct csum_fill cf;
 	struct btrfs_key key;
+	int done = 0;
+	int nr;
 	int ret;
+	int i;
 
 	path = btrfs_alloc_path();
-	if (!path)
+	extents = malloc(BTRFS_LEAF_DATA_SIZE(extent_root) /
+			 sizeof(struct btrfs_item) * sizeof(*extents));
+	if (!path || !extents) {
+		btrfs_free_path(path);
+		free(extents);
 		return -ENOMEM;
-
-	key.objectid = 0;
-	key.type = BTRFS_EXTENT_ITEM_KEY;
-	key.offset = 0;
-
-	ret = btrfs_search_slot(NULL, extent_root, &key, path, 0, 0);
-	if (ret < 0) {
+	}
+	ret = csum_fill_init(&cf, trans, csum_root);
+	if (ret) {
 		btrfs_free_path(path);
+		free(extents);
 		return ret;
 	}
 
-	buf = malloc(csum_root->sectorsize);
-	if (!buf) {
-		btrfs_free_path(path);
-		return -ENOMEM;
-	}
+	key.objectid = 0;
+	key.type = BTRFS_EXTENT_ITEM_KEY;
+	key.offset = 0;
 
-	while (1) {
-		if (path->slots[0] >= btrfs_header_nritems(path->nodes[0])) {
-			ret = btrfs_next_leaf(extent_root, path);
-			if (ret < 0)
-				break;
-			if (ret) {
-				ret = 0;
-				break;
+	/*
+	 * Inserting the sums allocates tree blocks, which changes extent
+	 * tree leaves that were already cowed in this transaction in
+	 * place.  So collect the data extents of a leaf, drop the path and
+	 * search again from the last key afterwards.
+	 */
+	while (!done) {
+		ret = btrfs_search_slot(NULL, extent_root, &key, path, 0, 0);
+		if (ret < 0)
+			break;
+		ret = 0;
+		nr = 0;
+		while (1) {
+			leaf = path->nodes[0];
+			if (path->slots[0] >= btrfs_header_nritems(leaf)) {
+				if (nr)
+					break;
+				ret = btrfs_next_leaf(extent_root, path);
+				if (ret > 0) {
+					ret = 0;
+					done = 1;
+				}
+				if (ret || done)
+					break;
+				continue;
 			}
-		}
-		leaf = path->nodes[0];
 
-		btrfs_item_key_to_cpu(leaf, &key, path->slots[0]);
-		if (key.type != BTRFS_EXTENT_ITEM_KEY) {
+			btrfs_item_key_to_cpu(leaf, &key, path->slots[0]);
 			path->slots[0]++;
-			continue;
+			if (key.type != BTRFS_EXTENT_ITEM_KEY)
+				continue;
+			ei = btrfs_item_ptr(leaf, path->slots[0] - 1,
+					    struct btrfs_extent_item);
+			if (!(btrfs_extent_flags(leaf, ei) &
+			      BTRFS_EXTENT_FLAG_DATA))
+				continue;
+			extents[nr].start = key.objectid;
+			extents[nr].len = key.offset;
+			nr++;
 		}
+		btrfs_release_path(path);
+		if (ret)
+			break;
 
-		ei = btrfs_item_ptr(leaf, path->slots[0],
-				    struct btrfs_extent_item);
-		if (!(btrfs_extent_flags(leaf, ei) &
-		      BTRFS_EXTENT_FLAG_DATA)) {
-			path->slots[0]++;
-			continue;
+		for (i = 0; i < nr; i++) {
+			ret = csum_fill_add(&cf, extents[i].start,
+					   extents[i].len);
+			if (ret)
+				break;
 		}
-
-		ret = populate_csum(trans, csum_root, buf, key.objectid,
-				    key.offset);
 		if (ret)
 			break;
-		path->slots[0]++;
+		key.offset++;
 	}
 
+	if (!ret)
+		ret = csum_fill_submit(&cf);
+	/* drain the ring oldest first, keeping the sums in order */
+	for (i = 0; i < CSUM_FILL_SLOTS; i++) {
+		chunk = &cf.chunks[(cf.next + i) % CSUM_FILL_SLOTS];
+		if (!ret) {
+			ret = csum_fill_finish_chunk(&cf, chunk);
+		} else if (chunk->busy) {
+			if (cf.pool)
+				task_pool_wait_work(cf.pool, &chunk->work);
+			chunk->busy = 0;
+		}
+	}
+	if (!ret)
+		csum_fill_report(&cf, 1);
+	csum_fill_release(&cf);
 	btrfs_free_path(path);
-	free(buf);
+	free(extents);
 	return ret;
 }
 
@@ -8403,6 +12094,347 @@ out:
 	return bad_roots;
 }
 
+enum check_stats_format {
+	CHECK_STATS_NONE,
+	CHECK_STATS_TEXT,
+	CHECK_STATS_JSON,
+};
+
+static enum check_stats_format stats_format = CHECK_STATS_NONE;
+/* where the JSON object goes, stdout of the caller */
+static int stats_fd = -1;
+
+/* resource use at a phase boundary */
+struct check_stats_sample {
+	double wall;
+	double user;
+	double sys;
+	u64 blocks;		/* tree blocks read */
+	u64 bytes;		/* bytes read from the devices */
+	long maxrss;		/* KiB */
+};
+
+struct check_phase_stats {
+	const char *name;
+	struct check_stats_sample used;
+};
+
+#define CHECK_STATS_PHASES 8
+
+static struct check_phase_stats check_phases[CHECK_STATS_PHASES];
+static int nr_check_phases;
+static int phase_running;
+static struct check_stats_sample phase_start;
+
+static const char * const read_stat_names[] = {
+	"root", "extent", "chunk", "dev", "fs", "csum", "quota", "uuid",
+	"log", "reloc", "other",
+};
+
+static const char * const check_rec_names[] = {
+	"inode", "shared_node", "extent", "extent_backref", "chunk",
+	"block_group", "dev_extent",
+};
+
+static double timeval_secs(struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+static void check_stats_sample(struct btrfs_fs_info *info,
+			       struct check_stats_sample *sample)
+{
+	struct btrfs_device *device;
+	struct timeval tv;
+	struct rusage ru;
+	int i;
+
+	memset(sample, 0, sizeof(*sample));
+	gettimeofday(&tv, NULL);
+	sample->wall = timeval_secs(&tv);
+	if (!getrusage(RUSAGE_SELF, &ru)) {
+		sample->user = timeval_secs(&ru.ru_utime);
+		sample->sys = timeval_secs(&ru.ru_stime);
+		sample->maxrss = ru.ru_maxrss;
+	}
+	if (!info)
+		return;
+	for (i = 0; i < BTRFS_READ_STAT_TREES; i++)
+		sample->blocks += info->read_stats.blocks[i];
+	list_for_each_entry(device, &info->fs_devices->devices, dev_list)
+		sample->bytes += device->bytes_read;
+}
+
+/*
+ * End the phase being timed, if any, and start timing @name unless it
+ * is NULL.  Only a clock and getrusage() are read, so this is done
+ * whether or not --stats is given.
+ */
+static void check_stats_phase(struct btrfs_fs_info *info, const char *name)
+{
+	struct check_stats_sample now;
+	struct check_stats_sample *used;
+
+	check_stats_sample(info, &now);
+	if (phase_running) {
+		used = &check_phases[nr_check_phases - 1].used;
+		used->wall = now.wall - phase_start.wall;
+		used->user = now.user - phase_start.user;
+		used->sys = now.sys - phase_start.sys;
+		used->blocks = now.blocks - phase_start.blocks;
+		used->bytes = now.bytes - phase_start.bytes;
+		used->maxrss = now.maxrss;
+		phase_running = 0;
+	}
+	if (!name || nr_check_phases == CHECK_STATS_PHASES)
+		return;
+	check_phases[nr_check_phases++].name = name;
+	phase_running = 1;
+	phase_start = now;
+}
+
+/* inode records set up per second of the fs roots phase */
+static double inode_recs_rate(void)
+{
+	int i;
+
+	for (i = 0; i < nr_check_phases; i++) {
+		if (!strcmp(check_phases[i].name,
+			    check_phase_names[CHECK_PHASE_FS_ROOTS]) &&
+		    check_phases[i].used.wall > 0)
+			return check_recs[CHECK_REC_INODE].total /
+			       check_phases[i].used.wall;
+	}
+	return 0;
+}
+
+/* the peak memory of the inode records and their tables, per record */
+static u64 inode_store_per_inode(void)
+{
+	if (!check_recs[CHECK_REC_INODE].peak)
+		return 0;
+	return inode_store.peak / check_recs[CHECK_REC_INODE].peak;
+}
+
+static void print_stats_text(struct btrfs_fs_info *info)
+{
+	struct btrfs_read_stats *stats = &info->read_stats;
+	struct extent_io_tree *cache = &info->extent_cache;
+	struct btrfs_device *device;
+	struct check_stats_sample *used;
+	struct rusage ru;
+	u64 seeks = extent_cursor.nr_seeks + csum_cursor.nr_seeks;
+	u64 nodes = extent_cursor.nr_nodes + csum_cursor.nr_nodes;
+	u64 reads = 0;
+	int i;
+
+	printf("\n%-12s %9s %9s %9s %11s %10s %10s\n", "phase", "wall",
+	       "user", "sys", "tree reads", "dev read", "peak rss");
+	for (i = 0; i < nr_check_phases; i++) {
+		used = &check_phases[i].used;
+		printf("%-12s %8.2fs %8.2fs %8.2fs %11llu %10s",
+		       check_phases[i].name, used->wall, used->user, used->sys,
+		       (unsigned long long)used->blocks,
+		       pretty_size(used->bytes));
+		printf(" %10s\n", pretty_size((u64)used->maxrss << 10));
+	}
+
+	printf("tree blocks read:");
+	for (i = 0; i < BTRFS_READ_STAT_TREES; i++) {
+		if (!stats->blocks[i])
+			continue;
+		printf(" %s %llu", read_stat_names[i],
+		       (unsigned long long)stats->blocks[i]);
+		reads += stats->blocks[i];
+	}
+	printf("\ntree block cache: %llu hits, %llu reads, %.1f%% hit ratio\n",
+	       (unsigned long long)stats->hits, (unsigned long long)reads,
+	       stats->hits + reads ? 100.0 * stats->hits /
+	       (stats->hits + reads) : 0.0);
+	if (seeks)
+		printf("extent and csum tree lookups: %llu, %.2f nodes "
+		       "searched per lookup\n", (unsigned long long)seeks,
+		       (double)nodes / seeks);
+	printf("node cache: %llu hits, %llu misses, %llu evictions, "
+	       "%llu of %llu KiB\n", (unsigned long long)cache->node_hits,
+	       (unsigned long long)cache->node_misses,
+	       (unsigned long long)cache->node_evictions,
+	       (unsigned long long)cache->node_cache_size >> 10,
+	       (unsigned long long)cache->node_cache_max >> 10);
+	printf("readahead: %llu blocks in %llu requests, %llu hits, "
+	       "%llu late, %llu misses\n",
+	       (unsigned long long)stats->reada_blocks,
+	       (unsigned long long)stats->reada_ios,
+	       (unsigned long long)stats->reada_hits,
+	       (unsigned long long)stats->reada_late,
+	       (unsigned long long)stats->reada_misses);
+	list_for_each_entry(device, &info->fs_devices->devices, dev_list)
+		printf("devid %llu %s: %s read in %llu ios\n",
+		       (unsigned long long)device->devid,
+		       device->name ? device->name : "missing",
+		       pretty_size(device->bytes_read),
+		       (unsigned long long)device->total_ios);
+
+	printf("peak records:");
+	for (i = 0; i < CHECK_REC_TYPES; i++)
+		printf("%s %s %llu", i ? "," : "", check_rec_names[i],
+		       (unsigned long long)check_recs[i].peak);
+	if (check_recs[CHECK_REC_INODE].total)
+		printf("\ninode records: %llu, %.0f per second, "
+		       "%llu bytes per inode at peak",
+		       (unsigned long long)check_recs[CHECK_REC_INODE].total,
+		       inode_recs_rate(),
+		       (unsigned long long)inode_store_per_inode());
+	if (check_recs[CHECK_REC_SHARED_NODE].total)
+		printf("\nshared subtrees: %llu walked, %llu reused",
+		       (unsigned long long)
+		       check_recs[CHECK_REC_SHARED_NODE].total,
+		       (unsigned long long)shared_node_reuse);
+	if (!getrusage(RUSAGE_SELF, &ru))
+		printf("\npeak rss: %s", pretty_size((u64)ru.ru_maxrss << 10));
+	printf("\n");
+}
+
+static void print_json_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
+
+static void print_stats_json(struct btrfs_fs_info *info)
+{
+	struct btrfs_read_stats *stats = &info->read_stats;
+	struct extent_io_tree *cache = &info->extent_cache;
+	struct btrfs_device *device;
+	struct check_stats_sample *used;
+	struct rusage ru;
+	u64 seeks = extent_cursor.nr_seeks + csum_cursor.nr_seeks;
+	u64 nodes = extent_cursor.nr_nodes + csum_cursor.nr_nodes;
+	u64 reads = 0;
+	int i;
+
+	printf("{\n  \"phases\": [");
+	for (i = 0; i < nr_check_phases; i++) {
+		used = &check_phases[i].used;
+		printf("%s\n    { \"name\": \"%s\", \"wall_secs\": %.6f, "
+		       "\"user_secs\": %.6f, \"sys_secs\": %.6f, "
+		       "\"tree_blocks_read\": %llu, \"bytes_read\": %llu, "
+		       "\"peak_rss_kib\": %ld }", i ? "," : "",
+		       check_phases[i].name, used->wall, used->user, used->sys,
+		       (unsigned long long)used->blocks,
+		       (unsigned long long)used->bytes, used->maxrss);
+	}
+	printf("\n  ],\n  \"tree_blocks_read\": {");
+	for (i = 0; i < BTRFS_READ_STAT_TREES; i++) {
+		printf("%s \"%s\": %llu", i ? "," : "", read_stat_names[i],
+		       (unsigned long long)stats->blocks[i]);
+		reads += stats->blocks[i];
+	}
+	printf(" },\n  \"tree_block_cache\": { \"hits\": %llu, "
+	       "\"reads\": %llu, \"hit_ratio\": %.4f },\n",
+	       (unsigned long long)stats->hits, (unsigned long long)reads,
+	       stats->hits + reads ? (double)stats->hits /
+	       (stats->hits + reads) : 0.0);
+	printf("  \"lookups\": { \"count\": %llu, "
+	       "\"nodes_per_lookup\": %.2f },\n", (unsigned long long)seeks,
+	       seeks ? (double)nodes / seeks : 0.0);
+	printf("  \"node_cache\": { \"hits\": %llu, \"misses\": %llu, "
+	       "\"evictions\": %llu, \"bytes\": %llu, \"max_bytes\": %llu },\n",
+	       (unsigned long long)cache->node_hits,
+	       (unsigned long long)cache->node_misses,
+	       (unsigned long long)cache->node_evictions,
+	       (unsigned long long)cache->node_cache_size,
+	       (unsigned long long)cache->node_cache_max);
+	printf("  \"readahead\": { \"blocks\": %llu, \"requests\": %llu, "
+	       "\"hits\": %llu, \"late\": %llu, \"misses\": %llu },\n",
+	       (unsigned long long)stats->reada_blocks,
+	       (unsigned long long)stats->reada_ios,
+	       (unsigned long long)stats->reada_hits,
+	       (unsigned long long)stats->reada_late,
+	       (unsigned long long)stats->reada_misses);
+	printf("  \"devices\": [");
+	i = 0;
+	list_for_each_entry(device, &info->fs_devices->devices, dev_list) {
+		printf("%s\n    { \"devid\": %llu, \"path\": ", i++ ? "," : "",
+		       (unsigned long long)device->devid);
+		print_json_string(device->name ? device->name : "");
+		printf(", \"bytes_read\": %llu, \"ios\": %llu }",
+		       (unsigned long long)device->bytes_read,
+		       (unsigned long long)device->total_ios);
+	}
+	printf("\n  ],\n  \"peak_records\": {");
+	for (i = 0; i < CHECK_REC_TYPES; i++)
+		printf("%s \"%s\": %llu", i ? "," : "", check_rec_names[i],
+		       (unsigned long long)check_recs[i].peak);
+	printf(" },\n  \"inode_records\": { \"total\": %llu, "
+	       "\"per_sec\": %.0f, \"bytes_per_inode\": %llu },\n",
+	       (unsigned long long)check_recs[CHECK_REC_INODE].total,
+	       inode_recs_rate(),
+	       (unsigned long long)inode_store_per_inode());
+	printf("  \"shared_subtrees\": { \"walked\": %llu, "
+	       "\"reused\": %llu },\n",
+	       (unsigned long long)check_recs[CHECK_REC_SHARED_NODE].total,
+	       (unsigned long long)shared_node_reuse);
+	if (getrusage(RUSAGE_SELF, &ru))
+		ru.ru_maxrss = 0;
+	printf("  \"peak_rss_kib\": %ld\n}\n", ru.ru_maxrss);
+}
+
+#define VERIFIED_GEN_HEADER "btrfs check verified generation"
+
+static int parse_verified_gen(char *key, char *value, void *data)
+{
+	u64 *gen = data;
+
+	if (!strcmp(key, "generation"))
+		*gen = strtoull(value, NULL, 10);
+	return 0;
+}
+
+/*
+ * The generation of the last check that found no errors, 0 if @path
+ * doesn't exist yet.
+ */
+static int load_verified_gen(struct btrfs_fs_info *info, const char *path,
+			     u64 *gen)
+{
+	int ret;
+
+	*gen = 0;
+	ret = load_state_file(path, VERIFIED_GEN_HEADER, info->fsid,
+			      "verified generation file", parse_verified_gen,
+			      gen);
+	return ret == -ENOENT ? 0 : ret;
+}
+
+static void fill_verified_gen(FILE *f, void *data)
+{
+	struct btrfs_fs_info *info = data;
+
+	fprintf(f, "generation:%llu\n",
+		(unsigned long long)btrfs_super_generation(info->super_copy));
+}
+
+static int save_verified_gen(struct btrfs_fs_info *info, const char *path)
+{
+	int ret;
+
+	ret = save_state_file(path, VERIFIED_GEN_HEADER, info->fsid,
+			      fill_verified_gen, info);
+	if (ret)
+		fprintf(stderr, "ERROR: cannot save %s: %s\n", path,
+			strerror(-ret));
+	return ret;
+}
+
 static struct option long_options[] = {
 	{ "super", 1, NULL, 's' },
 	{ "repair", 0, NULL, 0 },
@@ -8413,6 +12445,14 @@ static struct option long_options[] = {
 	{ "subvol-extents", 1, NULL, 'E' },
 	{ "qgroup-report", 0, NULL, 'Q' },
 	{ "tree-root", 1, NULL, 'r' },
+	{ "direct-io", 0, NULL, 0 },
+	{ "mode", 1, NULL, 'M' },
+	{ "incremental", 1, NULL, 'I' },
+	{ "checkpoint", 1, NULL, 'C' },
+	{ "resume", 0, NULL, 'R' },
+	{ "stats", 2, NULL, 'S' },
+	{ "readahead", 1, NULL, 'A' },
+	{ "mmap", 0, NULL, 'm' },
 	{ NULL, 0, NULL, 0}
 };
 
@@ -8429,6 +12469,24 @@ const char * const cmd_check_usage[] = {
 	"--qgroup-report             print a report on qgroup consistency",
 	"--subvol-extents <subvolid> print subvolume extents and sharing state",
 	"--tree-root <bytenr>        use the given bytenr for the tree root",
+	"--direct-io                 read with O_DIRECT, bypassing the page cache",
+	"--mmap                      read tree blocks from a mapping of the",
+	"                            devices, a read error then ends the check",
+	"--mode <MODE>               original (default) or lowmem, which checks",
+	"                            references with searches and uses less memory",
+	"--incremental <file>        lowmem check of the blocks written since the",
+	"                            generation recorded in <file> by the last",
+	"                            clean run",
+	"--checkpoint <file>         save progress to <file> every 30 seconds and",
+	"                            when interrupted",
+	"--resume                    continue from the progress saved in the",
+	"                            checkpoint",
+	"--stats[=json]              print the time, reads and memory used by",
+	"                            each phase, with json as the only output",
+	"                            on stdout",
+	"--readahead <size>[,<nr>]   read tree blocks ahead of the walks, up to",
+	"                            <size> bytes and <nr> blocks (16M,1024),",
+	"                            0 turns it off",
 	NULL
 };
 
@@ -8446,6 +12504,10 @@ int cmd_check(int argc, char **argv)
 	int option_index = 0;
 	int init_csum_tree = 0;
 	int qgroup_report = 0;
+	int extents_err;
+	int resume = 0;
+	const char *verified_file = NULL;
+	struct sigaction sa;
 	enum btrfs_open_ctree_flags ctree_flags = OPEN_CTREE_EXCLUSIVE;
 
 	while(1) {
@@ -8480,6 +12542,55 @@ int cmd_check(int argc, char **argv)
 			case 'r':
 				tree_root_bytenr = arg_strtou64(optarg);
 				break;
+			case 'M':
+				if (!strcmp(optarg, "original")) {
+					check_mode = CHECK_MODE_ORIGINAL;
+				} else if (!strcmp(optarg, "lowmem")) {
+					check_mode = CHECK_MODE_LOWMEM;
+				} else {
+					fprintf(stderr,
+						"ERROR: unknown check mode: %s\n",
+						optarg);
+					exit(1);
+				}
+				break;
+			case 'I':
+				verified_file = optarg;
+				check_mode = CHECK_MODE_LOWMEM;
+				break;
+			case 'C':
+				progress.file = optarg;
+				break;
+			case 'R':
+				resume = 1;
+				break;
+			case 'm':
+				ctree_flags |= OPEN_CTREE_MMAP;
+				break;
+			case 'A': {
+				char *nr = strchr(optarg, ',');
+
+				if (nr) {
+					*nr++ = 0;
+					reada_blocks = arg_strtou64(nr);
+				}
+				reada_bytes = parse_size(optarg);
+				if (!reada_bytes)
+					reada_blocks = 0;
+				break;
+			}
+			case 'S':
+				if (!optarg || !strcmp(optarg, "text")) {
+					stats_format = CHECK_STATS_TEXT;
+				} else if (!strcmp(optarg, "json")) {
+					stats_format = CHECK_STATS_JSON;
+				} else {
+					fprintf(stderr,
+						"ERROR: unknown stats format: %s\n",
+						optarg);
+					exit(1);
+				}
+				break;
 			case '?':
 			case 'h':
 				usage(cmd_check_usage);
@@ -8500,15 +12611,45 @@ int cmd_check(int argc, char **argv)
 			repair = 1;
 		} else if (option_index == 4) {
 			check_data_csum = 1;
+		} else if (option_index == 9) {
+			ctree_flags |= OPEN_CTREE_DIRECT;
 		}
 	}
+	/* O_DIRECT reads bypass the page cache readahead would fill */
+	if (ctree_flags & OPEN_CTREE_DIRECT)
+		reada_blocks = 0;
 	argc = argc - optind;
 
 	if (check_argc_exact(argc, 1))
 		usage(cmd_check_usage);
 
+	if (check_mode == CHECK_MODE_LOWMEM && repair) {
+		fprintf(stderr,
+			"ERROR: lowmem mode doesn't support repair yet\n");
+		exit(1);
+	}
+	if (resume && !progress.file) {
+		fprintf(stderr, "ERROR: --resume needs --checkpoint\n");
+		exit(1);
+	}
+	if (progress.file && repair) {
+		fprintf(stderr, "ERROR: --checkpoint can't be used with repair\n");
+		exit(1);
+	}
+	/* stdout only carries the JSON object, the rest goes to stderr */
+	if (stats_format == CHECK_STATS_JSON) {
+		fflush(stdout);
+		stats_fd = dup(STDOUT_FILENO);
+		if (stats_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+			fprintf(stderr, "ERROR: cannot set up stdout: %s\n",
+				strerror(errno));
+			exit(1);
+		}
+	}
+
 	radix_tree_init();
 	cache_tree_init(&root_cache);
+	check_stats_phase(NULL, "open");
 
 	if((ret = check_mounted(argv[optind])) < 0) {
 		fprintf(stderr, "Could not check mount status: %s\n", strerror(-ret));
@@ -8532,6 +12673,9 @@ int cmd_check(int argc, char **argv)
 	}
 
 	root = info->fs_root;
+	info->read_stats.reada_probe = stats_format != CHECK_STATS_NONE;
+	btrfs_tree_cursor_init(&extent_cursor, info->extent_root);
+	btrfs_tree_cursor_init(&csum_cursor, info->csum_root);
 
 	/*
 	 * repair mode will force us to commit transaction which
@@ -8567,6 +12711,42 @@ int cmd_check(int argc, char **argv)
 	}
 	printf("Checking filesystem on %s\nUUID: %s\n", argv[optind], uuidbuf);
 
+	progress.info = info;
+	progress.root_cache = &root_cache;
+	if (resume) {
+		ret = check_progress_load();
+		if (ret)
+			goto close_out;
+		if (progress.phase == CHECK_PHASE_DONE) {
+			printf("check already finished, nothing to resume\n");
+			ret = 2;
+			goto close_out;
+		}
+		printf("resuming the check at the %s phase\n",
+		       check_phase_names[progress.phase]);
+	}
+
+	if (verified_file && !resume) {
+		ret = load_verified_gen(info, verified_file, &lowmem_min_gen);
+		if (ret)
+			goto close_out;
+		/* a rolled back filesystem can't be trusted to match */
+		if (lowmem_min_gen > btrfs_super_generation(info->super_copy))
+			lowmem_min_gen = 0;
+		if (lowmem_min_gen)
+			printf("checking blocks newer than generation %llu\n",
+			       (unsigned long long)lowmem_min_gen);
+	}
+	if (progress.file) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = check_sigint;
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+		progress.last_save = time(NULL);
+		if (!resume)
+			check_progress_phase(CHECK_PHASE_EXTENTS);
+	}
+
 	if (!extent_buffer_uptodate(info->tree_root->node) ||
 	    !extent_buffer_uptodate(info->dev_root->node) ||
 	    !extent_buffer_uptodate(info->chunk_root->node)) {
@@ -8578,6 +12758,7 @@ int cmd_check(int argc, char **argv)
 	if (init_extent_tree || init_csum_tree) {
 		struct btrfs_trans_handle *trans;
 
+		check_stats_phase(info, "init-trees");
 		trans = btrfs_start_transaction(info->extent_root, 0);
 		if (IS_ERR(trans)) {
 			fprintf(stderr, "Error starting transaction\n");
@@ -8626,31 +12807,46 @@ int cmd_check(int argc, char **argv)
 		goto close_out;
 	}
 
-	fprintf(stderr, "checking extents\n");
-	ret = check_chunks_and_extents(root);
-	if (ret)
-		fprintf(stderr, "Errors found in extent allocation tree or chunk allocation\n");
+	extents_err = progress.extents_err;
+	if (progress.phase == CHECK_PHASE_EXTENTS) {
+		fprintf(stderr, "checking extents\n");
+		check_stats_phase(info, check_phase_names[CHECK_PHASE_EXTENTS]);
+		if (check_mode == CHECK_MODE_LOWMEM)
+			ret = check_chunks_and_extents_lowmem(info);
+		else
+			ret = check_chunks_and_extents(root);
+		extents_err = ret;
+		if (ret)
+			fprintf(stderr, "Errors found in extent allocation tree or chunk allocation\n");
 
-	ret = repair_root_items(info);
-	if (ret < 0)
-		goto close_out;
-	if (repair) {
-		fprintf(stderr, "Fixed %d roots.\n", ret);
-		ret = 0;
-	} else if (ret > 0) {
-		fprintf(stderr,
-		       "Found %d roots with an outdated root item.\n",
-		       ret);
-		fprintf(stderr,
-			"Please run a filesystem check with the option --repair to fix them.\n");
-		ret = 1;
-		goto close_out;
+		ret = repair_root_items(info);
+		if (ret < 0)
+			goto close_out;
+		if (repair) {
+			fprintf(stderr, "Fixed %d roots.\n", ret);
+			ret = 0;
+		} else if (ret > 0) {
+			fprintf(stderr,
+			       "Found %d roots with an outdated root item.\n",
+			       ret);
+			fprintf(stderr,
+				"Please run a filesystem check with the option --repair to fix them.\n");
+			ret = 1;
+			goto close_out;
+		}
+		progress.extents_err = extents_err;
+		check_progress_phase(CHECK_PHASE_SPACE_CACHE);
 	}
 
-	fprintf(stderr, "checking free space cache\n");
-	ret = check_space_cache(root);
-	if (ret)
-		goto out;
+	if (progress.phase == CHECK_PHASE_SPACE_CACHE) {
+		fprintf(stderr, "checking free space cache\n");
+		check_stats_phase(info,
+				  check_phase_names[CHECK_PHASE_SPACE_CACHE]);
+		ret = check_space_cache(root);
+		if (ret)
+			goto out;
+		check_progress_phase(CHECK_PHASE_FS_ROOTS);
+	}
 
 	/*
 	 * We used to have to have these hole extents in between our real
@@ -8660,18 +12856,33 @@ int cmd_check(int argc, char **argv)
 	 */
 	no_holes = btrfs_fs_incompat(root->fs_info,
 				     BTRFS_FEATURE_INCOMPAT_NO_HOLES);
-	fprintf(stderr, "checking fs roots\n");
-	ret = check_fs_roots(root, &root_cache);
-	if (ret)
-		goto out;
+	if (progress.phase == CHECK_PHASE_FS_ROOTS) {
+		fprintf(stderr, "checking fs roots\n");
+		check_stats_phase(info, check_phase_names[CHECK_PHASE_FS_ROOTS]);
+		if (check_mode == CHECK_MODE_LOWMEM)
+			ret = check_fs_roots_lowmem(info);
+		else
+			ret = check_fs_roots(root, &root_cache);
+		if (ret)
+			goto out;
+		check_progress_phase(CHECK_PHASE_CSUMS);
+	}
 
-	fprintf(stderr, "checking csums\n");
-	ret = check_csums(root);
-	if (ret)
-		goto out;
+	if (progress.phase == CHECK_PHASE_CSUMS) {
+		fprintf(stderr, "checking csums\n");
+		check_stats_phase(info, check_phase_names[CHECK_PHASE_CSUMS]);
+		ret = check_csums(root);
+		if (ret)
+			goto out;
+		check_progress_phase(CHECK_PHASE_ROOT_REFS);
+	}
 
 	fprintf(stderr, "checking root refs\n");
-	ret = check_root_refs(root, &root_cache);
+	check_stats_phase(info, check_phase_names[CHECK_PHASE_ROOT_REFS]);
+	if (check_mode == CHECK_MODE_LOWMEM)
+		ret = check_root_refs_lowmem(info);
+	else
+		ret = check_root_refs(root, &root_cache);
 	if (ret)
 		goto out;
 
@@ -8699,6 +12910,7 @@ int cmd_check(int argc, char **argv)
 	if (info->quota_enabled) {
 		int err;
 		fprintf(stderr, "checking quota groups\n");
+		check_stats_phase(info, "quota");
 		err = qgroup_verify_all(info);
 		if (err)
 			goto out;
@@ -8709,6 +12921,9 @@ int cmd_check(int argc, char **argv)
 		ret = 1;
 	}
 out:
+	check_stats_phase(info, NULL);
+	if (progress.file)
+		check_progress_phase(CHECK_PHASE_DONE);
 	print_qgroup_report(0);
 	if (found_old_backref) { /*
 		 * there was a disk format change when mixed
@@ -8721,6 +12936,12 @@ out:
 		       "backup data and re-format the FS. *\n\n");
 		ret = 1;
 	}
+	if (verified_file && !ret && !extents_err)
+		save_verified_gen(info, verified_file);
+	if (lowmem_min_gen)
+		printf("verified %llu tree blocks written after generation %llu\n",
+		       (unsigned long long)lowmem_blocks,
+		       (unsigned long long)lowmem_min_gen);
 	printf("found %llu bytes used err is %d\n",
 	       (unsigned long long)bytes_used, ret);
 	printf("total csum bytes: %llu\n",(unsigned long long)total_csum_bytes);
@@ -8736,9 +12957,18 @@ out:
 		(unsigned long long)data_bytes_allocated,
 		(unsigned long long)data_bytes_referenced);
 	printf("%s\n", BTRFS_BUILD_VERSION);
+	if (stats_format == CHECK_STATS_TEXT)
+		print_stats_text(info);
+	else if (stats_format == CHECK_STATS_JSON) {
+		fflush(stdout);
+		dup2(stats_fd, STDOUT_FILENO);
+		print_stats_json(info);
+	}
 
 	free_root_recs_tree(&root_cache);
 close_out:
+	btrfs_tree_cursor_release(&extent_cursor);
+	btrfs_tree_cursor_release(&csum_cursor);
 	close_ctree(root);
 err_out:
 	return ret;
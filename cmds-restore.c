@@ -54,6 +54,10 @@ static int ignore_errors = 0;
 static int overwrite = 0;
 static int get_xattrs = 0;
 static int dry_run = 0;
+static int direct_io = 0;
+
+/* inode and file extent lookups, files are mostly met in inode order */
+static struct btrfs_tree_cursor file_cursor;
 
 #define LZO_LEN 4
 #define PAGE_CACHE_SIZE 4096
@@ -296,7 +300,6 @@ static int copy_one_extent(struct btrfs_root *root, int fd,
 	u64 count = 0;
 	int compress;
 	int ret;
-	int dev_fd;
 	int mirror_num = 1;
 	int num_copies;
 
@@ -339,7 +342,6 @@ again:
 		goto out;
 	}
 	device = multi->stripes[0].dev;
-	dev_fd = device->fd;
 	device->total_ios++;
 	dev_bytenr = multi->stripes[0].physical;
 	kfree(multi);
@@ -347,7 +349,7 @@ again:
 	if (size_left < length)
 		length = size_left;
 
-	done = pread(dev_fd, inbuf+count, length, dev_bytenr);
+	done = btrfs_device_pread(device, inbuf+count, length, dev_bytenr);
 	/* Need both checks, or we miss negative values due to u64 conversion */
 	if (done < 0 || done < length) {
 		num_copies = btrfs_num_copies(&root->fs_info->mapping_tree,
@@ -564,27 +566,25 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 	int loops = 0;
 	u64 found_size = 0;
 
-	path = btrfs_alloc_path();
-	if (!path) {
-		fprintf(stderr, "Ran out of memory\n");
-		return -ENOMEM;
+	if (file_cursor.root != root) {
+		btrfs_tree_cursor_release(&file_cursor);
+		btrfs_tree_cursor_init(&file_cursor, root);
 	}
+	path = &file_cursor.path;
 
-	ret = btrfs_lookup_inode(NULL, root, path, key, 0);
+	ret = btrfs_tree_cursor_seek(&file_cursor, key);
 	if (ret == 0) {
 		inode_item = btrfs_item_ptr(path->nodes[0], path->slots[0],
 				    struct btrfs_inode_item);
 		found_size = btrfs_inode_size(path->nodes[0], inode_item);
 	}
-	btrfs_release_path(path);
 
 	key->offset = 0;
 	key->type = BTRFS_EXTENT_DATA_KEY;
 
-	ret = btrfs_search_slot(NULL, root, key, path, 0, 0);
+	ret = btrfs_tree_cursor_seek(&file_cursor, key);
 	if (ret < 0) {
 		fprintf(stderr, "Error searching %d\n", ret);
-		btrfs_free_path(path);
 		return ret;
 	}
 
@@ -594,11 +594,9 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 		if (ret < 0) {
 			fprintf(stderr, "Error getting next leaf %d\n",
 				ret);
-			btrfs_free_path(path);
 			return ret;
 		} else if (ret > 0) {
 			/* No more leaves to search */
-			btrfs_free_path(path);
 			return 0;
 		}
 		leaf = path->nodes[0];
@@ -621,11 +619,9 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 				ret = next_leaf(root, path);
 				if (ret < 0) {
 					fprintf(stderr, "Error searching %d\n", ret);
-					btrfs_free_path(path);
 					return ret;
 				} else if (ret) {
 					/* No more leaves to search */
-					btrfs_free_path(path);
 					goto set_size;
 				}
 				leaf = path->nodes[0];
@@ -644,7 +640,6 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 		if (compression >= BTRFS_COMPRESS_LAST) {
 			fprintf(stderr, "Don't support compression yet %d\n",
 				compression);
-			btrfs_free_path(path);
 			return -1;
 		}
 
@@ -653,14 +648,12 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 		if (extent_type == BTRFS_FILE_EXTENT_INLINE) {
 			ret = copy_one_inline(fd, path, found_key.offset);
 			if (ret) {
-				btrfs_free_path(path);
 				return -1;
 			}
 		} else if (extent_type == BTRFS_FILE_EXTENT_REG) {
 			ret = copy_one_extent(root, fd, leaf, fi,
 					      found_key.offset);
 			if (ret) {
-				btrfs_free_path(path);
 				return ret;
 			}
 		} else {
@@ -670,7 +663,6 @@ next:
 		path->slots[0]++;
 	}
 
-	btrfs_free_path(path);
 set_size:
 	if (found_size) {
 		ret = ftruncate(fd, (loff_t)found_size);
@@ -1003,13 +995,16 @@ static struct btrfs_root *open_fs(const char *dev, u64 root_location,
 {
 	struct btrfs_fs_info *fs_info = NULL;
 	struct btrfs_root *root = NULL;
+	enum btrfs_open_ctree_flags flags = OPEN_CTREE_PARTIAL;
 	u64 bytenr;
 	int i;
 
+	if (direct_io)
+		flags |= OPEN_CTREE_DIRECT;
 	for (i = super_mirror; i < BTRFS_SUPER_MIRROR_MAX; i++) {
 		bytenr = btrfs_sb_offset(i);
 		fs_info = open_ctree_fs_info(dev, bytenr, root_location,
-					     OPEN_CTREE_PARTIAL);
+					     flags);
 		if (fs_info)
 			break;
 		fprintf(stderr, "Could not open root, trying backup super\n");
@@ -1125,6 +1120,7 @@ out:
 static struct option long_options[] = {
 	{ "path-regex", 1, NULL, 256},
 	{ "dry-run", 0, NULL, 'D'},
+	{ "direct-io", 0, NULL, 257},
 	{ NULL, 0, NULL, 0}
 };
 
@@ -1149,6 +1145,8 @@ const char * const cmd_restore_usage[] = {
 	"                you have to use following syntax (possibly quoted):",
 	"                ^/(|home(|/username(|/Desktop(|/.*))))$",
 	"-c              ignore case (--path-regrex only)",
+	"--direct-io     read the filesystem with O_DIRECT, bypassing the",
+	"                page cache",
 	NULL
 };
 
@@ -1226,6 +1224,9 @@ int cmd_restore(int argc, char **argv)
 			case 256:
 				match_regstr = optarg;
 				break;
+			case 257:
+				direct_io = 1;
+				break;
 			case 'x':
 				get_xattrs = 1;
 				break;
@@ -1325,6 +1326,7 @@ int cmd_restore(int argc, char **argv)
 out:
 	if (mreg)
 		regfree(mreg);
+	btrfs_tree_cursor_release(&file_cursor);
 	close_ctree(root);
 	return !!ret;
 }
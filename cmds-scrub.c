@@ -34,12 +34,14 @@
 #include <ctype.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <getopt.h>
 
 #include "ctree.h"
 #include "ioctl.h"
 #include "utils.h"
 #include "volumes.h"
 #include "disk-io.h"
+#include "scrub-offline.h"
 
 #include "commands.h"
 
@@ -1803,10 +1805,83 @@ out:
 	return !!err;
 }
 
+static const char * const cmd_scrub_offline_usage[] = {
+	"btrfs scrub offline [-r] [-l <limit>] [--checkpoint <file> [--resume]] <device>",
+	"Scrub an unmounted filesystem",
+	"",
+	"Tree blocks and data of every copy are read and verified, and bad",
+	"copies are rewritten from good ones.",
+	"",
+	"-r                 read only mode, don't repair",
+	"-l <limit>         read at most <limit> bytes per second from each device",
+	"--checkpoint <file> save progress to <file> every 30 seconds and on exit",
+	"--resume           continue from the progress saved in the checkpoint",
+	NULL
+};
+
+static int cmd_scrub_offline(int argc, char **argv)
+{
+	struct scrub_offline_args args = { 0 };
+	char *path;
+	int ret;
+
+	optind = 1;
+	while (1) {
+		int c;
+		static const struct option long_options[] = {
+			{ "checkpoint", 1, NULL, 'C' },
+			{ "resume", 0, NULL, 'R' },
+			{ NULL, 0, NULL, 0 }
+		};
+
+		c = getopt_long(argc, argv, "rl:", long_options, NULL);
+		if (c < 0)
+			break;
+		switch (c) {
+		case 'r':
+			args.readonly = 1;
+			break;
+		case 'l':
+			args.limit = parse_size(optarg);
+			break;
+		case 'C':
+			args.checkpoint = optarg;
+			break;
+		case 'R':
+			args.resume = 1;
+			break;
+		default:
+			usage(cmd_scrub_offline_usage);
+		}
+	}
+
+	if (check_argc_exact(argc - optind, 1))
+		usage(cmd_scrub_offline_usage);
+	if (args.resume && !args.checkpoint) {
+		fprintf(stderr, "ERROR: --resume needs --checkpoint\n");
+		return 1;
+	}
+
+	path = argv[optind];
+	ret = check_mounted(path);
+	if (ret < 0) {
+		fprintf(stderr, "ERROR: could not check mount status of %s: "
+			"%s\n", path, strerror(-ret));
+		return 1;
+	} else if (ret) {
+		fprintf(stderr, "ERROR: %s is mounted, use scrub start\n",
+			path);
+		return 1;
+	}
+
+	return btrfs_scrub_offline(path, &args);
+}
+
 const struct cmd_group scrub_cmd_group = {
 	scrub_cmd_group_usage, NULL, {
 		{ "start", cmd_scrub_start, cmd_scrub_start_usage, NULL, 0 },
 		{ "cancel", cmd_scrub_cancel, cmd_scrub_cancel_usage, NULL, 0 },
+		{ "offline", cmd_scrub_offline, cmd_scrub_offline_usage, NULL, 0 },
 		{ "resume", cmd_scrub_resume, cmd_scrub_resume_usage, NULL, 0 },
 		{ "status", cmd_scrub_status, cmd_scrub_status_usage, NULL, 0 },
 		NULL_CMD_STRUCT
@@ -2905,3 +2905,143 @@ int btrfs_previous_extent_item(struct btrfs_root *root,
 	}
 	return 1;
 }
+
+/*
+ * Tree cursors: keys looked up in sorted order mostly land in the leaf of
+ * the previous lookup or close to it.  A cursor keeps its path between
+ * lookups and climbs only up to the first node whose key range holds the
+ * new key, then searches down from there instead of from the root.
+ *
+ * The caller may move the path of a cursor with btrfs_next_leaf() or by
+ * changing slots, but the tree must not be modified while the cursor is
+ * used.  The path is dropped when a new transaction has started or the
+ * root node changed since the last seek.
+ */
+void btrfs_tree_cursor_init(struct btrfs_tree_cursor *cur,
+			    struct btrfs_root *root)
+{
+	memset(cur, 0, sizeof(*cur));
+	cur->root = root;
+	btrfs_init_path(&cur->path);
+}
+
+void btrfs_tree_cursor_release(struct btrfs_tree_cursor *cur)
+{
+	btrfs_release_path(&cur->path);
+	cur->top = NULL;
+}
+
+/*
+ * Does the block at @level of the path hold @key?  Only the pointers
+ * around it in its parent are known, a block at either end of its parent
+ * is left to the parent.
+ */
+static int cursor_block_holds(struct btrfs_path *path, int level,
+			      struct btrfs_key *key)
+{
+	struct extent_buffer *parent = path->nodes[level + 1];
+	int slot = path->slots[level + 1];
+	struct btrfs_disk_key disk_key;
+
+	if (slot + 1 >= btrfs_header_nritems(parent))
+		return 0;
+	btrfs_node_key(parent, &disk_key, slot);
+	if (btrfs_comp_keys(&disk_key, key) > 0)
+		return 0;
+	btrfs_node_key(parent, &disk_key, slot + 1);
+	return btrfs_comp_keys(&disk_key, key) > 0;
+}
+
+/*
+ * Position the cursor at @key.  Returns what btrfs_search_slot() returns
+ * for a read-only search and leaves the path the same way.
+ */
+int btrfs_tree_cursor_seek(struct btrfs_tree_cursor *cur,
+			   struct btrfs_key *key)
+{
+	struct btrfs_root *root = cur->root;
+	struct btrfs_path *path = &cur->path;
+	struct extent_buffer *b;
+	int level = 0;
+	int top;
+	int slot;
+	int ret;
+
+	cur->nr_seeks++;
+	top = cur->top ? btrfs_header_level(cur->top) : 0;
+	if (!cur->top || cur->top != root->node ||
+	    path->nodes[top] != cur->top ||
+	    cur->generation != root->fs_info->generation) {
+		btrfs_tree_cursor_release(cur);
+		ret = btrfs_search_slot(NULL, root, key, path, 0, 0);
+		if (ret < 0) {
+			btrfs_release_path(path);
+			return ret;
+		}
+		cur->top = root->node;
+		cur->generation = root->fs_info->generation;
+		cur->nr_nodes += btrfs_header_level(root->node) + 1;
+		return ret;
+	}
+
+	/* a path with holes left by the caller just climbs higher */
+	while (level < top && !(path->nodes[level] &&
+				path->nodes[level + 1] &&
+				cursor_block_holds(path, level, key)))
+		level++;
+
+	b = path->nodes[level];
+	while (1) {
+		cur->nr_nodes++;
+		ret = bin_search(b, key, level, &slot);
+		if (level == 0) {
+			path->slots[0] = slot;
+			return ret;
+		}
+		if (ret && slot > 0)
+			slot--;
+		path->slots[level] = slot;
+		if (path->reada)
+			reada_for_search(root, path, level, slot,
+					 key->objectid);
+		b = read_node_slot(root, b, slot);
+		if (!extent_buffer_uptodate(b)) {
+			free_extent_buffer(b);
+			btrfs_tree_cursor_release(cur);
+			return -EIO;
+		}
+		level--;
+		free_extent_buffer(path->nodes[level]);
+		path->nodes[level] = b;
+		if (check_block(root, path, level)) {
+			btrfs_tree_cursor_release(cur);
+			return -EIO;
+		}
+	}
+}
+
+/*
+ * Look up @nr keys sorted in increasing order.  @fn is called for each of
+ * them with the cursor positioned as btrfs_search_slot() would leave it
+ * and @found set on an exact match.  Stops at the first seek error or
+ * non-zero return of @fn and returns it.
+ */
+int btrfs_tree_cursor_lookup_keys(struct btrfs_tree_cursor *cur,
+				  struct btrfs_key *keys, int nr,
+				  int (*fn)(struct btrfs_tree_cursor *cur,
+					    int index, int found, void *data),
+				  void *data)
+{
+	int ret;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		ret = btrfs_tree_cursor_seek(cur, &keys[i]);
+		if (ret < 0)
+			return ret;
+		ret = fn(cur, i, !ret, data);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
@@ -38,6 +38,7 @@
 struct btrfs_root;
 struct btrfs_trans_handle;
 struct btrfs_free_space_ctl;
+struct btrfs_free_index;
 #define BTRFS_MAGIC 0x4D5F53665248425FULL /* ascii _BHRfS_M, no null */
 
 #define BTRFS_MAX_MIRRORS 3
@@ -551,6 +552,20 @@ struct btrfs_path {
 	unsigned int skip_check_block:1;
 };
 
+/*
+ * a read-only path kept between lookups of keys arriving in sorted order,
+ * see btrfs_tree_cursor_seek() in ctree.c
+ */
+struct btrfs_tree_cursor {
+	struct btrfs_root *root;
+	struct btrfs_path path;
+	/* the root node and generation the path was searched in */
+	struct extent_buffer *top;
+	u64 generation;
+	u64 nr_seeks;
+	u64 nr_nodes;		/* nodes binary searched by all seeks */
+};
+
 /*
  * items in the extent btree are used to record the objectid of the
  * owner of the block and the number of references
@@ -925,12 +940,19 @@ struct btrfs_block_group_cache {
 	struct btrfs_block_group_item item;
 	struct btrfs_space_info *space_info;
 	struct btrfs_free_space_ctl *free_space_ctl;
+	struct btrfs_free_index *free_index;
 	u64 pinned;
 	u64 flags;
 	int cached;
 	int ro;
 };
 
+/* how find_free_extent() picks free space inside a block group */
+enum btrfs_alloc_policy {
+	BTRFS_ALLOC_NEXT_FIT,
+	BTRFS_ALLOC_BEST_FIT,
+};
+
 struct btrfs_extent_ops {
        int (*alloc_extent)(struct btrfs_root *root, u64 num_bytes,
 		           u64 hint_byte, struct btrfs_key *ins);
@@ -938,6 +960,46 @@ struct btrfs_extent_ops {
 		          u64 num_bytes);
 };
 
+/* totals of the tree block writeback done by transaction commits */
+struct btrfs_commit_stats {
+	u64 commits;
+	u64 blocks;		/* tree blocks written, counting each copy */
+	u64 bytes;
+	u64 ios;		/* write calls issued */
+	u64 merged;		/* block writes merged into a preceding one */
+	u64 usecs;		/* wall time spent writing blocks back */
+};
+
+/* the trees tree block reads are counted by, see btrfs_read_stat_tree() */
+enum btrfs_read_stat_tree {
+	BTRFS_READ_STAT_ROOT,
+	BTRFS_READ_STAT_EXTENT,
+	BTRFS_READ_STAT_CHUNK,
+	BTRFS_READ_STAT_DEV,
+	BTRFS_READ_STAT_FS,	/* the fs tree and all subvolumes */
+	BTRFS_READ_STAT_CSUM,
+	BTRFS_READ_STAT_QUOTA,
+	BTRFS_READ_STAT_UUID,
+	BTRFS_READ_STAT_LOG,
+	BTRFS_READ_STAT_RELOC,
+	BTRFS_READ_STAT_OTHER,
+	BTRFS_READ_STAT_TREES,
+};
+
+/* totals of the tree block reads done through read_tree_block() */
+struct btrfs_read_stats {
+	u64 hits;		/* blocks found up to date in the cache */
+	u64 blocks[BTRFS_READ_STAT_TREES];	/* blocks read, by owner */
+	u64 bytes;
+	/* see readahead_tree_blocks() and btrfs_reada_account() */
+	u64 reada_blocks;	/* blocks read ahead */
+	u64 reada_ios;		/* readahead requests, after merging */
+	u64 reada_hits;		/* blocks read that had been read ahead */
+	u64 reada_late;		/* hits not in memory yet when read */
+	u64 reada_misses;	/* blocks read that had not been read ahead */
+	int reada_probe;	/* count late hits, a syscall each */
+};
+
 struct btrfs_device;
 struct btrfs_fs_devices;
 struct btrfs_fs_info {
@@ -991,11 +1053,13 @@ struct btrfs_fs_info {
 	struct btrfs_fs_devices *fs_devices;
 	struct list_head space_info;
 	int system_allocs;
+	enum btrfs_alloc_policy alloc_policy;
 
 	unsigned int readonly:1;
 	unsigned int on_restoring:1;
 	unsigned int is_chunk_recover:1;
 	unsigned int quota_enabled:1;
+	unsigned int ignore_space_cache:1;
 
 	int (*free_extent_hook)(struct btrfs_trans_handle *trans,
 				struct btrfs_root *root,
@@ -1004,6 +1068,9 @@ struct btrfs_fs_info {
 				int refs_to_drop);
 	struct cache_tree *fsck_extent_cache;
 	struct cache_tree *corrupt_blocks;
+
+	struct btrfs_commit_stats commit_stats;
+	struct btrfs_read_stats read_stats;
 };
 
 /*
@@ -2170,6 +2237,8 @@ int btrfs_fix_block_accounting(struct btrfs_trans_handle *trans,
 void btrfs_pin_extent(struct btrfs_fs_info *fs_info, u64 bytenr, u64 num_bytes);
 void btrfs_unpin_extent(struct btrfs_fs_info *fs_info,
 			u64 bytenr, u64 num_bytes);
+int btrfs_set_free_space(struct btrfs_fs_info *info, u64 start, u64 end);
+int btrfs_clear_free_space(struct btrfs_fs_info *info, u64 start, u64 end);
 int btrfs_extent_post_op(struct btrfs_trans_handle *trans,
 			 struct btrfs_root *root);
 struct btrfs_block_group_cache *btrfs_lookup_block_group(struct
@@ -2192,6 +2261,10 @@ int btrfs_alloc_extent(struct btrfs_trans_handle *trans,
 int btrfs_lookup_extent_info(struct btrfs_trans_handle *trans,
 			     struct btrfs_root *root, u64 bytenr,
 			     u64 offset, int metadata, u64 *refs, u64 *flags);
+int btrfs_lookup_extent_info_cursor(struct btrfs_tree_cursor *cur,
+				    u64 bytenr, u64 offset, int metadata,
+				    u64 *refs, u64 *flags);
+u64 hash_extent_data_ref(u64 root_objectid, u64 owner, u64 offset);
 int btrfs_set_block_flags(struct btrfs_trans_handle *trans,
 			  struct btrfs_root *root,
 			  u64 bytenr, int level, u64 flags);
@@ -2337,6 +2410,16 @@ int btrfs_set_item_key_safe(struct btrfs_root *root, struct btrfs_path *path,
 void btrfs_set_item_key_unsafe(struct btrfs_root *root,
 			       struct btrfs_path *path,
 			       struct btrfs_key *new_key);
+void btrfs_tree_cursor_init(struct btrfs_tree_cursor *cur,
+			    struct btrfs_root *root);
+void btrfs_tree_cursor_release(struct btrfs_tree_cursor *cur);
+int btrfs_tree_cursor_seek(struct btrfs_tree_cursor *cur,
+			   struct btrfs_key *key);
+int btrfs_tree_cursor_lookup_keys(struct btrfs_tree_cursor *cur,
+				  struct btrfs_key *keys, int nr,
+				  int (*fn)(struct btrfs_tree_cursor *cur,
+					    int index, int found, void *data),
+				  void *data);
 
 /* root-item.c */
 int btrfs_add_root_ref(struct btrfs_trans_handle *trans,
@@ -2425,6 +2508,9 @@ int btrfs_insert_inline_extent(struct btrfs_trans_handle *trans,
 int btrfs_csum_file_block(struct btrfs_trans_handle *trans,
 			  struct btrfs_root *root, u64 alloc_end,
 			  u64 bytenr, char *data, size_t len);
+int btrfs_insert_csums(struct btrfs_trans_handle *trans,
+		       struct btrfs_root *root, u64 bytenr, u64 nr_sums,
+		       void *sums);
 int btrfs_csum_truncate(struct btrfs_trans_handle *trans,
 			struct btrfs_root *root, struct btrfs_path *path,
 			u64 isize);
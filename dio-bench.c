@@ -0,0 +1,159 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Tree block sized reads of a device or image through the page cache
+ * against O_DIRECT with the bounce buffer pool: sequential and random
+ * throughput, and how much of the file is left in the page cache.
+ *
+ * usage: dio-bench <device or image> [MiB to read] [block size in KiB]
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "kerncompat.h"
+#include "direct-io.h"
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* MiB of the first @size bytes of @fd in the page cache */
+static double cached_mib(int fd, u64 size)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned char *vec;
+	u64 pages = (size + page - 1) / page;
+	u64 resident = 0;
+	u64 i;
+	void *map;
+
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	vec = malloc(pages);
+	if (vec && !mincore(map, size, vec)) {
+		for (i = 0; i < pages; i++)
+			resident += vec[i] & 1;
+	}
+	free(vec);
+	munmap(map, size);
+	return (double)resident * page / (1024 * 1024);
+}
+
+static double run(int fd, int direct, char *buf, u64 size, u32 bs,
+		  int random)
+{
+	u64 nr = size / bs;
+	u64 offset;
+	double t;
+	ssize_t ret;
+	u64 i;
+
+	srand(1);
+	t = now();
+	for (i = 0; i < nr; i++) {
+		offset = random ? (((u64)rand() << 31) ^ rand()) % nr : i;
+		offset *= bs;
+		if (direct)
+			ret = btrfs_direct_pread(fd, buf, bs, offset);
+		else
+			ret = pread(fd, buf, bs, offset);
+		if (ret != bs) {
+			fprintf(stderr, "short read at %llu\n",
+				(unsigned long long)offset);
+			exit(1);
+		}
+	}
+	return size / (now() - t) / (1024 * 1024);
+}
+
+int main(int argc, char **argv)
+{
+	u64 size = 256;
+	u32 bs = 16;
+	u64 end;
+	double seq;
+	double rnd;
+	char *buf;
+	int direct_fd;
+	int fd;
+	int i;
+
+	if (argc < 2) {
+		fprintf(stderr,
+			"usage: dio-bench <device or image> [MiB] [block KiB]\n");
+		return 1;
+	}
+	if (argc > 2)
+		size = strtoull(argv[2], NULL, 10);
+	if (argc > 3)
+		bs = atoi(argv[3]);
+	size <<= 20;
+	bs <<= 10;
+
+	fd = open(argv[1], O_RDONLY);
+	direct_fd = btrfs_direct_open(argv[1]);
+	if (fd < 0 || direct_fd < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	end = lseek(fd, 0, SEEK_END);
+	size = min(size, end / bs * bs);
+	if (!bs || !size) {
+		fprintf(stderr, "nothing to read\n");
+		return 1;
+	}
+	/* an extent buffer's data is not page aligned either */
+	buf = malloc(bs + 16);
+	if (!buf) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	buf += 16;
+
+	printf("%llu MiB in %u KiB reads, MiB/s\n",
+	       (unsigned long long)(size >> 20), bs >> 10);
+	printf("%-14s %12s %12s %14s\n", "", "sequential", "random",
+	       "cached MiB");
+	for (i = 0; i < 3; i++) {
+		/* page cache cold, page cache warm, then direct */
+		if (i != 1)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		seq = run(i == 2 ? direct_fd : fd, i == 2, buf, size, bs, 0);
+		if (i != 1)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		rnd = run(i == 2 ? direct_fd : fd, i == 2, buf, size, bs, 1);
+		printf("%-14s %12.1f %12.1f %14.1f\n",
+		       i == 0 ? "page cache" : i == 1 ? "warm cache" : "direct",
+		       seq, rnd, cached_mib(fd, size));
+	}
+
+	btrfs_dio_pool_release();
+	free(buf - 16);
+	close(direct_fd);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "kerncompat.h"
+#include "direct-io.h"
+
+/* bounce buffers kept around between reads */
+#define DIO_POOL_MAX	8
+
+static void *dio_pool[DIO_POOL_MAX];
+static int dio_pool_nr;
+static pthread_mutex_t dio_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int btrfs_direct_open(const char *path)
+{
+	return open(path, O_RDONLY | O_DIRECT);
+}
+
+void *btrfs_dio_buf_get(void)
+{
+	void *buf = NULL;
+
+	pthread_mutex_lock(&dio_pool_lock);
+	if (dio_pool_nr)
+		buf = dio_pool[--dio_pool_nr];
+	pthread_mutex_unlock(&dio_pool_lock);
+
+	if (!buf && posix_memalign(&buf, BTRFS_DIO_ALIGN, BTRFS_DIO_BUFSIZE))
+		buf = NULL;
+	return buf;
+}
+
+void btrfs_dio_buf_put(void *buf)
+{
+	if (!buf)
+		return;
+	pthread_mutex_lock(&dio_pool_lock);
+	if (dio_pool_nr < DIO_POOL_MAX) {
+		dio_pool[dio_pool_nr++] = buf;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&dio_pool_lock);
+	free(buf);
+}
+
+void btrfs_dio_pool_release(void)
+{
+	pthread_mutex_lock(&dio_pool_lock);
+	while (dio_pool_nr)
+		free(dio_pool[--dio_pool_nr]);
+	pthread_mutex_unlock(&dio_pool_lock);
+}
+
+static inline int dio_aligned(unsigned long val)
+{
+	return !(val & (BTRFS_DIO_ALIGN - 1));
+}
+
+/* aligned reads straight into the caller's buffer */
+static ssize_t direct_pread_aligned(int fd, char *buf, size_t count,
+				    off_t offset)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < count) {
+		ret = pread(fd, buf + done, count - done, offset + done);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			break;
+		done += ret;
+		/* a short read that is not aligned is the end of the file */
+		if (!dio_aligned(ret))
+			break;
+	}
+	return done;
+}
+
+/*
+ * pread() on a file descriptor opened by btrfs_direct_open().  Any
+ * buffer, offset and length work: what is not aligned is read into a
+ * bounce buffer covering the surrounding blocks and copied out.
+ */
+ssize_t btrfs_direct_pread(int fd, void *buf, size_t count, off_t offset)
+{
+	char *bounce;
+	size_t done = 0;
+	size_t len;
+	size_t skip;
+	off_t start;
+	ssize_t ret;
+
+	if (dio_aligned((unsigned long)buf) && dio_aligned(count) &&
+	    dio_aligned(offset))
+		return direct_pread_aligned(fd, buf, count, offset);
+
+	bounce = btrfs_dio_buf_get();
+	if (!bounce) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	while (done < count) {
+		start = round_down(offset + done, BTRFS_DIO_ALIGN);
+		skip = offset + done - start;
+		len = min_t(size_t, BTRFS_DIO_BUFSIZE,
+			    round_up(skip + count - done, BTRFS_DIO_ALIGN));
+
+		ret = direct_pread_aligned(fd, bounce, len, start);
+		if (ret < 0) {
+			btrfs_dio_buf_put(bounce);
+			return ret;
+		}
+		if (ret <= skip)
+			break;
+		ret = min_t(size_t, ret - skip, count - done);
+		memcpy(buf + done, bounce + skip, ret);
+		done += ret;
+		if (skip + ret < len && done < count)
+			break;
+	}
+	btrfs_dio_buf_put(bounce);
+	return done;
+}
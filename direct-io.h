@@ -0,0 +1,38 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_DIRECT_IO_H__
+#define __BTRFS_DIRECT_IO_H__
+
+#include <sys/types.h>
+#include "kerncompat.h"
+
+/*
+ * Reads that bypass the page cache.  O_DIRECT wants the buffer, offset
+ * and length aligned to the logical block size of the device; 4KiB
+ * covers every device we run on.  Requests that are not aligned go
+ * through bounce buffers kept in a small pool.
+ */
+#define BTRFS_DIO_ALIGN		4096
+#define BTRFS_DIO_BUFSIZE	(1024 * 1024)
+
+int btrfs_direct_open(const char *path);
+ssize_t btrfs_direct_pread(int fd, void *buf, size_t count, off_t offset);
+void *btrfs_dio_buf_get(void);
+void btrfs_dio_buf_put(void *buf);
+void btrfs_dio_pool_release(void);
+
+#endif
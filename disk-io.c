@@ -25,6 +25,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include "kerncompat.h"
 #include "radix-tree.h"
 #include "ctree.h"
@@ -131,8 +134,15 @@ struct extent_buffer *btrfs_find_tree_block(struct btrfs_root *root,
 struct extent_buffer *btrfs_find_create_tree_block(struct btrfs_root *root,
 						 u64 bytenr, u32 blocksize)
 {
-	return alloc_extent_buffer(&root->fs_info->extent_cache, bytenr,
-				   blocksize);
+	struct extent_buffer *eb;
+
+	eb = alloc_extent_buffer(&root->fs_info->extent_cache, bytenr,
+				 blocksize);
+	if (eb && extent_buffer_own_data(eb)) {
+		free_extent_buffer(eb);
+		return NULL;
+	}
+	return eb;
 }
 
 void readahead_tree_block(struct btrfs_root *root, u64 bytenr, u32 blocksize,
@@ -157,6 +167,456 @@ void readahead_tree_block(struct btrfs_root *root, u64 bytenr, u32 blocksize,
 	kfree(multi);
 }
 
+struct reada_range {
+	struct btrfs_device *device;
+	u64 physical;
+	u64 len;
+};
+
+static int cmp_reada_range(const void *a, const void *b)
+{
+	const struct reada_range *ra = a;
+	const struct reada_range *rb = b;
+
+	if (ra->device != rb->device)
+		return ra->device < rb->device ? -1 : 1;
+	if (ra->physical != rb->physical)
+		return ra->physical < rb->physical ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Start reading @nr tree blocks into the page cache, in device and
+ * physical order and with adjacent blocks merged into one request.
+ * Blocks already up to date in the cache are left out, and only the
+ * first copy of a block is read.
+ */
+void readahead_tree_blocks(struct btrfs_fs_info *info,
+			   struct btrfs_reada_block *blocks, int nr)
+{
+	struct btrfs_read_stats *stats = &info->read_stats;
+	struct btrfs_multi_bio *multi;
+	struct btrfs_device *device;
+	struct extent_buffer *eb;
+	struct reada_range *ranges;
+	u64 end;
+	u64 len;
+	int nr_ranges = 0;
+	int uptodate;
+	int i;
+	int j;
+
+	ranges = malloc(nr * sizeof(*ranges));
+	if (!ranges)
+		return;
+	for (i = 0; i < nr; i++) {
+		eb = find_extent_buffer(&info->extent_cache, blocks[i].bytenr,
+					blocks[i].len);
+		uptodate = eb && extent_buffer_uptodate(eb);
+		free_extent_buffer(eb);
+		if (uptodate)
+			continue;
+		len = blocks[i].len;
+		multi = NULL;
+		if (btrfs_map_block(&info->mapping_tree, READ, blocks[i].bytenr,
+				    &len, &multi, 0, NULL))
+			continue;
+		device = multi->stripes[0].dev;
+		/* O_DIRECT reads don't look in the page cache */
+		if (device->fd > 0 && device->direct_fd <= 0) {
+			ranges[nr_ranges].device = device;
+			ranges[nr_ranges].physical = multi->stripes[0].physical;
+			ranges[nr_ranges].len = min_t(u64, len, blocks[i].len);
+			nr_ranges++;
+		}
+		kfree(multi);
+	}
+
+	qsort(ranges, nr_ranges, sizeof(*ranges), cmp_reada_range);
+	for (i = 0; i < nr_ranges; i = j) {
+		device = ranges[i].device;
+		end = ranges[i].physical + ranges[i].len;
+		for (j = i + 1; j < nr_ranges && ranges[j].device == device &&
+		     ranges[j].physical <= end; j++)
+			end = max(end, ranges[j].physical + ranges[j].len);
+		readahead(device->fd, ranges[i].physical,
+			  end - ranges[i].physical);
+		device->total_ios++;
+		stats->reada_ios++;
+	}
+	stats->reada_blocks += nr_ranges;
+	free(ranges);
+}
+
+static enum btrfs_read_stat_tree btrfs_read_stat_tree(u64 owner)
+{
+	switch (owner) {
+	case BTRFS_ROOT_TREE_OBJECTID:
+		return BTRFS_READ_STAT_ROOT;
+	case BTRFS_EXTENT_TREE_OBJECTID:
+		return BTRFS_READ_STAT_EXTENT;
+	case BTRFS_CHUNK_TREE_OBJECTID:
+		return BTRFS_READ_STAT_CHUNK;
+	case BTRFS_DEV_TREE_OBJECTID:
+		return BTRFS_READ_STAT_DEV;
+	case BTRFS_FS_TREE_OBJECTID:
+		return BTRFS_READ_STAT_FS;
+	case BTRFS_CSUM_TREE_OBJECTID:
+		return BTRFS_READ_STAT_CSUM;
+	case BTRFS_QUOTA_TREE_OBJECTID:
+		return BTRFS_READ_STAT_QUOTA;
+	case BTRFS_UUID_TREE_OBJECTID:
+		return BTRFS_READ_STAT_UUID;
+	case BTRFS_TREE_LOG_OBJECTID:
+		return BTRFS_READ_STAT_LOG;
+	case BTRFS_TREE_RELOC_OBJECTID:
+	case BTRFS_DATA_RELOC_TREE_OBJECTID:
+		return BTRFS_READ_STAT_RELOC;
+	}
+	if (owner >= BTRFS_FIRST_FREE_OBJECTID &&
+	    owner <= BTRFS_LAST_FREE_OBJECTID)
+		return BTRFS_READ_STAT_FS;
+	return BTRFS_READ_STAT_OTHER;
+}
+
+/*
+ * Whether tree block @bytenr can be read without waiting for the disk: 1
+ * if it can, 0 if not and -1 if that can't be told.  Pages still being
+ * read ahead are in the page cache already, so this asks for a read that
+ * fails rather than waits instead of looking at what is resident.  Only
+ * the last byte is asked for, the pages of a block are read together.
+ * Without RWF_NOWAIT, from the headers or the kernel, it's always -1.
+ */
+static int tree_block_resident(struct btrfs_fs_info *info, u64 bytenr,
+			       u32 len)
+{
+#ifdef RWF_NOWAIT
+	static int nowait = 1;
+	struct btrfs_multi_bio *multi = NULL;
+	struct btrfs_device *device;
+	struct iovec iov;
+	char c;
+	u64 physical;
+	u64 map_len = len;
+	ssize_t ret;
+
+	if (!nowait)
+		return -1;
+	if (btrfs_map_block(&info->mapping_tree, READ, bytenr, &map_len,
+			    &multi, 0, NULL))
+		return -1;
+	device = multi->stripes[0].dev;
+	physical = multi->stripes[0].physical;
+	kfree(multi);
+	if (device->fd < 0 || map_len < len)
+		return -1;
+
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	ret = preadv2(device->fd, &iov, 1, physical + len - 1, RWF_NOWAIT);
+	if (ret == 1)
+		return 1;
+	if (ret < 0 && errno == EAGAIN)
+		return 0;
+	if (ret < 0 && (errno == EOPNOTSUPP || errno == ENOSYS ||
+			errno == EINVAL))
+		nowait = 0;
+#endif
+	return -1;
+}
+
+/*
+ * Note that a walk is about to read tree block @bytenr, which it read
+ * ahead if @issued.  Blocks up to date in the cache need no reading
+ * and don't count.
+ */
+void btrfs_reada_account(struct btrfs_fs_info *info, u64 bytenr, u32 len,
+			 int issued)
+{
+	struct btrfs_read_stats *stats = &info->read_stats;
+	struct extent_buffer *eb;
+	int uptodate;
+
+	eb = find_extent_buffer(&info->extent_cache, bytenr, len);
+	uptodate = eb && extent_buffer_uptodate(eb);
+	free_extent_buffer(eb);
+	if (uptodate)
+		return;
+	if (!issued) {
+		stats->reada_misses++;
+		return;
+	}
+	stats->reada_hits++;
+	if (stats->reada_probe && !tree_block_resident(info, bytenr, len))
+		stats->reada_late++;
+}
+
+/* children read ahead at each level above the lowest one of the path */
+#define READA_UPPER_BLOCKS 2
+
+void btrfs_reada_window_init(struct btrfs_reada_window *win,
+			     struct btrfs_root *root, u64 max_bytes,
+			     u32 max_blocks)
+{
+	struct btrfs_fs_info *info = root->fs_info;
+	struct btrfs_device *device;
+
+	memset(win, 0, sizeof(*win));
+	win->root = root;
+	/* don't read ahead more tree blocks than the cache is to hold */
+	win->max_bytes = min(max_bytes, info->extent_cache.node_cache_max);
+	win->max_blocks = max_blocks;
+	list_for_each_entry(device, &info->fs_devices->devices, dev_list) {
+		if (device->direct_fd > 0)
+			win->max_blocks = 0;
+	}
+	if (!win->max_blocks)
+		return;
+	win->batch = malloc(win->max_blocks * sizeof(*win->batch));
+	if (!win->batch)
+		win->max_blocks = 0;
+}
+
+void btrfs_reada_window_release(struct btrfs_reada_window *win)
+{
+	int i;
+
+	for (i = 0; i < BTRFS_MAX_LEVEL; i++) {
+		free_extent_buffer(win->levels[i].node);
+		free_extent_buffer(win->levels[i].next);
+	}
+	free(win->batch);
+	memset(win, 0, sizeof(*win));
+}
+
+/* follow the path to @level, picking up the peeked node if it went there */
+static void reada_window_sync(struct btrfs_reada_window *win,
+			      struct btrfs_path *path, int level)
+{
+	struct btrfs_reada_level *rl = &win->levels[level];
+	struct extent_buffer *node = path->nodes[level];
+
+	if (rl->node == node)
+		return;
+	free_extent_buffer(rl->node);
+	rl->node = NULL;
+	rl->end = 0;
+	/* the walk is above this level, on its way to the next node */
+	if (!node)
+		return;
+	if (rl->next == node) {
+		rl->node = rl->next;
+		rl->end = rl->next_end;
+	} else {
+		free_extent_buffer(rl->next);
+		extent_buffer_get(node);
+		rl->node = node;
+		rl->end = path->slots[level];
+	}
+	rl->next = NULL;
+	rl->next_end = 0;
+}
+
+/* children of @level read ahead that the path hasn't got to yet */
+static int reada_level_pending(struct btrfs_reada_window *win,
+			       struct btrfs_path *path, int level)
+{
+	struct btrfs_reada_level *rl = &win->levels[level];
+	int nr = rl->end - path->slots[level] - 1;
+
+	if (nr < 0)
+		nr = 0;
+	if (rl->next)
+		nr += rl->next_end;
+	return nr;
+}
+
+/*
+ * Read the next node at a level for the window, if the readahead for it
+ * is done and it is good.  It is checked quietly: the walk reports a
+ * bad block itself when it gets there.
+ */
+static struct extent_buffer *reada_peek(struct btrfs_reada_window *win,
+					struct btrfs_reada_level *rl,
+					struct extent_buffer *parent, int slot)
+{
+	struct btrfs_root *root = win->root;
+	struct btrfs_fs_info *info = root->fs_info;
+	struct btrfs_read_stats *stats = &info->read_stats;
+	struct extent_buffer *eb;
+	int level = btrfs_header_level(parent) - 1;
+	u64 bytenr = btrfs_node_blockptr(parent, slot);
+	u64 gen = btrfs_node_ptr_generation(parent, slot);
+	u32 len = btrfs_level_size(root, level);
+	int good;
+
+	if (gen <= win->min_gen || bytenr == rl->bad)
+		return NULL;
+	eb = btrfs_find_tree_block(root, bytenr, len);
+	if (eb && btrfs_buffer_uptodate(eb, gen))
+		return eb;
+	free_extent_buffer(eb);
+	if (tree_block_resident(info, bytenr, len) != 1)
+		return NULL;
+
+	eb = alloc_extent_buffer(&info->extent_cache, bytenr, len);
+	if (!eb)
+		return NULL;
+	good = !read_whole_eb(info, eb, 0) &&
+	       btrfs_header_bytenr(eb) == bytenr &&
+	       !check_tree_block(root, eb) &&
+	       btrfs_header_generation(eb) == gen &&
+	       btrfs_header_level(eb) == level &&
+	       !verify_tree_block_csum_silent(eb,
+			btrfs_super_csum_size(info->super_copy));
+	if (!good) {
+		free_extent_buffer(eb);
+		rl->bad = bytenr;
+		return NULL;
+	}
+
+	/* passed all read_tree_block() checks, don't read it again */
+	btrfs_set_buffer_uptodate(eb);
+	extent_buffer_cache_node(eb, level, 0);
+	stats->blocks[btrfs_read_stat_tree(btrfs_header_owner(eb))]++;
+	stats->bytes += eb->len;
+	return eb;
+}
+
+static void reada_queue(struct btrfs_reada_window *win,
+			struct extent_buffer *node, int slot)
+{
+	struct btrfs_reada_block *block = &win->batch[win->nr_batch];
+
+	if (btrfs_node_ptr_generation(node, slot) <= win->min_gen)
+		return;
+	block->bytenr = btrfs_node_blockptr(node, slot);
+	block->len = btrfs_level_size(win->root,
+				      btrfs_header_level(node) - 1);
+	win->nr_batch++;
+}
+
+/* queue the next child at @level, from the next node once it's done */
+static int reada_level_next(struct btrfs_reada_window *win,
+			    struct btrfs_path *path, int level)
+{
+	struct btrfs_reada_level *rl = &win->levels[level];
+	struct btrfs_reada_level *up;
+	int slot;
+
+	if (rl->end <= path->slots[level])
+		rl->end = path->slots[level] + 1;
+	if (rl->end < btrfs_header_nritems(rl->node)) {
+		reada_queue(win, rl->node, rl->end++);
+		return 1;
+	}
+
+	if (!rl->next) {
+		if (level + 1 >= BTRFS_MAX_LEVEL || !win->levels[level + 1].node)
+			return 0;
+		up = &win->levels[level + 1];
+		slot = path->slots[level + 1] + 1;
+		if (slot < btrfs_header_nritems(up->node)) {
+			if (slot < up->end)
+				rl->next = reada_peek(win, rl, up->node, slot);
+		} else if (up->next && up->next_end > 0) {
+			rl->next = reada_peek(win, rl, up->next, 0);
+		}
+		if (!rl->next)
+			return 0;
+		rl->next_end = 0;
+	}
+	if (rl->next_end >= btrfs_header_nritems(rl->next))
+		return 0;
+	reada_queue(win, rl->next, rl->next_end++);
+	return 1;
+}
+
+/*
+ * Top up the readahead at every level of the path.  The lowest level
+ * gets most of the window; the levels above keep a couple of nodes
+ * ahead, which the levels below them need to carry on past the end of
+ * their node.  Lower levels go first so a node is only peeked at once
+ * the readahead for it was started by an earlier call.
+ */
+static void reada_window_fill(struct btrfs_reada_window *win,
+			      struct btrfs_path *path)
+{
+	int pending[BTRFS_MAX_LEVEL];
+	u64 bytes = 0;
+	u32 blocks = 0;
+	u32 quota;
+	u32 len;
+	int lowest = 0;
+	int upper = 0;
+	int level;
+
+	for (level = 1; level < BTRFS_MAX_LEVEL; level++) {
+		if (!win->levels[level].node)
+			continue;
+		if (!lowest)
+			lowest = level;
+		else
+			upper++;
+		pending[level] = reada_level_pending(win, path, level);
+		blocks += pending[level];
+		bytes += (u64)pending[level] *
+			 btrfs_level_size(win->root, level - 1);
+	}
+
+	win->nr_batch = 0;
+	for (level = lowest; level && level < BTRFS_MAX_LEVEL; level++) {
+		if (!win->levels[level].node)
+			continue;
+		len = btrfs_level_size(win->root, level - 1);
+		if (level > lowest)
+			quota = READA_UPPER_BLOCKS;
+		else if (win->max_blocks > READA_UPPER_BLOCKS * upper)
+			quota = win->max_blocks - READA_UPPER_BLOCKS * upper;
+		else
+			quota = 1;
+		while (pending[level] < quota && blocks < win->max_blocks &&
+		       bytes + len <= win->max_bytes) {
+			if (!reada_level_next(win, path, level))
+				break;
+			pending[level]++;
+			blocks++;
+			bytes += len;
+		}
+	}
+	if (win->nr_batch)
+		readahead_tree_blocks(win->root->fs_info, win->batch,
+				      win->nr_batch);
+}
+
+/*
+ * Called by a depth first walk before it reads the child at
+ * @path->slots[@level] of @path->nodes[@level].  The slots of the path
+ * above @level are those of the subtrees being walked, and the levels
+ * below it are empty.
+ */
+void btrfs_reada_window_read(struct btrfs_reada_window *win,
+			     struct btrfs_path *path, int level)
+{
+	struct extent_buffer *node = path->nodes[level];
+	int slot = path->slots[level];
+	int i;
+
+	if (!win->max_blocks) {
+		btrfs_reada_account(win->root->fs_info,
+				    btrfs_node_blockptr(node, slot),
+				    btrfs_level_size(win->root, level - 1), 0);
+		return;
+	}
+	for (i = 1; i < BTRFS_MAX_LEVEL; i++)
+		reada_window_sync(win, path, i);
+	btrfs_reada_account(win->root->fs_info,
+			    btrfs_node_blockptr(node, slot),
+			    btrfs_level_size(win->root, level - 1),
+			    slot < win->levels[level].end);
+	reada_window_fill(win, path);
+}
+
 static int verify_parent_transid(struct extent_io_tree *io_tree,
 				 struct extent_buffer *eb, u64 parent_transid,
 				 int ignore)
@@ -189,6 +649,38 @@ out:
 }
 
 
+/*
+ * Point @eb at its copy in a mmap'd device.  Returns 1 if the block is
+ * not in one stripe of a mapped device and has to be read.
+ */
+static int map_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb,
+			int mirror)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	struct btrfs_device *device;
+	u64 len = eb->len;
+	u64 physical;
+
+	if (info->on_restoring || eb->start == BTRFS_SUPER_INFO_OFFSET)
+		return 1;
+	if (btrfs_map_block(&info->mapping_tree, READ, eb->start, &len,
+			    &multi, mirror, NULL))
+		return 1;
+	device = multi->stripes[0].dev;
+	physical = multi->stripes[0].physical;
+	kfree(multi);
+
+	if (len < eb->len || !device->map || device->fd <= 0 ||
+	    physical + eb->len > device->map_len)
+		return 1;
+	eb->data = device->map + physical;
+	device->bytes_read += eb->len;
+	eb->flags |= EXTENT_BUFFER_MAPPED;
+	eb->fd = device->fd;
+	eb->dev_bytenr = physical;
+	return 0;
+}
+
 int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirror)
 {
 	unsigned long offset = 0;
@@ -198,6 +690,14 @@ int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirr
 	u64 read_len;
 	unsigned long bytes_left = eb->len;
 
+	if (!eb->data || (eb->flags & EXTENT_BUFFER_MAPPED)) {
+		if (!map_whole_eb(info, eb, mirror))
+			return 0;
+		ret = extent_buffer_own_data(eb);
+		if (ret)
+			return ret;
+	}
+
 	while (bytes_left) {
 		read_len = bytes_left;
 		device = NULL;
@@ -239,8 +739,9 @@ int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirr
 		if (read_len > bytes_left)
 			read_len = bytes_left;
 
-		ret = read_extent_from_disk(eb, offset, read_len);
-		if (ret)
+		ret = btrfs_device_pread(device, eb->data + offset, read_len,
+					 eb->dev_bytenr);
+		if (ret != read_len)
 			return -EIO;
 		offset += read_len;
 		bytes_left -= read_len;
@@ -251,6 +752,7 @@ int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirr
 struct extent_buffer *read_tree_block(struct btrfs_root *root, u64 bytenr,
 				     u32 blocksize, u64 parent_transid)
 {
+	struct btrfs_read_stats *stats = &root->fs_info->read_stats;
 	int ret;
 	struct extent_buffer *eb;
 	u64 best_transid = 0;
@@ -259,12 +761,17 @@ struct extent_buffer *read_tree_block(struct btrfs_root *root, u64 bytenr,
 	int num_copies;
 	int ignore = 0;
 
-	eb = btrfs_find_create_tree_block(root, bytenr, blocksize);
+	/* the data comes with the read, maybe from a mmap'd device */
+	eb = alloc_extent_buffer(&root->fs_info->extent_cache, bytenr,
+				 blocksize);
 	if (!eb)
 		return NULL;
 
-	if (btrfs_buffer_uptodate(eb, parent_transid))
+	if (btrfs_buffer_uptodate(eb, parent_transid)) {
+		extent_buffer_cache_node(eb, btrfs_header_level(eb), 1);
+		stats->hits++;
 		return eb;
+	}
 
 	while (1) {
 		ret = read_whole_eb(root->fs_info, eb, mirror_num);
@@ -279,6 +786,10 @@ struct extent_buffer *read_tree_block(struct btrfs_root *root, u64 bytenr,
 				eb->refs++;
 			}
 			btrfs_set_buffer_uptodate(eb);
+			extent_buffer_cache_node(eb, btrfs_header_level(eb), 0);
+			stats->blocks[btrfs_read_stat_tree(
+					btrfs_header_owner(eb))]++;
+			stats->bytes += eb->len;
 			return eb;
 		}
 		if (ignore) {
@@ -341,10 +852,93 @@ int write_and_map_eb(struct btrfs_trans_handle *trans,
 	return 0;
 }
 
-static int write_tree_block(struct btrfs_trans_handle *trans,
-		     struct btrfs_root *root,
-		     struct extent_buffer *eb)
+/*
+ * Commit writeback.  The dirty tree blocks are checksummed and mapped
+ * first, then the writes of every device are sorted by physical offset
+ * and adjacent blocks are written with a single pwritev().  Each device
+ * is written from its own thread.  RAID5/6 blocks are grouped by full
+ * stripe so the parity of a stripe is read and written only once.
+ */
+#define COMMIT_MAX_IOV		256
+
+struct commit_write {
+	u64 physical;
+	struct extent_buffer *eb;
+};
+
+struct commit_dev {
+	struct btrfs_device *dev;
+	struct commit_write *writes;
+	int nr_writes;
+	int max_writes;
+	u64 bytes;
+	u64 ios;
+	int ret;
+	int threaded;
+	pthread_t thread;
+};
+
+struct commit_writeback {
+	struct commit_dev *devs;
+	int nr_devs;
+	struct extent_buffer **raid56;
+	int nr_raid56;
+	int max_raid56;
+	u64 blocks;
+};
+
+static int queue_commit_write(struct commit_writeback *wb,
+			      struct btrfs_device *dev, u64 physical,
+			      struct extent_buffer *eb)
+{
+	struct commit_dev *cdev = NULL;
+	struct commit_write *writes;
+	int i;
+
+	for (i = 0; i < wb->nr_devs; i++) {
+		if (wb->devs[i].dev == dev) {
+			cdev = wb->devs + i;
+			break;
+		}
+	}
+	if (!cdev) {
+		cdev = realloc(wb->devs, (wb->nr_devs + 1) * sizeof(*cdev));
+		if (!cdev)
+			return -ENOMEM;
+		wb->devs = cdev;
+		cdev = wb->devs + wb->nr_devs++;
+		memset(cdev, 0, sizeof(*cdev));
+		cdev->dev = dev;
+	}
+	if (cdev->nr_writes == cdev->max_writes) {
+		int max = max(256, cdev->max_writes * 2);
+
+		writes = realloc(cdev->writes, max * sizeof(*writes));
+		if (!writes)
+			return -ENOMEM;
+		cdev->writes = writes;
+		cdev->max_writes = max;
+	}
+	extent_buffer_get(eb);
+	cdev->writes[cdev->nr_writes].physical = physical;
+	cdev->writes[cdev->nr_writes].eb = eb;
+	cdev->nr_writes++;
+	wb->blocks++;
+	dev->total_ios++;
+	return 0;
+}
+
+static int queue_tree_block(struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root,
+			    struct extent_buffer *eb,
+			    struct commit_writeback *wb)
 {
+	int ret;
+	int i;
+	u64 length;
+	u64 *raid_map = NULL;
+	struct btrfs_multi_bio *multi = NULL;
+
 	if (check_tree_block(root, eb))
 		BUG();
 
@@ -354,7 +948,255 @@ static int write_tree_block(struct btrfs_trans_handle *trans,
 	btrfs_set_header_flag(eb, BTRFS_HEADER_FLAG_WRITTEN);
 	csum_tree_block(root, eb, 0);
 
-	return write_and_map_eb(trans, root, eb);
+	length = eb->len;
+	ret = btrfs_map_block(&root->fs_info->mapping_tree, WRITE,
+			      eb->start, &length, &multi, 0, &raid_map);
+	if (ret)
+		return ret;
+
+	if (raid_map) {
+		kfree(raid_map);
+		if (wb->nr_raid56 == wb->max_raid56) {
+			int max = max(256, wb->max_raid56 * 2);
+			struct extent_buffer **raid56;
+
+			raid56 = realloc(wb->raid56, max * sizeof(*raid56));
+			if (!raid56) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			wb->raid56 = raid56;
+			wb->max_raid56 = max;
+		}
+		extent_buffer_get(eb);
+		wb->raid56[wb->nr_raid56++] = eb;
+		wb->blocks++;
+		goto out;
+	}
+	for (i = 0; i < multi->num_stripes; i++) {
+		eb->fd = multi->stripes[i].dev->fd;
+		eb->dev_bytenr = multi->stripes[i].physical;
+		ret = queue_commit_write(wb, multi->stripes[i].dev,
+					 multi->stripes[i].physical, eb);
+		if (ret)
+			break;
+	}
+out:
+	kfree(multi);
+	return ret;
+}
+
+static int cmp_commit_write(const void *a, const void *b)
+{
+	const struct commit_write *wa = a;
+	const struct commit_write *wb = b;
+
+	if (wa->physical != wb->physical)
+		return wa->physical < wb->physical ? -1 : 1;
+	return 0;
+}
+
+static int cmp_eb_start(const void *a, const void *b)
+{
+	const struct extent_buffer *ea = *(struct extent_buffer **)a;
+	const struct extent_buffer *eb = *(struct extent_buffer **)b;
+
+	if (ea->start != eb->start)
+		return ea->start < eb->start ? -1 : 1;
+	return 0;
+}
+
+/*
+ * write the RAID5/6 blocks a full stripe at a time: read the data
+ * stripes once, copy in every dirty block of the stripe and write the
+ * data and parity back.
+ */
+static int write_raid56_stripes(struct btrfs_fs_info *fs_info,
+				struct commit_writeback *wb)
+{
+	struct btrfs_commit_stats *stats = &fs_info->commit_stats;
+	struct btrfs_multi_bio *multi;
+	struct extent_buffer *full;
+	struct extent_buffer *eb;
+	u64 *raid_map;
+	u64 stripe_len;
+	u64 full_len;
+	int nr_data;
+	int ret = 0;
+	int i = 0;
+	int j;
+
+	qsort(wb->raid56, wb->nr_raid56, sizeof(struct extent_buffer *),
+	      cmp_eb_start);
+	while (i < wb->nr_raid56) {
+		eb = wb->raid56[i];
+		multi = NULL;
+		raid_map = NULL;
+		stripe_len = eb->len;
+		ret = btrfs_map_block(&fs_info->mapping_tree, WRITE, eb->start,
+				      &stripe_len, &multi, 0, &raid_map);
+		if (ret)
+			break;
+		BUG_ON(!raid_map);
+		for (nr_data = 0; nr_data < multi->num_stripes; nr_data++)
+			if (raid_map[nr_data] >= BTRFS_RAID5_P_STRIPE)
+				break;
+		full_len = nr_data * stripe_len;
+
+		/* a block crossing the stripe end is written on its own */
+		if (eb->start + eb->len > raid_map[0] + full_len) {
+			ret = write_raid56_with_parity(fs_info, eb, multi,
+						       stripe_len, raid_map);
+			stats->ios += multi->num_stripes;
+			stats->bytes += multi->num_stripes * stripe_len;
+			i++;
+			goto next;
+		}
+
+		full = calloc(1, sizeof(*full) + full_len);
+		if (!full) {
+			ret = -ENOMEM;
+			goto next;
+		}
+		full->data = full->inline_data;
+		full->start = raid_map[0];
+		full->len = full_len;
+		full->refs = 1;
+		ret = read_whole_eb(fs_info, full, 0);
+		if (ret) {
+			free(full);
+			goto next;
+		}
+		for (j = i; j < wb->nr_raid56; j++) {
+			eb = wb->raid56[j];
+			if (eb->start + eb->len > full->start + full_len)
+				break;
+			memcpy(full->data + eb->start - full->start, eb->data,
+			       eb->len);
+		}
+		ret = write_raid56_with_parity(fs_info, full, multi,
+					       stripe_len, raid_map);
+		stats->ios += multi->num_stripes;
+		stats->bytes += multi->num_stripes * stripe_len;
+		stats->merged += j - i - 1;
+		i = j;
+		free(full);
+next:
+		kfree(multi);
+		kfree(raid_map);
+		if (ret)
+			break;
+	}
+	for (i = 0; i < wb->nr_raid56; i++)
+		free_extent_buffer(wb->raid56[i]);
+	free(wb->raid56);
+	return ret;
+}
+
+static int pwritev_full(int fd, struct iovec *iov, int nr_iov, off_t offset)
+{
+	ssize_t ret;
+
+	while (nr_iov) {
+		ret = pwritev(fd, iov, nr_iov, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			return -EIO;
+		offset += ret;
+		while (nr_iov && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			nr_iov--;
+		}
+		if (nr_iov) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+static void *commit_dev_writeback(void *arg)
+{
+	struct commit_dev *cdev = arg;
+	struct iovec iov[COMMIT_MAX_IOV];
+	struct extent_buffer *eb;
+	u64 physical;
+	u64 len;
+	int nr_iov;
+	int i = 0;
+
+	qsort(cdev->writes, cdev->nr_writes, sizeof(struct commit_write),
+	      cmp_commit_write);
+	while (i < cdev->nr_writes) {
+		physical = cdev->writes[i].physical;
+		len = 0;
+		nr_iov = 0;
+		do {
+			eb = cdev->writes[i].eb;
+			iov[nr_iov].iov_base = eb->data;
+			iov[nr_iov].iov_len = eb->len;
+			len += eb->len;
+			nr_iov++;
+			i++;
+		} while (i < cdev->nr_writes && nr_iov < COMMIT_MAX_IOV &&
+			 cdev->writes[i].physical == physical + len);
+
+		cdev->ret = pwritev_full(cdev->dev->fd, iov, nr_iov, physical);
+		if (cdev->ret)
+			break;
+		cdev->bytes += len;
+		cdev->ios++;
+	}
+	return NULL;
+}
+
+static int run_commit_writeback(struct btrfs_fs_info *fs_info,
+				struct commit_writeback *wb)
+{
+	struct btrfs_commit_stats *stats = &fs_info->commit_stats;
+	struct commit_dev *cdev;
+	int ret;
+	int i;
+	int j;
+
+	ret = write_raid56_stripes(fs_info, wb);
+
+	/* the last device is written from this thread */
+	for (i = 0; i < wb->nr_devs - 1; i++) {
+		cdev = wb->devs + i;
+		if (pthread_create(&cdev->thread, NULL, commit_dev_writeback,
+				   cdev))
+			commit_dev_writeback(cdev);
+		else
+			cdev->threaded = 1;
+	}
+	if (wb->nr_devs)
+		commit_dev_writeback(wb->devs + wb->nr_devs - 1);
+
+	for (i = 0; i < wb->nr_devs; i++) {
+		cdev = wb->devs + i;
+		if (cdev->threaded)
+			pthread_join(cdev->thread, NULL);
+		if (cdev->ret && !ret) {
+			fprintf(stderr, "failed to write tree blocks to %s: %s\n",
+				cdev->dev->name, strerror(-cdev->ret));
+			ret = cdev->ret;
+		}
+		stats->bytes += cdev->bytes;
+		stats->ios += cdev->ios;
+		stats->merged += cdev->nr_writes - cdev->ios;
+		for (j = 0; j < cdev->nr_writes; j++)
+			free_extent_buffer(cdev->writes[j].eb);
+		free(cdev->writes);
+	}
+	stats->blocks += wb->blocks;
+	free(wb->devs);
+	return ret;
 }
 
 int __setup_root(u32 nodesize, u32 leafsize, u32 sectorsize,
@@ -445,9 +1287,14 @@ static int __commit_transaction(struct btrfs_trans_handle *trans,
 	u64 start;
 	u64 end;
 	struct extent_buffer *eb;
-	struct extent_io_tree *tree = &root->fs_info->extent_cache;
+	struct btrfs_fs_info *fs_info = root->fs_info;
+	struct extent_io_tree *tree = &fs_info->extent_cache;
+	struct commit_writeback wb = { 0 };
+	struct timeval start_tv;
+	struct timeval end_tv;
 	int ret;
 
+	gettimeofday(&start_tv, NULL);
 	while(1) {
 		ret = find_first_extent_bit(tree, 0, &start, &end,
 					    EXTENT_DIRTY);
@@ -456,14 +1303,19 @@ static int __commit_transaction(struct btrfs_trans_handle *trans,
 		while(start <= end) {
 			eb = find_first_extent_buffer(tree, start);
 			BUG_ON(!eb || eb->start != start);
-			ret = write_tree_block(trans, root, eb);
+			ret = queue_tree_block(trans, root, eb, &wb);
 			BUG_ON(ret);
 			start += eb->len;
 			clear_extent_buffer_dirty(eb);
 			free_extent_buffer(eb);
 		}
 	}
-	return 0;
+	ret = run_commit_writeback(fs_info, &wb);
+	gettimeofday(&end_tv, NULL);
+	fs_info->commit_stats.commits++;
+	fs_info->commit_stats.usecs += (end_tv.tv_sec - start_tv.tv_sec) *
+		1000000ULL + end_tv.tv_usec - start_tv.tv_usec;
+	return ret;
 }
 
 int btrfs_commit_transaction(struct btrfs_trans_handle *trans,
@@ -1131,6 +1983,13 @@ static struct btrfs_fs_info *__open_ctree_fd(int fp, const char *path,
 	if (ret)
 		goto out;
 
+	if (flags & OPEN_CTREE_DIRECT)
+		btrfs_open_devices_direct(fs_devices);
+	else if ((flags & OPEN_CTREE_MMAP) &&
+		 !(flags & (OPEN_CTREE_WRITES | OPEN_CTREE_RESTORE)) &&
+		 btrfs_mmap_devices(fs_devices))
+		fs_info->extent_cache.mapped_ebs = 1;
+
 	disk_super = fs_info->super_copy;
 	if (!(flags & OPEN_CTREE_RECOVER_SUPER))
 		ret = btrfs_read_dev_super(fs_devices->latest_bdev,
@@ -33,6 +33,8 @@ enum btrfs_open_ctree_flags {
 	OPEN_CTREE_RESTORE		= 16,
 	OPEN_CTREE_NO_BLOCK_GROUPS	= 32,
 	OPEN_CTREE_EXCLUSIVE		= 64,
+	OPEN_CTREE_MMAP			= 128,
+	OPEN_CTREE_DIRECT		= 256,
 };
 
 static inline u64 btrfs_sb_offset(int mirror)
@@ -50,6 +52,50 @@ struct extent_buffer *read_tree_block(struct btrfs_root *root, u64 bytenr,
 				      u32 blocksize, u64 parent_transid);
 void readahead_tree_block(struct btrfs_root *root, u64 bytenr, u32 blocksize,
 			  u64 parent_transid);
+
+struct btrfs_reada_block {
+	u64 bytenr;
+	u32 len;
+};
+
+/*
+ * Readahead kept ahead of a depth first walk at every level of the
+ * tree.  At each level the children after the path's slot are read
+ * ahead, and once a node is done the next node at its level is peeked
+ * at so the window carries on past it.  See btrfs_reada_window_read().
+ */
+struct btrfs_reada_level {
+	/* the path's node and the slot its children are read ahead up to */
+	struct extent_buffer *node;
+	int end;
+	/* the node after it at this level, and how far it is read ahead */
+	struct extent_buffer *next;
+	int next_end;
+	/* a next node that turned out bad, not to be tried again */
+	u64 bad;
+};
+
+struct btrfs_reada_window {
+	struct btrfs_root *root;
+	u64 max_bytes;
+	u32 max_blocks;		/* 0 if readahead is off */
+	/* subtrees not newer than this are skipped by the walk */
+	u64 min_gen;
+	struct btrfs_reada_level levels[BTRFS_MAX_LEVEL];
+	struct btrfs_reada_block *batch;
+	int nr_batch;
+};
+
+void readahead_tree_blocks(struct btrfs_fs_info *info,
+			   struct btrfs_reada_block *blocks, int nr);
+void btrfs_reada_account(struct btrfs_fs_info *info, u64 bytenr, u32 len,
+			 int issued);
+void btrfs_reada_window_init(struct btrfs_reada_window *win,
+			     struct btrfs_root *root, u64 max_bytes,
+			     u32 max_blocks);
+void btrfs_reada_window_read(struct btrfs_reada_window *win,
+			     struct btrfs_path *path, int level);
+void btrfs_reada_window_release(struct btrfs_reada_window *win);
 struct extent_buffer *btrfs_find_create_tree_block(struct btrfs_root *root,
 						   u64 bytenr, u32 blocksize);
 
@@ -17,6 +17,7 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "kerncompat.h"
 #include "extent-cache.h"
 #include "rbtree-utils.h"
@@ -88,9 +89,724 @@ static int cache_tree_comp_nodes2(struct rb_node *node1, struct rb_node *node2)
 	return cache_tree_comp_range2(node1, (void *)&range);
 }
 
+
+/*
+ * B+tree backend, see cache_tree_init_btree().
+ *
+ * Leaves hold the extents sorted by (objectid, start + size), with the
+ * keys copied next to the pointers so a search never dereferences a
+ * record it is not going to return.  The trees that ignore objectid store
+ * it as zero.  Separator i of an inner node is no larger than any key in
+ * child i and larger than every key in child i - 1.  Every extent points
+ * back at its leaf, which is how next/prev work without the tree.
+ *
+ * Deletion frees empty nodes and merges sparse neighbouring leaves, inner
+ * nodes are not rebalanced.
+ */
+#define CACHE_BTREE_LEAF_SLOTS		64
+#define CACHE_BTREE_INNER_SLOTS		64
+#define CACHE_BTREE_BULK_FILL(slots)	((slots) * 3 / 4)
+
+/* Never a valid rb parent/color word, the low pointer bits are clear */
+#define CACHE_EXTENT_IN_BTREE		2UL
+
+struct cache_btree_node {
+	struct cache_btree_node *parent;
+	int level;
+	int nr;
+};
+
+struct cache_btree_leaf {
+	struct cache_btree_node node;
+	struct cache_btree_leaf *prev;
+	struct cache_btree_leaf *next;
+	u64 objectid[CACHE_BTREE_LEAF_SLOTS];
+	u64 end[CACHE_BTREE_LEAF_SLOTS];
+	struct cache_extent *items[CACHE_BTREE_LEAF_SLOTS];
+};
+
+struct cache_btree_inner {
+	struct cache_btree_node node;
+	u64 objectid[CACHE_BTREE_INNER_SLOTS];
+	u64 end[CACHE_BTREE_INNER_SLOTS];
+	struct cache_btree_node *children[CACHE_BTREE_INNER_SLOTS];
+};
+
+#define btree_leaf(n) container_of(n, struct cache_btree_leaf, node)
+#define btree_inner(n) container_of(n, struct cache_btree_inner, node)
+
+static inline int in_btree(struct cache_extent *pe)
+{
+	return pe->bt.magic == CACHE_EXTENT_IN_BTREE;
+}
+
+static inline int key_less(u64 objectid1, u64 end1, u64 objectid2, u64 end2)
+{
+	return objectid1 < objectid2 ||
+	       (objectid1 == objectid2 && end1 < end2);
+}
+
+static void *btree_alloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (!p) {
+		fprintf(stderr, "memory allocation failed\n");
+		exit(1);
+	}
+	return p;
+}
+
+/* First slot whose key is above (objectid, pos) */
+static int leaf_upper_slot(struct cache_btree_leaf *leaf, u64 objectid,
+			   u64 pos)
+{
+	int lo = 0;
+	int hi = leaf->node.nr;
+	int mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (key_less(objectid, pos, leaf->objectid[mid], leaf->end[mid]))
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/* The child whose key range holds (objectid, pos) */
+static int inner_child_slot(struct cache_btree_inner *inner, u64 objectid,
+			    u64 pos)
+{
+	int lo = 1;
+	int hi = inner->node.nr;
+	int mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (key_less(objectid, pos, inner->objectid[mid],
+			     inner->end[mid]))
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo - 1;
+}
+
+static struct cache_btree_leaf *btree_descend(struct cache_tree *tree,
+					      u64 objectid, u64 pos)
+{
+	struct cache_btree_node *node = tree->btree_root;
+	struct cache_btree_inner *inner;
+
+	while (node->level) {
+		inner = btree_inner(node);
+		node = inner->children[inner_child_slot(inner, objectid, pos)];
+	}
+	return btree_leaf(node);
+}
+
+static struct cache_btree_leaf *btree_edge_leaf(struct cache_tree *tree,
+						int last)
+{
+	struct cache_btree_node *node = tree->btree_root;
+	struct cache_btree_inner *inner;
+
+	if (!node)
+		return NULL;
+	while (node->level) {
+		inner = btree_inner(node);
+		node = inner->children[last ? node->nr - 1 : 0];
+	}
+	return btree_leaf(node);
+}
+
+static int leaf_slot_of(struct cache_extent *pe)
+{
+	struct cache_btree_leaf *leaf = pe->bt.leaf;
+	u64 end = pe->start + pe->size;
+	int i;
+
+	/* the key is stored with either its objectid or zero */
+	i = leaf_upper_slot(leaf, pe->objectid, end) - 1;
+	if (i >= 0 && leaf->items[i] == pe)
+		return i;
+	i = leaf_upper_slot(leaf, 0, end) - 1;
+	if (i >= 0 && leaf->items[i] == pe)
+		return i;
+
+	/* empty extents can share their key */
+	for (i = 0; i < leaf->node.nr; i++)
+		if (leaf->items[i] == pe)
+			return i;
+	BUG_ON(1);
+	return -1;
+}
+
+static int child_slot_of(struct cache_btree_node *node)
+{
+	struct cache_btree_inner *parent = btree_inner(node->parent);
+	int i;
+
+	for (i = 0; i < parent->node.nr; i++)
+		if (parent->children[i] == node)
+			return i;
+	BUG_ON(1);
+	return -1;
+}
+
+/* The first extent with a key above (objectid, pos) */
+static struct cache_extent *btree_search(struct cache_tree *tree,
+					 u64 objectid, u64 pos)
+{
+	struct cache_btree_leaf *leaf;
+	int slot;
+
+	if (!tree->btree_root)
+		return NULL;
+	leaf = btree_descend(tree, objectid, pos);
+	slot = leaf_upper_slot(leaf, objectid, pos);
+	if (slot == leaf->node.nr) {
+		leaf = leaf->next;
+		slot = 0;
+	}
+	return leaf ? leaf->items[slot] : NULL;
+}
+
+static int btree_overlaps(struct cache_extent *entry, int key2, u64 objectid,
+			  u64 start, u64 size)
+{
+	if (key2 && entry->objectid != objectid)
+		return 0;
+	return entry->start + entry->size > start &&
+	       start + size > entry->start;
+}
+
+static struct cache_extent *btree_lookup(struct cache_tree *tree, int key2,
+					 u64 objectid, u64 start, u64 size)
+{
+	struct cache_extent *entry;
+
+	entry = btree_search(tree, key2 ? objectid : 0, start);
+	if (entry && btree_overlaps(entry, key2, objectid, start, size))
+		return entry;
+	return NULL;
+}
+
+static void btree_insert_parent(struct cache_tree *tree,
+				struct cache_btree_node *left, u64 objectid,
+				u64 end, struct cache_btree_node *right);
+
+static void inner_insert_slot(struct cache_btree_inner *inner, int slot,
+			      u64 objectid, u64 end,
+			      struct cache_btree_node *child)
+{
+	int move = inner->node.nr - slot;
+
+	memmove(inner->objectid + slot + 1, inner->objectid + slot,
+		move * sizeof(u64));
+	memmove(inner->end + slot + 1, inner->end + slot, move * sizeof(u64));
+	memmove(inner->children + slot + 1, inner->children + slot,
+		move * sizeof(child));
+	inner->objectid[slot] = objectid;
+	inner->end[slot] = end;
+	inner->children[slot] = child;
+	child->parent = &inner->node;
+	inner->node.nr++;
+}
+
+static void btree_insert_parent(struct cache_tree *tree,
+				struct cache_btree_node *left, u64 objectid,
+				u64 end, struct cache_btree_node *right)
+{
+	struct cache_btree_inner *parent;
+	struct cache_btree_inner *split;
+	int slot;
+	int mid;
+	int i;
+
+	if (!left->parent) {
+		parent = btree_alloc(sizeof(*parent));
+		parent->node.parent = NULL;
+		parent->node.level = left->level + 1;
+		parent->node.nr = 1;
+		parent->objectid[0] = 0;
+		parent->end[0] = 0;
+		parent->children[0] = left;
+		left->parent = &parent->node;
+		inner_insert_slot(parent, 1, objectid, end, right);
+		tree->btree_root = &parent->node;
+		return;
+	}
+
+	parent = btree_inner(left->parent);
+	slot = child_slot_of(left) + 1;
+	if (parent->node.nr < CACHE_BTREE_INNER_SLOTS) {
+		inner_insert_slot(parent, slot, objectid, end, right);
+		return;
+	}
+
+	mid = CACHE_BTREE_INNER_SLOTS / 2;
+	split = btree_alloc(sizeof(*split));
+	split->node.level = parent->node.level;
+	split->node.nr = CACHE_BTREE_INNER_SLOTS - mid;
+	memcpy(split->objectid, parent->objectid + mid,
+	       split->node.nr * sizeof(u64));
+	memcpy(split->end, parent->end + mid, split->node.nr * sizeof(u64));
+	memcpy(split->children, parent->children + mid,
+	       split->node.nr * sizeof(right));
+	for (i = 0; i < split->node.nr; i++)
+		split->children[i]->parent = &split->node;
+	parent->node.nr = mid;
+	btree_insert_parent(tree, &parent->node, split->objectid[0],
+			    split->end[0], &split->node);
+
+	if (slot > mid)
+		inner_insert_slot(split, slot - mid, objectid, end, right);
+	else
+		inner_insert_slot(parent, slot, objectid, end, right);
+}
+
+static struct cache_btree_leaf *btree_new_leaf(void)
+{
+	struct cache_btree_leaf *leaf = btree_alloc(sizeof(*leaf));
+
+	leaf->node.parent = NULL;
+	leaf->node.level = 0;
+	leaf->node.nr = 0;
+	leaf->prev = NULL;
+	leaf->next = NULL;
+	return leaf;
+}
+
+static void leaf_insert_slot(struct cache_btree_leaf *leaf, int slot,
+			     u64 objectid, struct cache_extent *pe)
+{
+	int move = leaf->node.nr - slot;
+
+	memmove(leaf->objectid + slot + 1, leaf->objectid + slot,
+		move * sizeof(u64));
+	memmove(leaf->end + slot + 1, leaf->end + slot, move * sizeof(u64));
+	memmove(leaf->items + slot + 1, leaf->items + slot,
+		move * sizeof(pe));
+	leaf->objectid[slot] = objectid;
+	leaf->end[slot] = pe->start + pe->size;
+	leaf->items[slot] = pe;
+	leaf->node.nr++;
+	pe->bt.magic = CACHE_EXTENT_IN_BTREE;
+	pe->bt.leaf = leaf;
+}
+
+static struct cache_btree_leaf *btree_split_leaf(struct cache_tree *tree,
+						 struct cache_btree_leaf *leaf)
+{
+	struct cache_btree_leaf *split = btree_new_leaf();
+	int mid = CACHE_BTREE_LEAF_SLOTS / 2;
+	int i;
+
+	split->node.nr = leaf->node.nr - mid;
+	memcpy(split->objectid, leaf->objectid + mid,
+	       split->node.nr * sizeof(u64));
+	memcpy(split->end, leaf->end + mid, split->node.nr * sizeof(u64));
+	memcpy(split->items, leaf->items + mid,
+	       split->node.nr * sizeof(split->items[0]));
+	for (i = 0; i < split->node.nr; i++)
+		split->items[i]->bt.leaf = split;
+	leaf->node.nr = mid;
+
+	split->next = leaf->next;
+	if (split->next)
+		split->next->prev = split;
+	split->prev = leaf;
+	leaf->next = split;
+
+	btree_insert_parent(tree, &leaf->node, split->objectid[0],
+			    split->end[0], &split->node);
+	return split;
+}
+
+static int btree_insert(struct cache_tree *tree, struct cache_extent *pe,
+			int key2)
+{
+	struct cache_btree_leaf *leaf;
+	struct cache_extent *prev;
+	struct cache_extent *next;
+	u64 objectid = key2 ? pe->objectid : 0;
+	u64 end = pe->start + pe->size;
+	int slot;
+
+	if (!tree->btree_root) {
+		leaf = btree_new_leaf();
+		tree->btree_root = &leaf->node;
+		leaf_insert_slot(leaf, 0, objectid, pe);
+		return 0;
+	}
+
+	leaf = btree_descend(tree, objectid, end);
+	slot = leaf_upper_slot(leaf, objectid, end);
+
+	/* the neighbours in key order are the only extents it can overlap */
+	if (slot)
+		prev = leaf->items[slot - 1];
+	else
+		prev = leaf->prev ? leaf->prev->items[leaf->prev->node.nr - 1] :
+				    NULL;
+	if (slot < leaf->node.nr)
+		next = leaf->items[slot];
+	else
+		next = leaf->next ? leaf->next->items[0] : NULL;
+	if (prev && btree_overlaps(prev, key2, pe->objectid, pe->start,
+				   pe->size))
+		return -EEXIST;
+	if (next && btree_overlaps(next, key2, pe->objectid, pe->start,
+				   pe->size))
+		return -EEXIST;
+
+	if (leaf->node.nr == CACHE_BTREE_LEAF_SLOTS) {
+		struct cache_btree_leaf *split = btree_split_leaf(tree, leaf);
+
+		if (slot > leaf->node.nr) {
+			slot -= leaf->node.nr;
+			leaf = split;
+		}
+	}
+	leaf_insert_slot(leaf, slot, objectid, pe);
+	return 0;
+}
+
+/* Unhook @node from its parent and free it, collapsing emptied levels */
+static void btree_delete_node(struct cache_tree *tree,
+			      struct cache_btree_node *node)
+{
+	struct cache_btree_inner *parent;
+	struct cache_btree_leaf *leaf;
+	int slot;
+	int move;
+
+	if (!node->level) {
+		leaf = btree_leaf(node);
+		if (leaf->prev)
+			leaf->prev->next = leaf->next;
+		if (leaf->next)
+			leaf->next->prev = leaf->prev;
+	}
+
+	if (!node->parent) {
+		tree->btree_root = NULL;
+		free(node);
+		return;
+	}
+
+	parent = btree_inner(node->parent);
+	slot = child_slot_of(node);
+	free(node);
+	move = parent->node.nr - slot - 1;
+	memmove(parent->objectid + slot, parent->objectid + slot + 1,
+		move * sizeof(u64));
+	memmove(parent->end + slot, parent->end + slot + 1, move * sizeof(u64));
+	memmove(parent->children + slot, parent->children + slot + 1,
+		move * sizeof(node));
+	parent->node.nr--;
+
+	if (!parent->node.nr) {
+		btree_delete_node(tree, &parent->node);
+		return;
+	}
+	while (tree->btree_root == &parent->node && parent->node.nr == 1) {
+		node = parent->children[0];
+		node->parent = NULL;
+		tree->btree_root = node;
+		free(parent);
+		if (!node->level)
+			break;
+		parent = btree_inner(node);
+	}
+}
+
+/* Move all of @right into @left, its predecessor under the same parent */
+static void btree_merge_leaves(struct cache_tree *tree,
+			       struct cache_btree_leaf *left,
+			       struct cache_btree_leaf *right)
+{
+	int nr = left->node.nr;
+	int i;
+
+	memcpy(left->objectid + nr, right->objectid,
+	       right->node.nr * sizeof(u64));
+	memcpy(left->end + nr, right->end, right->node.nr * sizeof(u64));
+	memcpy(left->items + nr, right->items,
+	       right->node.nr * sizeof(left->items[0]));
+	for (i = 0; i < right->node.nr; i++)
+		right->items[i]->bt.leaf = left;
+	left->node.nr += right->node.nr;
+	right->node.nr = 0;
+	btree_delete_node(tree, &right->node);
+}
+
+static void btree_rebalance_leaf(struct cache_tree *tree,
+				 struct cache_btree_leaf *leaf)
+{
+	struct cache_btree_leaf *sibling;
+
+	if (!leaf->node.nr) {
+		btree_delete_node(tree, &leaf->node);
+		return;
+	}
+	if (leaf->node.nr >= CACHE_BTREE_LEAF_SLOTS / 4)
+		return;
+
+	sibling = leaf->next;
+	if (sibling && sibling->node.parent == leaf->node.parent &&
+	    leaf->node.nr + sibling->node.nr <= CACHE_BTREE_LEAF_SLOTS / 2) {
+		btree_merge_leaves(tree, leaf, sibling);
+		return;
+	}
+	sibling = leaf->prev;
+	if (sibling && sibling->node.parent == leaf->node.parent &&
+	    leaf->node.nr + sibling->node.nr <= CACHE_BTREE_LEAF_SLOTS / 2)
+		btree_merge_leaves(tree, sibling, leaf);
+}
+
+static void leaf_remove_slots(struct cache_btree_leaf *leaf, int slot,
+			      int nr)
+{
+	int move = leaf->node.nr - slot - nr;
+
+	memmove(leaf->objectid + slot, leaf->objectid + slot + nr,
+		move * sizeof(u64));
+	memmove(leaf->end + slot, leaf->end + slot + nr, move * sizeof(u64));
+	memmove(leaf->items + slot, leaf->items + slot + nr,
+		move * sizeof(leaf->items[0]));
+	leaf->node.nr -= nr;
+}
+
+static void btree_remove(struct cache_tree *tree, struct cache_extent *pe)
+{
+	struct cache_btree_leaf *leaf = pe->bt.leaf;
+
+	leaf_remove_slots(leaf, leaf_slot_of(pe), 1);
+	pe->bt.magic = 0;
+	pe->bt.leaf = NULL;
+	btree_rebalance_leaf(tree, leaf);
+}
+
+static struct cache_extent *btree_next(struct cache_extent *pe)
+{
+	struct cache_btree_leaf *leaf = pe->bt.leaf;
+	int slot = leaf_slot_of(pe) + 1;
+
+	if (slot < leaf->node.nr)
+		return leaf->items[slot];
+	return leaf->next ? leaf->next->items[0] : NULL;
+}
+
+static struct cache_extent *btree_prev(struct cache_extent *pe)
+{
+	struct cache_btree_leaf *leaf = pe->bt.leaf;
+	int slot = leaf_slot_of(pe);
+
+	if (slot)
+		return leaf->items[slot - 1];
+	return leaf->prev ? leaf->prev->items[leaf->prev->node.nr - 1] : NULL;
+}
+
+static void btree_free_node(struct cache_btree_node *node,
+			    free_cache_extent free_func)
+{
+	struct cache_btree_leaf *leaf;
+	struct cache_btree_inner *inner;
+	int i;
+
+	if (node->level) {
+		inner = btree_inner(node);
+		for (i = 0; i < node->nr; i++)
+			btree_free_node(inner->children[i], free_func);
+	} else {
+		leaf = btree_leaf(node);
+		for (i = 0; i < node->nr; i++) {
+			leaf->items[i]->bt.magic = 0;
+			leaf->items[i]->bt.leaf = NULL;
+			free_func(leaf->items[i]);
+		}
+	}
+	free(node);
+}
+
+static void btree_remove_range(struct cache_tree *tree, u64 start, u64 size,
+			       free_cache_extent free_func)
+{
+	struct cache_extent *removed[CACHE_BTREE_LEAF_SLOTS];
+	struct cache_btree_leaf *leaf;
+	int slot;
+	int nr;
+	int i;
+
+	while (tree->btree_root) {
+		leaf = btree_descend(tree, 0, start);
+		slot = leaf_upper_slot(leaf, 0, start);
+		if (slot == leaf->node.nr) {
+			leaf = leaf->next;
+			slot = 0;
+		}
+		if (!leaf)
+			break;
+
+		nr = 0;
+		while (slot + nr < leaf->node.nr &&
+		       btree_overlaps(leaf->items[slot + nr], 0, 0, start,
+				      size)) {
+			removed[nr] = leaf->items[slot + nr];
+			nr++;
+		}
+		if (!nr)
+			break;
+
+		leaf_remove_slots(leaf, slot, nr);
+		btree_rebalance_leaf(tree, leaf);
+		for (i = 0; i < nr; i++) {
+			removed[i]->bt.magic = 0;
+			removed[i]->bt.leaf = NULL;
+			if (free_func)
+				free_func(removed[i]);
+		}
+	}
+}
+
+/*
+ * Build the tree bottom up from @nr sorted, disjoint extents.  Nodes are
+ * left three quarters full so the following inserts do not split every
+ * one of them.
+ */
+static void btree_bulk_build(struct cache_tree *tree,
+			     struct cache_extent **extents, int nr, int key2)
+{
+	struct cache_btree_node **level;
+	struct cache_btree_leaf *leaf;
+	struct cache_btree_leaf *prev = NULL;
+	struct cache_btree_inner *inner;
+	u64 *objectids;
+	u64 *ends;
+	int nr_nodes;
+	int nr_upper;
+	int per_node;
+	int done;
+	int i;
+	int j;
+
+	per_node = CACHE_BTREE_BULK_FILL(CACHE_BTREE_LEAF_SLOTS);
+	nr_nodes = (nr + per_node - 1) / per_node;
+	level = btree_alloc(nr_nodes * sizeof(*level));
+	objectids = btree_alloc(nr_nodes * sizeof(u64));
+	ends = btree_alloc(nr_nodes * sizeof(u64));
+
+	done = 0;
+	for (i = 0; i < nr_nodes; i++) {
+		leaf = btree_new_leaf();
+		per_node = (nr - done) / (nr_nodes - i);
+		for (j = 0; j < per_node; j++)
+			leaf_insert_slot(leaf, j,
+					 key2 ? extents[done + j]->objectid : 0,
+					 extents[done + j]);
+		done += per_node;
+		leaf->prev = prev;
+		if (prev)
+			prev->next = leaf;
+		prev = leaf;
+		level[i] = &leaf->node;
+		objectids[i] = leaf->objectid[0];
+		ends[i] = leaf->end[0];
+	}
+
+	while (nr_nodes > 1) {
+		per_node = CACHE_BTREE_BULK_FILL(CACHE_BTREE_INNER_SLOTS);
+		nr_upper = (nr_nodes + per_node - 1) / per_node;
+		done = 0;
+		for (i = 0; i < nr_upper; i++) {
+			inner = btree_alloc(sizeof(*inner));
+			inner->node.parent = NULL;
+			inner->node.level = level[done]->level + 1;
+			inner->node.nr = 0;
+			per_node = (nr_nodes - done) / (nr_upper - i);
+			for (j = 0; j < per_node; j++)
+				inner_insert_slot(inner, j, objectids[done + j],
+						  ends[done + j],
+						  level[done + j]);
+			objectids[i] = objectids[done];
+			ends[i] = ends[done];
+			level[i] = &inner->node;
+			done += per_node;
+		}
+		nr_nodes = nr_upper;
+	}
+	tree->btree_root = level[0];
+	free(level);
+	free(objectids);
+	free(ends);
+}
+
+static int cache_tree_bulk_sorted(struct cache_extent **extents, int nr,
+				  int key2)
+{
+	struct cache_extent *prev;
+	struct cache_extent *cur;
+	int i;
+
+	for (i = 1; i < nr; i++) {
+		prev = extents[i - 1];
+		cur = extents[i];
+		if (key2 && prev->objectid != cur->objectid) {
+			if (prev->objectid > cur->objectid)
+				return 0;
+			continue;
+		}
+		if (prev->start + prev->size > cur->start)
+			return 0;
+	}
+	return 1;
+}
+
+static int __cache_tree_bulk_load(struct cache_tree *tree,
+				  struct cache_extent **extents, int nr,
+				  int key2)
+{
+	int ret = 0;
+	int i;
+
+	if (nr <= 0)
+		return 0;
+	if (tree->btree && !tree->btree_root &&
+	    cache_tree_bulk_sorted(extents, nr, key2)) {
+		btree_bulk_build(tree, extents, nr, key2);
+		return 0;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (key2)
+			ret = insert_cache_extent2(tree, extents[i]);
+		else
+			ret = insert_cache_extent(tree, extents[i]);
+		if (ret)
+			break;
+	}
+	if (ret) {
+		while (i--)
+			remove_cache_extent(tree, extents[i]);
+	}
+	return ret;
+}
+
 void cache_tree_init(struct cache_tree *tree)
 {
 	tree->root = RB_ROOT;
+	tree->btree_root = NULL;
+	tree->btree = 0;
+}
+
+void cache_tree_init_btree(struct cache_tree *tree)
+{
+	cache_tree_init(tree);
+	tree->btree = 1;
 }
 
 static struct cache_extent *
@@ -138,11 +854,15 @@ int add_cache_extent2(struct cache_tree *tree,
 
 int insert_cache_extent(struct cache_tree *tree, struct cache_extent *pe)
 {
+	if (tree->btree)
+		return btree_insert(tree, pe, 0);
 	return rb_insert(&tree->root, &pe->rb_node, cache_tree_comp_nodes);
 }
 
 int insert_cache_extent2(struct cache_tree *tree, struct cache_extent *pe)
 {
+	if (tree->btree)
+		return btree_insert(tree, pe, 1);
 	return rb_insert(&tree->root, &pe->rb_node, cache_tree_comp_nodes2);
 }
 
@@ -153,6 +873,9 @@ struct cache_extent *lookup_cache_extent(struct cache_tree *tree,
 	struct cache_extent *entry;
 	struct cache_extent_search_range range;
 
+	if (tree->btree)
+		return btree_lookup(tree, 0, 0, start, size);
+
 	range.start = start;
 	range.size = size;
 	node = rb_search(&tree->root, &range, cache_tree_comp_range, NULL);
@@ -170,6 +893,9 @@ struct cache_extent *lookup_cache_extent2(struct cache_tree *tree,
 	struct cache_extent *entry;
 	struct cache_extent_search_range range;
 
+	if (tree->btree)
+		return btree_lookup(tree, 1, objectid, start, size);
+
 	range.objectid = objectid;
 	range.start = start;
 	range.size = size;
@@ -188,6 +914,9 @@ struct cache_extent *search_cache_extent(struct cache_tree *tree, u64 start)
 	struct cache_extent *entry;
 	struct cache_extent_search_range range;
 
+	if (tree->btree)
+		return btree_search(tree, 0, start);
+
 	range.start = start;
 	range.size = 1;
 	node = rb_search(&tree->root, &range, cache_tree_comp_range, &next);
@@ -208,6 +937,9 @@ struct cache_extent *search_cache_extent2(struct cache_tree *tree,
 	struct cache_extent *entry;
 	struct cache_extent_search_range range;
 
+	if (tree->btree)
+		return btree_search(tree, objectid, start);
+
 	range.objectid = objectid;
 	range.start = start;
 	range.size = 1;
@@ -223,8 +955,15 @@ struct cache_extent *search_cache_extent2(struct cache_tree *tree,
 
 struct cache_extent *first_cache_extent(struct cache_tree *tree)
 {
-	struct rb_node *node = rb_first(&tree->root);
+	struct cache_btree_leaf *leaf;
+	struct rb_node *node;
 
+	if (tree->btree) {
+		leaf = btree_edge_leaf(tree, 0);
+		return leaf ? leaf->items[0] : NULL;
+	}
+
+	node = rb_first(&tree->root);
 	if (!node)
 		return NULL;
 	return rb_entry(node, struct cache_extent, rb_node);
@@ -232,8 +971,15 @@ struct cache_extent *first_cache_extent(struct cache_tree *tree)
 
 struct cache_extent *last_cache_extent(struct cache_tree *tree)
 {
-	struct rb_node *node = rb_last(&tree->root);
+	struct cache_btree_leaf *leaf;
+	struct rb_node *node;
 
+	if (tree->btree) {
+		leaf = btree_edge_leaf(tree, 1);
+		return leaf ? leaf->items[leaf->node.nr - 1] : NULL;
+	}
+
+	node = rb_last(&tree->root);
 	if (!node)
 		return NULL;
 	return rb_entry(node, struct cache_extent, rb_node);
@@ -241,8 +987,12 @@ struct cache_extent *last_cache_extent(struct cache_tree *tree)
 
 struct cache_extent *prev_cache_extent(struct cache_extent *pe)
 {
-	struct rb_node *node = rb_prev(&pe->rb_node);
+	struct rb_node *node;
+
+	if (in_btree(pe))
+		return btree_prev(pe);
 
+	node = rb_prev(&pe->rb_node);
 	if (!node)
 		return NULL;
 	return rb_entry(node, struct cache_extent, rb_node);
@@ -250,8 +1000,12 @@ struct cache_extent *prev_cache_extent(struct cache_extent *pe)
 
 struct cache_extent *next_cache_extent(struct cache_extent *pe)
 {
-	struct rb_node *node = rb_next(&pe->rb_node);
+	struct rb_node *node;
+
+	if (in_btree(pe))
+		return btree_next(pe);
 
+	node = rb_next(&pe->rb_node);
 	if (!node)
 		return NULL;
 	return rb_entry(node, struct cache_extent, rb_node);
@@ -259,20 +1013,70 @@ struct cache_extent *next_cache_extent(struct cache_extent *pe)
 
 void remove_cache_extent(struct cache_tree *tree, struct cache_extent *pe)
 {
+	if (tree->btree) {
+		btree_remove(tree, pe);
+		return;
+	}
 	rb_erase(&pe->rb_node, &tree->root);
 }
 
 void cache_tree_free_extents(struct cache_tree *tree,
 			     free_cache_extent free_func)
 {
+	struct cache_btree_node *root = tree->btree_root;
 	struct cache_extent *ce;
 
+	if (tree->btree) {
+		tree->btree_root = NULL;
+		if (root)
+			btree_free_node(root, free_func);
+		return;
+	}
+
 	while ((ce = first_cache_extent(tree))) {
 		remove_cache_extent(tree, ce);
 		free_func(ce);
 	}
 }
 
+/*
+ * Insert @nr extents sorted by start (objectid first for the *2 variant).
+ * An empty B+tree is built from them directly.  Either all of them are
+ * inserted or, if one overlaps, none and -EEXIST is returned.
+ */
+int cache_tree_bulk_load(struct cache_tree *tree,
+			 struct cache_extent **extents, int nr)
+{
+	return __cache_tree_bulk_load(tree, extents, nr, 0);
+}
+
+int cache_tree_bulk_load2(struct cache_tree *tree,
+			  struct cache_extent **extents, int nr)
+{
+	return __cache_tree_bulk_load(tree, extents, nr, 1);
+}
+
+/*
+ * Remove every extent overlapping [start, start + size) and pass it to
+ * @free_func, if there is one.
+ */
+void cache_tree_remove_range(struct cache_tree *tree, u64 start, u64 size,
+			     free_cache_extent free_func)
+{
+	struct cache_extent *ce;
+
+	if (tree->btree) {
+		btree_remove_range(tree, start, size, free_func);
+		return;
+	}
+
+	while ((ce = lookup_cache_extent(tree, start, size))) {
+		remove_cache_extent(tree, ce);
+		if (free_func)
+			free_func(ce);
+	}
+}
+
 static void free_extent_cache(struct cache_extent *pe)
 {
 	free(pe);
@@ -27,18 +27,38 @@
 #include <btrfs/rbtree.h>
 #endif /* BTRFS_FLAT_INCLUDES */
 
+struct cache_btree_node;
+struct cache_btree_leaf;
+
+/*
+ * A cache_tree is an rbtree unless it was set up with
+ * cache_tree_init_btree(), then the extents are kept in a B+tree with
+ * wide nodes that carry the keys inline.  Lookups then touch a few
+ * contiguous arrays instead of one cache line per level in every record,
+ * which matters once the tree holds millions of extents.  Both behave
+ * the same through the functions below.
+ */
 struct cache_tree {
 	struct rb_root root;
+	struct cache_btree_node *btree_root;
+	int btree;
 };
 
 struct cache_extent {
-	struct rb_node rb_node;
+	union {
+		struct rb_node rb_node;
+		struct {
+			unsigned long magic;
+			struct cache_btree_leaf *leaf;
+		} bt;
+	};
 	u64 objectid;
 	u64 start;
 	u64 size;
 };
 
 void cache_tree_init(struct cache_tree *tree);
+void cache_tree_init_btree(struct cache_tree *tree);
 
 struct cache_extent *first_cache_extent(struct cache_tree *tree);
 struct cache_extent *last_cache_extent(struct cache_tree *tree);
@@ -55,6 +75,8 @@ void remove_cache_extent(struct cache_tree *tree, struct cache_extent *pe);
 
 static inline int cache_tree_empty(struct cache_tree *tree)
 {
+	if (tree->btree)
+		return !tree->btree_root;
 	return RB_EMPTY_ROOT(&tree->root);
 }
 
@@ -62,6 +84,10 @@ typedef void (*free_cache_extent)(struct cache_extent *pe);
 
 void cache_tree_free_extents(struct cache_tree *tree,
 			     free_cache_extent free_func);
+int cache_tree_bulk_load(struct cache_tree *tree,
+			 struct cache_extent **extents, int nr);
+void cache_tree_remove_range(struct cache_tree *tree, u64 start, u64 size,
+			     free_cache_extent free_func);
 
 #define FREE_EXTENT_CACHE_BASED_TREE(name, free_func)		\
 static void free_##name##_tree(struct cache_tree *tree)		\
@@ -78,5 +104,7 @@ struct cache_extent *lookup_cache_extent2(struct cache_tree *tree,
 int add_cache_extent2(struct cache_tree *tree,
 		      u64 objectid, u64 start, u64 size);
 int insert_cache_extent2(struct cache_tree *tree, struct cache_extent *pe);
+int cache_tree_bulk_load2(struct cache_tree *tree,
+			  struct cache_extent **extents, int nr);
 
 #endif
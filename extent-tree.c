@@ -28,6 +28,7 @@
 #include "crc32c.h"
 #include "volumes.h"
 #include "free-space-cache.h"
+#include "free-space-index.h"
 #include "math.h"
 #include "utils.h"
 
@@ -62,6 +63,134 @@ static struct btrfs_block_group_cache *
 btrfs_find_block_group(struct btrfs_root *root, struct btrfs_block_group_cache
 		       *hint, u64 search_start, int data, int owner);
 
+/*
+ * fs_info->free_space_cache records the free space of all block groups.
+ * Block groups find_free_extent() has searched also keep their free space
+ * in a btrfs_free_index, minus the pinned ranges and the reserved ranges
+ * whose extent items are not inserted yet.  Free space must be changed
+ * through btrfs_set_free_space() and btrfs_clear_free_space() so the two
+ * stay in sync.
+ */
+static void free_index_add_range(struct btrfs_fs_info *info,
+				 struct btrfs_free_index *index,
+				 u64 start, u64 end)
+{
+	u64 found_start;
+	u64 found_end;
+	u64 excl_start;
+	u64 excl_end = 0;
+	int ret;
+
+	while (start <= end) {
+		excl_start = (u64)-1;
+		ret = find_first_extent_bit(&info->pinned_extents, start,
+					    &found_start, &found_end,
+					    EXTENT_DIRTY);
+		if (!ret && found_start <= end) {
+			excl_start = max(found_start, start);
+			excl_end = found_end;
+		}
+		ret = find_first_extent_bit(&info->extent_ins, start,
+					    &found_start, &found_end,
+					    EXTENT_LOCKED);
+		if (!ret && found_start <= end &&
+		    max(found_start, start) < excl_start) {
+			excl_start = max(found_start, start);
+			excl_end = found_end;
+		}
+
+		if (excl_start == (u64)-1) {
+			ret = btrfs_free_index_add(index, start,
+						   end + 1 - start);
+			BUG_ON(ret);
+			break;
+		}
+		if (excl_start > start) {
+			ret = btrfs_free_index_add(index, start,
+						   excl_start - start);
+			BUG_ON(ret);
+		}
+		if (excl_end >= end)
+			break;
+		start = excl_end + 1;
+	}
+}
+
+static void update_free_index(struct btrfs_fs_info *info, u64 start, u64 end,
+			      int free)
+{
+	struct btrfs_block_group_cache *cache;
+	u64 group_end;
+	u64 range_start;
+	u64 range_end;
+	int ret;
+
+	while (start <= end) {
+		cache = btrfs_lookup_first_block_group(info, start);
+		if (!cache || cache->key.objectid > end)
+			break;
+		group_end = cache->key.objectid + cache->key.offset - 1;
+		if (cache->free_index) {
+			range_start = max(start, cache->key.objectid);
+			range_end = min(end, group_end);
+			if (free) {
+				free_index_add_range(info, cache->free_index,
+						     range_start, range_end);
+			} else {
+				ret = btrfs_free_index_remove(cache->free_index,
+						range_start,
+						range_end + 1 - range_start);
+				BUG_ON(ret);
+			}
+		}
+		if (group_end >= end)
+			break;
+		start = group_end + 1;
+	}
+}
+
+/* put the free parts of an unpinned range back into the indexes */
+static void restore_free_index(struct btrfs_fs_info *info, u64 start, u64 end)
+{
+	u64 found_start;
+	u64 found_end;
+
+	while (start <= end) {
+		if (find_first_extent_bit(&info->free_space_cache, start,
+					  &found_start, &found_end,
+					  EXTENT_DIRTY))
+			break;
+		if (found_start > end)
+			break;
+		update_free_index(info, max(found_start, start),
+				  min(found_end, end), 1);
+		if (found_end >= end)
+			break;
+		start = found_end + 1;
+	}
+}
+
+int btrfs_set_free_space(struct btrfs_fs_info *info, u64 start, u64 end)
+{
+	int ret;
+
+	ret = set_extent_dirty(&info->free_space_cache, start, end, GFP_NOFS);
+	if (!ret)
+		update_free_index(info, start, end, 1);
+	return ret;
+}
+
+int btrfs_clear_free_space(struct btrfs_fs_info *info, u64 start, u64 end)
+{
+	int ret;
+
+	ret = clear_extent_dirty(&info->free_space_cache, start, end,
+				 GFP_NOFS);
+	if (ret >= 0)
+		update_free_index(info, start, end, 0);
+	return ret;
+}
+
 static int remove_sb_from_cache(struct btrfs_root *root,
 				struct btrfs_block_group_cache *cache)
 {
@@ -69,9 +198,7 @@ static int remove_sb_from_cache(struct btrfs_root *root,
 	u64 *logical;
 	int stripe_len;
 	int i, nr, ret;
-	struct extent_io_tree *free_space_cache;
 
-	free_space_cache = &root->fs_info->free_space_cache;
 	for (i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
 		bytenr = btrfs_sb_offset(i);
 		ret = btrfs_rmap_block(&root->fs_info->mapping_tree,
@@ -79,14 +206,102 @@ static int remove_sb_from_cache(struct btrfs_root *root,
 				       &logical, &nr, &stripe_len);
 		BUG_ON(ret);
 		while (nr--) {
-			clear_extent_dirty(free_space_cache, logical[nr],
-				logical[nr] + stripe_len - 1, GFP_NOFS);
+			btrfs_clear_free_space(root->fs_info, logical[nr],
+					       logical[nr] + stripe_len - 1);
 		}
 		kfree(logical);
 	}
 	return 0;
 }
 
+/* bytes of the group the super block copies keep from being allocated */
+static u64 super_stripe_bytes(struct btrfs_root *root,
+			      struct btrfs_block_group_cache *cache)
+{
+	u64 start = cache->key.objectid;
+	u64 end = cache->key.objectid + cache->key.offset;
+	u64 bytes = 0;
+	u64 *logical;
+	int stripe_len;
+	int i, nr, ret;
+
+	if (start < BTRFS_SUPER_INFO_OFFSET)
+		bytes += min(end, (u64)BTRFS_SUPER_INFO_OFFSET) - start;
+
+	for (i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
+		ret = btrfs_rmap_block(&root->fs_info->mapping_tree, start,
+				       btrfs_sb_offset(i), 0, &logical, &nr,
+				       &stripe_len);
+		BUG_ON(ret);
+		while (nr--) {
+			if (logical[nr] >= end ||
+			    logical[nr] + stripe_len <= start)
+				continue;
+			bytes += min(end, logical[nr] + stripe_len) -
+				 max(start, logical[nr]);
+		}
+		kfree(logical);
+	}
+	return bytes;
+}
+
+/*
+ * Take the free space of a block group from its v1 free space cache.
+ * The cache is only trusted if it was written by the last transaction
+ * committed, nothing in the group changed since and the crcs, generations
+ * and free space total all check out.  Returns 1 if the cache was used.
+ */
+static int load_cached_free_space(struct btrfs_root *root,
+				  struct btrfs_block_group_cache *cache)
+{
+	struct btrfs_fs_info *info = root->fs_info;
+	struct btrfs_super_block *super = info->super_copy;
+	struct btrfs_free_space_ctl ctl;
+	struct btrfs_free_space *entry;
+	struct rb_node *node;
+	u64 start = cache->key.objectid;
+	u64 end = cache->key.objectid + cache->key.offset - 1;
+	int ret;
+
+	if (info->ignore_space_cache ||
+	    btrfs_super_cache_generation(super) !=
+	    btrfs_super_generation(super))
+		return 0;
+	if (test_range_bit(&info->block_group_cache, start, end,
+			   BLOCK_GROUP_DIRTY, 0))
+		return 0;
+
+	ret = btrfs_read_free_space_cache(info, cache, &ctl);
+	if (ret <= 0)
+		return 0;
+
+	if (btrfs_block_group_used(&cache->item) + ctl.free_space +
+	    super_stripe_bytes(root, cache) != cache->key.offset) {
+		ret = 0;
+		goto out;
+	}
+
+	for (node = rb_first(&ctl.free_space_offset); node;
+	     node = rb_next(node)) {
+		entry = rb_entry(node, struct btrfs_free_space, offset_index);
+		if (entry->offset < start ||
+		    entry->offset + entry->bytes - 1 > end) {
+			ret = 0;
+			goto out;
+		}
+	}
+
+	for (node = rb_first(&ctl.free_space_offset); node;
+	     node = rb_next(node)) {
+		entry = rb_entry(node, struct btrfs_free_space, offset_index);
+		btrfs_set_free_space(info, entry->offset,
+				     entry->offset + entry->bytes - 1);
+	}
+out:
+	__btrfs_remove_free_space_cache(&ctl);
+	return ret;
+}
+
 static int cache_block_group(struct btrfs_root *root,
 			     struct btrfs_block_group_cache *block_group)
 {
@@ -94,7 +309,6 @@ static int cache_block_group(struct btrfs_root *root,
 	int ret;
 	struct btrfs_key key;
 	struct extent_buffer *leaf;
-	struct extent_io_tree *free_space_cache;
 	int slot;
 	u64 last;
 	u64 hole_size;
@@ -103,11 +317,16 @@ static int cache_block_group(struct btrfs_root *root,
 		return 0;
 
 	root = root->fs_info->extent_root;
-	free_space_cache = &root->fs_info->free_space_cache;
 
 	if (block_group->cached)
 		return 0;
 
+	if (load_cached_free_space(root, block_group)) {
+		remove_sb_from_cache(root, block_group);
+		block_group->cached = 1;
+		return 0;
+	}
+
 	path = btrfs_alloc_path();
 	if (!path)
 		return -ENOMEM;
@@ -148,9 +367,8 @@ static int cache_block_group(struct btrfs_root *root,
 		    key.type == BTRFS_METADATA_ITEM_KEY) {
 			if (key.objectid > last) {
 				hole_size = key.objectid - last;
-				set_extent_dirty(free_space_cache, last,
-						 last + hole_size - 1,
-						 GFP_NOFS);
+				btrfs_set_free_space(root->fs_info, last,
+						     last + hole_size - 1);
 			}
 			if (key.type == BTRFS_METADATA_ITEM_KEY)
 				last = key.objectid + root->leafsize;
@@ -165,8 +383,8 @@ next:
 	    block_group->key.offset > last) {
 		hole_size = block_group->key.objectid +
 			block_group->key.offset - last;
-		set_extent_dirty(free_space_cache, last,
-				 last + hole_size - 1, GFP_NOFS);
+		btrfs_set_free_space(root->fs_info, last,
+				     last + hole_size - 1);
 	}
 	remove_sb_from_cache(root, block_group);
 	block_group->cached = 1;
@@ -239,71 +457,45 @@ static int block_group_bits(struct btrfs_block_group_cache *cache, u64 bits)
 	return (cache->flags & bits) == bits;
 }
 
-static int noinline find_search_start(struct btrfs_root *root,
-			      struct btrfs_block_group_cache **cache_ret,
-			      u64 *start_ret, int num, int data)
+/*
+ * The free space index of a block group, built from free_space_cache the
+ * first time the allocator looks at the group.
+ */
+static struct btrfs_free_index *
+block_group_free_index(struct btrfs_root *root,
+		       struct btrfs_block_group_cache *cache)
 {
-	int ret;
-	struct btrfs_block_group_cache *cache = *cache_ret;
-	u64 last = *start_ret;
-	u64 start = 0;
-	u64 end = 0;
-	u64 search_start = *start_ret;
-	int wrapped = 0;
-
-	if (!cache)
-		goto out;
-again:
-	ret = cache_block_group(root, cache);
-	if (ret)
-		goto out;
-
-	last = max(search_start, cache->key.objectid);
-	if (cache->ro || !block_group_bits(cache, data))
-		goto new_group;
-
-	while(1) {
-		ret = find_first_extent_bit(&root->fs_info->free_space_cache,
-					    last, &start, &end, EXTENT_DIRTY);
-		if (ret) {
-			goto new_group;
-		}
-
-		start = max(last, start);
-		last = end + 1;
-		if (last - start < num) {
-			continue;
-		}
-		if (start + num > cache->key.objectid + cache->key.offset) {
-			goto new_group;
-		}
-		*start_ret = start;
-		return 0;
-	}
-out:
-	*start_ret = last;
-	cache = btrfs_lookup_block_group(root->fs_info, search_start);
-	if (!cache) {
-		printk("Unable to find block group for %llu\n",
-			(unsigned long long)search_start);
-		WARN_ON(1);
-	}
-	return -ENOSPC;
+	struct btrfs_fs_info *info = root->fs_info;
+	struct btrfs_free_index *index;
+	u64 start = cache->key.objectid;
+	u64 group_end = cache->key.objectid + cache->key.offset - 1;
+	u64 found_start;
+	u64 found_end;
+
+	cache_block_group(root, cache);
+	if (cache->free_index)
+		return cache->free_index;
+
+	index = kmalloc(sizeof(*index), GFP_NOFS);
+	if (!index)
+		return NULL;
+	btrfs_free_index_init(index);
 
-new_group:
-	last = cache->key.objectid + cache->key.offset;
-wrapped:
-	cache = btrfs_lookup_first_block_group(root->fs_info, last);
-	if (!cache) {
-		if (!wrapped) {
-			wrapped = 1;
-			last = search_start;
-			goto wrapped;
-		}
-		goto out;
+	while (start <= group_end) {
+		if (find_first_extent_bit(&info->free_space_cache, start,
+					  &found_start, &found_end,
+					  EXTENT_DIRTY))
+			break;
+		if (found_start > group_end)
+			break;
+		free_index_add_range(info, index, max(found_start, start),
+				     min(found_end, group_end));
+		if (found_end >= group_end)
+			break;
+		start = found_end + 1;
 	}
-	*cache_ret = cache;
-	goto again;
+	cache->free_index = index;
+	return index;
 }
 
 static int block_group_state_bits(u64 flags)
@@ -598,7 +790,7 @@ static int convert_extent_item_v0(struct btrfs_trans_handle *trans,
 }
 #endif
 
-static u64 hash_extent_data_ref(u64 root_objectid, u64 owner, u64 offset)
+u64 hash_extent_data_ref(u64 root_objectid, u64 owner, u64 offset)
 {
 	u32 high_crc = ~(u32)0;
 	u32 low_crc = ~(u32)0;
@@ -1442,9 +1634,14 @@ int btrfs_extent_post_op(struct btrfs_trans_handle *trans,
 	return 0;
 }
 
-int btrfs_lookup_extent_info(struct btrfs_trans_handle *trans,
-			     struct btrfs_root *root, u64 bytenr,
-			     u64 offset, int metadata, u64 *refs, u64 *flags)
+/*
+ * Search through @cur when given, it is left where the item was found.
+ * Otherwise a path of our own is used.
+ */
+static int lookup_extent_info(struct btrfs_trans_handle *trans,
+			      struct btrfs_root *root,
+			      struct btrfs_tree_cursor *cur, u64 bytenr,
+			      u64 offset, int metadata, u64 *refs, u64 *flags)
 {
 	struct btrfs_path *path;
 	int ret;
@@ -1462,10 +1659,14 @@ int btrfs_lookup_extent_info(struct btrfs_trans_handle *trans,
 		metadata = 0;
 	}
 
-	path = btrfs_alloc_path();
-	if (!path)
-		return -ENOMEM;
-	path->reada = 1;
+	if (cur) {
+		path = &cur->path;
+	} else {
+		path = btrfs_alloc_path();
+		if (!path)
+			return -ENOMEM;
+		path->reada = 1;
+	}
 
 	key.objectid = bytenr;
 	key.offset = offset;
@@ -1475,8 +1676,11 @@ int btrfs_lookup_extent_info(struct btrfs_trans_handle *trans,
 		key.type = BTRFS_EXTENT_ITEM_KEY;
 
 again:
-	ret = btrfs_search_slot(trans, root->fs_info->extent_root, &key, path,
-				0, 0);
+	if (cur)
+		ret = btrfs_tree_cursor_seek(cur, &key);
+	else
+		ret = btrfs_search_slot(trans, root->fs_info->extent_root,
+					&key, path, 0, 0);
 	if (ret < 0)
 		goto out;
 
@@ -1498,7 +1702,8 @@ again:
 		}
 
 		if (ret) {
-			btrfs_release_path(path);
+			if (!cur)
+				btrfs_release_path(path);
 			key.type = BTRFS_EXTENT_ITEM_KEY;
 			key.offset = root->leafsize;
 			metadata = 0;
@@ -1537,10 +1742,31 @@ again:
 	if (flags)
 		*flags = extent_flags;
 out:
-	btrfs_free_path(path);
+	if (!cur)
+		btrfs_free_path(path);
 	return ret;
 }
 
+int btrfs_lookup_extent_info(struct btrfs_trans_handle *trans,
+			     struct btrfs_root *root, u64 bytenr,
+			     u64 offset, int metadata, u64 *refs, u64 *flags)
+{
+	return lookup_extent_info(trans, root, NULL, bytenr, offset, metadata,
+				  refs, flags);
+}
+
+/*
+ * Same as above, for callers looking up many blocks in about increasing
+ * order.  @cur must be a cursor on the extent root.
+ */
+int btrfs_lookup_extent_info_cursor(struct btrfs_tree_cursor *cur,
+				    u64 bytenr, u64 offset, int metadata,
+				    u64 *refs, u64 *flags)
+{
+	return lookup_extent_info(NULL, cur->root, cur, bytenr, offset,
+				  metadata, refs, flags);
+}
+
 int btrfs_set_block_flags(struct btrfs_trans_handle *trans,
 			  struct btrfs_root *root,
 			  u64 bytenr, int level, u64 flags)
@@ -1945,9 +2171,8 @@ static int update_block_group(struct btrfs_trans_handle *trans,
 			old_val -= num_bytes;
 			cache->space_info->bytes_used -= num_bytes;
 			if (mark_free) {
-				set_extent_dirty(&info->free_space_cache,
-						 bytenr, bytenr + num_bytes - 1,
-						 GFP_NOFS);
+				btrfs_set_free_space(info, bytenr,
+						     bytenr + num_bytes - 1);
 			}
 		}
 		btrfs_set_block_group_used(&cache->item, old_val);
@@ -1967,9 +2192,11 @@ static int update_pinned_extents(struct btrfs_root *root,
 	if (pin) {
 		set_extent_dirty(&fs_info->pinned_extents,
 				bytenr, bytenr + num - 1, GFP_NOFS);
+		update_free_index(fs_info, bytenr, bytenr + num - 1, 0);
 	} else {
 		clear_extent_dirty(&fs_info->pinned_extents,
 				bytenr, bytenr + num - 1, GFP_NOFS);
+		restore_free_index(fs_info, bytenr, bytenr + num - 1);
 	}
 	while (num > 0) {
 		cache = btrfs_lookup_block_group(fs_info, bytenr);
@@ -2003,8 +2230,6 @@ int btrfs_finish_extent_commit(struct btrfs_trans_handle *trans,
 	u64 start;
 	u64 end;
 	int ret;
-	struct extent_io_tree *free_space_cache;
-	free_space_cache = &root->fs_info->free_space_cache;
 
 	while(1) {
 		ret = find_first_extent_bit(unpin, 0, &start, &end,
@@ -2013,7 +2238,7 @@ int btrfs_finish_extent_commit(struct btrfs_trans_handle *trans,
 			break;
 		update_pinned_extents(root, start, end + 1 - start, 0);
 		clear_extent_dirty(unpin, start, end, GFP_NOFS);
-		set_extent_dirty(free_space_cache, start, end, GFP_NOFS);
+		btrfs_set_free_space(root->fs_info, start, end);
 	}
 	return 0;
 }
@@ -2487,12 +2712,69 @@ static u64 stripe_align(struct btrfs_root *root, u64 val)
 }
 
 /*
- * walks the btree of allocated extents and find a hole of a given size.
+ * Find @num_bytes of free space in one block group.  With the next-fit
+ * policy the search starts at @search_start when it falls inside the
+ * group, and where the last allocation from the group ended otherwise.
+ */
+static int find_free_in_group(struct btrfs_root *root,
+			      struct btrfs_block_group_cache *cache,
+			      u64 num_bytes, u64 search_start,
+			      u64 exclude_start, u64 exclude_nr,
+			      int data, u64 *start_ret)
+{
+	struct btrfs_free_index *index;
+	u64 group_start = cache->key.objectid;
+	u64 align = root->stripesize;
+	u64 from = max(search_start, group_start);
+	u64 start;
+	int ret;
+
+	if (cache->ro || !block_group_bits(cache, data))
+		return -ENOSPC;
+
+	index = block_group_free_index(root, cache);
+	if (!index)
+		return -ENOMEM;
+	if (btrfs_free_index_max_extent(index) < num_bytes)
+		return -ENOSPC;
+
+	if (root->fs_info->alloc_policy == BTRFS_ALLOC_BEST_FIT) {
+		ret = btrfs_free_index_best_fit(index, group_start, num_bytes,
+						align, &start);
+	} else if (from > group_start) {
+		ret = btrfs_free_index_first_fit(index, from, num_bytes,
+						 align, &start);
+		if (ret)
+			ret = btrfs_free_index_first_fit(index, group_start,
+							 num_bytes, align,
+							 &start);
+	} else {
+		ret = btrfs_free_index_next_fit(index, num_bytes, align,
+						&start);
+	}
+	if (ret)
+		return ret;
+
+	if (exclude_nr > 0 && start + num_bytes > exclude_start &&
+	    start < exclude_start + exclude_nr) {
+		ret = btrfs_free_index_first_fit(index,
+						 exclude_start + exclude_nr,
+						 num_bytes, align, &start);
+		if (ret)
+			return ret;
+	}
+	*start_ret = start;
+	return 0;
+}
+
+/*
+ * finds a free extent of a given size.
  * The key ins is changed to record the hole:
  * ins->objectid == block start
  * ins->flags = BTRFS_EXTENT_ITEM_KEY
  * ins->offset == number of blocks
- * Any available blocks before search_start are skipped.
+ * Block groups are tried starting with the one picked by the hints, then
+ * in address order, wrapping around once.
  */
 static int noinline find_free_extent(struct btrfs_trans_handle *trans,
 				     struct btrfs_root *orig_root,
@@ -2503,13 +2785,13 @@ static int noinline find_free_extent(struct btrfs_trans_handle *trans,
 				     int data)
 {
 	int ret;
-	u64 orig_search_start = search_start;
 	struct btrfs_root * root = orig_root->fs_info->extent_root;
 	struct btrfs_fs_info *info = root->fs_info;
-	u64 total_needed = num_bytes;
+	u64 total_needed = num_bytes + empty_size;
+	struct btrfs_block_group_cache *first_group;
 	struct btrfs_block_group_cache *block_group;
-	int full_scan = 0;
-	int wrapped = 0;
+	u64 start;
+	int wrapped;
 
 	WARN_ON(num_bytes < root->sectorsize);
 	btrfs_set_key_type(ins, BTRFS_EXTENT_ITEM_KEY);
@@ -2527,81 +2809,52 @@ static int noinline find_free_extent(struct btrfs_trans_handle *trans,
 						     trans->block_group,
 						     search_start, data, 1);
 	}
-
-	total_needed += empty_size;
-
-check_failed:
-	search_start = stripe_align(root, search_start);
-	if (!block_group) {
+	if (!block_group)
 		block_group = btrfs_lookup_first_block_group(info,
 							     search_start);
-		if (!block_group)
-			block_group = btrfs_lookup_first_block_group(info,
-						       orig_search_start);
-	}
-	ret = find_search_start(root, &block_group, &search_start,
-				total_needed, data);
-	if (ret)
-		goto new_group;
+	first_group = block_group;
 
-	ins->objectid = search_start;
-	ins->offset = num_bytes;
-
-	if (ins->objectid + num_bytes >
-	    block_group->key.objectid + block_group->key.offset) {
-		search_start = block_group->key.objectid +
-			block_group->key.offset;
-		goto new_group;
-	}
+again:
+	block_group = first_group;
+	wrapped = 0;
+	while (1) {
+		if (!block_group) {
+			if (wrapped)
+				break;
+			wrapped = 1;
+			block_group = btrfs_lookup_first_block_group(info, 0);
+			if (!block_group)
+				break;
+		}
+		if (wrapped && first_group &&
+		    block_group->key.objectid >= first_group->key.objectid)
+			break;
 
-	if (test_range_bit(&info->extent_ins, ins->objectid,
-			   ins->objectid + num_bytes -1, EXTENT_LOCKED, 0)) {
-		search_start = ins->objectid + num_bytes;
-		goto new_group;
-	}
+		ret = find_free_in_group(root, block_group, total_needed,
+					 search_start, exclude_start,
+					 exclude_nr, data, &start);
+		if (!ret)
+			goto found;
+		if (ret != -ENOSPC)
+			return ret;
 
-	if (test_range_bit(&info->pinned_extents, ins->objectid,
-			   ins->objectid + num_bytes -1, EXTENT_DIRTY, 0)) {
-		search_start = ins->objectid + num_bytes;
-		goto new_group;
+		block_group = btrfs_lookup_first_block_group(info,
+				block_group->key.objectid +
+				block_group->key.offset);
+		cond_resched();
 	}
-
-	if (exclude_nr > 0 && (ins->objectid + num_bytes > exclude_start &&
-	    ins->objectid < exclude_start + exclude_nr)) {
-		search_start = exclude_start + exclude_nr;
-		goto new_group;
+	if (total_needed > num_bytes) {
+		total_needed = num_bytes;
+		goto again;
 	}
+	return -ENOSPC;
 
-	if (!(data & BTRFS_BLOCK_GROUP_DATA)) {
-		block_group = btrfs_lookup_block_group(info, ins->objectid);
-		if (block_group)
-			trans->block_group = block_group;
-	}
+found:
+	if (!(data & BTRFS_BLOCK_GROUP_DATA))
+		trans->block_group = block_group;
+	ins->objectid = start;
 	ins->offset = num_bytes;
 	return 0;
-
-new_group:
-	block_group = btrfs_lookup_first_block_group(info, search_start);
-	if (!block_group) {
-		search_start = orig_search_start;
-		if (full_scan) {
-			ret = -ENOSPC;
-			goto error;
-		}
-		if (wrapped) {
-			if (!full_scan)
-				total_needed -= empty_size;
-			full_scan = 1;
-		} else
-			wrapped = 1;
-	}
-	cond_resched();
-	block_group = btrfs_find_block_group(root, block_group,
-					     search_start, data, 0);
-	goto check_failed;
-
-error:
-	return ret;
 }
 
 int btrfs_reserve_extent(struct btrfs_trans_handle *trans,
@@ -2656,9 +2909,8 @@ int btrfs_reserve_extent(struct btrfs_trans_handle *trans,
 			       trans->alloc_exclude_nr, data);
 	BUG_ON(ret);
 found:
-	clear_extent_dirty(&root->fs_info->free_space_cache,
-			   ins->objectid, ins->objectid + ins->offset - 1,
-			   GFP_NOFS);
+	btrfs_clear_free_space(root->fs_info, ins->objectid,
+			       ins->objectid + ins->offset - 1);
 	return ret;
 }
 
@@ -2792,6 +3044,8 @@ struct extent_buffer *btrfs_alloc_free_block(struct btrfs_trans_handle *trans,
 		BUG_ON(1);
 		return ERR_PTR(-ENOMEM);
 	}
+	/* a node freed in this transaction may come back as a leaf */
+	extent_buffer_uncache_node(buf);
 	btrfs_set_buffer_uptodate(buf);
 	trans->blocks_used++;
 
@@ -3069,6 +3323,10 @@ int btrfs_free_block_groups(struct btrfs_fs_info *info)
 				btrfs_remove_free_space_cache(cache);
 				kfree(cache->free_space_ctl);
 			}
+			if (cache->free_index) {
+				btrfs_free_index_release(cache->free_index);
+				kfree(cache->free_index);
+			}
 			kfree(cache);
 		}
 		clear_extent_bits(&info->block_group_cache, start,
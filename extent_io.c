@@ -32,10 +32,20 @@
 
 void extent_io_tree_init(struct extent_io_tree *tree)
 {
+	int i;
+
 	cache_tree_init(&tree->state);
 	cache_tree_init(&tree->cache);
 	INIT_LIST_HEAD(&tree->lru);
 	tree->cache_size = 0;
+	for (i = 0; i < EXTENT_NODE_LEVELS; i++)
+		INIT_LIST_HEAD(&tree->node_lru[i]);
+	tree->node_cache_size = 0;
+	tree->node_cache_max = EXTENT_NODE_CACHE_DEFAULT;
+	tree->node_hits = 0;
+	tree->node_misses = 0;
+	tree->node_evictions = 0;
+	tree->mapped_ebs = 0;
 }
 
 static struct extent_state *alloc_extent_state(void)
@@ -72,6 +82,7 @@ void extent_io_tree_cleanup(struct extent_io_tree *tree)
 {
 	struct extent_buffer *eb;
 
+	extent_io_tree_drop_nodes(tree);
 	while(!list_empty(&tree->lru)) {
 		eb = list_entry(tree->lru.next, struct extent_buffer, lru);
 		fprintf(stderr, "extent buffer leak: "
@@ -539,13 +550,18 @@ static struct extent_buffer *__alloc_extent_buffer(struct extent_io_tree *tree,
 						   u64 bytenr, u32 blocksize)
 {
 	struct extent_buffer *eb;
+	u32 inline_size = blocksize;
 
-	eb = malloc(sizeof(struct extent_buffer) + blocksize);
+	if (tree && tree->mapped_ebs)
+		inline_size = 0;
+	eb = malloc(sizeof(struct extent_buffer) + inline_size);
 	if (!eb) {
 		BUG();
 		return NULL;
 	}
-	memset(eb, 0, sizeof(struct extent_buffer) + blocksize);
+	memset(eb, 0, sizeof(struct extent_buffer) + inline_size);
+	if (inline_size)
+		eb->data = eb->inline_data;
 
 	eb->start = bytenr;
 	eb->len = blocksize;
@@ -556,6 +572,7 @@ static struct extent_buffer *__alloc_extent_buffer(struct extent_io_tree *tree,
 	eb->dev_bytenr = (u64)-1;
 	eb->cache_node.start = bytenr;
 	eb->cache_node.size = blocksize;
+	INIT_LIST_HEAD(&eb->node_lru);
 	INIT_LIST_HEAD(&eb->recow);
 
 	return eb;
@@ -587,15 +604,110 @@ void free_extent_buffer(struct extent_buffer *eb)
 		BUG_ON(eb->flags & EXTENT_DIRTY);
 		list_del_init(&eb->lru);
 		list_del_init(&eb->recow);
+		BUG_ON(!list_empty(&eb->node_lru));
 		if (!(eb->flags & EXTENT_BUFFER_DUMMY)) {
 			BUG_ON(tree->cache_size < eb->len);
 			remove_cache_extent(&tree->cache, &eb->cache_node);
 			tree->cache_size -= eb->len;
 		}
+		if (eb->data != eb->inline_data &&
+		    !(eb->flags & EXTENT_BUFFER_MAPPED))
+			free(eb->data);
 		free(eb);
 	}
 }
 
+/*
+ * Give @eb a zeroed buffer of its own if it has no data yet or points
+ * into a mmap'd device.
+ */
+int extent_buffer_own_data(struct extent_buffer *eb)
+{
+	char *data;
+
+	if (eb->data && !(eb->flags & EXTENT_BUFFER_MAPPED))
+		return 0;
+	data = calloc(1, eb->len);
+	if (!data)
+		return -ENOMEM;
+	eb->data = data;
+	eb->flags &= ~EXTENT_BUFFER_MAPPED;
+	return 0;
+}
+
+static void uncache_node(struct extent_io_tree *tree,
+			 struct extent_buffer *eb)
+{
+	list_del_init(&eb->node_lru);
+	tree->node_cache_size -= eb->len;
+	free_extent_buffer(eb);
+}
+
+/*
+ * Note a read of tree block @eb at @level, served from memory if @hit.
+ * Nodes are kept in the node cache, evicting the least recently used
+ * nodes of the lowest level while it is over budget.
+ */
+void extent_buffer_cache_node(struct extent_buffer *eb, int level, int hit)
+{
+	struct extent_io_tree *tree = eb->tree;
+	struct extent_buffer *victim;
+	int i;
+
+	if (!tree || (eb->flags & EXTENT_BUFFER_DUMMY))
+		return;
+
+	if (level == 0) {
+		/* the block was freed and reused for a leaf */
+		if (!list_empty(&eb->node_lru))
+			uncache_node(tree, eb);
+		return;
+	}
+
+	if (hit)
+		tree->node_hits++;
+	else
+		tree->node_misses++;
+
+	if (level >= EXTENT_NODE_LEVELS)
+		level = EXTENT_NODE_LEVELS - 1;
+	if (list_empty(&eb->node_lru)) {
+		extent_buffer_get(eb);
+		tree->node_cache_size += eb->len;
+	}
+	list_move_tail(&eb->node_lru, &tree->node_lru[level]);
+
+	while (tree->node_cache_size > tree->node_cache_max) {
+		for (i = 1; list_empty(&tree->node_lru[i]); i++)
+			;
+		victim = list_entry(tree->node_lru[i].next,
+				    struct extent_buffer, node_lru);
+		uncache_node(tree, victim);
+		tree->node_evictions++;
+	}
+}
+
+/* @eb is being reused for a new tree block, which may be a leaf */
+void extent_buffer_uncache_node(struct extent_buffer *eb)
+{
+	if (eb->tree && !list_empty(&eb->node_lru))
+		uncache_node(eb->tree, eb);
+}
+
+void extent_io_tree_drop_nodes(struct extent_io_tree *tree)
+{
+	struct extent_buffer *eb;
+	int i;
+
+	for (i = 0; i < EXTENT_NODE_LEVELS; i++) {
+		while (!list_empty(&tree->node_lru[i])) {
+			eb = list_entry(tree->node_lru[i].next,
+					struct extent_buffer, node_lru);
+			uncache_node(tree, eb);
+		}
+	}
+}
+
 struct extent_buffer *find_extent_buffer(struct extent_io_tree *tree,
 					 u64 bytenr, u32 blocksize)
 {
@@ -645,7 +757,10 @@ struct extent_buffer *alloc_extent_buffer(struct extent_io_tree *tree,
 		if (cache) {
 			eb = container_of(cache, struct extent_buffer,
 					  cache_node);
-			free_extent_buffer(eb);
+			if (!list_empty(&eb->node_lru))
+				uncache_node(tree, eb);
+			else
+				free_extent_buffer(eb);
 		}
 		eb = __alloc_extent_buffer(tree, bytenr, blocksize);
 		if (!eb)
@@ -721,8 +836,8 @@ int read_data_from_disk(struct btrfs_fs_info *info, void *buf, u64 offset,
 			return -EIO;
 		}
 
-		ret = pread(device->fd, buf + total_read, read_len,
-			    multi->stripes[0].physical);
+		ret = btrfs_device_pread(device, buf + total_read, read_len,
+					 multi->stripes[0].physical);
 		kfree(multi);
 		if (ret < 0) {
 			fprintf(stderr, "Error reading %Lu, %d\n", offset,
@@ -779,6 +894,7 @@ int write_data_to_disk(struct btrfs_fs_info *info, void *buf, u64 offset,
 			BUG_ON(!eb);
 
 			memset(eb, 0, sizeof(struct extent_buffer) + this_len);
+			eb->data = eb->inline_data;
 			eb->start = offset;
 			eb->len = this_len;
 
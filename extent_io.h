@@ -41,6 +41,7 @@
 #define EXTENT_CSUM (1 << 9)
 #define EXTENT_BAD_TRANSID (1 << 10)
 #define EXTENT_BUFFER_DUMMY (1 << 11)
+#define EXTENT_BUFFER_MAPPED (1 << 12)
 #define EXTENT_IOBITS (EXTENT_LOCKED | EXTENT_WRITEBACK)
 
 #define BLOCK_GROUP_DATA     EXTENT_WRITEBACK
@@ -51,11 +52,32 @@
 
 struct btrfs_fs_info;
 
+#define EXTENT_NODE_LEVELS 8
+#define EXTENT_NODE_CACHE_DEFAULT (32 * 1024 * 1024)
+
 struct extent_io_tree {
 	struct cache_tree state;
 	struct cache_tree cache;
 	struct list_head lru;
 	u64 cache_size;
+
+	/*
+	 * Interior tree nodes hold an extra ref here between searches, one
+	 * lru list per level.  Leaves never enter it, and the lowest level
+	 * goes first when it is over node_cache_max.
+	 */
+	struct list_head node_lru[EXTENT_NODE_LEVELS];
+	u64 node_cache_size;
+	u64 node_cache_max;
+	u64 node_hits;
+	u64 node_misses;
+	u64 node_evictions;
+
+	/*
+	 * Extent buffers start without data, read_whole_eb() points them
+	 * into the mmap'd devices or gives them a buffer of their own.
+	 */
+	int mapped_ebs;
 };
 
 struct extent_state {
@@ -74,11 +96,13 @@ struct extent_buffer {
 	u32 len;
 	struct extent_io_tree *tree;
 	struct list_head lru;
+	struct list_head node_lru;
 	struct list_head recow;
 	int refs;
 	int flags;
 	int fd;
-	char data[];
+	char *data;		/* inline_data or the mmap'd block */
+	char inline_data[];
 };
 
 static inline void extent_buffer_get(struct extent_buffer *eb)
@@ -114,6 +138,10 @@ struct extent_buffer *alloc_extent_buffer(struct extent_io_tree *tree,
 					  u64 bytenr, u32 blocksize);
 struct extent_buffer *btrfs_clone_extent_buffer(struct extent_buffer *src);
 void free_extent_buffer(struct extent_buffer *eb);
+int extent_buffer_own_data(struct extent_buffer *eb);
+void extent_buffer_cache_node(struct extent_buffer *eb, int level, int hit);
+void extent_buffer_uncache_node(struct extent_buffer *eb);
+void extent_io_tree_drop_nodes(struct extent_io_tree *tree);
 int read_extent_from_disk(struct extent_buffer *eb,
 			  unsigned long offset, unsigned long len);
 int write_extent_to_disk(struct extent_buffer *eb);
@@ -310,6 +310,161 @@ fail:
 	return ret;
 }
 
+/*
+ * returns -EEXIST if any csum item covers part of [bytenr, end), 0 if the
+ * range is free and < 0 on error
+ */
+static int csum_range_busy(struct btrfs_root *root, struct btrfs_path *path,
+			   u64 bytenr, u64 end)
+{
+	struct btrfs_key key;
+	struct extent_buffer *leaf;
+	u16 csum_size =
+		btrfs_super_csum_size(root->fs_info->super_copy);
+	u64 item_end;
+	int ret;
+
+	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	key.offset = bytenr;
+
+	ret = btrfs_search_slot(NULL, root, &key, path, 0, 0);
+	if (ret < 0)
+		goto out;
+	if (ret == 0) {
+		ret = -EEXIST;
+		goto out;
+	}
+
+	/* the item before us must end at or before bytenr */
+	leaf = path->nodes[0];
+	if (path->slots[0] > 0) {
+		btrfs_item_key_to_cpu(leaf, &key, path->slots[0] - 1);
+		item_end = key.offset + (u64)(btrfs_item_size_nr(leaf,
+				path->slots[0] - 1) / csum_size) *
+				root->sectorsize;
+		if (key.objectid == BTRFS_EXTENT_CSUM_OBJECTID &&
+		    key.type == BTRFS_EXTENT_CSUM_KEY && item_end > bytenr) {
+			ret = -EEXIST;
+			goto out;
+		}
+	}
+
+	/* and the item after us must start at or after end */
+	if (path->slots[0] >= btrfs_header_nritems(leaf)) {
+		ret = btrfs_next_leaf(root, path);
+		if (ret) {
+			ret = ret < 0 ? ret : 0;
+			goto out;
+		}
+		leaf = path->nodes[0];
+	}
+	btrfs_item_key_to_cpu(leaf, &key, path->slots[0]);
+	ret = 0;
+	if (key.objectid == BTRFS_EXTENT_CSUM_OBJECTID &&
+	    key.type == BTRFS_EXTENT_CSUM_KEY && key.offset < end)
+		ret = -EEXIST;
+out:
+	btrfs_release_path(path);
+	return ret;
+}
+
+/*
+ * insert the precomputed checksums of @nr_sums sectors starting at
+ * @bytenr.  The range must not have any checksums yet, -EEXIST is
+ * returned if an existing item overlaps it.  The item ending
+ * right at @bytenr is extended when possible and the rest goes into new
+ * items holding as many checksums as fit in a leaf.
+ */
+int btrfs_insert_csums(struct btrfs_trans_handle *trans,
+		       struct btrfs_root *root, u64 bytenr, u64 nr_sums,
+		       void *sums)
+{
+	struct btrfs_path *path;
+	struct btrfs_key key;
+	struct extent_buffer *leaf;
+	unsigned long ptr;
+	u16 csum_size =
+		btrfs_super_csum_size(root->fs_info->super_copy);
+	u32 max_sums = MAX_CSUM_ITEMS(root, csum_size);
+	u32 item_sums;
+	u64 nr;
+	int free_space;
+	int ret = 0;
+
+	path = btrfs_alloc_path();
+	if (!path)
+		return -ENOMEM;
+
+	ret = csum_range_busy(root, path, bytenr,
+			      bytenr + nr_sums * root->sectorsize);
+	if (ret)
+		goto out;
+
+	while (nr_sums) {
+		key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+		key.type = BTRFS_EXTENT_CSUM_KEY;
+		key.offset = bytenr;
+
+		ret = btrfs_search_slot(trans, root, &key, path, csum_size, 1);
+		if (ret < 0)
+			goto out;
+		if (ret == 0) {
+			ret = -EEXIST;
+			goto out;
+		}
+
+		/* try to grow the previous item if it ends at bytenr */
+		leaf = path->nodes[0];
+		if (path->slots[0] > 0) {
+			btrfs_item_key_to_cpu(leaf, &key, path->slots[0] - 1);
+			item_sums = btrfs_item_size_nr(leaf,
+					path->slots[0] - 1) / csum_size;
+			free_space = btrfs_leaf_free_space(root, leaf);
+			nr = min_t(u64, nr_sums, max_sums - min(item_sums,
+								max_sums));
+			nr = min_t(u64, nr, free_space / csum_size);
+			if (key.objectid == BTRFS_EXTENT_CSUM_OBJECTID &&
+			    key.type == BTRFS_EXTENT_CSUM_KEY &&
+			    key.offset + (u64)item_sums * root->sectorsize ==
+			    bytenr && nr) {
+				path->slots[0]--;
+				ret = btrfs_extend_item(trans, root, path,
+							nr * csum_size);
+				if (ret)
+					goto out;
+				ptr = btrfs_item_ptr_offset(leaf,
+							    path->slots[0]);
+				ptr += item_sums * csum_size;
+				goto write;
+			}
+		}
+		btrfs_release_path(path);
+
+		key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+		key.type = BTRFS_EXTENT_CSUM_KEY;
+		key.offset = bytenr;
+		nr = min_t(u64, nr_sums, max_sums);
+		ret = btrfs_insert_empty_item(trans, root, path, &key,
+					      nr * csum_size);
+		if (ret)
+			goto out;
+		leaf = path->nodes[0];
+		ptr = btrfs_item_ptr_offset(leaf, path->slots[0]);
+write:
+		write_extent_buffer(leaf, sums, ptr, nr * csum_size);
+		btrfs_mark_buffer_dirty(leaf);
+		btrfs_release_path(path);
+
+		sums = (char *)sums + nr * csum_size;
+		bytenr += nr * root->sectorsize;
+		nr_sums -= nr;
+	}
+out:
+	btrfs_free_path(path);
+	return ret;
+}
+
 /*
  * helper function for csum removal, this expects the
  * key to describe the csum pointed to by the path, and it expects
@@ -37,6 +37,17 @@ static int link_free_space(struct btrfs_free_space_ctl *ctl,
 			   struct btrfs_free_space *info);
 static void merge_space_tree(struct btrfs_free_space_ctl *ctl);
 
+static void init_free_space_ctl(struct btrfs_free_space_ctl *ctl,
+				struct btrfs_block_group_cache *block_group,
+				int sectorsize)
+{
+	memset(ctl, 0, sizeof(*ctl));
+	ctl->sectorsize = sectorsize;
+	ctl->unit = sectorsize;
+	ctl->start = block_group->key.objectid;
+	ctl->private = block_group;
+}
+
 struct io_ctl {
 	void *cur, *orig;
 	void *buffer;
@@ -423,10 +434,10 @@ free_cache:
 	goto out;
 }
 
-int load_free_space_cache(struct btrfs_fs_info *fs_info,
-			  struct btrfs_block_group_cache *block_group)
+static int load_free_space_ctl(struct btrfs_fs_info *fs_info,
+			       struct btrfs_block_group_cache *block_group,
+			       struct btrfs_free_space_ctl *ctl)
 {
-	struct btrfs_free_space_ctl *ctl = block_group->free_space_ctl;
 	struct btrfs_path *path;
 	int ret = 0;
 
@@ -448,6 +459,27 @@ int load_free_space_cache(struct btrfs_fs_info *fs_info,
 	return ret;
 }
 
+int load_free_space_cache(struct btrfs_fs_info *fs_info,
+			  struct btrfs_block_group_cache *block_group)
+{
+	return load_free_space_ctl(fs_info, block_group,
+				   block_group->free_space_ctl);
+}
+
+/*
+ * Load the cache of @block_group into @ctl, which the caller owns and
+ * empties with __btrfs_remove_free_space_cache().  Bitmaps are turned into
+ * extents.  Returns 1 if the cache exists and passed the generation and
+ * crc checks.
+ */
+int btrfs_read_free_space_cache(struct btrfs_fs_info *fs_info,
+				struct btrfs_block_group_cache *block_group,
+				struct btrfs_free_space_ctl *ctl)
+{
+	init_free_space_ctl(ctl, block_group, fs_info->tree_root->sectorsize);
+	return load_free_space_ctl(fs_info, block_group, ctl);
+}
+
 static inline unsigned long offset_to_bit(u64 bitmap_start, u32 unit,
 					  u64 offset)
 {
@@ -758,10 +790,7 @@ int btrfs_init_free_space_ctl(struct btrfs_block_group_cache *block_group,
 	if (!ctl)
 		return -ENOMEM;
 
-	ctl->sectorsize = sectorsize;
-	ctl->unit = sectorsize;
-	ctl->start = block_group->key.objectid;
-	ctl->private = block_group;
+	init_free_space_ctl(ctl, block_group, sectorsize);
 	block_group->free_space_ctl = ctl;
 
 	return 0;
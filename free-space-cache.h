@@ -41,6 +41,9 @@ struct btrfs_free_space_ctl {
 
 int load_free_space_cache(struct btrfs_fs_info *fs_info,
 			  struct btrfs_block_group_cache *block_group);
+int btrfs_read_free_space_cache(struct btrfs_fs_info *fs_info,
+				struct btrfs_block_group_cache *block_group,
+				struct btrfs_free_space_ctl *ctl);
 
 void __btrfs_remove_free_space_cache(struct btrfs_free_space_ctl *ctl);
 void btrfs_remove_free_space_cache(struct btrfs_block_group_cache
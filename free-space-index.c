@@ -0,0 +1,370 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include "rbtree_augmented.h"
+#include "free-space-index.h"
+
+struct free_index_entry {
+	struct rb_node offset_node;
+	struct rb_node size_node;
+	u64 offset;
+	u64 bytes;
+	u64 max_bytes;		/* largest extent in the offset subtree */
+};
+
+#define offset_entry(node) rb_entry(node, struct free_index_entry, offset_node)
+#define size_entry(node) rb_entry(node, struct free_index_entry, size_node)
+
+static inline u64 compute_max_bytes(struct free_index_entry *entry)
+{
+	struct rb_node *left = entry->offset_node.rb_left;
+	struct rb_node *right = entry->offset_node.rb_right;
+	u64 largest = entry->bytes;
+
+	if (left)
+		largest = max(largest, offset_entry(left)->max_bytes);
+	if (right)
+		largest = max(largest, offset_entry(right)->max_bytes);
+	return largest;
+}
+
+RB_DECLARE_CALLBACKS(static, free_index_augment, struct free_index_entry,
+		     offset_node, u64, max_bytes, compute_max_bytes)
+
+static inline u64 subtree_max(struct rb_node *node)
+{
+	return node ? offset_entry(node)->max_bytes : 0;
+}
+
+void btrfs_free_index_init(struct btrfs_free_index *index)
+{
+	index->offset_root = RB_ROOT;
+	index->size_root = RB_ROOT;
+	index->free_bytes = 0;
+	index->nr_extents = 0;
+	index->cursor = 0;
+}
+
+static void link_entry(struct btrfs_free_index *index,
+		       struct free_index_entry *entry)
+{
+	struct rb_node **p = &index->offset_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct free_index_entry *cur;
+
+	while (*p) {
+		parent = *p;
+		cur = offset_entry(parent);
+		if (entry->offset < cur->offset)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	entry->max_bytes = 0;
+	rb_link_node(&entry->offset_node, parent, p);
+	free_index_augment.propagate(&entry->offset_node, NULL);
+	rb_insert_augmented(&entry->offset_node, &index->offset_root,
+			    &free_index_augment);
+
+	p = &index->size_root.rb_node;
+	parent = NULL;
+	while (*p) {
+		parent = *p;
+		cur = size_entry(parent);
+		if (entry->bytes < cur->bytes ||
+		    (entry->bytes == cur->bytes && entry->offset < cur->offset))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&entry->size_node, parent, p);
+	rb_insert_color(&entry->size_node, &index->size_root);
+
+	index->free_bytes += entry->bytes;
+	index->nr_extents++;
+}
+
+static void unlink_entry(struct btrfs_free_index *index,
+			 struct free_index_entry *entry)
+{
+	rb_erase_augmented(&entry->offset_node, &index->offset_root,
+			   &free_index_augment);
+	rb_erase(&entry->size_node, &index->size_root);
+	index->free_bytes -= entry->bytes;
+	index->nr_extents--;
+}
+
+/*
+ * Return the first extent ending after @offset, or ending at it too when
+ * @touching is set.
+ */
+static struct free_index_entry *search_entry(struct btrfs_free_index *index,
+					     u64 offset, int touching)
+{
+	struct rb_node *node = index->offset_root.rb_node;
+	struct free_index_entry *found = NULL;
+	struct free_index_entry *entry;
+	u64 end;
+
+	while (node) {
+		entry = offset_entry(node);
+		end = entry->offset + entry->bytes;
+		if (end > offset || (touching && end == offset)) {
+			found = entry;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+	return found;
+}
+
+static struct free_index_entry *next_entry(struct free_index_entry *entry)
+{
+	struct rb_node *node = rb_next(&entry->offset_node);
+
+	return node ? offset_entry(node) : NULL;
+}
+
+void btrfs_free_index_release(struct btrfs_free_index *index)
+{
+	struct free_index_entry *entry;
+	struct rb_node *node;
+
+	while ((node = rb_first(&index->offset_root))) {
+		entry = offset_entry(node);
+		unlink_entry(index, entry);
+		kfree(entry);
+	}
+	index->cursor = 0;
+}
+
+/*
+ * Mark [start, start + bytes) free.  The range may overlap or touch
+ * extents already in the index, they are merged into one.
+ */
+int btrfs_free_index_add(struct btrfs_free_index *index, u64 start, u64 bytes)
+{
+	struct free_index_entry *entry;
+	struct free_index_entry *next;
+	struct free_index_entry *merged = NULL;
+	u64 end = start + bytes;
+
+	if (!bytes)
+		return 0;
+
+	entry = search_entry(index, start, 1);
+	while (entry && entry->offset <= end) {
+		next = next_entry(entry);
+		start = min(start, entry->offset);
+		end = max(end, entry->offset + entry->bytes);
+		unlink_entry(index, entry);
+		if (merged)
+			kfree(entry);
+		else
+			merged = entry;
+		entry = next;
+	}
+	if (!merged) {
+		merged = kmalloc(sizeof(*merged), GFP_NOFS);
+		if (!merged)
+			return -ENOMEM;
+	}
+	merged->offset = start;
+	merged->bytes = end - start;
+	link_entry(index, merged);
+	return 0;
+}
+
+/* Mark [start, start + bytes) used, whether or not all of it was free. */
+int btrfs_free_index_remove(struct btrfs_free_index *index, u64 start,
+			    u64 bytes)
+{
+	struct free_index_entry *entry;
+	struct free_index_entry *next;
+	struct free_index_entry *tail;
+	u64 end = start + bytes;
+	u64 entry_end;
+
+	if (!bytes)
+		return 0;
+
+	entry = search_entry(index, start, 0);
+	while (entry && entry->offset < end) {
+		next = next_entry(entry);
+		entry_end = entry->offset + entry->bytes;
+		unlink_entry(index, entry);
+
+		if (entry_end > end) {
+			if (entry->offset < start) {
+				tail = kmalloc(sizeof(*tail), GFP_NOFS);
+				if (!tail) {
+					link_entry(index, entry);
+					return -ENOMEM;
+				}
+			} else {
+				tail = entry;
+			}
+			tail->offset = end;
+			tail->bytes = entry_end - end;
+			link_entry(index, tail);
+			if (tail == entry)
+				break;
+		}
+		if (entry->offset < start) {
+			entry->bytes = start - entry->offset;
+			link_entry(index, entry);
+		} else {
+			kfree(entry);
+		}
+		entry = next;
+	}
+	return 0;
+}
+
+u64 btrfs_free_index_max_extent(struct btrfs_free_index *index)
+{
+	return subtree_max(index->offset_root.rb_node);
+}
+
+/* Where an aligned @bytes long allocation fits in @entry, or (u64)-1 */
+static u64 fit_in_entry(struct free_index_entry *entry, u64 from, u64 bytes,
+			u64 align)
+{
+	u64 start = round_up(max(entry->offset, from), align);
+
+	if (start + bytes > entry->offset + entry->bytes)
+		return (u64)-1;
+	return start;
+}
+
+/* The leftmost extent of at least @bytes in the subtree under @node */
+static struct rb_node *leftmost_fit(struct rb_node *node, u64 bytes)
+{
+	while (node) {
+		if (subtree_max(node->rb_left) >= bytes)
+			node = node->rb_left;
+		else if (offset_entry(node)->bytes >= bytes)
+			return node;
+		else if (subtree_max(node->rb_right) >= bytes)
+			node = node->rb_right;
+		else
+			return NULL;
+	}
+	return NULL;
+}
+
+/* The next extent of at least @bytes after @node in offset order */
+static struct rb_node *next_fit(struct rb_node *node, u64 bytes)
+{
+	struct rb_node *parent;
+
+	if (subtree_max(node->rb_right) >= bytes)
+		return leftmost_fit(node->rb_right, bytes);
+
+	while ((parent = rb_parent(node))) {
+		if (node == parent->rb_left) {
+			if (offset_entry(parent)->bytes >= bytes)
+				return parent;
+			if (subtree_max(parent->rb_right) >= bytes)
+				return leftmost_fit(parent->rb_right, bytes);
+		}
+		node = parent;
+	}
+	return NULL;
+}
+
+/*
+ * Find the lowest @align aligned offset at or after @from where @bytes are
+ * free.  Returns -ENOSPC if there is none.
+ */
+int btrfs_free_index_first_fit(struct btrfs_free_index *index, u64 from,
+			       u64 bytes, u64 align, u64 *start_ret)
+{
+	struct free_index_entry *entry;
+	struct rb_node *node;
+	u64 start;
+
+	if (btrfs_free_index_max_extent(index) < bytes)
+		return -ENOSPC;
+
+	entry = search_entry(index, from, 0);
+	if (!entry)
+		return -ENOSPC;
+
+	node = &entry->offset_node;
+	if (entry->bytes < bytes)
+		node = next_fit(node, bytes);
+	while (node) {
+		start = fit_in_entry(offset_entry(node), from, bytes, align);
+		if (start != (u64)-1) {
+			*start_ret = start;
+			return 0;
+		}
+		node = next_fit(node, bytes);
+	}
+	return -ENOSPC;
+}
+
+/*
+ * First fit starting where the previous next-fit allocation ended,
+ * wrapping around to the start of the index once.
+ */
+int btrfs_free_index_next_fit(struct btrfs_free_index *index, u64 bytes,
+			      u64 align, u64 *start_ret)
+{
+	int ret;
+
+	ret = btrfs_free_index_first_fit(index, index->cursor, bytes, align,
+					 start_ret);
+	if (ret && index->cursor)
+		ret = btrfs_free_index_first_fit(index, 0, bytes, align,
+						 start_ret);
+	if (!ret)
+		index->cursor = *start_ret + bytes;
+	return ret;
+}
+
+/*
+ * Find the smallest free extent at or after @from that holds @bytes at an
+ * @align aligned offset, lowest offset first among equal sizes.
+ */
+int btrfs_free_index_best_fit(struct btrfs_free_index *index, u64 from,
+			      u64 bytes, u64 align, u64 *start_ret)
+{
+	struct rb_node *node = index->size_root.rb_node;
+	struct rb_node *found = NULL;
+	u64 start;
+
+	while (node) {
+		if (size_entry(node)->bytes >= bytes) {
+			found = node;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+
+	for (node = found; node; node = rb_next(node)) {
+		start = fit_in_entry(size_entry(node), from, bytes, align);
+		if (start != (u64)-1) {
+			*start_ret = start;
+			return 0;
+		}
+	}
+	return -ENOSPC;
+}
@@ -0,0 +1,51 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_FREE_SPACE_INDEX_H__
+#define __BTRFS_FREE_SPACE_INDEX_H__
+
+#include "kerncompat.h"
+#include "rbtree.h"
+
+/*
+ * Free extents of one block group, indexed both by offset and by size.
+ *
+ * The offset tree is augmented with the largest extent of every subtree,
+ * so the first extent big enough at or after an offset is found without
+ * walking the fragments in between.  The size tree gives the best fit.
+ */
+struct btrfs_free_index {
+	struct rb_root offset_root;
+	struct rb_root size_root;
+	u64 free_bytes;
+	u64 nr_extents;
+	u64 cursor;		/* where the next next-fit search starts */
+};
+
+void btrfs_free_index_init(struct btrfs_free_index *index);
+void btrfs_free_index_release(struct btrfs_free_index *index);
+int btrfs_free_index_add(struct btrfs_free_index *index, u64 start, u64 bytes);
+int btrfs_free_index_remove(struct btrfs_free_index *index, u64 start,
+			    u64 bytes);
+u64 btrfs_free_index_max_extent(struct btrfs_free_index *index);
+int btrfs_free_index_first_fit(struct btrfs_free_index *index, u64 from,
+			       u64 bytes, u64 align, u64 *start_ret);
+int btrfs_free_index_next_fit(struct btrfs_free_index *index, u64 bytes,
+			      u64 align, u64 *start_ret);
+int btrfs_free_index_best_fit(struct btrfs_free_index *index, u64 from,
+			      u64 bytes, u64 align, u64 *start_ret);
+
+#endif
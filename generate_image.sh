@@ -0,0 +1,6 @@
+#!/bin/bash
+
+truncate -s 64m test.img
+btrfs-image -r test.img.btrfs-image test.img
+rm test.img.btrfs-image
+dd if=/dev/zero of=test.img bs=1 count=32 seek=20832256 conv=notrunc 1>/dev/null 2>&1
@@ -44,21 +44,80 @@
 #include "volumes.h"
 #include "transaction.h"
 #include "utils.h"
+#include "task-utils.h"
 #include "version.h"
 
-static u64 index_cnt = 2;
 static int init_metadata_chunks_ratio = 0;
+static int verbose;
 
 #define DEFAULT_MKFS_FEATURES	(BTRFS_FEATURE_INCOMPAT_EXTENDED_IREF \
 		| BTRFS_FEATURE_INCOMPAT_SKINNY_METADATA)
 
 #define DEFAULT_MKFS_LEAF_SIZE 16384
 
+/*
+ * --rootdir population: worker threads scan directories and collect the
+ * stat, xattr, symlink and inline data of each entry, the main thread
+ * inserts the resulting items.  At most ROOTDIR_SCAN_AHEAD directories are
+ * scanned ahead of the one being inserted, each split into batches of
+ * ROOTDIR_BATCH entries.  The workers hold at most ROOTDIR_INLINE_BYTES of
+ * inline file data, the main thread reads the rest when it inserts them.
+ */
+#define ROOTDIR_SCAN_AHEAD	64
+#define ROOTDIR_BATCH		128
+#define ROOTDIR_INLINE_BYTES	(32 * 1024 * 1024)
+
+struct rootdir_walk {
+	struct task_pool *pool;
+	u32 sectorsize;
+	u32 max_inline;
+	/* inline data read by the workers and not inserted yet */
+	u64 inline_bytes;
+};
+
+struct rootdir_xattr {
+	char *name;
+	char *value;
+	int name_len;
+	int value_len;
+};
+
+struct rootdir_entry {
+	char *name;
+	char *path;
+	struct stat st;
+	u64 dir_size;
+	u64 index;
+	char *data;
+	int data_len;
+	/* bytes of data counted in rootdir_walk::inline_bytes */
+	int data_charged;
+	int nr_xattrs;
+	struct rootdir_xattr *xattrs;
+	int error;
+};
+
+struct rootdir_batch {
+	struct task_work work;
+	struct directory_name_entry *dir;
+	int start;
+	int nr;
+};
+
 struct directory_name_entry {
 	char *dir_name;
 	char *path;
 	ino_t inum;
 	struct list_head list;
+
+	struct rootdir_walk *walk;
+	struct task_work work;
+	int queued;
+	int error;
+	int nr_entries;
+	struct rootdir_entry *entries;
+	int nr_batches;
+	struct rootdir_batch *batches;
 };
 
 static int make_root_dir(struct btrfs_root *root, int mixed)
@@ -321,6 +380,7 @@ static void print_usage(void)
 	fprintf(stderr, "\t -K --nodiscard do not perform whole device TRIM\n");
 	fprintf(stderr, "\t -O --features comma separated list of filesystem features\n");
 	fprintf(stderr, "\t -U --uuid specify the filesystem UUID\n");
+	fprintf(stderr, "\t -v --verbose print how the metadata was written\n");
 	fprintf(stderr, "\t -V --version print the mkfs.btrfs version and exit\n");
 	fprintf(stderr, "\t -i metadata_ratio(for exmaple,10,20,30 percentage of whole filesystem)\n");
 	fprintf(stderr, "%s\n", BTRFS_BUILD_VERSION);
@@ -386,13 +446,14 @@ static struct option long_options[] = {
 	{ "nodiscard", 0, NULL, 'K' },
 	{ "features", 1, NULL, 'O' },
 	{ "uuid", required_argument, NULL, 'U' },
+	{ "verbose", 0, NULL, 'v' },
 	{ NULL, 0, NULL, 0}
 };
 
 static int add_directory_items(struct btrfs_trans_handle *trans,
 			       struct btrfs_root *root, u64 objectid,
 			       ino_t parent_inum, const char *name,
-			       struct stat *st, int *dir_index_cnt)
+			       struct stat *st, u64 index)
 {
 	int ret;
 	int name_len;
@@ -414,14 +475,11 @@ static int add_directory_items(struct btrfs_trans_handle *trans,
 
 	ret = btrfs_insert_dir_item(trans, root, name, name_len,
 				    parent_inum, &location,
-				    filetype, index_cnt);
+				    filetype, index);
 	if (ret)
 		return ret;
 	ret = btrfs_insert_inode_ref(trans, root, name, name_len,
-				     objectid, parent_inum, index_cnt);
-	*dir_index_cnt = index_cnt;
-	index_cnt++;
-
+				     objectid, parent_inum, index);
 	return ret;
 }
 
@@ -522,23 +580,19 @@ static u64 calculate_dir_inode_size(char *dirname)
 
 static int add_inode_items(struct btrfs_trans_handle *trans,
 			   struct btrfs_root *root,
-			   struct stat *st, char *name,
-			   u64 self_objectid, ino_t parent_inum,
-			   int dir_index_cnt, struct btrfs_inode_item *inode_ret)
+			   struct stat *st, u64 dir_size,
+			   u64 self_objectid, struct btrfs_inode_item *inode_ret)
 {
 	int ret;
 	struct btrfs_key inode_key;
 	struct btrfs_inode_item btrfs_inode;
 	u64 objectid;
-	u64 inode_size = 0;
 
 	fill_inode_item(trans, root, &btrfs_inode, st);
 	objectid = self_objectid;
 
-	if (S_ISDIR(st->st_mode)) {
-		inode_size = calculate_dir_inode_size(name);
-		btrfs_set_stack_inode_size(&btrfs_inode, inode_size);
-	}
+	if (S_ISDIR(st->st_mode))
+		btrfs_set_stack_inode_size(&btrfs_inode, dir_size);
 
 	inode_key.objectid = objectid;
 	inode_key.offset = 0;
@@ -550,89 +604,175 @@ static int add_inode_items(struct btrfs_trans_handle *trans,
 	return ret;
 }
 
-static int add_xattr_item(struct btrfs_trans_handle *trans,
-			  struct btrfs_root *root, u64 objectid,
-			  const char *file_name)
+static int read_xattrs(struct rootdir_entry *entry)
 {
 	int ret;
 	int cur_name_len;
 	char xattr_list[XATTR_LIST_MAX];
 	char *cur_name;
 	char cur_value[XATTR_SIZE_MAX];
-	char delimiter = '\0';
-	char *next_location = xattr_list;
+	char *end;
+	struct rootdir_xattr *xattr;
 
-	ret = llistxattr(file_name, xattr_list, XATTR_LIST_MAX);
+	ret = llistxattr(entry->path, xattr_list, XATTR_LIST_MAX);
 	if (ret < 0) {
 		if(errno == ENOTSUP)
 			return 0;
 		fprintf(stderr, "get a list of xattr failed for %s\n",
-			file_name);
+			entry->path);
 		return ret;
 	}
 	if (ret == 0)
 		return ret;
 
-	cur_name = strtok(xattr_list, &delimiter);
-	while (cur_name != NULL) {
+	end = xattr_list + ret;
+	for (cur_name = xattr_list; cur_name < end;
+	     cur_name += cur_name_len + 1) {
 		cur_name_len = strlen(cur_name);
-		next_location += cur_name_len + 1;
 
-		ret = getxattr(file_name, cur_name, cur_value, XATTR_SIZE_MAX);
+		ret = lgetxattr(entry->path, cur_name, cur_value,
+				XATTR_SIZE_MAX);
 		if (ret < 0) {
 			if(errno == ENOTSUP)
 				return 0;
 			fprintf(stderr, "get a xattr value failed for %s attr %s\n",
-				file_name, cur_name);
+				entry->path, cur_name);
 			return ret;
 		}
 
-		ret = btrfs_insert_xattr_item(trans, root, cur_name,
-					      cur_name_len, cur_value,
-					      ret, objectid);
+		xattr = realloc(entry->xattrs,
+				(entry->nr_xattrs + 1) * sizeof(*xattr));
+		if (!xattr)
+			return -ENOMEM;
+		entry->xattrs = xattr;
+		xattr += entry->nr_xattrs;
+		xattr->name = strdup(cur_name);
+		xattr->value = malloc(ret ? ret : 1);
+		if (!xattr->name || !xattr->value) {
+			free(xattr->name);
+			free(xattr->value);
+			return -ENOMEM;
+		}
+		memcpy(xattr->value, cur_value, ret);
+		xattr->name_len = cur_name_len;
+		xattr->value_len = ret;
+		entry->nr_xattrs++;
+	}
+
+	return 0;
+}
+
+static int add_xattr_item(struct btrfs_trans_handle *trans,
+			  struct btrfs_root *root, u64 objectid,
+			  struct rootdir_entry *entry)
+{
+	struct rootdir_xattr *xattr;
+	int ret;
+	int i;
+
+	for (i = 0; i < entry->nr_xattrs; i++) {
+		xattr = entry->xattrs + i;
+		ret = btrfs_insert_xattr_item(trans, root, xattr->name,
+					      xattr->name_len, xattr->value,
+					      xattr->value_len, objectid);
 		if (ret) {
 			fprintf(stderr, "insert a xattr item failed for %s\n",
-				file_name);
+				entry->path);
+			return ret;
 		}
-
-		cur_name = strtok(next_location, &delimiter);
 	}
 
-	return ret;
+	return 0;
 }
 
-static int add_symbolic_link(struct btrfs_trans_handle *trans,
-			     struct btrfs_root *root,
-			     u64 objectid, const char *path_name)
+static int read_symbolic_link(struct rootdir_entry *entry, u32 sectorsize)
 {
 	int ret;
-	u64 sectorsize = root->sectorsize;
 	char *buf = malloc(sectorsize);
 
-	ret = readlink(path_name, buf, sectorsize);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = readlink(entry->path, buf, sectorsize);
 	if (ret <= 0) {
-		fprintf(stderr, "readlink failed for %s\n", path_name);
+		fprintf(stderr, "readlink failed for %s\n", entry->path);
 		goto fail;
 	}
 	if (ret >= sectorsize) {
-		fprintf(stderr, "symlink too long for %s", path_name);
+		fprintf(stderr, "symlink too long for %s", entry->path);
 		ret = -1;
 		goto fail;
 	}
 
 	buf[ret] = '\0'; /* readlink does not do it for us */
-	ret = btrfs_insert_inline_extent(trans, root, objectid, 0,
-					 buf, ret + 1);
+	entry->data = buf;
+	entry->data_len = ret + 1;
+	return 0;
 fail:
 	free(buf);
-	return ret;
+	return ret ? ret : -1;
+}
+
+static int add_symbolic_link(struct btrfs_trans_handle *trans,
+			     struct btrfs_root *root,
+			     u64 objectid, struct rootdir_entry *entry)
+{
+	return btrfs_insert_inline_extent(trans, root, objectid, 0,
+					  entry->data, entry->data_len);
+}
+
+/*
+ * A file that shrank since the lstat is padded with zeroes up to the
+ * size we have for the inode, like add_file_items() does for big ones.
+ */
+static int read_inline_file(struct rootdir_entry *entry)
+{
+	ssize_t ret_read;
+	off_t pos = 0;
+	int ret = 0;
+	int fd;
+
+	fd = open(entry->path, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "%s open failed\n", entry->path);
+		return -1;
+	}
+
+	entry->data = calloc(1, entry->st.st_size);
+	if (!entry->data) {
+		close(fd);
+		return -ENOMEM;
+	}
+	while (pos < entry->st.st_size) {
+		ret_read = pread64(fd, entry->data + pos,
+				   entry->st.st_size - pos, pos);
+		if (ret_read == -1 && errno == EINTR)
+			continue;
+		if (ret_read == -1) {
+			ret = -errno;
+			fprintf(stderr, "%s read failed: %s\n", entry->path,
+				strerror(errno));
+			break;
+		}
+		if (ret_read == 0)
+			break;
+		pos += ret_read;
+	}
+	close(fd);
+	if (ret) {
+		free(entry->data);
+		entry->data = NULL;
+		return ret;
+	}
+	entry->data_len = entry->st.st_size;
+	return 0;
 }
 
 static int add_file_items(struct btrfs_trans_handle *trans,
 			  struct btrfs_root *root,
 			  struct btrfs_inode_item *btrfs_inode, u64 objectid,
-			  ino_t parent_inum, struct stat *st,
-			  const char *path_name, int out_fd)
+			  ino_t parent_inum, struct rootdir_entry *entry,
+			  int out_fd)
 {
 	int ret = -1;
 	ssize_t ret_read;
@@ -645,11 +785,24 @@ static int add_file_items(struct btrfs_trans_handle *trans,
 	u64 cur_bytes;
 	u64 total_bytes;
 	struct extent_buffer *eb = NULL;
+	struct stat *st = &entry->st;
+	const char *path_name = entry->path;
 	int fd;
 
 	if (st->st_size == 0)
 		return 0;
 
+	/* small files were read by the scanning threads if they had room */
+	if (st->st_size <= BTRFS_MAX_INLINE_DATA_SIZE(root)) {
+		if (!entry->data) {
+			ret = read_inline_file(entry);
+			if (ret)
+				return ret;
+		}
+		return btrfs_insert_inline_extent(trans, root, objectid, 0,
+						  entry->data, entry->data_len);
+	}
+
 	fd = open(path_name, O_RDONLY);
 	if (fd == -1) {
 		fprintf(stderr, "%s open failed\n", path_name);
@@ -660,21 +813,6 @@ static int add_file_items(struct btrfs_trans_handle *trans,
 	if (st->st_size % sectorsize)
 		blocks += 1;
 
-	if (st->st_size <= BTRFS_MAX_INLINE_DATA_SIZE(root)) {
-		char *buffer = malloc(st->st_size);
-		ret_read = pread64(fd, buffer, st->st_size, bytes_read);
-		if (ret_read == -1) {
-			fprintf(stderr, "%s read failed\n", path_name);
-			free(buffer);
-			goto end;
-		}
-
-		ret = btrfs_insert_inline_extent(trans, root, objectid, 0,
-						 buffer, st->st_size);
-		free(buffer);
-		goto end;
-	}
-
 	/* round up our st_size to the FS blocksize */
 	total_bytes = (u64)blocks * sectorsize;
 
@@ -688,6 +826,7 @@ static int add_file_items(struct btrfs_trans_handle *trans,
 		goto end;
 	}
 	memset(eb, 0, sizeof(*eb) + sectorsize);
+	eb->data = eb->inline_data;
 
 again:
 
@@ -771,6 +910,238 @@ static char *make_path(char *dir, char *name)
 	return path;
 }
 
+static void free_entry_data(struct rootdir_walk *walk,
+			    struct rootdir_entry *entry)
+{
+	free(entry->data);
+	entry->data = NULL;
+	if (entry->data_charged)
+		__sync_fetch_and_sub(&walk->inline_bytes, entry->data_charged);
+	entry->data_charged = 0;
+}
+
+static void free_rootdir_entries(struct directory_name_entry *dir)
+{
+	struct rootdir_entry *entry;
+	int i, j;
+
+	for (i = 0; i < dir->nr_entries; i++) {
+		entry = dir->entries + i;
+		for (j = 0; j < entry->nr_xattrs; j++) {
+			free(entry->xattrs[j].name);
+			free(entry->xattrs[j].value);
+		}
+		free(entry->xattrs);
+		free_entry_data(dir->walk, entry);
+		free(entry->path);
+		free(entry->name);
+	}
+	free(dir->entries);
+	free(dir->batches);
+	dir->entries = NULL;
+	dir->batches = NULL;
+	dir->nr_entries = 0;
+	dir->nr_batches = 0;
+}
+
+static void free_dir_entry(struct directory_name_entry *dir)
+{
+	free_rootdir_entries(dir);
+	free(dir->dir_name);
+	free(dir->path);
+	free(dir);
+}
+
+/* read a small file now if the inline data in flight stays below the cap */
+static int scan_inline_file(struct rootdir_walk *walk,
+			    struct rootdir_entry *entry)
+{
+	int size = entry->st.st_size;
+	int ret;
+
+	if (__sync_add_and_fetch(&walk->inline_bytes, size) >
+	    ROOTDIR_INLINE_BYTES) {
+		__sync_fetch_and_sub(&walk->inline_bytes, size);
+		return 0;
+	}
+	ret = read_inline_file(entry);
+	if (ret)
+		__sync_fetch_and_sub(&walk->inline_bytes, size);
+	else
+		entry->data_charged = size;
+	return ret;
+}
+
+/* runs on a worker: stat one batch of a scanned directory */
+static void scan_entry_batch(struct task_work *work)
+{
+	struct rootdir_batch *batch;
+	struct directory_name_entry *dir;
+	struct rootdir_entry *entry;
+	struct rootdir_walk *walk;
+	int ret;
+	int i;
+
+	batch = container_of(work, struct rootdir_batch, work);
+	dir = batch->dir;
+	walk = dir->walk;
+
+	for (i = batch->start; i < batch->start + batch->nr; i++) {
+		entry = dir->entries + i;
+		entry->path = make_path(dir->path, entry->name);
+		if (!entry->path) {
+			entry->error = -ENOMEM;
+			continue;
+		}
+
+		if (lstat(entry->path, &entry->st) == -1) {
+			fprintf(stderr, "lstat failed for file %s\n",
+				entry->path);
+			entry->error = -1;
+			continue;
+		}
+
+		ret = read_xattrs(entry);
+		if (ret) {
+			entry->error = ret;
+			continue;
+		}
+
+		if (S_ISDIR(entry->st.st_mode))
+			entry->dir_size = calculate_dir_inode_size(entry->path);
+		else if (S_ISLNK(entry->st.st_mode))
+			ret = read_symbolic_link(entry, walk->sectorsize);
+		else if (S_ISREG(entry->st.st_mode) && entry->st.st_size &&
+			 entry->st.st_size <= walk->max_inline)
+			ret = scan_inline_file(walk, entry);
+		else
+			ret = 0;
+		if (ret)
+			entry->error = ret;
+	}
+}
+
+/* runs on a worker: list a directory and queue the stat batches */
+static void scan_directory(struct task_work *work)
+{
+	struct directory_name_entry *dir;
+	struct direct **files;
+	struct rootdir_batch *batch;
+	int count, i;
+
+	dir = container_of(work, struct directory_name_entry, work);
+
+	count = scandir(dir->path, &files, directory_select, NULL);
+	if (count == -1) {
+		fprintf(stderr, "scandir for %s failed: %s\n",
+			dir->dir_name, strerror(errno));
+		dir->error = -1;
+		return;
+	}
+
+	dir->entries = calloc(count ? count : 1, sizeof(*dir->entries));
+	dir->nr_batches = (count + ROOTDIR_BATCH - 1) / ROOTDIR_BATCH;
+	dir->batches = calloc(dir->nr_batches ? dir->nr_batches : 1,
+			      sizeof(*dir->batches));
+	if (!dir->entries || !dir->batches) {
+		dir->error = -ENOMEM;
+		dir->nr_batches = 0;
+		goto out;
+	}
+
+	/* directory indexes follow readdir order and restart at 2 */
+	for (i = 0; i < count; i++) {
+		dir->entries[i].name = strdup(files[i]->d_name);
+		dir->entries[i].index = i + 2;
+		if (!dir->entries[i].name)
+			dir->error = -ENOMEM;
+	}
+	dir->nr_entries = count;
+	if (dir->error) {
+		dir->nr_batches = 0;
+		goto out;
+	}
+
+	for (i = 0; i < dir->nr_batches; i++) {
+		batch = dir->batches + i;
+		batch->dir = dir;
+		batch->start = i * ROOTDIR_BATCH;
+		batch->nr = min(count - batch->start, ROOTDIR_BATCH);
+		task_pool_queue(dir->walk->pool, &batch->work,
+				scan_entry_batch);
+	}
+out:
+	free_namelist(files, count);
+}
+
+/* keep up to ROOTDIR_SCAN_AHEAD pending directories being scanned */
+static void queue_directory_scans(struct rootdir_walk *walk,
+				  struct list_head *dirs)
+{
+	struct directory_name_entry *dir;
+	int nr = 0;
+
+	list_for_each_entry(dir, dirs, list) {
+		if (nr++ >= ROOTDIR_SCAN_AHEAD)
+			break;
+		if (dir->queued)
+			continue;
+		dir->queued = 1;
+		task_pool_queue(walk->pool, &dir->work, scan_directory);
+	}
+}
+
+static int wait_directory_scan(struct rootdir_walk *walk,
+			       struct directory_name_entry *dir)
+{
+	int i;
+
+	task_pool_wait_work(walk->pool, &dir->work);
+	for (i = 0; i < dir->nr_batches; i++)
+		task_pool_wait_work(walk->pool, &dir->batches[i].work);
+	if (dir->error)
+		return dir->error;
+	for (i = 0; i < dir->nr_entries; i++)
+		if (dir->entries[i].error)
+			return dir->entries[i].error;
+	return 0;
+}
+
+/* insert in inode number order so the fs tree fills mostly by appending */
+static int cmp_rootdir_entry(const void *a, const void *b)
+{
+	const struct rootdir_entry *ea = a;
+	const struct rootdir_entry *eb = b;
+
+	if (ea->st.st_ino != eb->st.st_ino)
+		return ea->st.st_ino < eb->st.st_ino ? -1 : 1;
+	if (ea->index != eb->index)
+		return ea->index < eb->index ? -1 : 1;
+	return 0;
+}
+
+static struct directory_name_entry *alloc_dir_entry(struct rootdir_walk *walk,
+						    const char *dir_name,
+						    char *path, ino_t inum)
+{
+	struct directory_name_entry *dir_entry;
+
+	dir_entry = calloc(1, sizeof(*dir_entry));
+	if (!dir_entry) {
+		free(path);
+		return NULL;
+	}
+	dir_entry->dir_name = strdup(dir_name);
+	dir_entry->path = path;
+	dir_entry->inum = inum;
+	dir_entry->walk = walk;
+	if (!dir_entry->dir_name || !dir_entry->path) {
+		free_dir_entry(dir_entry);
+		return NULL;
+	}
+	return dir_entry;
+}
+
 static int traverse_directory(struct btrfs_trans_handle *trans,
 			      struct btrfs_root *root, char *dir_name,
 			      struct directory_name_entry *dir_head, int out_fd)
@@ -779,33 +1150,43 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 
 	struct btrfs_inode_item cur_inode;
 	struct btrfs_inode_item *inode_item;
-	int count, i, dir_index_cnt;
-	struct direct **files;
-	struct stat st;
+	int i;
 	struct directory_name_entry *dir_entry, *parent_dir_entry;
-	struct direct *cur_file;
+	struct rootdir_entry *cur_file;
+	struct rootdir_walk walk;
 	ino_t parent_inum, cur_inum;
 	ino_t highest_inum = 0;
-	char *parent_dir_name;
-	char real_path[PATH_MAX];
+	char *real_path;
 	struct btrfs_path path;
 	struct extent_buffer *leaf;
 	struct btrfs_key root_dir_key;
 	u64 root_dir_inode_size = 0;
 
+	walk.sectorsize = root->sectorsize;
+	walk.max_inline = BTRFS_MAX_INLINE_DATA_SIZE(root);
+	walk.inline_bytes = 0;
+	walk.pool = task_pool_init(0);
+	if (!walk.pool) {
+		fprintf(stderr, "unable to start directory scanning threads\n");
+		return 1;
+	}
+
 	/* Add list for source directory */
-	dir_entry = malloc(sizeof(struct directory_name_entry));
-	dir_entry->dir_name = dir_name;
-	dir_entry->path = realpath(dir_name, real_path);
-	if (!dir_entry->path) {
+	real_path = realpath(dir_name, NULL);
+	if (!real_path) {
 		fprintf(stderr, "get directory real path error\n");
 		ret = -1;
-		goto fail_no_dir;
+		goto out;
 	}
 
 	parent_inum = highest_inum + BTRFS_FIRST_FREE_OBJECTID;
-	dir_entry->inum = parent_inum;
+	dir_entry = alloc_dir_entry(&walk, dir_name, real_path, parent_inum);
+	if (!dir_entry) {
+		ret = -ENOMEM;
+		goto out;
+	}
 	list_add_tail(&dir_entry->list, &dir_head->list);
+	queue_directory_scans(&walk, &dir_head->list);
 
 	btrfs_init_path(&path);
 
@@ -815,7 +1196,7 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 	ret = btrfs_lookup_inode(trans, root, &path, &root_dir_key, 1);
 	if (ret) {
 		fprintf(stderr, "root dir lookup error\n");
-		goto fail_no_dir;
+		goto out;
 	}
 
 	leaf = path.nodes[0];
@@ -832,53 +1213,35 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 		parent_dir_entry = list_entry(dir_head->list.next,
 					      struct directory_name_entry,
 					      list);
+
+		ret = wait_directory_scan(&walk, parent_dir_entry);
+		if (ret)
+			goto out;
 		list_del(&parent_dir_entry->list);
 
 		parent_inum = parent_dir_entry->inum;
-		parent_dir_name = parent_dir_entry->dir_name;
-		if (chdir(parent_dir_entry->path)) {
-			fprintf(stderr, "chdir error for %s\n",
-				parent_dir_name);
-			ret = -1;
-			goto fail_no_files;
-		}
-
-		count = scandir(parent_dir_entry->path, &files,
-				directory_select, NULL);
-		if (count == -1)
-		{
-			fprintf(stderr, "scandir for %s failed: %s\n",
-				parent_dir_name, strerror (errno));
-			ret = -1;
-			goto fail;
-		}
+		qsort(parent_dir_entry->entries, parent_dir_entry->nr_entries,
+		      sizeof(struct rootdir_entry), cmp_rootdir_entry);
 
-		for (i = 0; i < count; i++) {
-			cur_file = files[i];
+		for (i = 0; i < parent_dir_entry->nr_entries; i++) {
+			cur_file = parent_dir_entry->entries + i;
 
-			if (lstat(cur_file->d_name, &st) == -1) {
-				fprintf(stderr, "lstat failed for file %s\n",
-					cur_file->d_name);
-				ret = -1;
-				goto fail;
-			}
-
-			cur_inum = st.st_ino;
+			cur_inum = cur_file->st.st_ino;
 			ret = add_directory_items(trans, root,
 						  cur_inum, parent_inum,
-						  cur_file->d_name,
-						  &st, &dir_index_cnt);
+						  cur_file->name,
+						  &cur_file->st,
+						  cur_file->index);
 			if (ret) {
 				fprintf(stderr, "add_directory_items failed\n");
 				goto fail;
 			}
 
-			ret = add_inode_items(trans, root, &st,
-					      cur_file->d_name, cur_inum,
-					      parent_inum, dir_index_cnt,
+			ret = add_inode_items(trans, root, &cur_file->st,
+					      cur_file->dir_size, cur_inum,
 					      &cur_inode);
 			if (ret == -EEXIST) {
-				BUG_ON(st.st_nlink <= 1);
+				BUG_ON(cur_file->st.st_nlink <= 1);
 				continue;
 			}
 			if (ret) {
@@ -886,55 +1249,55 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 				goto fail;
 			}
 
-			ret = add_xattr_item(trans, root,
-					     cur_inum, cur_file->d_name);
+			ret = add_xattr_item(trans, root, cur_inum, cur_file);
 			if (ret) {
 				fprintf(stderr, "add_xattr_item failed\n");
 				if(ret != -ENOTSUP)
 					goto fail;
 			}
 
-			if (S_ISDIR(st.st_mode)) {
-				dir_entry = malloc(sizeof(struct directory_name_entry));
-				dir_entry->dir_name = cur_file->d_name;
-				dir_entry->path = make_path(parent_dir_entry->path,
-							    cur_file->d_name);
-				dir_entry->inum = cur_inum;
-				list_add_tail(&dir_entry->list,	&dir_head->list);
-			} else if (S_ISREG(st.st_mode)) {
+			if (S_ISDIR(cur_file->st.st_mode)) {
+				dir_entry = alloc_dir_entry(&walk,
+							    cur_file->name,
+							    cur_file->path,
+							    cur_inum);
+				cur_file->path = NULL;
+				if (!dir_entry) {
+					ret = -ENOMEM;
+					goto fail;
+				}
+				list_add_tail(&dir_entry->list, &dir_head->list);
+			} else if (S_ISREG(cur_file->st.st_mode)) {
 				ret = add_file_items(trans, root, &cur_inode,
-						     cur_inum, parent_inum, &st,
-						     cur_file->d_name, out_fd);
+						     cur_inum, parent_inum,
+						     cur_file, out_fd);
 				if (ret) {
 					fprintf(stderr, "add_file_items failed\n");
 					goto fail;
 				}
-			} else if (S_ISLNK(st.st_mode)) {
+			} else if (S_ISLNK(cur_file->st.st_mode)) {
 				ret = add_symbolic_link(trans, root,
-						        cur_inum, cur_file->d_name);
+							cur_inum, cur_file);
 				if (ret) {
 					fprintf(stderr, "add_symbolic_link failed\n");
 					goto fail;
 				}
 			}
+			free_entry_data(&walk, cur_file);
 		}
 
-		free_namelist(files, count);
-		free(parent_dir_entry);
-
-		index_cnt = 2;
+		free_dir_entry(parent_dir_entry);
+		queue_directory_scans(&walk, &dir_head->list);
 
 	} while (!list_empty(&dir_head->list));
 
 out:
+	/* wait for scans still in flight before their entries are freed */
+	task_pool_flush(walk.pool);
+	task_pool_destroy(walk.pool);
 	return !!ret;
 fail:
-	free_namelist(files, count);
-fail_no_files:
-	free(parent_dir_entry);
-	goto out;
-fail_no_dir:
-	free(dir_entry);
+	free_dir_entry(parent_dir_entry);
 	goto out;
 }
 
@@ -967,8 +1330,8 @@ static int create_chunks(struct btrfs_trans_handle *trans,
 					     meta_type, BTRFS_FIRST_CHUNK_TREE_OBJECTID,
 					     chunk_start, chunk_size);
 		BUG_ON(ret);
-		set_extent_dirty(&root->fs_info->free_space_cache,
-				 chunk_start, chunk_start + chunk_size - 1, 0);
+		btrfs_set_free_space(root->fs_info, chunk_start,
+				     chunk_start + chunk_size - 1);
 	}
 
 	if (size_of_data < minimum_data_chunk_size)
@@ -981,11 +1344,20 @@ static int create_chunks(struct btrfs_trans_handle *trans,
 				     data_type, BTRFS_FIRST_CHUNK_TREE_OBJECTID,
 				     chunk_start, size_of_data);
 	BUG_ON(ret);
-	set_extent_dirty(&root->fs_info->free_space_cache,
-			 chunk_start, chunk_start + size_of_data - 1, 0);
+	btrfs_set_free_space(root->fs_info, chunk_start,
+			     chunk_start + size_of_data - 1);
 	return ret;
 }
 
+static void print_commit_stats(struct btrfs_commit_stats *stats)
+{
+	printf("Metadata written: %llu blocks, %s in %llu writes "
+	       "(%llu merged) by %llu commits, %llu.%03llu seconds\n",
+	       stats->blocks, pretty_size(stats->bytes), stats->ios,
+	       stats->merged, stats->commits, stats->usecs / 1000000,
+	       stats->usecs / 1000 % 1000);
+}
+
 static int make_image(char *source_dir, struct btrfs_root *root, int out_fd)
 {
 	int ret;
@@ -1014,13 +1386,15 @@ static int make_image(char *source_dir, struct btrfs_root *root, int out_fd)
 	btrfs_commit_transaction(trans, root);
 
 	printf("Making image is completed.\n");
+	if (verbose)
+		print_commit_stats(&root->fs_info->commit_stats);
 	return 0;
 fail:
 	while (!list_empty(&dir_head.list)) {
 		dir_entry = list_entry(dir_head.list.next,
 				       struct directory_name_entry, list);
 		list_del(&dir_entry->list);
-		free(dir_entry);
+		free_dir_entry(dir_entry);
 	}
 out:
 	fprintf(stderr, "Making image is aborted.\n");
@@ -1313,7 +1687,7 @@ int main(int ac, char **av)
 
 	while(1) {
 		int c;
-		c = getopt_long(ac, av, "A:b:fl:n:s:m:d:L:O:r:U:VMKi:",
+		c = getopt_long(ac, av, "A:b:fl:n:s:m:d:L:O:r:U:VMKvi:",
 				long_options, &option_index);
 		if (c < 0)
 			break;
@@ -1388,6 +1762,9 @@ int main(int ac, char **av)
 			case 'K':
 				discard = 0;
 				break;
+			case 'v':
+				verbose = 1;
+				break;
 			case 'i':
 				init_metadata_chunks_ratio = atoi(optarg);
 				if (init_metadata_chunks_ratio <= 0 || init_metadata_chunks_ratio > 90) {
@@ -20,6 +20,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <uuid/uuid.h>
 #include "kerncompat.h"
 #include "radix-tree.h"
@@ -29,13 +31,17 @@
 #include "utils.h"
 #include "ulist.h"
 #include "rbtree-utils.h"
+#include "backref.h"
+#include "task-utils.h"
 
 #include "qgroup-verify.h"
 
 /*#define QGROUP_VERIFY_DEBUG*/
 static unsigned long tot_extents_scanned = 0;
 
-static void add_bytes(u64 root_objectid, u64 num_bytes, int exclusive);
+struct ref_part;
+static void add_bytes(struct ref_part *part, u64 root_objectid, u64 num_bytes,
+		      int exclusive);
 
 struct qgroup_count {
 	u64				qgroupid;
@@ -54,22 +60,73 @@ struct counts_tree {
 	unsigned int		num_groups;
 } counts = { .root = RB_ROOT };
 
-struct rb_root by_bytenr = RB_ROOT;
+/* the qgroup counts in qgroupid order, for the per range accumulators */
+static struct qgroup_count **count_index;
 
 /*
- * List of interior tree blocks. We walk this list after loading the
- * extent tree to resolve implied refs. For each interior node we'll
- * place a shared ref in the ref tree against each child object. This
- * allows the shared ref resolving code to do the actual work later of
- * finding roots to account against.
- *
- * An implied ref is when a tree block has refs on it that may not
- * exist in any of its child nodes. Even though the refs might not
- * exist further down the tree, the fact that our interior node has a
- * ref means we need to account anything below it to all its roots.
+ * The extent tree is scanned and accounted in bytenr ranges on a thread
+ * pool.  All refs of an extent are keyed by its bytenr, so each range
+ * owns the refs and the interior tree blocks found in it, and a lookup
+ * goes to the range holding the bytenr.  The ranges cover all of the
+ * address space in ascending order, walking them one after the other
+ * gives the same order as a single scan.
+ */
+struct ref_part {
+	struct task_work	work;
+	struct btrfs_fs_info	*info;
+	u64			start;
+	u64			end;
+
+	struct rb_root		by_bytenr;
+
+	/*
+	 * List of interior tree blocks. We walk this list after loading the
+	 * extent tree to resolve implied refs. For each interior node we'll
+	 * place a shared ref in the ref tree against each child object. This
+	 * allows the shared ref resolving code to do the actual work later of
+	 * finding roots to account against.
+	 *
+	 * An implied ref is when a tree block has refs on it that may not
+	 * exist in any of its child nodes. Even though the refs might not
+	 * exist further down the tree, the fact that our interior node has a
+	 * ref means we need to account anything below it to all its roots.
+	 */
+	struct ulist		*tree_blocks;	/* unode->val = bytenr, ->aux
+						 * = tree_block pointer */
+
+	/* bytes accounted in this range, indexed like count_index */
+	struct btrfs_qgroup_info_item *qgroups;
+
+	unsigned long		nr_extents;
+	unsigned long		nr_leaves;
+	int			ret;
+};
+
+static struct ref_part *parts;
+static int nr_parts;
+
+/* ranges per worker thread, so one dense range doesn't hold up the rest */
+#define PARTS_PER_THREAD	4
+
+/* extent buffers and their cache are not thread safe */
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* extent tree scan statistics for the report */
+static int scan_threads;
+static int nr_scan_parts;
+static unsigned long scan_leaves;
+static u32 scan_leafsize;
+static double scan_seconds;
+
+/*
+ * Roots of the shared tree blocks already resolved, snapshots make most
+ * extents go through the same parents.
  */
-struct ulist *tree_blocks = NULL;	/* unode->val = bytenr, ->aux
-					 * = tree_block pointer */
+#define ROOTS_CACHE_BLOCKS	(256 * 1024)
+static struct btrfs_backref_cache *roots_cache;
+static struct btrfs_backref_cache_stats roots_cache_stats;
+static pthread_mutex_t roots_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct tree_block {
 	int			level;
 	u64			num_bytes;
@@ -97,15 +154,18 @@ static void print_all_refs(void)
 	unsigned long count = 0;
 	struct ref *ref;
 	struct rb_node *node;
+	int i;
 
-	node = rb_first(&by_bytenr);
-	while (node) {
-		ref = rb_entry(node, struct ref, bytenr_node);
+	for (i = 0; i < nr_parts; i++) {
+		node = rb_first(&parts[i].by_bytenr);
+		while (node) {
+			ref = rb_entry(node, struct ref, bytenr_node);
 
-		print_ref(ref);
+			print_ref(ref);
 
-		count++;
-		node = rb_next(node);
+			count++;
+			node = rb_next(node);
+		}
 	}
 
 	printf("%lu extents scanned with %lu refs in total.\n",
@@ -113,6 +173,23 @@ static void print_all_refs(void)
 }
 #endif
 
+/* the range holding @bytenr */
+static struct ref_part *find_part(u64 bytenr)
+{
+	int lo = 0;
+	int hi = nr_parts - 1;
+	int mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (parts[mid].start <= bytenr)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return &parts[lo];
+}
+
 /*
  * Store by bytenr in rbtree
  *
@@ -147,7 +224,8 @@ static int compare_ref(struct ref *orig, u64 bytenr, u64 root, u64 parent)
 static struct ref *insert_ref(struct ref *ref)
 {
 	int ret;
-	struct rb_node **p = &by_bytenr.rb_node;
+	struct rb_root *by_bytenr = &find_part(ref->bytenr)->by_bytenr;
+	struct rb_node **p = &by_bytenr->rb_node;
 	struct rb_node *parent = NULL;
 	struct ref *curr;
 
@@ -165,7 +243,7 @@ static struct ref *insert_ref(struct ref *ref)
 	}
 
 	rb_link_node(&ref->bytenr_node, parent, p);
-	rb_insert_color(&ref->bytenr_node, &by_bytenr);
+	rb_insert_color(&ref->bytenr_node, by_bytenr);
 	return ref;
 }
 
@@ -178,7 +256,7 @@ static struct ref *insert_ref(struct ref *ref)
  */
 static struct ref *find_ref_bytenr(u64 bytenr)
 {
-	struct rb_node *n = by_bytenr.rb_node;
+	struct rb_node *n = find_part(bytenr)->by_bytenr.rb_node;
 	struct ref *ref;
 
 	while (n) {
@@ -209,7 +287,7 @@ static struct ref *find_ref_bytenr(u64 bytenr)
 
 static struct ref *find_ref(u64 bytenr, u64 root, u64 parent)
 {
-	struct rb_node *n = by_bytenr.rb_node;
+	struct rb_node *n = find_part(bytenr)->by_bytenr.rb_node;
 	struct ref *ref;
 	int ret;
 
@@ -262,6 +340,22 @@ static void find_parent_roots(struct ulist *roots, u64 parent)
 {
 	struct ref *ref;
 	struct rb_node *node;
+	struct ulist *parent_roots = NULL;
+	struct ulist *found = roots;
+	struct ulist_iterator uiter;
+	struct ulist_node *unode;
+	int ret;
+
+	if (roots_cache) {
+		pthread_mutex_lock(&roots_cache_lock);
+		ret = btrfs_backref_cache_merge(roots_cache, parent, roots);
+		pthread_mutex_unlock(&roots_cache_lock);
+		if (ret > 0)
+			return;
+		parent_roots = ulist_alloc(0);
+		if (parent_roots)
+			found = parent_roots;
+	}
 
 	/*
 	 * Search the rbtree for the first ref with bytenr == parent.
@@ -288,20 +382,30 @@ static void find_parent_roots(struct ulist *roots, u64 parent)
 
 	do {
 		if (ref->root)
-			ulist_add(roots, ref->root, 0, 0);
+			ulist_add(found, ref->root, 0, 0);
 		else
-			find_parent_roots(roots, ref->parent);
+			find_parent_roots(found, ref->parent);
 
 		node = rb_next(node);
 		if (node)
 			ref = rb_entry(node, struct ref, bytenr_node);
 	} while (node && ref->bytenr == parent);
+
+	if (parent_roots) {
+		pthread_mutex_lock(&roots_cache_lock);
+		btrfs_backref_cache_insert(roots_cache, parent, parent_roots);
+		pthread_mutex_unlock(&roots_cache_lock);
+		ULIST_ITER_INIT(&uiter);
+		while ((unode = ulist_next(parent_roots, &uiter)))
+			ulist_add(roots, unode->val, 0, 0);
+		ulist_free(parent_roots);
+	}
 }
 
 static void print_subvol_info(u64 subvolid, u64 bytenr, u64 num_bytes,
 			      struct ulist *roots);
 /*
- * Account each ref. Walk the refs, for each set of refs in a
+ * Account each ref of a range. Walk the refs, for each set of refs in a
  * given bytenr:
  *
  * - add the roots for direct refs to the ref roots ulist
@@ -311,8 +415,11 @@ static void print_subvol_info(u64 subvolid, u64 bytenr, u64 num_bytes,
  *
  * - Walk ref_roots ulist, adding extent bytes to each qgroup count that
  *    cooresponds to a found root.
+ *
+ * The ref trees are only read here, ranges can be accounted in parallel.
  */
-static void account_all_refs(int do_qgroups, u64 search_subvol)
+static void account_part_refs(struct ref_part *part, int do_qgroups,
+			      u64 search_subvol)
 {
 	int exclusive;
 	struct ref *ref;
@@ -322,7 +429,12 @@ static void account_all_refs(int do_qgroups, u64 search_subvol)
 	struct ulist_iterator uiter;
 	struct ulist_node *unode;
 
-	node = rb_first(&by_bytenr);
+	if (!roots) {
+		part->ret = ENOMEM;
+		return;
+	}
+
+	node = rb_first(&part->by_bytenr);
 	while (node) {
 		ulist_reinit(roots);
 
@@ -371,13 +483,73 @@ static void account_all_refs(int do_qgroups, u64 search_subvol)
 			BUG_ON(unode->val == 0ULL);
 			/* We only want to account fs trees */
 			if (is_fstree(unode->val) && do_qgroups)
-				add_bytes(unode->val, num_bytes, exclusive);
+				add_bytes(part, unode->val, num_bytes,
+					  exclusive);
 		}
 	}
 
 	ulist_free(roots);
 }
 
+static void account_part_work(struct task_work *work)
+{
+	struct ref_part *part = container_of(work, struct ref_part, work);
+
+	account_part_refs(part, 1, 0);
+}
+
+/*
+ * Account all ranges, on @pool when given.  The extents of @search_subvol
+ * are printed in bytenr order, so that is always done on this thread.
+ */
+static int account_all_refs(struct task_pool *pool, int do_qgroups,
+			    u64 search_subvol)
+{
+	struct btrfs_qgroup_info_item *sum;
+	struct btrfs_qgroup_info_item *qg;
+	int ret = 0;
+	int i;
+	int j;
+
+	/* without the cache the walks are just slower */
+	roots_cache = btrfs_backref_cache_alloc(ROOTS_CACHE_BLOCKS);
+
+	for (i = 0; i < nr_parts; i++) {
+		parts[i].ret = 0;
+		if (pool && do_qgroups && !search_subvol)
+			task_pool_queue(pool, &parts[i].work,
+					account_part_work);
+		else
+			account_part_refs(&parts[i], do_qgroups,
+					  search_subvol);
+	}
+
+	/* add up the ranges in bytenr order */
+	for (i = 0; i < nr_parts; i++) {
+		if (pool && do_qgroups && !search_subvol)
+			task_pool_wait_work(pool, &parts[i].work);
+		if (parts[i].ret && !ret)
+			ret = parts[i].ret;
+		if (!do_qgroups)
+			continue;
+		for (j = 0; j < counts.num_groups; j++) {
+			sum = &count_index[j]->info;
+			qg = &parts[i].qgroups[j];
+			sum->referenced += qg->referenced;
+			sum->referenced_compressed += qg->referenced_compressed;
+			sum->exclusive += qg->exclusive;
+			sum->exclusive_compressed += qg->exclusive_compressed;
+		}
+	}
+
+	if (roots_cache) {
+		btrfs_backref_cache_get_stats(roots_cache, &roots_cache_stats);
+		btrfs_backref_cache_free(roots_cache);
+		roots_cache = NULL;
+	}
+	return ret;
+}
+
 static u64 resolve_one_root(u64 bytenr)
 {
 	struct ref *ref = find_ref_bytenr(bytenr);
@@ -398,33 +570,35 @@ static inline u64 unode_bytenr(struct ulist_node *unode)
 	return unode->val;
 }
 
-static int alloc_tree_block(u64 bytenr, u64 num_bytes, int level)
+static int alloc_tree_block(struct ref_part *part, u64 bytenr, u64 num_bytes,
+			    int level)
 {
 	struct tree_block *block = calloc(1, sizeof(*block));
 
 	if (block) {
 		block->num_bytes = num_bytes;
 		block->level = level;
-		if (ulist_add(tree_blocks, bytenr, ptr_to_u64(block), 0) >= 0)
+		if (ulist_add(part->tree_blocks, bytenr, ptr_to_u64(block),
+			      0) >= 0)
 			return 0;
 		free(block);
 	}
 	return -ENOMEM;
 }
 
-static void free_tree_blocks(void)
+static void free_tree_blocks(struct ref_part *part)
 {
 	struct ulist_iterator uiter;
 	struct ulist_node *unode;
 
-	if (!tree_blocks)
+	if (!part->tree_blocks)
 		return;
 
 	ULIST_ITER_INIT(&uiter);
-	while ((unode = ulist_next(tree_blocks, &uiter)))
+	while ((unode = ulist_next(part->tree_blocks, &uiter)))
 		free(unode_tree_block(unode));
-	ulist_free(tree_blocks);	
-	tree_blocks = NULL;
+	ulist_free(part->tree_blocks);
+	part->tree_blocks = NULL;
 }
 
 #ifdef QGROUP_VERIFY_DEBUG
@@ -452,15 +626,16 @@ static void print_all_tree_blocks(void)
 {
 	struct ulist_iterator uiter;
 	struct ulist_node *unode;
-
-	if (!tree_blocks)
-		return;
+	int i;
 
 	printf("Listing all found interior tree nodes:\n");
 
-	ULIST_ITER_INIT(&uiter);
-	while ((unode = ulist_next(tree_blocks, &uiter)))
-		print_tree_block(unode_bytenr(unode), unode_tree_block(unode));
+	for (i = 0; i < nr_parts; i++) {
+		ULIST_ITER_INIT(&uiter);
+		while ((unode = ulist_next(parts[i].tree_blocks, &uiter)))
+			print_tree_block(unode_bytenr(unode),
+					 unode_tree_block(unode));
+	}
 }
 #endif
 
@@ -578,19 +753,25 @@ static int add_refs_for_implied(struct btrfs_fs_info *info, u64 bytenr,
 
 /*
  * Place shared refs in the ref tree for each child of an interior tree node.
+ *
+ * The children may live in any range and are read through the tree, so
+ * this runs on one thread.
  */
 static int map_implied_refs(struct btrfs_fs_info *info)
 {
 	int ret = 0;
 	struct ulist_iterator uiter;
 	struct ulist_node *unode;
+	int i;
 
-	ULIST_ITER_INIT(&uiter);
-	while ((unode = ulist_next(tree_blocks, &uiter))) {
-		ret = add_refs_for_implied(info, unode_bytenr(unode),
-					   unode_tree_block(unode));
-		if (ret)
-			goto out;
+	for (i = 0; i < nr_parts; i++) {
+		ULIST_ITER_INIT(&uiter);
+		while ((unode = ulist_next(parts[i].tree_blocks, &uiter))) {
+			ret = add_refs_for_implied(info, unode_bytenr(unode),
+						   unode_tree_block(unode));
+			if (ret)
+				goto out;
+		}
 	}
 out:
 	return ret;
@@ -624,22 +805,37 @@ static int insert_count(struct qgroup_count *qc)
 	return 0;
 }
 
-static struct qgroup_count *find_count(u64 qgroupid)
+static int build_count_index(void)
 {
-	struct rb_node *n = counts.root.rb_node;
-	struct qgroup_count *count;
+	struct rb_node *node;
+	int i = 0;
 
-	while (n) {
-		count = rb_entry(n, struct qgroup_count, rb_node);
+	free(count_index);
+	count_index = calloc(counts.num_groups + 1, sizeof(*count_index));
+	if (!count_index)
+		return ENOMEM;
+	for (node = rb_first(&counts.root); node; node = rb_next(node))
+		count_index[i++] = rb_entry(node, struct qgroup_count, rb_node);
+	return 0;
+}
 
-		if (qgroupid < count->qgroupid)
-			n = n->rb_left;
-		else if (qgroupid > count->qgroupid)
-			n = n->rb_right;
+/* position of @qgroupid in count_index, or -1 */
+static int find_count_index(u64 qgroupid)
+{
+	int lo = 0;
+	int hi = (int)counts.num_groups - 1;
+	int mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (qgroupid < count_index[mid]->qgroupid)
+			hi = mid - 1;
+		else if (qgroupid > count_index[mid]->qgroupid)
+			lo = mid + 1;
 		else
-			return count;
+			return mid;
 	}
-	return NULL;
+	return -1;
 }
 
 static struct qgroup_count *alloc_count(struct btrfs_disk_key *key,
@@ -670,17 +866,18 @@ static struct qgroup_count *alloc_count(struct btrfs_disk_key *key,
 	return c;
 }
 
-static void add_bytes(u64 root_objectid, u64 num_bytes, int exclusive)
+static void add_bytes(struct ref_part *part, u64 root_objectid, u64 num_bytes,
+		      int exclusive)
 {
-	struct qgroup_count *count = find_count(root_objectid);
+	int index = find_count_index(root_objectid);
 	struct btrfs_qgroup_info_item *qg;
 
 	BUG_ON(num_bytes < 4096); /* Random sanity check. */
 
-	if (!count)
+	if (index < 0)
 		return;
 
-	qg = &count->info;
+	qg = &part->qgroups[index];
 
 	qg->referenced += num_bytes;
 	/*
@@ -695,14 +892,60 @@ static void add_bytes(u64 root_objectid, u64 num_bytes, int exclusive)
 	}
 }
 
+/* the last root item of the subvolume sits just before the search slot */
+static int mark_subvol_exists(struct btrfs_tree_cursor *cur, int index,
+			      int found, void *data)
+{
+	struct extent_buffer *leaf = cur->path.nodes[0];
+	int slot = cur->path.slots[0];
+	struct btrfs_key key;
+
+	if (!found) {
+		if (slot == 0)
+			return 0;
+		slot--;
+	}
+	btrfs_item_key_to_cpu(leaf, &key, slot);
+	if (key.objectid == count_index[index]->qgroupid &&
+	    key.type == BTRFS_ROOT_ITEM_KEY)
+		count_index[index]->subvol_exists = 1;
+	return 0;
+}
+
+/*
+ * Qgroups come in qgroupid order, so the root items of their subvolumes
+ * are looked up in one sweep over the root tree.
+ */
+static int find_existing_subvols(struct btrfs_fs_info *info)
+{
+	struct btrfs_tree_cursor cur;
+	struct btrfs_key *keys;
+	int i;
+	int ret;
+
+	keys = calloc(counts.num_groups + 1, sizeof(*keys));
+	if (!keys)
+		return ENOMEM;
+	for (i = 0; i < counts.num_groups; i++) {
+		keys[i].objectid = count_index[i]->qgroupid;
+		keys[i].type = BTRFS_ROOT_ITEM_KEY;
+		keys[i].offset = (u64)-1;
+	}
+
+	btrfs_tree_cursor_init(&cur, info->tree_root);
+	ret = btrfs_tree_cursor_lookup_keys(&cur, keys, counts.num_groups,
+					    mark_subvol_exists, NULL);
+	btrfs_tree_cursor_release(&cur);
+	free(keys);
+	return ret < 0 ? -ret : ret;
+}
+
 static int load_quota_info(struct btrfs_fs_info *info)
 {
 	int ret;
 	struct btrfs_root *root = info->quota_root;
-	struct btrfs_root *tmproot;
 	struct btrfs_path path;
 	struct btrfs_key key;
-	struct btrfs_key root_key;
 	struct btrfs_disk_key disk_key;
 	struct extent_buffer *leaf;
 	struct btrfs_qgroup_info_item *item;
@@ -749,15 +992,6 @@ static int load_quota_info(struct btrfs_fs_info *info)
 				fprintf(stderr, "ERROR: out of memory\n");
 				goto out;
 			}
-
-			root_key.objectid = key.offset;
-			root_key.type = BTRFS_ROOT_ITEM_KEY;
-			root_key.offset = (u64)-1;
-			tmproot = btrfs_read_fs_root_no_cache(info, &root_key);
-			if (tmproot && !IS_ERR(tmproot)) {
-				count->subvol_exists = 1;
-				free(tmproot);
-			}
 		}
 
 		ret = btrfs_next_leaf(root, &path);
@@ -888,13 +1122,16 @@ static int get_tree_block_level(struct btrfs_key *key,
 }
 
 /*
- * Walk the extent tree, allocating a ref item for every ref and
- * storing it in the bytenr tree.
+ * Walk the extent items of a range, allocating a ref item for every ref
+ * and storing it in the range's bytenr tree.
+ *
+ * Only the tree walk itself is serialized, the items of a leaf are taken
+ * apart with the lock dropped, the path keeps the leaf alive.
  */
-static int scan_extents(struct btrfs_fs_info *info,
-			u64 start, u64 end)
+static int scan_extents(struct ref_part *part)
 {
 	int ret, i, nr, level;
+	struct btrfs_fs_info *info = part->info;
 	struct btrfs_root *root = info->extent_root;
 	struct btrfs_key key;
 	struct btrfs_path path;
@@ -904,11 +1141,13 @@ static int scan_extents(struct btrfs_fs_info *info,
 
 	btrfs_init_path(&path);
 
-	key.objectid = start;
+	key.objectid = part->start;
 	key.type = 0;
 	key.offset = 0;
 
+	pthread_mutex_lock(&tree_lock);
 	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	pthread_mutex_unlock(&tree_lock);
 	if (ret < 0) {
 		fprintf(stderr, "ERROR: Couldn't search slot: %d\n", ret);
 		goto out;
@@ -917,23 +1156,24 @@ static int scan_extents(struct btrfs_fs_info *info,
 
 	while (1) {
 		leaf = path.nodes[0];
+		part->nr_leaves++;
 
 		nr = btrfs_header_nritems(leaf);
 		for(i = 0; i < nr; i++) {
 			btrfs_item_key(leaf, &disk_key, i);
 			btrfs_disk_key_to_cpu(&key, &disk_key);
 
-			if (key.objectid < start)
+			if (key.objectid < part->start)
 				continue;
 
-			if (key.objectid > end)
+			if (key.objectid > part->end)
 				goto done;
 
 			if (key.type == BTRFS_EXTENT_ITEM_KEY ||
 			    key.type == BTRFS_METADATA_ITEM_KEY) {
 				int meta = 0;
 
-				tot_extents_scanned++;
+				part->nr_extents++;
 
 				bytenr = key.objectid;
 				num_bytes = key.offset;
@@ -949,9 +1189,12 @@ static int scan_extents(struct btrfs_fs_info *info,
 
 				level = get_tree_block_level(&key, leaf, i);
 				if (level) {
-					if (alloc_tree_block(bytenr, num_bytes,
-							     level))
-						return ENOMEM;
+					if (alloc_tree_block(part, bytenr,
+							     num_bytes,
+							     level)) {
+						ret = ENOMEM;
+						goto out;
+					}
 				}
 
 				continue;
@@ -977,7 +1220,9 @@ static int scan_extents(struct btrfs_fs_info *info,
 				goto out;
 		}
 
+		pthread_mutex_lock(&tree_lock);
 		ret = btrfs_next_leaf(root, &path);
+		pthread_mutex_unlock(&tree_lock);
 		if (ret != 0) {
 			if (ret < 0) {
 				fprintf(stderr,
@@ -990,11 +1235,213 @@ static int scan_extents(struct btrfs_fs_info *info,
 done:
 	ret = 0;
 out:
+	pthread_mutex_lock(&tree_lock);
 	btrfs_release_path(&path);
+	pthread_mutex_unlock(&tree_lock);
 
 	return ret;
 }
 
+static void scan_part_work(struct task_work *work)
+{
+	struct ref_part *part = container_of(work, struct ref_part, work);
+
+	part->ret = scan_extents(part);
+}
+
+/*
+ * Pick the bytenrs splitting the extent tree into about @want ranges of
+ * similar size, from the keys of the highest node level with enough of
+ * them.  Returns the number of ranges, the first one starts at 0.
+ */
+static int split_extent_tree(struct btrfs_fs_info *info, int want,
+			     u64 **starts_ret)
+{
+	struct btrfs_root *root = info->extent_root;
+	struct btrfs_disk_key disk_key;
+	struct extent_buffer *eb;
+	u64 *blocks = NULL;
+	u64 *ptrs = NULL;
+	u64 *keys = NULL;
+	u64 *starts;
+	u64 start;
+	int nr_blocks = 1;
+	int nr_ptrs;
+	int nr_starts = 1;
+	int level;
+	int ret = 0;
+	int i;
+	int j;
+
+	starts = calloc(want, sizeof(*starts));
+	blocks = malloc(sizeof(*blocks));
+	if (!starts || !blocks) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	blocks[0] = root->node->start;
+	level = btrfs_header_level(root->node);
+
+	while (level > 0) {
+		ptrs = malloc(nr_blocks * BTRFS_NODEPTRS_PER_BLOCK(root) *
+			      sizeof(*ptrs));
+		keys = malloc(nr_blocks * BTRFS_NODEPTRS_PER_BLOCK(root) *
+			      sizeof(*keys));
+		if (!ptrs || !keys) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		nr_ptrs = 0;
+		for (i = 0; i < nr_blocks; i++) {
+			eb = read_tree_block(root, blocks[i],
+					     btrfs_level_size(root, level), 0);
+			if (!extent_buffer_uptodate(eb)) {
+				free_extent_buffer(eb);
+				ret = -EIO;
+				goto out;
+			}
+			for (j = 0; j < btrfs_header_nritems(eb); j++) {
+				ptrs[nr_ptrs] = btrfs_node_blockptr(eb, j);
+				btrfs_node_key(eb, &disk_key, j);
+				keys[nr_ptrs] = btrfs_disk_key_objectid(&disk_key);
+				nr_ptrs++;
+			}
+			free_extent_buffer(eb);
+		}
+		if (nr_ptrs >= want || level == 1)
+			break;
+		free(blocks);
+		free(keys);
+		keys = NULL;
+		blocks = ptrs;
+		ptrs = NULL;
+		nr_blocks = nr_ptrs;
+		level--;
+	}
+
+	for (i = 1; keys && i < want; i++) {
+		start = keys[(u64)i * nr_ptrs / want];
+		if (start > starts[nr_starts - 1])
+			starts[nr_starts++] = start;
+	}
+out:
+	free(blocks);
+	free(ptrs);
+	free(keys);
+	if (ret) {
+		free(starts);
+		return ret;
+	}
+	*starts_ret = starts;
+	return nr_starts;
+}
+
+static int alloc_ref_parts(struct btrfs_fs_info *info, int want)
+{
+	u64 *starts;
+	int ret;
+	int i;
+
+	ret = split_extent_tree(info, want, &starts);
+	if (ret < 0)
+		return -ret;
+
+	nr_parts = ret;
+	parts = calloc(nr_parts, sizeof(*parts));
+	if (!parts) {
+		free(starts);
+		return ENOMEM;
+	}
+	for (i = 0; i < nr_parts; i++) {
+		parts[i].info = info;
+		parts[i].start = starts[i];
+		parts[i].end = i + 1 < nr_parts ? starts[i + 1] - 1 : (u64)-1;
+		parts[i].by_bytenr = RB_ROOT;
+		parts[i].tree_blocks = ulist_alloc(0);
+		parts[i].qgroups = calloc(counts.num_groups + 1,
+					  sizeof(*parts[i].qgroups));
+		if (!parts[i].tree_blocks || !parts[i].qgroups) {
+			free(starts);
+			return ENOMEM;
+		}
+	}
+	free(starts);
+	return 0;
+}
+
+static void free_ref_parts(void)
+{
+	int i;
+
+	for (i = 0; i < nr_parts; i++) {
+		free_tree_blocks(&parts[i]);
+		free_ref_tree(&parts[i].by_bytenr);
+		free(parts[i].qgroups);
+	}
+	free(parts);
+	parts = NULL;
+	nr_parts = 0;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/*
+ * Put all extent refs into the ref trees of the ranges, on @pool when
+ * given, then add the implied refs of the interior tree blocks.
+ */
+static int load_all_refs(struct btrfs_fs_info *info, struct task_pool *pool)
+{
+	double t = now();
+	int ret;
+	int i;
+
+	ret = alloc_ref_parts(info, pool ? pool->nr_threads *
+			      PARTS_PER_THREAD : 1);
+	if (ret) {
+		fprintf(stderr, "ERROR: while splitting extent tree: %d\n",
+			ret);
+		return ret;
+	}
+
+	for (i = 0; i < nr_parts; i++) {
+		if (pool)
+			task_pool_queue(pool, &parts[i].work, scan_part_work);
+		else
+			scan_part_work(&parts[i].work);
+	}
+
+	ret = 0;
+	tot_extents_scanned = 0;
+	scan_leaves = 0;
+	for (i = 0; i < nr_parts; i++) {
+		if (pool)
+			task_pool_wait_work(pool, &parts[i].work);
+		if (parts[i].ret && !ret)
+			ret = parts[i].ret;
+		tot_extents_scanned += parts[i].nr_extents;
+		scan_leaves += parts[i].nr_leaves;
+	}
+	scan_threads = pool ? pool->nr_threads : 1;
+	nr_scan_parts = nr_parts;
+	scan_leafsize = info->extent_root->leafsize;
+	scan_seconds = now() - t;
+	if (ret) {
+		fprintf(stderr, "ERROR: while scanning extent tree: %d\n", ret);
+		return ret;
+	}
+
+	ret = map_implied_refs(info);
+	if (ret)
+		fprintf(stderr, "ERROR: while mapping refs: %d\n", ret);
+	return ret;
+}
+
 static void print_fields(u64 bytes, u64 bytes_compressed, char *prefix,
 			 char *type)
 {
@@ -1054,52 +1501,68 @@ void print_qgroup_report(int all)
 		print_qgroup_difference(c, all);
 		node = rb_next(node);
 	}
+
+	if (all && tot_extents_scanned)
+		printf("Extent tree scan: %lu extents in %lu leaves, %d ranges "
+		       "on %d threads, %.2fs (%.0f extents/s, %.1f MiB/s)\n",
+		       tot_extents_scanned, scan_leaves, nr_scan_parts,
+		       scan_threads, scan_seconds,
+		       tot_extents_scanned / max(scan_seconds, 0.000001),
+		       (double)scan_leaves * scan_leafsize / (1024 * 1024) /
+		       max(scan_seconds, 0.000001));
+
+	if (all && roots_cache_stats.lookups)
+		printf("Shared block root cache: %llu lookups, %llu hits "
+		       "(%llu%%), %llu evictions\n",
+		       (unsigned long long)roots_cache_stats.lookups,
+		       (unsigned long long)roots_cache_stats.hits,
+		       (unsigned long long)(roots_cache_stats.hits * 100 /
+					    roots_cache_stats.lookups),
+		       (unsigned long long)roots_cache_stats.evictions);
 }
 
 int qgroup_verify_all(struct btrfs_fs_info *info)
 {
+	struct task_pool *pool;
 	int ret;
 
 	if (!info->quota_enabled)
 		return 0;
 
-	tree_blocks = ulist_alloc(0);
-	if (!tree_blocks) {
-		fprintf(stderr,
-			"ERROR: Out of memory while allocating ulist.\n");
-		return ENOMEM;
-	}
-
 	ret = load_quota_info(info);
 	if (ret) {
 		fprintf(stderr, "ERROR: Loading qgroups from disk: %d\n", ret);
-		goto out;
+		return ret;
 	}
-
-	/*
-	 * Put all extent refs into our rbtree
-	 */
-	ret = scan_extents(info, 0, ~0ULL);
+	ret = build_count_index();
 	if (ret) {
-		fprintf(stderr, "ERROR: while scanning extent tree: %d\n", ret);
-		goto out;
+		fprintf(stderr, "ERROR: out of memory\n");
+		return ret;
 	}
-
-	ret = map_implied_refs(info);
+	ret = find_existing_subvols(info);
 	if (ret) {
-		fprintf(stderr, "ERROR: while mapping refs: %d\n", ret);
-		goto out;
+		fprintf(stderr, "ERROR: Looking up subvolumes: %d\n", ret);
+		return ret;
 	}
 
-	account_all_refs(1, 0);
+	/* a pool that fails to start only costs the parallelism */
+	pool = task_pool_init(0);
+
+	ret = load_all_refs(info, pool);
+	if (ret)
+		goto out;
+
+	ret = account_all_refs(pool, 1, 0);
+	if (ret)
+		fprintf(stderr, "ERROR: while accounting refs: %d\n", ret);
 
 out:
 	/*
 	 * Don't free the qgroup count records as they will be walked
 	 * later via the print function.
 	 */
-	free_tree_blocks();
-	free_ref_tree(&by_bytenr);
+	task_pool_destroy(pool);
+	free_ref_parts();
 	return ret;
 }
 
@@ -1138,36 +1601,20 @@ static void print_subvol_info(u64 subvolid, u64 bytenr, u64 num_bytes,
 
 int print_extent_state(struct btrfs_fs_info *info, u64 subvol)
 {
+	struct task_pool *pool;
 	int ret;
 
-	tree_blocks = ulist_alloc(0);
-	if (!tree_blocks) {
-		fprintf(stderr,
-			"ERROR: Out of memory while allocating ulist.\n");
-		return ENOMEM;
-	}
+	pool = task_pool_init(0);
 
-	/*
-	 * Put all extent refs into our rbtree
-	 */
-	ret = scan_extents(info, 0, ~0ULL);
-	if (ret) {
-		fprintf(stderr, "ERROR: while scanning extent tree: %d\n", ret);
-		goto out;
-	}
-
-	ret = map_implied_refs(info);
-	if (ret) {
-		fprintf(stderr, "ERROR: while mapping refs: %d\n", ret);
+	ret = load_all_refs(info, pool);
+	if (ret)
 		goto out;
-	}
 
 	printf("Offset\t\tLen\tRoot Refs\tRoots\n");
-	account_all_refs(0, subvol);
+	ret = account_all_refs(pool, 0, subvol);
 
 out:
-	free_tree_blocks();
-	free_ref_tree(&by_bytenr);
+	task_pool_destroy(pool);
+	free_ref_parts();
 	return ret;
 }
-
@@ -0,0 +1,1061 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Scrub of an unmounted filesystem.  The extent tree gives the tree
+ * blocks and the csum tree the checksummed data.  Both are cut into
+ * ranges that are contiguous on every copy, and each copy of a range is
+ * read and verified by the thread of the device it lives on.  When all
+ * copies of a range are in, bad blocks are rewritten from a good copy.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <uuid/uuid.h>
+
+#include "kerncompat.h"
+#include "ctree.h"
+#include "disk-io.h"
+#include "volumes.h"
+#include "utils.h"
+#include "scrub-offline.h"
+
+/* largest range read in one go, and how many ranges are in flight */
+#define SCRUB_RANGE_SIZE	(1024 * 1024)
+#define SCRUB_MAX_INFLIGHT	64
+#define SCRUB_CHECKPOINT_SECS	30
+
+#define SCRUB_CHECKPOINT_HEADER	"btrfs offline scrub checkpoint"
+
+enum {
+	SCRUB_PASS_TREE,
+	SCRUB_PASS_DATA,
+	SCRUB_PASS_DONE,
+};
+
+static const char * const scrub_pass_names[] = { "tree", "data", "done" };
+
+/* per block state of a copy */
+enum {
+	SCRUB_OK,
+	SCRUB_UNREADABLE,
+	SCRUB_BAD,
+};
+
+struct scrub_ctx;
+struct scrub_range;
+
+struct scrub_dev {
+	struct scrub_ctx *sctx;
+	struct btrfs_device *device;
+	pthread_t thread;
+	pthread_cond_t cond;
+	struct list_head queue;
+
+	/* stats, under sctx->lock */
+	u64 bytes_read;
+	u64 reads;
+	double busy;
+	u64 read_errors;
+	u64 csum_errors;
+	u64 corrected;
+	u64 uncorrectable;
+};
+
+struct scrub_copy {
+	struct list_head list;
+	struct scrub_range *range;
+	struct scrub_dev *dev;
+	u64 physical;
+	int mirror;
+	char *data;
+	u8 *state;
+};
+
+struct scrub_range {
+	struct list_head list;
+	u64 logical;
+	u64 len;
+	u32 blocksize;
+	int is_data;
+	int pending;
+	int cancelled;
+	char *csums;
+	/* generation of each tree block, from its extent item */
+	u64 *gens;
+	int nr_copies;
+	struct scrub_copy copies[BTRFS_MAX_MIRRORS];
+};
+
+struct scrub_ctx {
+	struct btrfs_fs_info *info;
+	struct scrub_offline_args *args;
+	struct scrub_dev *devs;
+	int nr_devs;
+	int threads;
+	int stop;
+
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+	/* submitted ranges, in logical order */
+	struct list_head inflight;
+	int nr_inflight;
+	struct scrub_range *open;
+
+	int pass;
+	/* everything of the pass before this is done */
+	u64 pos;
+	u64 resume_pos;
+	/* first range dropped when we were interrupted */
+	u64 cancel_pos;
+
+	u32 sectorsize;
+	u32 nodesize;
+	u16 csum_size;
+	double start;
+	double last_save;
+
+	/* totals, including the ones of the run we resumed */
+	u64 tree_bytes;
+	u64 data_bytes;
+	u64 skipped;
+	u64 read_errors;
+	u64 csum_errors;
+	u64 corrected;
+	u64 uncorrectable;
+};
+
+static volatile sig_atomic_t scrub_interrupted;
+
+static void scrub_sigint(int signo)
+{
+	scrub_interrupted = 1;
+}
+
+static double scrub_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static struct scrub_dev *scrub_find_dev(struct scrub_ctx *sctx,
+					struct btrfs_device *device)
+{
+	int i;
+
+	for (i = 0; i < sctx->nr_devs; i++)
+		if (sctx->devs[i].device == device)
+			return &sctx->devs[i];
+	return NULL;
+}
+
+/*
+ * A stale copy of an older block at the same place has a good csum too,
+ * so the header has to match the extent item as well.
+ */
+static int scrub_tree_block_ok(struct scrub_ctx *sctx, char *buf, u64 bytenr,
+			       u64 gen)
+{
+	struct btrfs_header *header = (struct btrfs_header *)buf;
+	u32 csum = ~(u32)0;
+
+	if (btrfs_stack_header_bytenr(header) != bytenr)
+		return 0;
+	if (gen && btrfs_stack_header_generation(header) != gen)
+		return 0;
+	if (memcmp(header->fsid, sctx->info->fsid, BTRFS_FSID_SIZE) ||
+	    memcmp(header->chunk_tree_uuid, sctx->info->chunk_tree_uuid,
+		   BTRFS_UUID_SIZE))
+		return 0;
+	csum = btrfs_csum_data(NULL, buf + BTRFS_CSUM_SIZE, csum,
+			       sctx->nodesize - BTRFS_CSUM_SIZE);
+	btrfs_csum_final(csum, (char *)&csum);
+	return !memcmp(buf, &csum, sctx->csum_size);
+}
+
+static int scrub_sector_ok(struct scrub_ctx *sctx, char *buf, char *expected)
+{
+	u32 csum = ~(u32)0;
+
+	csum = btrfs_csum_data(NULL, buf, csum, sctx->sectorsize);
+	btrfs_csum_final(csum, (char *)&csum);
+	return !memcmp(expected, &csum, sctx->csum_size);
+}
+
+static int scrub_block_ok(struct scrub_ctx *sctx, struct scrub_range *range,
+			  char *buf, u64 offset)
+{
+	if (range->is_data)
+		return scrub_sector_ok(sctx, buf, range->csums + offset /
+				       sctx->sectorsize * sctx->csum_size);
+	return scrub_tree_block_ok(sctx, buf, range->logical + offset,
+				   range->gens[offset / sctx->nodesize]);
+}
+
+/* the reads of a device stay below the rate limit, averaged from the start */
+static void scrub_throttle(struct scrub_dev *dev)
+{
+	struct scrub_ctx *sctx = dev->sctx;
+	double ahead;
+
+	if (!sctx->args->limit)
+		return;
+	pthread_mutex_lock(&sctx->lock);
+	ahead = (double)dev->bytes_read / sctx->args->limit -
+		(scrub_now() - sctx->start);
+	pthread_mutex_unlock(&sctx->lock);
+	if (ahead > 0)
+		usleep(ahead * 1000000);
+}
+
+/*
+ * Read and verify one copy.  If the range can't be read as a whole it
+ * is read block by block, so a bad spot only costs the blocks in it.
+ */
+static void scrub_read_copy(struct scrub_copy *copy)
+{
+	struct scrub_range *range = copy->range;
+	struct scrub_dev *dev = copy->dev;
+	struct scrub_ctx *sctx = dev->sctx;
+	u64 bytes = range->len;
+	u64 offset;
+	double t = scrub_now();
+	int reads = 1;
+
+	if (btrfs_device_pread(dev->device, copy->data, range->len,
+			       copy->physical) != range->len) {
+		bytes = 0;
+		for (offset = 0; offset < range->len;
+		     offset += range->blocksize) {
+			reads++;
+			if (btrfs_device_pread(dev->device,
+					copy->data + offset, range->blocksize,
+					copy->physical + offset) ==
+			    range->blocksize)
+				bytes += range->blocksize;
+			else
+				copy->state[offset / range->blocksize] =
+					SCRUB_UNREADABLE;
+		}
+	}
+
+	for (offset = 0; offset < range->len; offset += range->blocksize) {
+		if (copy->state[offset / range->blocksize])
+			continue;
+		if (!scrub_block_ok(sctx, range, copy->data + offset, offset))
+			copy->state[offset / range->blocksize] = SCRUB_BAD;
+	}
+
+	pthread_mutex_lock(&sctx->lock);
+	dev->busy += scrub_now() - t;
+	dev->reads += reads;
+	dev->bytes_read += bytes;
+	pthread_mutex_unlock(&sctx->lock);
+}
+
+/* rewrite a bad block from a good copy, and read it back */
+static int scrub_repair_block(struct scrub_ctx *sctx, struct scrub_range *range,
+			      struct scrub_copy *bad, struct scrub_copy *good,
+			      u64 offset)
+{
+	struct btrfs_device *device = bad->dev->device;
+	u32 blocksize = range->blocksize;
+	char *buf;
+	int ret = 0;
+
+	if (pwrite(device->fd, good->data + offset, blocksize,
+		   bad->physical + offset) != blocksize)
+		return 0;
+	buf = malloc(blocksize);
+	if (!buf)
+		return 0;
+	if (btrfs_device_pread(device, buf, blocksize,
+			       bad->physical + offset) == blocksize)
+		ret = scrub_block_ok(sctx, range, buf, offset);
+	free(buf);
+	return ret;
+}
+
+static void scrub_range_free(struct scrub_range *range)
+{
+	int i;
+
+	for (i = 0; i < range->nr_copies; i++) {
+		free(range->copies[i].data);
+		free(range->copies[i].state);
+	}
+	free(range->csums);
+	free(range->gens);
+	free(range);
+}
+
+/* all copies are in: count the errors and fix what has a good copy */
+static void scrub_range_done(struct scrub_ctx *sctx, struct scrub_range *range)
+{
+	struct scrub_copy *good;
+	struct scrub_copy *copy;
+	struct scrub_dev *dev;
+	const char *result;
+	u64 offset;
+	int state;
+	int fixed;
+	int i;
+	int j;
+
+	for (offset = 0; offset < range->len && !range->cancelled;
+	     offset += range->blocksize) {
+		j = offset / range->blocksize;
+		good = NULL;
+		for (i = 0; i < range->nr_copies && !good; i++)
+			if (range->copies[i].state[j] == SCRUB_OK)
+				good = &range->copies[i];
+
+		for (i = 0; i < range->nr_copies; i++) {
+			copy = &range->copies[i];
+			dev = copy->dev;
+			state = copy->state[j];
+			if (state == SCRUB_OK)
+				continue;
+
+			fixed = 0;
+			if (!good)
+				result = "unrecoverable";
+			else if (sctx->args->readonly)
+				result = "not repaired, read only";
+			else if ((fixed = scrub_repair_block(sctx, range, copy,
+							     good, offset)))
+				result = "repaired";
+			else
+				result = "repair failed";
+			fprintf(stderr, "ERROR: %s error at logical %llu on "
+				"devid %llu physical %llu, mirror %d: %s\n",
+				state == SCRUB_UNREADABLE ? "read" :
+				range->is_data ? "csum" : "tree block",
+				(unsigned long long)(range->logical + offset),
+				(unsigned long long)dev->device->devid,
+				(unsigned long long)(copy->physical + offset),
+				copy->mirror, result);
+
+			pthread_mutex_lock(&sctx->lock);
+			if (state == SCRUB_UNREADABLE) {
+				dev->read_errors++;
+				sctx->read_errors++;
+			} else {
+				dev->csum_errors++;
+				sctx->csum_errors++;
+			}
+			if (fixed) {
+				dev->corrected++;
+				sctx->corrected++;
+			} else if (!good || !sctx->args->readonly) {
+				dev->uncorrectable++;
+				sctx->uncorrectable++;
+			}
+			pthread_mutex_unlock(&sctx->lock);
+		}
+	}
+
+	pthread_mutex_lock(&sctx->lock);
+	if (range->cancelled)
+		sctx->cancel_pos = min(sctx->cancel_pos, range->logical);
+	else if (range->is_data)
+		sctx->data_bytes += range->len;
+	else
+		sctx->tree_bytes += range->len;
+	list_del(&range->list);
+	sctx->nr_inflight--;
+	pthread_cond_broadcast(&sctx->done_cond);
+	pthread_mutex_unlock(&sctx->lock);
+
+	scrub_range_free(range);
+}
+
+static void scrub_copy_done(struct scrub_ctx *sctx, struct scrub_copy *copy)
+{
+	struct scrub_range *range = copy->range;
+	int last;
+
+	pthread_mutex_lock(&sctx->lock);
+	last = !--range->pending;
+	pthread_mutex_unlock(&sctx->lock);
+	if (last)
+		scrub_range_done(sctx, range);
+}
+
+static void *scrub_dev_thread(void *data)
+{
+	struct scrub_dev *dev = data;
+	struct scrub_ctx *sctx = dev->sctx;
+	struct scrub_copy *copy;
+
+	pthread_mutex_lock(&sctx->lock);
+	while (1) {
+		while (list_empty(&dev->queue) && !sctx->stop)
+			pthread_cond_wait(&dev->cond, &sctx->lock);
+		if (list_empty(&dev->queue))
+			break;
+		copy = list_entry(dev->queue.next, struct scrub_copy, list);
+		list_del_init(&copy->list);
+		pthread_mutex_unlock(&sctx->lock);
+
+		if (scrub_interrupted) {
+			copy->range->cancelled = 1;
+		} else {
+			scrub_throttle(dev);
+			scrub_read_copy(copy);
+		}
+		scrub_copy_done(sctx, copy);
+
+		pthread_mutex_lock(&sctx->lock);
+	}
+	pthread_mutex_unlock(&sctx->lock);
+	return NULL;
+}
+
+struct scrub_checkpoint {
+	struct scrub_ctx *sctx;
+	u64 pos;
+	int pass;
+};
+
+static void fill_scrub_checkpoint(FILE *f, void *data)
+{
+	struct scrub_checkpoint *cp = data;
+	struct scrub_ctx *sctx = cp->sctx;
+
+	fprintf(f, "pass:%s\n", scrub_pass_names[sctx->pass]);
+	fprintf(f, "logical:%llu\n", (unsigned long long)cp->pos);
+	fprintf(f, "tree_bytes:%llu\n", (unsigned long long)sctx->tree_bytes);
+	fprintf(f, "data_bytes:%llu\n", (unsigned long long)sctx->data_bytes);
+	fprintf(f, "skipped:%llu\n", (unsigned long long)sctx->skipped);
+	fprintf(f, "read_errors:%llu\n", (unsigned long long)sctx->read_errors);
+	fprintf(f, "csum_errors:%llu\n", (unsigned long long)sctx->csum_errors);
+	fprintf(f, "corrected:%llu\n", (unsigned long long)sctx->corrected);
+	fprintf(f, "uncorrectable:%llu\n",
+		(unsigned long long)sctx->uncorrectable);
+}
+
+static int scrub_checkpoint_save(struct scrub_ctx *sctx)
+{
+	struct scrub_checkpoint cp = { .sctx = sctx };
+	struct scrub_range *range;
+	int ret;
+
+	if (!sctx->args->checkpoint)
+		return 0;
+
+	pthread_mutex_lock(&sctx->lock);
+	if (!list_empty(&sctx->inflight)) {
+		range = list_entry(sctx->inflight.next, struct scrub_range,
+				   list);
+		cp.pos = range->logical;
+	} else if (sctx->open) {
+		cp.pos = sctx->open->logical;
+	} else {
+		cp.pos = sctx->pos;
+	}
+	cp.pos = min(cp.pos, sctx->cancel_pos);
+
+	ret = save_state_file(sctx->args->checkpoint, SCRUB_CHECKPOINT_HEADER,
+			      sctx->info->fsid, fill_scrub_checkpoint, &cp);
+	pthread_mutex_unlock(&sctx->lock);
+	if (ret)
+		fprintf(stderr, "ERROR: cannot save checkpoint %s: %s\n",
+			sctx->args->checkpoint, strerror(-ret));
+	sctx->last_save = scrub_now();
+	return ret;
+}
+
+static int parse_scrub_checkpoint(char *key, char *value, void *data)
+{
+	struct scrub_checkpoint *cp = data;
+	struct scrub_ctx *sctx = cp->sctx;
+	unsigned long long val;
+	int i;
+
+	if (!strcmp(key, "pass")) {
+		for (i = 0; i <= SCRUB_PASS_DONE; i++)
+			if (!strcmp(value, scrub_pass_names[i]))
+				cp->pass = i;
+		return 0;
+	}
+	val = strtoull(value, NULL, 10);
+	if (!strcmp(key, "logical"))
+		sctx->resume_pos = val;
+	else if (!strcmp(key, "tree_bytes"))
+		sctx->tree_bytes = val;
+	else if (!strcmp(key, "data_bytes"))
+		sctx->data_bytes = val;
+	else if (!strcmp(key, "skipped"))
+		sctx->skipped = val;
+	else if (!strcmp(key, "read_errors"))
+		sctx->read_errors = val;
+	else if (!strcmp(key, "csum_errors"))
+		sctx->csum_errors = val;
+	else if (!strcmp(key, "corrected"))
+		sctx->corrected = val;
+	else if (!strcmp(key, "uncorrectable"))
+		sctx->uncorrectable = val;
+	return 0;
+}
+
+static int scrub_checkpoint_load(struct scrub_ctx *sctx)
+{
+	struct scrub_checkpoint cp = { .sctx = sctx, .pass = -1 };
+	int ret;
+
+	ret = load_state_file(sctx->args->checkpoint, SCRUB_CHECKPOINT_HEADER,
+			      sctx->info->fsid, "scrub checkpoint",
+			      parse_scrub_checkpoint, &cp);
+	if (ret == -ENOENT)
+		fprintf(stderr, "ERROR: cannot open checkpoint %s: %s\n",
+			sctx->args->checkpoint, strerror(-ret));
+	if (ret)
+		return ret;
+	if (cp.pass < 0) {
+		fprintf(stderr, "ERROR: %s is not a scrub checkpoint\n",
+			sctx->args->checkpoint);
+		return -EINVAL;
+	}
+	sctx->pass = cp.pass;
+	sctx->pos = sctx->resume_pos;
+	return 0;
+}
+
+static void scrub_range_submit(struct scrub_ctx *sctx, struct scrub_range *range)
+{
+	struct scrub_copy *copy;
+	u32 nr_blocks = range->len / range->blocksize;
+	int i;
+
+	sctx->open = NULL;
+
+	pthread_mutex_lock(&sctx->lock);
+	while (sctx->nr_inflight >= SCRUB_MAX_INFLIGHT)
+		pthread_cond_wait(&sctx->done_cond, &sctx->lock);
+	sctx->nr_inflight++;
+	list_add_tail(&range->list, &sctx->inflight);
+	pthread_mutex_unlock(&sctx->lock);
+
+	for (i = 0; i < range->nr_copies; i++) {
+		copy = &range->copies[i];
+		copy->data = malloc(range->len);
+		copy->state = calloc(nr_blocks, 1);
+		if (!copy->data || !copy->state) {
+			fprintf(stderr, "ERROR: out of memory\n");
+			exit(1);
+		}
+	}
+	range->pending = range->nr_copies;
+
+	if (!sctx->threads) {
+		for (i = 0; i < range->nr_copies; i++) {
+			scrub_throttle(range->copies[i].dev);
+			scrub_read_copy(&range->copies[i]);
+			scrub_copy_done(sctx, &range->copies[i]);
+		}
+	} else {
+		pthread_mutex_lock(&sctx->lock);
+		for (i = 0; i < range->nr_copies; i++) {
+			copy = &range->copies[i];
+			list_add_tail(&copy->list, &copy->dev->queue);
+			pthread_cond_signal(&copy->dev->cond);
+		}
+		pthread_mutex_unlock(&sctx->lock);
+	}
+
+	if (scrub_now() - sctx->last_save >= SCRUB_CHECKPOINT_SECS)
+		scrub_checkpoint_save(sctx);
+}
+
+static void scrub_wait_inflight(struct scrub_ctx *sctx)
+{
+	if (sctx->open)
+		scrub_range_submit(sctx, sctx->open);
+	pthread_mutex_lock(&sctx->lock);
+	while (sctx->nr_inflight)
+		pthread_cond_wait(&sctx->done_cond, &sctx->lock);
+	pthread_mutex_unlock(&sctx->lock);
+}
+
+/*
+ * Map every copy of @logical worth reading.  Only mirrored profiles have
+ * more than one: the other mirrors of RAID5/6 are parity, which we can't
+ * check without rebuilding the stripe.  *len is trimmed to what is
+ * contiguous on all copies.
+ */
+static int scrub_map_copies(struct scrub_ctx *sctx, u64 logical, u64 *len,
+			    struct scrub_copy *copies, int *nr_copies)
+{
+	struct btrfs_mapping_tree *map_tree = &sctx->info->mapping_tree;
+	struct btrfs_multi_bio *multi = NULL;
+	struct scrub_dev *dev;
+	u64 map_len;
+	u64 type = 0;
+	int num_copies = 1;
+	int mirror;
+	int ret;
+
+	*nr_copies = 0;
+	for (mirror = 1; mirror <= num_copies; mirror++) {
+		map_len = *len;
+		ret = __btrfs_map_block(map_tree, READ, logical, &map_len,
+					&type, &multi, mirror, NULL);
+		if (ret)
+			return ret;
+		if (mirror == 1 && (type & (BTRFS_BLOCK_GROUP_RAID1 |
+					    BTRFS_BLOCK_GROUP_RAID10 |
+					    BTRFS_BLOCK_GROUP_DUP)))
+			num_copies = min(btrfs_num_copies(map_tree, logical,
+							  map_len),
+					 BTRFS_MAX_MIRRORS);
+		*len = min(*len, map_len);
+		dev = scrub_find_dev(sctx, multi->stripes[0].dev);
+		if (dev && dev->device->fd > 0) {
+			copies[*nr_copies].dev = dev;
+			copies[*nr_copies].physical =
+				multi->stripes[0].physical;
+			copies[*nr_copies].mirror = mirror;
+			(*nr_copies)++;
+		}
+		kfree(multi);
+		multi = NULL;
+	}
+	return 0;
+}
+
+static int scrub_range_extends(struct scrub_range *range, int is_data,
+			       u64 logical, struct scrub_copy *copies,
+			       int nr_copies)
+{
+	int i;
+
+	if (!range || range->is_data != is_data ||
+	    range->logical + range->len != logical ||
+	    range->len >= SCRUB_RANGE_SIZE || range->nr_copies != nr_copies)
+		return 0;
+	for (i = 0; i < nr_copies; i++) {
+		if (range->copies[i].dev != copies[i].dev ||
+		    range->copies[i].physical + range->len !=
+		    copies[i].physical)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * queue tree blocks of generation @gen, or checksummed data whose csums
+ * are at @csum_offset in @leaf
+ */
+static void scrub_add(struct scrub_ctx *sctx, u64 logical, u64 len,
+		      int is_data, u64 gen, struct extent_buffer *leaf,
+		      unsigned long csum_offset)
+{
+	struct scrub_copy copies[BTRFS_MAX_MIRRORS];
+	struct scrub_range *range;
+	u64 map_len;
+	u64 skip;
+	int nr_copies;
+	int i;
+
+	if (logical + len <= sctx->resume_pos)
+		return;
+	if (logical < sctx->resume_pos) {
+		skip = sctx->resume_pos - logical;
+		logical += skip;
+		len -= skip;
+		csum_offset += skip / sctx->sectorsize * sctx->csum_size;
+	}
+
+	while (len) {
+		map_len = len;
+		if (scrub_map_copies(sctx, logical, &map_len, copies,
+				     &nr_copies)) {
+			fprintf(stderr, "ERROR: cannot map logical %llu\n",
+				(unsigned long long)logical);
+			sctx->skipped += len;
+			break;
+		}
+		if (!nr_copies) {
+			sctx->skipped += map_len;
+			goto next;
+		}
+
+		range = sctx->open;
+		if (range && !scrub_range_extends(range, is_data, logical,
+						  copies, nr_copies)) {
+			scrub_range_submit(sctx, range);
+			range = NULL;
+		}
+		if (!range) {
+			range = calloc(1, sizeof(*range));
+			if (range && is_data)
+				range->csums = malloc(SCRUB_RANGE_SIZE /
+						      sctx->sectorsize *
+						      sctx->csum_size);
+			else if (range)
+				range->gens = malloc(SCRUB_RANGE_SIZE /
+						     sctx->nodesize *
+						     sizeof(u64));
+			if (!range || (!range->csums && !range->gens)) {
+				fprintf(stderr, "ERROR: out of memory\n");
+				exit(1);
+			}
+			range->logical = logical;
+			range->is_data = is_data;
+			range->blocksize = is_data ? sctx->sectorsize :
+						     sctx->nodesize;
+			range->nr_copies = nr_copies;
+			for (i = 0; i < nr_copies; i++) {
+				range->copies[i] = copies[i];
+				range->copies[i].range = range;
+				INIT_LIST_HEAD(&range->copies[i].list);
+			}
+			sctx->open = range;
+		}
+		map_len = min_t(u64, map_len, SCRUB_RANGE_SIZE - range->len);
+		if (is_data)
+			read_extent_buffer(leaf, range->csums + range->len /
+					   sctx->sectorsize * sctx->csum_size,
+					   csum_offset, map_len /
+					   sctx->sectorsize * sctx->csum_size);
+		else
+			for (i = 0; i < map_len / sctx->nodesize; i++)
+				range->gens[range->len / sctx->nodesize + i] =
+					gen;
+		range->len += map_len;
+		if (range->len == SCRUB_RANGE_SIZE)
+			scrub_range_submit(sctx, range);
+next:
+		if (is_data)
+			csum_offset += map_len / sctx->sectorsize *
+				       sctx->csum_size;
+		logical += map_len;
+		len -= map_len;
+	}
+	sctx->pos = logical;
+}
+
+static int scrub_tree_blocks(struct scrub_ctx *sctx)
+{
+	struct btrfs_root *root = sctx->info->extent_root;
+	struct btrfs_extent_item *ei;
+	struct btrfs_path *path;
+	struct extent_buffer *leaf;
+	struct btrfs_key key;
+	int ret;
+
+	path = btrfs_alloc_path();
+	if (!path)
+		return -ENOMEM;
+
+	key.objectid = sctx->resume_pos;
+	key.type = 0;
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, root, &key, path, 0, 0);
+	if (ret < 0)
+		goto out;
+
+	while (!scrub_interrupted) {
+		leaf = path->nodes[0];
+		if (path->slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(root, path);
+			if (ret)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path->slots[0]);
+		if ((key.type != BTRFS_METADATA_ITEM_KEY &&
+		     key.type != BTRFS_EXTENT_ITEM_KEY) ||
+		    btrfs_item_size_nr(leaf, path->slots[0]) < sizeof(*ei)) {
+			path->slots[0]++;
+			continue;
+		}
+		ei = btrfs_item_ptr(leaf, path->slots[0],
+				    struct btrfs_extent_item);
+		if (key.type == BTRFS_METADATA_ITEM_KEY)
+			scrub_add(sctx, key.objectid, sctx->nodesize, 0,
+				  btrfs_extent_generation(leaf, ei), NULL, 0);
+		else if (btrfs_extent_flags(leaf, ei) &
+			 BTRFS_EXTENT_FLAG_TREE_BLOCK)
+			scrub_add(sctx, key.objectid, key.offset, 0,
+				  btrfs_extent_generation(leaf, ei), NULL, 0);
+		path->slots[0]++;
+	}
+out:
+	btrfs_free_path(path);
+	return ret < 0 ? ret : 0;
+}
+
+static int scrub_data(struct scrub_ctx *sctx)
+{
+	struct btrfs_root *root = sctx->info->csum_root;
+	struct btrfs_path *path;
+	struct extent_buffer *leaf;
+	struct btrfs_key key;
+	u64 len;
+	int ret;
+
+	path = btrfs_alloc_path();
+	if (!path)
+		return -ENOMEM;
+
+	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	key.offset = sctx->resume_pos;
+	ret = btrfs_search_slot(NULL, root, &key, path, 0, 0);
+	if (ret < 0)
+		goto out;
+	if (ret > 0 && path->slots[0])
+		path->slots[0]--;
+
+	while (!scrub_interrupted) {
+		leaf = path->nodes[0];
+		if (path->slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(root, path);
+			if (ret)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path->slots[0]);
+		if (key.objectid > BTRFS_EXTENT_CSUM_OBJECTID)
+			break;
+		if (key.objectid == BTRFS_EXTENT_CSUM_OBJECTID &&
+		    key.type == BTRFS_EXTENT_CSUM_KEY) {
+			len = btrfs_item_size_nr(leaf, path->slots[0]) /
+			      sctx->csum_size * sctx->sectorsize;
+			scrub_add(sctx, key.offset, len, 1, 0, leaf,
+				  btrfs_item_ptr_offset(leaf, path->slots[0]));
+		}
+		path->slots[0]++;
+	}
+out:
+	btrfs_free_path(path);
+	return ret < 0 ? ret : 0;
+}
+
+static void scrub_print_stats(struct scrub_ctx *sctx, const char *status)
+{
+	struct scrub_dev *dev;
+	char fsid[BTRFS_UUID_UNPARSED_SIZE];
+	double seconds = max(scrub_now() - sctx->start, 0.000001);
+	u64 bytes = 0;
+	int i;
+
+	for (i = 0; i < sctx->nr_devs; i++)
+		bytes += sctx->devs[i].bytes_read;
+
+	uuid_unparse(sctx->info->fsid, fsid);
+	printf("scrub %s for %s\n", status, fsid);
+	printf("\ttree blocks scrubbed: %s\n", pretty_size(sctx->tree_bytes));
+	printf("\tdata scrubbed: %s\n", pretty_size(sctx->data_bytes));
+	if (sctx->skipped)
+		printf("\tnot scrubbed, no device: %s\n",
+		       pretty_size(sctx->skipped));
+	printf("\tread %s in %.1fs, %s/s\n", pretty_size(bytes), seconds,
+	       pretty_size(bytes / seconds));
+	printf("\tread errors: %llu, csum errors: %llu, corrected: %llu, "
+	       "uncorrectable: %llu\n",
+	       (unsigned long long)sctx->read_errors,
+	       (unsigned long long)sctx->csum_errors,
+	       (unsigned long long)sctx->corrected,
+	       (unsigned long long)sctx->uncorrectable);
+
+	for (i = 0; i < sctx->nr_devs; i++) {
+		dev = &sctx->devs[i];
+		if (!dev->reads)
+			continue;
+		printf("\tdevid %llu %s: %s in %llu reads, %s/s, "
+		       "%llu read errors, %llu csum errors, %llu corrected, "
+		       "%llu uncorrectable\n",
+		       (unsigned long long)dev->device->devid,
+		       dev->device->name, pretty_size(dev->bytes_read),
+		       (unsigned long long)dev->reads,
+		       pretty_size(dev->bytes_read /
+				   max(dev->busy, 0.000001)),
+		       (unsigned long long)dev->read_errors,
+		       (unsigned long long)dev->csum_errors,
+		       (unsigned long long)dev->corrected,
+		       (unsigned long long)dev->uncorrectable);
+	}
+}
+
+static int scrub_init(struct scrub_ctx *sctx, struct btrfs_fs_info *info,
+		      struct scrub_offline_args *args)
+{
+	struct btrfs_fs_devices *fs_devices;
+	struct btrfs_device *device;
+	struct scrub_dev *dev;
+	int i;
+
+	memset(sctx, 0, sizeof(*sctx));
+	sctx->info = info;
+	sctx->args = args;
+	sctx->sectorsize = info->tree_root->sectorsize;
+	sctx->nodesize = info->tree_root->nodesize;
+	sctx->cancel_pos = (u64)-1;
+	sctx->csum_size = btrfs_super_csum_size(info->super_copy);
+	pthread_mutex_init(&sctx->lock, NULL);
+	pthread_cond_init(&sctx->done_cond, NULL);
+	INIT_LIST_HEAD(&sctx->inflight);
+
+	for (fs_devices = info->fs_devices; fs_devices;
+	     fs_devices = fs_devices->seed)
+		list_for_each_entry(device, &fs_devices->devices, dev_list)
+			sctx->nr_devs++;
+	sctx->devs = calloc(sctx->nr_devs, sizeof(*sctx->devs));
+	if (!sctx->devs)
+		return -ENOMEM;
+
+	dev = sctx->devs;
+	for (fs_devices = info->fs_devices; fs_devices;
+	     fs_devices = fs_devices->seed) {
+		list_for_each_entry(device, &fs_devices->devices, dev_list) {
+			if (device->fd <= 0)
+				fprintf(stderr, "WARNING: devid %llu is "
+					"missing, its copies are not scrubbed\n",
+					(unsigned long long)device->devid);
+			dev->sctx = sctx;
+			dev->device = device;
+			pthread_cond_init(&dev->cond, NULL);
+			INIT_LIST_HEAD(&dev->queue);
+			dev++;
+		}
+	}
+
+	for (i = 0; i < sctx->nr_devs; i++) {
+		if (pthread_create(&sctx->devs[i].thread, NULL,
+				   scrub_dev_thread, &sctx->devs[i]))
+			break;
+	}
+	sctx->threads = i;
+	if (i < sctx->nr_devs) {
+		/* do it all from the walker instead */
+		pthread_mutex_lock(&sctx->lock);
+		sctx->stop = 1;
+		for (i = 0; i < sctx->threads; i++)
+			pthread_cond_signal(&sctx->devs[i].cond);
+		pthread_mutex_unlock(&sctx->lock);
+		for (i = 0; i < sctx->threads; i++)
+			pthread_join(sctx->devs[i].thread, NULL);
+		sctx->threads = 0;
+	}
+	return 0;
+}
+
+static void scrub_release(struct scrub_ctx *sctx)
+{
+	int i;
+
+	pthread_mutex_lock(&sctx->lock);
+	sctx->stop = 1;
+	for (i = 0; i < sctx->threads; i++)
+		pthread_cond_signal(&sctx->devs[i].cond);
+	pthread_mutex_unlock(&sctx->lock);
+	for (i = 0; i < sctx->threads; i++)
+		pthread_join(sctx->devs[i].thread, NULL);
+
+	for (i = 0; sctx->devs && i < sctx->nr_devs; i++)
+		pthread_cond_destroy(&sctx->devs[i].cond);
+	free(sctx->devs);
+	pthread_cond_destroy(&sctx->done_cond);
+	pthread_mutex_destroy(&sctx->lock);
+}
+
+int btrfs_scrub_offline(const char *path, struct scrub_offline_args *args)
+{
+	struct btrfs_fs_info *info;
+	struct scrub_ctx sctx;
+	struct sigaction sa;
+	struct sigaction old_int;
+	struct sigaction old_term;
+	enum btrfs_open_ctree_flags flags = OPEN_CTREE_DIRECT |
+					    OPEN_CTREE_EXCLUSIVE;
+	int ret;
+
+	if (!args->readonly)
+		flags |= OPEN_CTREE_WRITES;
+	info = open_ctree_fs_info(path, 0, 0, flags);
+	if (!info) {
+		fprintf(stderr, "ERROR: cannot open filesystem on %s\n", path);
+		return 1;
+	}
+
+	ret = scrub_init(&sctx, info, args);
+	if (ret) {
+		fprintf(stderr, "ERROR: out of memory\n");
+		goto out;
+	}
+	if (args->resume) {
+		ret = scrub_checkpoint_load(&sctx);
+		if (ret)
+			goto out;
+		if (sctx.pass == SCRUB_PASS_DONE) {
+			printf("scrub already finished, nothing to resume\n");
+			ret = 2;
+			goto out;
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = scrub_sigint;
+	sigaction(SIGINT, &sa, &old_int);
+	sigaction(SIGTERM, &sa, &old_term);
+	scrub_interrupted = 0;
+
+	sctx.start = scrub_now();
+	sctx.last_save = sctx.start;
+	while (sctx.pass != SCRUB_PASS_DONE && !ret) {
+		if (sctx.pass == SCRUB_PASS_TREE)
+			ret = scrub_tree_blocks(&sctx);
+		else
+			ret = scrub_data(&sctx);
+		scrub_wait_inflight(&sctx);
+		if (ret || scrub_interrupted)
+			break;
+		sctx.pass++;
+		sctx.pos = 0;
+		sctx.resume_pos = 0;
+	}
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+
+	if (ret)
+		fprintf(stderr, "ERROR: scrub failed: %s\n", strerror(-ret));
+	scrub_checkpoint_save(&sctx);
+	scrub_print_stats(&sctx, sctx.pass == SCRUB_PASS_DONE ? "done" :
+			  "interrupted");
+	if (sctx.pass != SCRUB_PASS_DONE && args->checkpoint)
+		printf("progress saved in %s, continue with --resume\n",
+		       args->checkpoint);
+out:
+	scrub_release(&sctx);
+	close_ctree(info->fs_root);
+	if (ret == 2)
+		return 2;
+	if (ret)
+		return 1;
+	return sctx.uncorrectable ? 3 : 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_SCRUB_OFFLINE_H__
+#define __BTRFS_SCRUB_OFFLINE_H__
+
+#include "kerncompat.h"
+
+struct scrub_offline_args {
+	/* don't rewrite bad copies */
+	int readonly;
+	/* bytes per second read from each device, 0 for no limit */
+	u64 limit;
+	/* progress is saved here, and picked up again with @resume */
+	const char *checkpoint;
+	int resume;
+};
+
+/*
+ * Returns 0 when everything is good or was repaired, 3 if there are
+ * uncorrectable errors and 1 if the scrub could not run.
+ */
+int btrfs_scrub_offline(const char *path, struct scrub_offline_args *args);
+
+#endif
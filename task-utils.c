@@ -132,3 +132,126 @@ void task_period_stop(struct task_info *info)
 		close(info->periodic.timer_fd);
 	}
 }
+
+int task_pool_default_threads(void)
+{
+	long nr = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (nr < 1)
+		return 1;
+	if (nr > 64)
+		return 64;
+	return nr;
+}
+
+static void *task_pool_worker(void *data)
+{
+	struct task_pool *pool = data;
+	struct task_work *work;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (list_empty(&pool->queue) && !pool->stop)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		if (list_empty(&pool->queue))
+			break;
+		work = list_entry(pool->queue.next, struct task_work, list);
+		list_del_init(&work->list);
+		pthread_mutex_unlock(&pool->lock);
+
+		work->func(work);
+
+		pthread_mutex_lock(&pool->lock);
+		work->done = 1;
+		pool->pending--;
+		pthread_cond_broadcast(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+struct task_pool *task_pool_init(int nr_threads)
+{
+	struct task_pool *pool;
+	int i;
+
+	if (nr_threads <= 0)
+		nr_threads = task_pool_default_threads();
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->threads = calloc(nr_threads, sizeof(pthread_t));
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	INIT_LIST_HEAD(&pool->queue);
+
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(pool->threads + i, NULL, task_pool_worker,
+				   pool))
+			break;
+	}
+	pool->nr_threads = i;
+	if (!i) {
+		task_pool_destroy(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+void task_pool_queue(struct task_pool *pool, struct task_work *work,
+		     void (*func)(struct task_work *work))
+{
+	work->func = func;
+	pthread_mutex_lock(&pool->lock);
+	work->done = 0;
+	list_add_tail(&work->list, &pool->queue);
+	pool->pending++;
+	pthread_cond_signal(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* wait for one queued work item to finish */
+void task_pool_wait_work(struct task_pool *pool, struct task_work *work)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (!work->done)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* wait until every queued work item, including ones queued by work, is done */
+void task_pool_flush(struct task_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void task_pool_destroy(struct task_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
@@ -18,6 +18,8 @@
 #define __TASK_UTILS_H_
 
 #include <pthread.h>
+#include "kerncompat.h"
+#include "list.h"
 
 struct periodic_info {
 	int timer_fd;
@@ -44,4 +46,33 @@ int task_period_start(struct task_info *info, unsigned int period_ms);
 void task_period_wait(struct task_info *info);
 void task_period_stop(struct task_info *info);
 
+/*
+ * A simple pool of worker threads pulling task_work items off a FIFO.
+ * Work functions run without any pool lock held and may queue more work.
+ */
+struct task_work {
+	struct list_head list;
+	void (*func)(struct task_work *work);
+	int done;
+};
+
+struct task_pool {
+	pthread_t *threads;
+	int nr_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct list_head queue;
+	unsigned long pending;
+	int stop;
+};
+
+int task_pool_default_threads(void);
+struct task_pool *task_pool_init(int nr_threads);
+void task_pool_queue(struct task_pool *pool, struct task_work *work,
+		     void (*func)(struct task_work *work));
+void task_pool_wait_work(struct task_pool *pool, struct task_work *work);
+void task_pool_flush(struct task_pool *pool);
+void task_pool_destroy(struct task_pool *pool);
+
 #endif
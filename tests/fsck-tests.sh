@@ -56,11 +56,92 @@ do
 
 	$here/btrfs check test.img >> $RESULT 2>&1
 	[ $? -eq 0 ] && _fail "btrfs check should have detected corruption"
+	$here/btrfs check --mode=lowmem test.img >> $RESULT 2>&1
+	[ $? -eq 0 ] && _fail "lowmem check should have detected corruption"
 
 	run_check $here/btrfs check --repair test.img
 	run_check $here/btrfs check test.img
+	run_check $here/btrfs check --mode=lowmem test.img
 done
 
+# a clean filesystem with a few thousand files and directories
+make_clean_image()
+{
+	rm -rf clean-fs test.img
+	mkdir clean-fs
+	for i in `seq 1 200`;do
+		mkdir clean-fs/$i
+		for j in `seq 1 100`;do
+			echo $i $j > clean-fs/$i/$j
+		done
+	done
+	truncate -s 256M test.img
+	run_check $here/mkfs.btrfs -f -b 256M -r clean-fs test.img
+	rm -rf clean-fs
+}
+
+# a clean run records its generation, the next run checks what came after
+test_incremental()
+{
+	echo "     [TEST]    incremental check"
+	rm -f verified-gen
+	run_check $here/btrfs check --incremental verified-gen test.img
+	[ -f verified-gen ] || _fail "no verified generation saved"
+
+	# a label change commits a transaction
+	run_check $here/btrfs filesystem label test.img fsck-test
+	run_check $here/btrfs check --incremental verified-gen test.img
+	grep -q "checking blocks newer than generation" $RESULT || \
+		_fail "incremental check walked the whole filesystem"
+	rm -f verified-gen
+}
+
+# interrupt a check once it saved its first checkpoint and resume it
+test_checkpoint_resume()
+{
+	echo "     [TEST]    checkpoint and resume"
+	rm -f check-progress
+	$here/btrfs check --mode=lowmem --checkpoint check-progress \
+		test.img >> $RESULT 2>&1 &
+	pid=$!
+	while [ ! -f check-progress ] && kill -0 $pid 2>/dev/null;do
+		:
+	done
+	kill -INT $pid 2>/dev/null
+	wait $pid
+	[ -f check-progress ] || _fail "no checkpoint saved"
+
+	# the interrupt may have come too late to leave anything to resume
+	if grep -q "^phase:done" check-progress;then
+		$here/btrfs check --mode=lowmem --checkpoint check-progress \
+			--resume test.img >> $RESULT 2>&1
+		[ $? -eq 2 ] || _fail "a finished check was resumed"
+	else
+		run_check $here/btrfs check --mode=lowmem \
+			--checkpoint check-progress --resume test.img
+	fi
+	rm -f check-progress
+}
+
+# with --stats=json the JSON object is all there is on stdout
+test_stats_json()
+{
+	echo "     [TEST]    json stats"
+	$here/btrfs check --stats=json test.img > check-stats 2>> $RESULT || \
+		_fail "failed: btrfs check --stats=json test.img"
+	cat check-stats >> $RESULT
+	[ "`head -n 1 check-stats`" = "{" ] && \
+		[ "`tail -n 1 check-stats`" = "}" ] || \
+		_fail "more than the JSON object on stdout"
+	rm -f check-stats
+}
+
+make_clean_image
+test_incremental
+test_checkpoint_resume
+test_stats_json
+rm -f test.img
+
 if [ -z $TEST_DEV ] || [ -z $TEST_MNT ];then
 	echo "     [NOTRUN] extent tree rebuild"
 	exit 0
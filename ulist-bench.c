@@ -0,0 +1,139 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * ulist usage patterns of backref walking and qgroup verification: lots
+ * of short lived lists holding a few roots, and one big list of tree
+ * blocks.
+ *
+ * usage: ulist-bench [lists] [big list size]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "kerncompat.h"
+#include "ulist.h"
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static u64 random_u64(void)
+{
+	return ((u64)rand() << 32) ^ rand();
+}
+
+/* alloc, add a few values with duplicates, walk, free */
+static u64 bench_small(int nr_lists, int max_vals, double *rate)
+{
+	struct ulist *ulist;
+	struct ulist_iterator uiter;
+	struct ulist_node *node;
+	u64 sum = 0;
+	double t;
+	int nr_vals;
+	int i;
+	int j;
+
+	t = now();
+	for (i = 0; i < nr_lists; i++) {
+		ulist = ulist_alloc(0);
+		if (!ulist) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		nr_vals = 1 + i % max_vals;
+		for (j = 0; j < nr_vals * 2; j++)
+			ulist_add(ulist, 256 + (i + j / 2) % 4096, j, 0);
+		ULIST_ITER_INIT(&uiter);
+		while ((node = ulist_next(ulist, &uiter)))
+			sum += node->val;
+		ulist_free(ulist);
+	}
+	*rate = nr_lists / (now() - t);
+	return sum;
+}
+
+/* one large list, half of the adds are duplicates, then a walk */
+static u64 bench_big(int nr_vals, double *add_rate, double *walk_rate)
+{
+	struct ulist *ulist = ulist_alloc(0);
+	struct ulist_iterator uiter;
+	struct ulist_node *node;
+	u64 *vals;
+	u64 sum = 0;
+	double t;
+	int i;
+
+	vals = malloc(nr_vals * sizeof(*vals));
+	if (!ulist || !vals) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < nr_vals; i++)
+		vals[i] = random_u64() & ~4095ULL;
+
+	t = now();
+	for (i = 0; i < nr_vals; i++)
+		ulist_add(ulist, vals[i / 2 + (i & 1) * (nr_vals / 2)], i, 0);
+	*add_rate = nr_vals / (now() - t);
+
+	t = now();
+	ULIST_ITER_INIT(&uiter);
+	while ((node = ulist_next(ulist, &uiter)))
+		sum += node->aux;
+	*walk_rate = ulist->nnodes / (now() - t);
+
+	ulist_free(ulist);
+	free(vals);
+	return sum;
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = { 2, 8, 32 };
+	int nr_lists = 2000000;
+	int big = 2000000;
+	double rate;
+	double walk;
+	u64 sum = 0;
+	int i;
+
+	if (argc > 1)
+		nr_lists = atoi(argv[1]);
+	if (argc > 2)
+		big = atoi(argv[2]);
+	if (nr_lists <= 0 || big <= 0) {
+		fprintf(stderr, "usage: ulist-bench [lists] [big list size]\n");
+		return 1;
+	}
+
+	srand(1);
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		sum += bench_small(nr_lists, sizes[i], &rate);
+		printf("%d lists of up to %d values: %.0f lists/s\n",
+		       nr_lists, sizes[i], rate);
+	}
+	sum += bench_big(big, &rate, &walk);
+	printf("one list, %d adds: %.0f adds/s, %.0f nodes/s walked\n",
+	       big, rate, walk);
+	return !sum;
+}
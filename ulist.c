@@ -48,9 +48,12 @@
  */
 void ulist_init(struct ulist *ulist)
 {
-	INIT_LIST_HEAD(&ulist->nodes);
-	ulist->root = RB_ROOT;
 	ulist->nnodes = 0;
+	ulist->chunks = NULL;
+	ulist->nr_chunks = 0;
+	ulist->max_chunks = 0;
+	ulist->table = NULL;
+	ulist->table_bits = 0;
 }
 
 /**
@@ -62,14 +65,17 @@ void ulist_init(struct ulist *ulist)
  */
 static void ulist_fini(struct ulist *ulist)
 {
-	struct ulist_node *node;
-	struct ulist_node *next;
+	unsigned long i;
 
-	list_for_each_entry_safe(node, next, &ulist->nodes, list) {
-		kfree(node);
-	}
-	ulist->root = RB_ROOT;
-	INIT_LIST_HEAD(&ulist->nodes);
+	for (i = 0; i < ulist->nr_chunks; i++)
+		kfree(ulist->chunks[i]);
+	kfree(ulist->chunks);
+	kfree(ulist->table);
+	ulist->chunks = NULL;
+	ulist->nr_chunks = 0;
+	ulist->max_chunks = 0;
+	ulist->table = NULL;
+	ulist->table_bits = 0;
 }
 
 /**
@@ -117,42 +123,103 @@ void ulist_free(struct ulist *ulist)
 	kfree(ulist);
 }
 
-static struct ulist_node *ulist_rbtree_search(struct ulist *ulist, u64 val)
+static struct ulist_node *ulist_node_at(struct ulist *ulist,
+					unsigned long index)
+{
+	if (index < ULIST_INLINE_NODES)
+		return &ulist->inline_nodes[index];
+	index -= ULIST_INLINE_NODES;
+	return &ulist->chunks[index / ULIST_CHUNK_NODES]
+			     [index % ULIST_CHUNK_NODES];
+}
+
+static inline unsigned long ulist_hash(u64 val, unsigned int bits)
 {
-	struct rb_node *n = ulist->root.rb_node;
-	struct ulist_node *u = NULL;
-
-	while (n) {
-		u = rb_entry(n, struct ulist_node, rb_node);
-		if (u->val < val)
-			n = n->rb_right;
-		else if (u->val > val)
-			n = n->rb_left;
-		else
-			return u;
+	return (val * 0x9e3779b97f4a7c15ULL) >> (64 - bits);
+}
+
+static struct ulist_node *ulist_search(struct ulist *ulist, u64 val)
+{
+	struct ulist_node *node;
+	unsigned long mask;
+	unsigned long slot;
+	unsigned long i;
+
+	if (!ulist->table) {
+		for (i = 0; i < ulist->nnodes; i++)
+			if (ulist->inline_nodes[i].val == val)
+				return &ulist->inline_nodes[i];
+		return NULL;
+	}
+
+	mask = (1UL << ulist->table_bits) - 1;
+	for (slot = ulist_hash(val, ulist->table_bits);
+	     ulist->table[slot]; slot = (slot + 1) & mask) {
+		node = ulist_node_at(ulist, ulist->table[slot] - 1);
+		if (node->val == val)
+			return node;
 	}
 	return NULL;
 }
 
-static int ulist_rbtree_insert(struct ulist *ulist, struct ulist_node *ins)
+static void ulist_hash_insert(u32 *table, unsigned int bits, u64 val,
+			      unsigned long index)
 {
-	struct rb_node **p = &ulist->root.rb_node;
-	struct rb_node *parent = NULL;
-	struct ulist_node *cur = NULL;
-
-	while (*p) {
-		parent = *p;
-		cur = rb_entry(parent, struct ulist_node, rb_node);
-
-		if (cur->val < ins->val)
-			p = &(*p)->rb_right;
-		else if (cur->val > ins->val)
-			p = &(*p)->rb_left;
-		else
-			return -EEXIST;
+	unsigned long mask = (1UL << bits) - 1;
+	unsigned long slot = ulist_hash(val, bits);
+
+	while (table[slot])
+		slot = (slot + 1) & mask;
+	table[slot] = index + 1;
+}
+
+/* Keep the hash table at most half full once there is one */
+static int ulist_grow_table(struct ulist *ulist, unsigned long nnodes)
+{
+	unsigned int bits = ulist->table_bits ? ulist->table_bits : 5;
+	unsigned long i;
+	u32 *table;
+
+	if (nnodes <= ULIST_INLINE_NODES ||
+	    (ulist->table && nnodes * 2 <= (1UL << bits)))
+		return 0;
+	while (nnodes * 2 > (1UL << bits))
+		bits++;
+
+	table = kzalloc(sizeof(*table) << bits, GFP_NOFS);
+	if (!table)
+		return -ENOMEM;
+	for (i = 0; i < ulist->nnodes; i++)
+		ulist_hash_insert(table, bits, ulist_node_at(ulist, i)->val, i);
+	kfree(ulist->table);
+	ulist->table = table;
+	ulist->table_bits = bits;
+	return 0;
+}
+
+/* Make sure node @index has memory, the nodes before it never move */
+static int ulist_grow_nodes(struct ulist *ulist, unsigned long index)
+{
+	struct ulist_node **chunks;
+	unsigned long nr;
+
+	if (index < ULIST_INLINE_NODES ||
+	    (index - ULIST_INLINE_NODES) % ULIST_CHUNK_NODES)
+		return 0;
+
+	if (ulist->nr_chunks == ulist->max_chunks) {
+		nr = ulist->max_chunks ? ulist->max_chunks * 2 : 4;
+		chunks = realloc(ulist->chunks, nr * sizeof(*chunks));
+		if (!chunks)
+			return -ENOMEM;
+		ulist->chunks = chunks;
+		ulist->max_chunks = nr;
 	}
-	rb_link_node(&ins->rb_node, parent, p);
-	rb_insert_color(&ins->rb_node, &ulist->root);
+	ulist->chunks[ulist->nr_chunks] =
+		kmalloc(ULIST_CHUNK_NODES * sizeof(struct ulist_node), GFP_NOFS);
+	if (!ulist->chunks[ulist->nr_chunks])
+		return -ENOMEM;
+	ulist->nr_chunks++;
 	return 0;
 }
 
@@ -184,28 +251,26 @@ int ulist_add(struct ulist *ulist, u64 val, u64 aux, gfp_t gfp_mask)
 int ulist_add_merge(struct ulist *ulist, u64 val, u64 aux,
 		    u64 *old_aux, gfp_t gfp_mask)
 {
-	int ret;
 	struct ulist_node *node;
+	unsigned long index = ulist->nnodes;
 
-	node = ulist_rbtree_search(ulist, val);
+	node = ulist_search(ulist, val);
 	if (node) {
 		if (old_aux)
 			*old_aux = node->aux;
 		return 0;
 	}
-	node = kmalloc(sizeof(*node), gfp_mask);
-	if (!node)
+
+	/* neither of these changes what the ulist holds */
+	if (ulist_grow_table(ulist, index + 1) ||
+	    ulist_grow_nodes(ulist, index))
 		return -ENOMEM;
 
+	node = ulist_node_at(ulist, index);
 	node->val = val;
 	node->aux = aux;
-#ifdef CONFIG_BTRFS_DEBUG
-	node->seqnum = ulist->nnodes;
-#endif
-
-	ret = ulist_rbtree_insert(ulist, node);
-	ASSERT(!ret);
-	list_add_tail(&node->list, &ulist->nodes);
+	if (ulist->table)
+		ulist_hash_insert(ulist->table, ulist->table_bits, val, index);
 	ulist->nnodes++;
 
 	return 1;
@@ -229,25 +294,7 @@ int ulist_add_merge(struct ulist *ulist, u64 val, u64 aux,
  */
 struct ulist_node *ulist_next(struct ulist *ulist, struct ulist_iterator *uiter)
 {
-	struct ulist_node *node;
-
-	if (list_empty(&ulist->nodes))
+	if (uiter->next >= ulist->nnodes)
 		return NULL;
-	if (uiter->cur_list && uiter->cur_list->next == &ulist->nodes)
-		return NULL;
-	if (uiter->cur_list) {
-		uiter->cur_list = uiter->cur_list->next;
-	} else {
-		uiter->cur_list = ulist->nodes.next;
-#ifdef CONFIG_BTRFS_DEBUG
-		uiter->i = 0;
-#endif
-	}
-	node = list_entry(uiter->cur_list, struct ulist_node, list);
-#ifdef CONFIG_BTRFS_DEBUG
-	ASSERT(node->seqnum == uiter->i);
-	ASSERT(uiter->i >= 0 && uiter->i < ulist->nnodes);
-	uiter->i++;
-#endif
-	return node;
+	return ulist_node_at(ulist, uiter->next++);
 }
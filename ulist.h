@@ -9,8 +9,6 @@
 #define __ULIST__
 
 #include "kerncompat.h"
-#include "list.h"
-#include "rbtree.h"
 
 /*
  * ulist is a generic data structure to hold a collection of unique u64
@@ -18,12 +16,15 @@
  * enumerating it.
  * It is possible to store an auxiliary value along with the key.
  *
+ * The first ULIST_INLINE_NODES elements live in the ulist itself and are
+ * searched linearly, the rest go to fixed size chunks that never move and
+ * are found through an open addressing hash of their index.
  */
+#define ULIST_INLINE_NODES	8
+#define ULIST_CHUNK_NODES	128
+
 struct ulist_iterator {
-#ifdef CONFIG_BTRFS_DEBUG
-	int i;
-#endif
-	struct list_head *cur_list;  /* hint to start search */
+	unsigned long next;	/* index of the next element to return */
 };
 
 /*
@@ -32,13 +33,6 @@ struct ulist_iterator {
 struct ulist_node {
 	u64 val;		/* value to store */
 	u64 aux;		/* auxiliary value saved along with the val */
-
-#ifdef CONFIG_BTRFS_DEBUG
-	int seqnum;		/* sequence number this node is added */
-#endif
-
-	struct list_head list;  /* used to link node */
-	struct rb_node rb_node;	/* used to speed up search */
 };
 
 struct ulist {
@@ -47,8 +41,14 @@ struct ulist {
 	 */
 	unsigned long nnodes;
 
-	struct list_head nodes;
-	struct rb_root root;
+	struct ulist_node inline_nodes[ULIST_INLINE_NODES];
+	struct ulist_node **chunks;
+	unsigned long nr_chunks;
+	unsigned long max_chunks;
+
+	/* index + 1 of the element in each slot, 0 if empty */
+	u32 *table;
+	unsigned int table_bits;
 };
 
 void ulist_init(struct ulist *ulist);
@@ -76,6 +76,6 @@ static inline int ulist_add_merge_ptr(struct ulist *ulist, u64 val, void *aux,
 struct ulist_node *ulist_next(struct ulist *ulist,
 			      struct ulist_iterator *uiter);
 
-#define ULIST_ITER_INIT(uiter) ((uiter)->cur_list = NULL)
+#define ULIST_ITER_INIT(uiter) ((uiter)->next = 0)
 
 #endif
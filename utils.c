@@ -242,6 +242,7 @@ int make_btrfs(int fd, const char *device, const char *label, char *fs_uuid,
 		strncpy(super.label, label, BTRFS_LABEL_SIZE - 1);
 
 	buf = malloc(sizeof(*buf) + max(sectorsize, leafsize));
+	buf->data = buf->inline_data;
 
 	/* create the tree of root objects */
 	memset(buf->data, 0, leafsize);
@@ -2724,3 +2725,103 @@ int btrfs_tree_search2_ioctl_supported(int fd)
 
 	return v2_supported;
 }
+
+/*
+ * State files kept next to a filesystem by check and scrub: a header
+ * line, the fsid and then "key:value" lines.  @fill writes the lines
+ * after the fsid.  The file is written to "<path>.tmp" and renamed over
+ * @path, so a crash leaves the old or the new one.
+ */
+int save_state_file(const char *path, const char *header, const u8 *fsid,
+		    void (*fill)(FILE *f, void *data), void *data)
+{
+	char uuidbuf[BTRFS_UUID_UNPARSED_SIZE];
+	char *tmp;
+	FILE *f;
+	int ret = 0;
+
+	tmp = malloc(strlen(path) + 5);
+	if (!tmp)
+		return -ENOMEM;
+	sprintf(tmp, "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (!f) {
+		ret = -errno;
+		goto out;
+	}
+	uuid_unparse(fsid, uuidbuf);
+	fprintf(f, "%s\n", header);
+	fprintf(f, "fsid:%s\n", uuidbuf);
+	fill(f, data);
+	if (fflush(f) || fsync(fileno(f)))
+		ret = -errno;
+	if (fclose(f) && !ret)
+		ret = -errno;
+	if (!ret && rename(tmp, path))
+		ret = -errno;
+out:
+	free(tmp);
+	return ret;
+}
+
+/*
+ * Read back a file of save_state_file(), calling @parse for every line
+ * but the fsid.  A file that doesn't start with @header, or whose lines
+ * @parse refuses with -EINVAL, is reported as not being @what.  Any other
+ * error of @parse is returned as is, it already said why.  A missing
+ * file is the only error returned without a message, as -ENOENT.
+ */
+int load_state_file(const char *path, const char *header, const u8 *fsid,
+		    const char *what,
+		    int (*parse)(char *key, char *value, void *data),
+		    void *data)
+{
+	char uuidbuf[BTRFS_UUID_UNPARSED_SIZE];
+	char line[1024];
+	char *value;
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(path, "r");
+	if (!f) {
+		ret = -errno;
+		if (ret != -ENOENT)
+			fprintf(stderr, "ERROR: cannot open %s: %s\n", path,
+				strerror(-ret));
+		return ret;
+	}
+	uuid_unparse(fsid, uuidbuf);
+	if (!fgets(line, sizeof(line), f) ||
+	    strncmp(line, header, strlen(header)) ||
+	    strcmp(line + strlen(header), "\n")) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = 0;
+		value = strchr(line, ':');
+		if (!value) {
+			ret = -EINVAL;
+			break;
+		}
+		*value++ = 0;
+		if (!strcmp(line, "fsid")) {
+			if (strcmp(value, uuidbuf)) {
+				fprintf(stderr, "ERROR: %s is for filesystem "
+					"%s\n", path, value);
+				ret = -ESTALE;
+				break;
+			}
+			continue;
+		}
+		ret = parse(line, value, data);
+		if (ret)
+			break;
+	}
+out:
+	if (ret == -EINVAL)
+		fprintf(stderr, "ERROR: %s is not a %s\n", path, what);
+	fclose(f);
+	return ret;
+}
@@ -203,4 +203,11 @@ static inline u64 div_factor(u64 num, int factor)
 
 int btrfs_tree_search2_ioctl_supported(int fd);
 
+int save_state_file(const char *path, const char *header, const u8 *fsid,
+		    void (*fill)(FILE *f, void *data), void *data);
+int load_state_file(const char *path, const char *header, const u8 *fsid,
+		    const char *what,
+		    int (*parse)(char *key, char *value, void *data),
+		    void *data);
+
 #endif
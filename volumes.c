@@ -24,12 +24,14 @@
 #include <uuid/uuid.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include "ctree.h"
 #include "disk-io.h"
 #include "transaction.h"
 #include "print-tree.h"
 #include "volumes.h"
 #include "utils.h"
+#include "direct-io.h"
 
 struct stripe {
 	struct btrfs_device *dev;
@@ -167,6 +169,14 @@ again:
 	while (!list_empty(&fs_devices->devices)) {
 		device = list_entry(fs_devices->devices.next,
 				    struct btrfs_device, dev_list);
+		if (device->map) {
+			munmap(device->map, device->map_len);
+			device->map = NULL;
+		}
+		if (device->direct_fd > 0) {
+			close(device->direct_fd);
+			device->direct_fd = 0;
+		}
 		if (device->fd != -1) {
 			fsync(device->fd);
 			if (posix_fadvise(device->fd, 0, 0, POSIX_FADV_DONTNEED))
@@ -197,6 +207,7 @@ again:
 		free(fs_devices);
 	}
 
+	btrfs_dio_pool_release();
 	return 0;
 }
 
@@ -238,6 +249,82 @@ fail:
 	return ret;
 }
 
+/*
+ * Map the open devices for read-only tools, so tree blocks are read
+ * straight from the page cache.  The mappings are private: an extent
+ * buffer changed in memory never reaches the disk.  A bad sector or a
+ * device that shrinks raises SIGBUS instead of failing the read, so this
+ * is only done when the user asks for it.  Returns the number of devices
+ * mapped.
+ */
+int btrfs_mmap_devices(struct btrfs_fs_devices *fs_devices)
+{
+	struct btrfs_device *device;
+	off_t size;
+	void *map;
+	int nr = 0;
+
+	list_for_each_entry(device, &fs_devices->devices, dev_list) {
+		if (device->fd <= 0 || device->map)
+			continue;
+		size = lseek(device->fd, 0, SEEK_END);
+		if (size <= 0)
+			continue;
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			   device->fd, 0);
+		if (map == MAP_FAILED)
+			continue;
+		device->map = map;
+		device->map_len = size;
+		nr++;
+	}
+	return nr;
+}
+
+/*
+ * Give the open devices a second, O_DIRECT descriptor that all tree
+ * block and data reads go through, keeping them out of the page cache.
+ * Writes still use the buffered descriptor.  Returns the number of
+ * devices that support direct I/O.
+ */
+int btrfs_open_devices_direct(struct btrfs_fs_devices *fs_devices)
+{
+	struct btrfs_device *device;
+	int nr = 0;
+	int fd;
+
+	list_for_each_entry(device, &fs_devices->devices, dev_list) {
+		if (device->fd <= 0 || device->direct_fd > 0)
+			continue;
+		fd = btrfs_direct_open(device->name);
+		if (fd < 0) {
+			fprintf(stderr,
+				"WARNING: no direct I/O on %s, using the page cache\n",
+				device->name);
+			continue;
+		}
+		device->direct_fd = fd;
+		nr++;
+	}
+	return nr;
+}
+
+ssize_t btrfs_device_pread(struct btrfs_device *device, void *buf,
+			   size_t count, u64 offset)
+{
+	ssize_t ret;
+
+	if (device->direct_fd > 0)
+		ret = btrfs_direct_pread(device->direct_fd, buf, count,
+					 offset);
+	else
+		ret = pread(device->fd, buf, count, offset);
+	/* the csum workers read the same devices from several threads */
+	if (ret > 0)
+		__sync_fetch_and_add(&device->bytes_read, ret);
+	return ret;
+}
+
 int btrfs_scan_one_device(int fd, const char *path,
 			  struct btrfs_fs_devices **fs_devices_ret,
 			  u64 *total_devs, u64 super_offset, int super_recover)
@@ -1909,6 +1996,7 @@ static void split_eb_for_raid56(struct btrfs_fs_info *info,
 		if (!eb)
 			BUG();
 		memset(eb, 0, sizeof(struct extent_buffer) + stripe_len);
+		eb->data = eb->inline_data;
 
 		eb->start = raid_map[i];
 		eb->len = stripe_len;
@@ -1961,6 +2049,7 @@ int write_raid56_with_parity(struct btrfs_fs_info *info,
 		}
 		new_eb = kmalloc(sizeof(*eb) + alloc_size, GFP_NOFS);
 		BUG_ON(!new_eb);
+		new_eb->data = new_eb->inline_data;
 		new_eb->dev_bytenr = multi->stripes[i].physical;
 		new_eb->fd = multi->stripes[i].dev->fd;
 		multi->stripes[i].dev->total_ios++;
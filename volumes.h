@@ -27,6 +27,8 @@ struct btrfs_device {
 	struct btrfs_fs_devices *fs_devices;
 
 	u64 total_ios;
+	/* bytes read or mapped from the device */
+	u64 bytes_read;
 
 	int fd;
 
@@ -64,6 +66,13 @@ struct btrfs_device {
 
 	/* physical drive uuid (or lvm uuid) */
 	u8 uuid[BTRFS_UUID_SIZE];
+
+	/* read-only private mapping of the whole device, or NULL */
+	char *map;
+	u64 map_len;
+
+	/* O_DIRECT descriptor for reads, or 0 */
+	int direct_fd;
 };
 
 struct btrfs_fs_devices {
@@ -174,6 +183,10 @@ int btrfs_add_device(struct btrfs_trans_handle *trans,
 int btrfs_open_devices(struct btrfs_fs_devices *fs_devices,
 		       int flags);
 int btrfs_close_devices(struct btrfs_fs_devices *fs_devices);
+int btrfs_mmap_devices(struct btrfs_fs_devices *fs_devices);
+int btrfs_open_devices_direct(struct btrfs_fs_devices *fs_devices);
+ssize_t btrfs_device_pread(struct btrfs_device *device, void *buf,
+			   size_t count, u64 offset);
 int btrfs_add_device(struct btrfs_trans_handle *trans,
 		     struct btrfs_root *root,
 		     struct btrfs_device *device);